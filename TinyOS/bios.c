@@ -9,6 +9,11 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -22,13 +27,20 @@
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
-	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
+	- One POSIX timer per core thread, on CLOCK_MONOTONIC. Expiry is
+	delivered directly to the core thread as a thread-directed SIGALRM
+	(SIGEV_THREAD_ID), without going through the PIC thread.
+	- Core threads mask all signals except for USR1 and ALRM.
+	- The PIC thread receives device events and dispatches them to
 	the right core thread by raising SIGUSR1.
 
  */
 
+/* Older glibc versions do not define this field name */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 
 /*
 	Per-core data.
@@ -41,19 +53,21 @@ typedef struct core
 
 	struct sigevent timer_sigevent;
 	timer_t timer_id;
+	uint64_t timer_deadline;	/* in virtual time mode, the expiry time (0 if inactive) */
 
 	interrupt_handler* intvec[maximum_interrupt_no];
 	sig_atomic_t intpending[maximum_interrupt_no];
 
 	sig_atomic_t int_disabled;
-	sig_atomic_t halted;
-	rlnode halted_node;
-	pthread_cond_t halt_cond;
+	int halted;				/* also used as the futex word for halting */
+
+	uint32_t device_pending[maximum_interrupt_no];	/* bitmaps of interrupting devices (serial ports or disks) */
 
 	/* Statistics */
-	int irq_count;
-	int irq_raised[maximum_interrupt_no];
-	int irq_delivered[maximum_interrupt_no];
+	unsigned long irq_count;
+	unsigned long irq_raised[maximum_interrupt_no];
+	unsigned long irq_delivered[maximum_interrupt_no];
+	unsigned long irq_dropped[maximum_interrupt_no];
 } Core;
 
 
@@ -66,11 +80,8 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
-
-/* Used to create the signalfd */
-static sigset_t signalfd_set;
+/* Used to store the set of core interrupt signals, SIGUSR1 and SIGALRM */
+static sigset_t core_interrupt_set;
 
 /* Array of Core objects, one per core */
 static Core CORE[MAX_CORES];
@@ -84,11 +95,8 @@ static pthread_barrier_t system_barrier, core_barrier;
 /* Flag that signals that PIC daemon should be active */
 static volatile sig_atomic_t PIC_active;
 
-/* Mutex for implementing core halt */
-static pthread_mutex_t core_halt_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-/* List of halted cores */
-static rlnode halted_list;
+/* Bitmap of halted cores (bit c is set while core c is halted) */
+static uint32_t halted_cores;
 
 /* PIC thread id */
 static pthread_t PIC_thread;
@@ -99,6 +107,12 @@ static struct sigaction USR1_saved_sigaction;
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
+/* Save the sigaction for SIGALRM */
+static struct sigaction ALRM_saved_sigaction;
+
+/* The sigaction for SIGALRM (core timers) */
+static struct sigaction ALRM_sigaction;
+
 /* A simulated coarse clock measuring time with a res. of 0.1 sec,
    since "boot". Used for serial device timeouts. */
 typedef unsigned long coarse_clock_t;
@@ -111,10 +125,33 @@ static volatile coarse_clock_t  system_clock;
 #define SERIAL_TIMEOUT 3
 
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
+static void sigalrm_handler(int signo, siginfo_t* si, void* ctx);
 
 
 /* PIC daemon statistics */
 static unsigned long PIC_loops, PIC_usr1_drained, PIC_usr1_queued;
+static uint64_t PIC_busy_ns;
+
+/* The monotonic time of vm_boot(), in nsec */
+static uint64_t boot_time_ns;
+
+/* 
+	Virtual time mode. The clock runs as the real clock, except that it
+	jumps forward over the periods when the whole VM is idle.
+	vtime_skip_ns is the total time jumped over.
+ */
+static int virtual_time = 0;
+static uint64_t vtime_skip_ns;
+
+/* The time by which the PIC daemon will wake up, at the latest */
+static uint64_t vtime_pic_wakeup_ns;
+
+static inline uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
 
 
 /* Initialize static vars. This is called via pthread_once() */
@@ -128,23 +165,26 @@ static void initialize()
 	USR1_sigaction.sa_flags = SA_SIGINFO;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
-	/* Create the sigmask to block all signals, except USR1 */
+	/* The timer handler must not nest with the interrupt handler */
+	ALRM_sigaction.sa_sigaction = sigalrm_handler;
+	ALRM_sigaction.sa_flags = SA_SIGINFO;
+	sigemptyset(& ALRM_sigaction.sa_mask);
+	sigaddset(& ALRM_sigaction.sa_mask, SIGUSR1);
+	sigaddset(& USR1_sigaction.sa_mask, SIGALRM);
+
+	/* Create the sigmask to block all signals, except USR1 and ALRM */
 	CHECK(sigfillset(&core_signal_set));
 	CHECK(sigdelset(&core_signal_set, SIGUSR1));
+	CHECK(sigdelset(&core_signal_set, SIGALRM));
 
 	/* Create the mask for blocking SIGUSR1 */
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
-
-	/* Create signaldf_set */
-	CHECK(sigemptyset(&signalfd_set));
-	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
+	/* Create the mask for blocking core interrupts */
+	CHECK(sigemptyset(&core_interrupt_set));
+	CHECK(sigaddset(&core_interrupt_set, SIGUSR1));
+	CHECK(sigaddset(&core_interrupt_set, SIGALRM));
 }
 
 
@@ -176,6 +216,244 @@ static inline void interrupt_pic_thread()
 
 
 
+/*****************************************
+ *
+ *  Event tracing (record/replay)
+ *
+ *****************************************/
+
+/*
+	In record mode, every raised interrupt and every byte moved through
+	a serial port is logged to a trace file. In replay mode, the interrupts
+	and the serial input of a trace are re-injected at the same VM clock 
+	times, instead of the live ones, until the trace is exhausted.
+
+	The trace file is a header, followed by a sequence of fixed-size
+	records, in the order they were logged.
+
+	Records are logged by cores (possibly from signal handlers) and by the 
+	PIC daemon into a lock-free ring, which is written to the file by the 
+	PIC daemon.
+ */
+
+#define TRACE_MAGIC "TOSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 65536		/* must be a power of 2 */
+#define TRACE_NOPORT 0xff
+
+typedef struct trace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint16_t ncores;
+	uint16_t nterm;
+} trace_header;
+
+enum trace_record_type 
+{ 
+	TRACE_EMPTY=0,			/* used to mark free ring slots */
+	TRACE_INTERRUPT,		/* data = { intno, serial port or TRACE_NOPORT } */
+	TRACE_SERIAL_RX,		/* data = bytes read from the terminal */
+	TRACE_SERIAL_TX			/* data = bytes written to the terminal */
+};
+
+typedef struct trace_record
+{
+	uint64_t time;			/* VM clock, in nsec */
+	uint8_t type;			/* a trace_record_type */
+	uint8_t unit;			/* the core or the serial port */
+	uint8_t len;			/* the number of bytes in data */
+	uint8_t data[5];
+} trace_record;
+
+static vm_trace_mode trace_mode = VM_TRACE_OFF;
+static const char* trace_filename = NULL;
+static FILE* trace_file;
+
+/* The record ring */
+static trace_record* trace_ring;
+static unsigned long trace_head, trace_tail;
+
+/* The replayed records */
+static trace_record* replay_trace;
+static size_t replay_size, replay_next;
+
+/* This is set while replaying, and cleared when the trace is exhausted */
+static int replay_active;
+
+
+/*
+	Write the records of the ring to the trace file. Called only by the 
+	PIC daemon.
+ */
+static void trace_drain()
+{
+	unsigned long tail = trace_tail;
+	while(1) {
+		trace_record* rec = & trace_ring[tail & (TRACE_RING_SIZE-1)];
+		if(__atomic_load_n(& rec->type, __ATOMIC_ACQUIRE) == TRACE_EMPTY) break;
+		CHECK_CONDITION(fwrite(rec, sizeof(trace_record), 1, trace_file)==1);
+		__atomic_store_n(& rec->type, TRACE_EMPTY, __ATOMIC_RELEASE);
+		tail++;
+	}
+	__atomic_store_n(&trace_tail, tail, __ATOMIC_RELEASE);
+}
+
+
+/*
+	Log a record. Core interrupts are blocked while a core owns a ring 
+	slot, so that a nested record cannot wait for a slot that is held
+	by the interrupted code.
+ */
+static void trace_log(uint8_t type, uint8_t unit, const void* data, uint8_t len)
+{
+	int is_pic = pthread_equal(pthread_self(), PIC_thread);
+	sigset_t saved_mask;
+	if(! is_pic)
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &core_interrupt_set, &saved_mask));
+
+	unsigned long idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_ACQ_REL);
+
+	/* Wait for the PIC daemon to make room */
+	while(idx - __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+		if(is_pic) trace_drain(); else sched_yield();
+	}
+
+	trace_record* rec = & trace_ring[idx & (TRACE_RING_SIZE-1)];
+	rec->time = bios_clock_ns();
+	rec->unit = unit;
+	rec->len = len;
+	memcpy(rec->data, data, len);
+	__atomic_store_n(& rec->type, type, __ATOMIC_RELEASE);
+
+	if(! is_pic)
+		CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
+}
+
+
+/*
+	In virtual time and in replay, core timers are kept by the PIC daemon.
+ */
+static inline int pic_timers()
+{
+	return virtual_time || trace_mode == VM_TRACE_REPLAY;
+}
+
+
+static inline void trace_interrupt(uint core, Interrupt intno, uint serial)
+{
+	if(trace_mode != VM_TRACE_RECORD) return;
+	uint8_t data[2] = { intno, serial };
+	trace_log(TRACE_INTERRUPT, core, data, 2);
+}
+
+
+static void trace_serial(uint8_t type, uint serial, const char* buf, size_t size)
+{
+	if(trace_mode != VM_TRACE_RECORD) return;
+	const size_t chunk = sizeof(((trace_record*)0)->data);
+	for(size_t i=0; i<size; i+=chunk)
+		trace_log(type, serial, buf+i, (size-i < chunk) ? size-i : chunk);
+}
+
+
+/*
+	Called at vm_boot, to set up tracing.
+ */
+static void trace_open(uint cores, uint serialno)
+{
+	const char* env;
+	if((env = getenv("TINYOS_RECORD")) != NULL) {
+		trace_mode = VM_TRACE_RECORD;
+		trace_filename = env;
+	}
+	else if((env = getenv("TINYOS_REPLAY")) != NULL) {
+		trace_mode = VM_TRACE_REPLAY;
+		trace_filename = env;
+	}
+
+	trace_header hdr;
+	replay_active = 0;
+
+	switch(trace_mode) {
+	case VM_TRACE_RECORD:
+		trace_file = fopen(trace_filename, "w");
+		CHECK_CONDITION(trace_file != NULL);
+		memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+		hdr.version = TRACE_VERSION;
+		hdr.ncores = cores;
+		hdr.nterm = serialno;
+		CHECK_CONDITION(fwrite(&hdr, sizeof(hdr), 1, trace_file)==1);
+
+		trace_ring = calloc(TRACE_RING_SIZE, sizeof(trace_record));
+		CHECK_CONDITION(trace_ring != NULL);
+		trace_head = trace_tail = 0;
+		break;
+
+	case VM_TRACE_REPLAY:
+		trace_file = fopen(trace_filename, "r");
+		CHECK_CONDITION(trace_file != NULL);
+		CHECK_CONDITION(fread(&hdr, sizeof(hdr), 1, trace_file)==1);
+		CHECK_CONDITION(memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic))==0);
+		CHECK_CONDITION(hdr.version == TRACE_VERSION);
+		CHECK_CONDITION(hdr.ncores == cores && hdr.nterm == serialno);
+
+		/* Load the whole trace */
+		size_t cap = 1024;
+		replay_trace = malloc(cap * sizeof(trace_record));
+		replay_size = 0;
+		size_t n;
+		while((n = fread(replay_trace+replay_size, sizeof(trace_record), 
+				cap-replay_size, trace_file)) > 0) {
+			replay_size += n;
+			if(replay_size == cap) {
+				cap *= 2;
+				replay_trace = realloc(replay_trace, cap * sizeof(trace_record));
+			}
+			CHECK_CONDITION(replay_trace != NULL);
+		}
+		CHECK_CONDITION(fclose(trace_file)==0);
+		trace_file = NULL;
+
+		replay_next = 0;
+		replay_active = (replay_size > 0);
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/*
+	Called at the end of vm_boot, after all cores have stopped.
+ */
+static void trace_close()
+{
+	if(trace_mode == VM_TRACE_RECORD) {
+		trace_drain();
+		CHECK_CONDITION(fclose(trace_file)==0);
+		trace_file = NULL;
+		free(trace_ring);
+		trace_ring = NULL;
+	}
+	else if(trace_mode == VM_TRACE_REPLAY) {
+		free(replay_trace);
+		replay_trace = NULL;
+	}
+}
+
+
+void vm_set_trace(vm_trace_mode mode, const char* filename)
+{
+	CHECK_CONDITION(ncores==0);
+	CHECK_CONDITION(mode==VM_TRACE_OFF || filename!=NULL);
+	trace_mode = mode;
+	trace_filename = filename;
+}
+
+
+
 /*
 	Helper pthread-startable function to launch a core thread.
 */
@@ -199,11 +477,16 @@ static void* bootfunc_wrapper(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
-	core->timer_sigevent.sigev_value.sival_int = core->id;
-	CHECK(timer_create(CLOCK_REALTIME, & core->timer_sigevent, & core->timer_id));
+	/* create a thread-specific timer, whose expiry is signalled to this thread.
+	   In virtual time mode, the timer is simulated by the PIC daemon. */
+	core->timer_deadline = 0;
+	if(! virtual_time) {
+		core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+		core->timer_sigevent.sigev_signo = SIGALRM;
+		core->timer_sigevent.sigev_value.sival_int = core->id;
+		core->timer_sigevent.sigev_notify_thread_id = syscall(SYS_gettid);
+		CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
+	}
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -217,7 +500,8 @@ static void* bootfunc_wrapper(void* _core)
 	}		
 
 	/* Delete the core timer */
-	CHECK(timer_delete(core->timer_id));
+	if(! virtual_time)
+		CHECK(timer_delete(core->timer_id));
 
 	pthread_barrier_wait(& core_barrier);
 
@@ -235,17 +519,28 @@ static void* bootfunc_wrapper(void* _core)
 
 
 /*
-	Raise an interrupt to a core.
+	Raise an interrupt to a core, without logging it.
  */
-static inline void raise_interrupt(Core* core, Interrupt intno) 
+static inline void post_interrupt(Core* core, Interrupt intno) 
 {
 	union sigval coreval;
 	coreval.sival_ptr = NULL; /* This is to silence valgrind */
 	coreval.sival_int = core->id;
+	__atomic_fetch_add(& core->irq_raised[intno], 1, __ATOMIC_RELAXED);
 	core->intpending[intno] = 1;
-	core->irq_raised[intno] ++;
+
+	/* This also wakes up the core, if it is halted */
 	CHECKRC(pthread_sigqueue(core->thread, SIGUSR1, coreval));
-	cpu_core_restart(core->id);
+}
+
+
+/*
+	Raise an interrupt to a core.
+ */
+static inline void raise_interrupt(Core* core, Interrupt intno) 
+{
+	trace_interrupt(core->id, intno, TRACE_NOPORT);
+	post_interrupt(core, intno);
 }
 
 
@@ -264,11 +559,46 @@ static void dispatch_interrupts(Core* core)
 			if(handler != NULL) { 
 				handler();
 			}
+			else
+				core->irq_dropped[intno]++;
 		}
 	}	
 }
 
 
+/*
+	Futex helpers used to halt and restart cores.
+ */
+static inline void futex_wait(int* addr, int val)
+{
+	if(syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0)==-1)
+		assert(errno==EAGAIN || errno==EINTR);
+}
+
+static inline void futex_wake(int* addr)
+{
+	CHECK(syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0));
+}
+
+
+/*
+	Called by a signal handler on its own core. If the core is halted,
+	the halt is cancelled, so that the interrupts are dispatched when
+	cpu_core_halt() returns, and 1 is returned. Else, 0 is returned.
+
+	Clearing the futex word ensures that the halt is not lost, even if
+	the signal arrived just before the core entered futex_wait().
+ */
+static inline int core_wake_halted(Core* core)
+{
+	if(__atomic_load_n(&core->halted, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&core->halted, 0, __ATOMIC_RELEASE);
+		return 1;
+	}
+	return 0;
+}
+
+
 /*
 	This is the handler run by core threads to handle interrupts.
  */
@@ -278,6 +608,36 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 
 	core->irq_count++;
 	if(core->int_disabled) return;
+	if(core_wake_halted(core)) return;
+	dispatch_interrupts(core);
+}
+
+
+/*
+	Mark the ALARM interrupt as pending for the given core.
+ */
+static inline void core_alarm(Core* core)
+{
+	trace_interrupt(core->id, ALARM, TRACE_NOPORT);
+	__atomic_fetch_add(& core->irq_raised[ALARM], 1, __ATOMIC_RELAXED);
+	core->intpending[ALARM] = 1;
+}
+
+
+/*
+	This is the handler run by core threads when their timer expires.
+ */
+static void sigalrm_handler(int signo, siginfo_t* si, void* ctx)
+{
+	/* Ignore anything that was not sent by a core timer */
+	if(si->si_code != SI_TIMER) return;
+
+	Core* core = & CORE[si->si_value.sival_int];
+
+	core_alarm(core);
+	core->irq_count++;
+	if(core->int_disabled) return;
+	if(core_wake_halted(core)) return;
 	dispatch_interrupts(core);
 }
 
@@ -290,9 +650,14 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 /* Coarse clock */
 coarse_clock_t get_coarse_time()
 {
-	struct timespec curtime;
-	CHECK(clock_gettime(CLOCK_REALTIME, &curtime));
-	return curtime.tv_nsec / 100000000 + curtime.tv_sec*10;
+	return bios_clock_ns() / (SLOW_HZ*1000ull);
+}
+
+
+/* The time at which coarse time 'c' begins, in nsec */
+static inline uint64_t coarse_time_ns(coarse_clock_t c)
+{
+	return c * (SLOW_HZ*1000ull);
 }
 
 
@@ -311,9 +676,14 @@ coarse_clock_t get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	Between the two ends sits a (lock-free) io_buffer. Much like a DMA engine,
+	the PIC daemon moves data between the fd and the buffer in bulk, and the
+	cores transfer data from/to the buffer with plain memory copies, never
+	touching the fd. For an RX device, the PIC daemon fills the buffer when the
+	fd is readable; for a TX device, it drains the buffer when the fd is writable.
 
-	A not-ready device is made ready when select() returns it as such.
+	An io_device is ready if I/O transfers may succeed (i.e., an RX buffer has 
+	data, or a TX buffer has space).
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
@@ -333,66 +703,216 @@ typedef struct io_device
 {
 	int fd;              		/* file descriptor */
 	io_direction iodir;  		/* device direction */
+	uint serial;				/* the serial port of this device */
 
 	volatile Core* int_core;		/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
 	coarse_clock_t last_int;	/* used for timeouts */
-} io_device;
 
+	io_buffer buffer;			/* data in transit between the fd and the cores */
+} io_device;
 
-static int io_ready(int fd, io_direction dir) {
-	struct pollfd pfd;
-	pfd.fd = fd;
-	int evt = (dir==IODIR_RX) ? POLLIN : POLLOUT;
-	pfd.events = evt;
-	CHECK(poll(&pfd, 1, 0));
-	return (pfd.revents & evt) ? 1 : 0;
-}
 
-static void io_device_init(io_device* this, int fd, io_direction iodir)
+static void io_device_init(io_device* this, int fd, io_direction iodir, uint serial)
 {
 	this->fd = fd;
 	this->iodir = iodir;
+	this->serial = serial;
 	this->int_core = &CORE[0];
-	this->ready = io_ready(fd, iodir);
+	this->ready = (iodir==IODIR_TX);
 	this->last_int = system_clock;
+	io_buffer_init(& this->buffer);
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Return the number of bytes that an io_device buffer holds for the 
+	fd side: the free space for RX and the pending data for TX.
+ */
+static inline uint io_device_pending(io_device* this)
+{
+	io_buffer_segment* seg = (this->iodir==IODIR_RX) ? 
+		& this->buffer.space : & this->buffer.data;
+	return __atomic_load_n(& seg->available, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+	Return the number of bytes that an io_device buffer holds for the 
+	cores: the pending data for RX and the free space for TX.
+ */
+static inline uint io_device_available(io_device* this)
+{
+	return IO_BUFFER_CAPACITY - io_device_pending(this);
+}
+
+
+/* 
+	Describe a reserved buffer region [pos, pos+size) by at most two iovecs.
+ */
+static inline int io_buffer_iovec(io_buffer* buf, uint pos, uint size, struct iovec iov[2])
+{
+	uint first = (pos+size <= IO_BUFFER_CAPACITY) ? size : IO_BUFFER_CAPACITY-pos;
+	iov[0] = (struct iovec){ .iov_base = buf->storage + pos, .iov_len = first };
+	iov[1] = (struct iovec){ .iov_base = buf->storage, .iov_len = size-first };
+	return (size>first) ? 2 : 1;
+}
+
+
+/*
+	Log the first n bytes described by iov to the trace.
+ */
+static void io_device_trace(io_device* this, struct iovec iov[2], size_t n)
+{
+	uint8_t type = (this->iodir==IODIR_RX) ? TRACE_SERIAL_RX : TRACE_SERIAL_TX;
+	for(int i=0; i<2 && n>0; i++) {
+		size_t len = (n < iov[i].iov_len) ? n : iov[i].iov_len;
+		trace_serial(type, this->serial, iov[i].iov_base, len);
+		n -= len;
+	}
+}
+
+
+/*
+	Called by the PIC daemon to fill an RX buffer from its fd.
+	Returns the number of bytes read.
+ */
+static uint io_device_fill(io_device* this)
+{
+	assert(this->iodir == IODIR_RX);
+	io_buffer* buf = & this->buffer;
+
+	uint pos;
+	uint size = io_buffer_segment_reserve(& buf->space, IO_BUFFER_CAPACITY, &pos);
+	if(size==0) return 0;
+
+	struct iovec iov[2];
+	int iovcnt = io_buffer_iovec(buf, pos, size, iov);
+
+	ssize_t rc;
+	while((rc=readv(this->fd, iov, iovcnt))==-1 && errno==EINTR);
+	assert(rc>=0 || errno==EAGAIN || errno==EWOULDBLOCK);
+	if(rc<0) rc = 0;
+	io_device_trace(this, iov, rc);
+
+	/* Return what was not used */
+	io_buffer_segment_unreserve(& buf->space, size-rc);
+	io_buffer_segment_release(& buf->data, rc);
+	return rc;
+}
+
+
+/*
+	Called by the PIC daemon while replaying, to consume the live input
+	of an RX fd, which is replaced by the trace.
+ */
+static void io_device_discard(io_device* this)
 {
 	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
-	assert(rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
+	char scratch[IO_BUFFER_CAPACITY];
+	while(read(this->fd, scratch, sizeof(scratch))==-1 && errno==EINTR);
+}
+
+
+/*
+	Called by the PIC daemon to drain a TX buffer to its fd.
+	Returns the number of bytes written.
+ */
+static uint io_device_drain(io_device* this)
+{
+	assert(this->iodir == IODIR_TX);
+	io_buffer* buf = & this->buffer;
+
+	uint pos;
+	uint size = io_buffer_segment_reserve(& buf->data, IO_BUFFER_CAPACITY, &pos);
+	if(size==0) return 0;
+
+	struct iovec iov[2];
+	int iovcnt = io_buffer_iovec(buf, pos, size, iov);
+
+	ssize_t rc;
+	while((rc=writev(this->fd, iov, iovcnt))==-1 && errno==EINTR);
+	assert(rc>=0 || errno==EAGAIN || errno==EWOULDBLOCK || errno==EPIPE);
+
+	/* Nobody is listening at the other end: the data is lost, as on a 
+	   disconnected serial line. */
+	if(rc<0 && errno==EPIPE) rc = size;
+	if(rc<0) rc = 0;
+	io_device_trace(this, iov, rc);
+
+	/* Return what was not used */
+	io_buffer_segment_unreserve(& buf->data, size-rc);
+	io_buffer_segment_release(& buf->space, rc);
+	return rc;
+}
+
+
+/*
+	Called by the PIC daemon at shutdown, to send any data left in 
+	a TX buffer to its fd.
+ */
+static void io_device_flush(io_device* this)
+{
+	assert(this->iodir == IODIR_TX);
+	CHECK(fcntl(this->fd, F_SETFL, 0));
+	while(io_device_pending(this) && io_device_drain(this));
+}
+
+
+/*
+	Called by cores to transfer data out of an RX buffer.
+ */
+static uint io_device_read(io_device* this, char* ptr, uint size)
+{
+	assert(this->iodir == IODIR_RX);
+	io_buffer* buf = & this->buffer;
+
+	uint pos;
+	uint count = io_buffer_segment_reserve(& buf->data, size, &pos);
+	io_buffer_get(buf, pos, ptr, count);
+	uint space = io_buffer_segment_release(& buf->space, count);
 
-	if(rc!=1 && this->ready) {
+	if(count < size && this->ready) {
+		/* The PIC will raise an interrupt when there is data */
 		this->ready = 0;
 		interrupt_pic_thread();
 	}
-	return rc==1;
+	else if(count>0 && space==0) {
+		/* The PIC stopped reading the fd, because the buffer was full */
+		interrupt_pic_thread();
+	}
+
+	return count;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Called by cores to transfer data into a TX buffer.
+ */
+static uint io_device_write(io_device* this, const char* ptr, uint size)
 {
 	assert(this->iodir == IODIR_TX);
+	io_buffer* buf = & this->buffer;
 
-	/* Try to write */
-	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
-
-	assert(rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
+	uint pos;
+	uint count = io_buffer_segment_reserve(& buf->space, size, &pos);
+	io_buffer_put(buf, pos, (char*) ptr, count);
+	uint data = io_buffer_segment_release(& buf->data, count);
 
-	if(rc!=1 && this->ready) {
+	if(count < size && this->ready) {
+		/* The PIC will raise an interrupt when there is space */
 		this->ready = 0;
 		interrupt_pic_thread();
-	} 
+	}
+	else if(count>0 && data==0) {
+		/* The PIC is not watching the fd, because the buffer was empty */
+		interrupt_pic_thread();
+	}
 
-	return rc==1;
+	return count;
 }
 
 
@@ -421,12 +941,12 @@ static int terminal_init(terminal* this, int no)
 	sprintf(fname, "con%d", no);
 	fd = open(fname, O_WRONLY);
 	if(fd==-1) return -1;
-	io_device_init(& this->con, fd, IODIR_TX);
+	io_device_init(& this->con, fd, IODIR_TX, no);
 
 	sprintf(fname, "kbd%d", no);
 	fd = open(fname, O_RDONLY);
 	if(fd==-1) return -1;
-	io_device_init(& this->kbd, fd, IODIR_RX);
+	io_device_init(& this->kbd, fd, IODIR_RX, no);
 
 	return 0;
 }
@@ -463,45 +983,793 @@ static inline void fdset_add(fd_set* set, int fd, int* nfds)
 }
 
 
-static int check_terminal(terminal* term)
+/*
+	Raise an interrupt for device 'unit' (a serial port or a disk), 
+	marking the device in the pending bitmap of the receiving core.
+ */
+static void raise_device_interrupt(Core* core, uint unit, Interrupt intno)
 {
-	/* poll the read side */
-	struct pollfd fds = { .fd=term->kbd.fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	return (fds.revents & (POLLHUP|POLLERR))==0;
+	__atomic_fetch_or(& core->device_pending[intno], 1u<<unit, __ATOMIC_RELEASE);
+	trace_interrupt(core->id, intno, unit);
+	post_interrupt(core, intno);
 }
 
-
-
-/* Helper for PIC_daemon */
-static void pic_drain_sigusr1(int sigusr1fd)
+static void raise_serial_interrupt(io_device* dev, uint serial, Interrupt intno)
 {
-	struct signalfd_siginfo sfdinfo;
-	while(1) {
-		int rc = read(sigusr1fd, &sfdinfo, sizeof(sfdinfo));
-		if(rc==-1) {
-			assert(errno==EAGAIN || errno==EWOULDBLOCK);
-			break;
-		}
-		assert(rc==sizeof(sfdinfo));
-		__atomic_fetch_add(&PIC_usr1_drained,1,__ATOMIC_RELAXED);
-	}				
+	raise_device_interrupt((Core*) dev->int_core, serial, intno);
 }
 
 
-/*
-	The PIC daemon is the dispatcher on interrupts to core threads,
-	by calling raise_interrupt().
 
-	Interrupts sent include
-	(a) ALARM, when the per-core timer expires
-	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
-		io_device becomes ready.
+/*****************************************
+ *
+ *  Block devices
+ *
+ *****************************************/
 
+/*
+	A block device (disk) is simulated by a host image file. 
+
+	Requests are served in FIFO order, one at a time. When a request is 
+	submitted, its completion time is computed from the disk's latency
+	and bandwidth, and it is appended to the disk's queue. A request
+	that does not start where the previous one ended pays a positioning 
+	delay of half the latency, plus up to another half in proportion to 
+	the seek distance. The PIC daemon
+	performs the transfer of each request at its completion time, moves 
+	the request to the list of completed requests and raises BLOCK_DONE.
  */
-static void PIC_daemon(uint serialno)
+
+typedef struct block_device_config
+{
+	const char* image;			/* the host image file, or NULL */
+	TimerDuration latency;		/* per request, in usec */
+	uint64_t bandwidth;			/* bytes per sec, or 0 for unlimited */
+} block_device_config;
+
+typedef struct block_device
+{
+	int fd;						/* the image file */
+	uint64_t sectors;			/* the disk size */
+	uint64_t latency_ns;
+	uint64_t bandwidth;
+
+	volatile Core* int_core;	/* core to receive interrupts */
+
+	pthread_mutex_t lock;		/* protects the lists and busy_until */
+	bios_block_request *queue_head, *queue_tail;	/* submitted requests */
+	bios_block_request *done_head, *done_tail;		/* completed requests */
+	uint64_t busy_until;		/* completion time of the last request queued */
+	uint64_t head;				/* the sector after the last request queued */
+} block_device;
+
+static block_device_config DISK_CONFIG[MAX_BLOCK_DEVICES];
+static block_device DISK[MAX_BLOCK_DEVICES];
+
+/* Current number of disks */
+static uint ndisks = 0;
+
+
+/* Append a request to a list */
+static inline void block_list_append(bios_block_request** head, bios_block_request** tail,
+	bios_block_request* req)
+{
+	req->next = NULL;
+	if(*tail) (*tail)->next = req; else *head = req;
+	*tail = req;
+}
+
+
+/* 
+	Lock a disk from a core. Core interrupts are blocked while the lock is 
+	held, so that an interrupt handler cannot deadlock on it.
+ */
+static void block_core_lock(block_device* disk, sigset_t* saved_mask)
+{
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_interrupt_set, saved_mask));
+	CHECKRC(pthread_mutex_lock(& disk->lock));
+}
+
+static void block_core_unlock(block_device* disk, sigset_t* saved_mask)
+{
+	CHECKRC(pthread_mutex_unlock(& disk->lock));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, saved_mask, NULL));
+}
+
+
+/*
+	Called at vm_boot, to open the configured disks. The disks are the 
+	configured ones, from disk 0 up to the first unconfigured one.
+ */
+static void block_devices_open()
+{
+	const char* env = getenv("TINYOS_DISK");
+	if(env != NULL)
+		DISK_CONFIG[0].image = env;
+
+	ndisks = 0;
+	while(ndisks < MAX_BLOCK_DEVICES && DISK_CONFIG[ndisks].image != NULL) {
+		block_device_config* cfg = & DISK_CONFIG[ndisks];
+		block_device* disk = & DISK[ndisks];
+
+		disk->fd = open(cfg->image, O_RDWR);
+		CHECK(disk->fd);
+		struct stat st;
+		CHECK(fstat(disk->fd, &st));
+		disk->sectors = st.st_size / BLOCK_SECTOR_SIZE;
+		disk->latency_ns = cfg->latency * 1000ull;
+		disk->bandwidth = cfg->bandwidth;
+
+		disk->int_core = & CORE[0];
+		CHECKRC(pthread_mutex_init(& disk->lock, NULL));
+		disk->queue_head = disk->queue_tail = NULL;
+		disk->done_head = disk->done_tail = NULL;
+		disk->busy_until = 0;
+		disk->head = 0;
+
+		ndisks++;
+	}
+}
+
+
+/*
+	Transfer the data of a request from/to the image file.
+ */
+static void block_transfer(block_device* disk, bios_block_request* req)
+{
+	if(req->status != 0) return;
+
+	char* buf = req->buffer;
+	size_t size = (size_t) req->count * BLOCK_SECTOR_SIZE;
+	off_t offset = (off_t) req->sector * BLOCK_SECTOR_SIZE;
+
+	while(size > 0) {
+		ssize_t rc = (req->op == BLOCK_READ) ? 
+			pread(disk->fd, buf, size, offset) : pwrite(disk->fd, buf, size, offset);
+		if(rc == -1 && errno == EINTR) continue;
+		if(rc <= 0) { req->status = -1; return; }
+		buf += rc; size -= rc; offset += rc;
+	}
+}
+
+
+/*
+	Called by the PIC daemon to complete the requests whose time has come.
+ */
+static void block_devices_complete()
+{
+	uint64_t now = bios_clock_ns();
+
+	for(uint d=0; d<ndisks; d++) {
+		block_device* disk = & DISK[d];
+		int completed = 0;
+
+		while(1) {
+			/* Take the next request, if it is done */
+			CHECKRC(pthread_mutex_lock(& disk->lock));
+			bios_block_request* req = disk->queue_head;
+			if(req && req->completion_time <= now) {
+				disk->queue_head = req->next;
+				if(disk->queue_head == NULL) disk->queue_tail = NULL;
+			}
+			else req = NULL;
+			CHECKRC(pthread_mutex_unlock(& disk->lock));
+			if(req == NULL) break;
+
+			block_transfer(disk, req);
+
+			CHECKRC(pthread_mutex_lock(& disk->lock));
+			block_list_append(& disk->done_head, & disk->done_tail, req);
+			CHECKRC(pthread_mutex_unlock(& disk->lock));
+			completed = 1;
+		}
+
+		if(completed)
+			raise_device_interrupt((Core*) disk->int_core, d, BLOCK_DONE);
+	}
+}
+
+
+/*
+	Return the completion time of the earliest submitted request, or 0.
+ */
+static uint64_t block_devices_next_event()
+{
+	uint64_t next = 0;
+	for(uint d=0; d<ndisks; d++) {
+		block_device* disk = & DISK[d];
+		CHECKRC(pthread_mutex_lock(& disk->lock));
+		if(disk->queue_head && (next==0 || disk->queue_head->completion_time < next))
+			next = disk->queue_head->completion_time;
+		CHECKRC(pthread_mutex_unlock(& disk->lock));
+	}
+	return next;
+}
+
+
+/*
+	Called at the end of vm_boot. Requests still queued are carried out,
+	without raising interrupts, so that no write is lost.
+ */
+static void block_devices_close()
+{
+	for(uint d=0; d<ndisks; d++) {
+		block_device* disk = & DISK[d];
+		for(bios_block_request* req = disk->queue_head; req; req = req->next)
+			block_transfer(disk, req);
+		CHECK(close(disk->fd));
+		CHECKRC(pthread_mutex_destroy(& disk->lock));
+	}
+	ndisks = 0;
+}
+
+
+
+/*****************************************
+ *
+ *  Network devices
+ *
+ *****************************************/
+
+/*
+	A network device (NIC) is simulated by a host AF_UNIX socket of type
+	SOCK_SEQPACKET. A loopback NIC sends to one end of a socket pair and 
+	receives from the other.
+
+	Each queue has a TX ring and an RX ring, protected by the queue lock.
+	Cores append packets to TX rings and take them from RX rings; the PIC
+	daemon sends the packets of the TX rings to the socket, and receives
+	packets from the socket into the RX rings. Since only the PIC takes
+	packets from a TX ring and adds packets to an RX ring, the PIC accesses
+	those descriptors without the lock; the lock protects the ring indices
+	and the interrupt flags.
+
+	The PIC receives packets only while every RX ring has room, so that a
+	slow receiver makes the socket push back on the sender, instead of
+	losing packets.
+ */
+
+typedef struct nic_config
+{
+	vm_nic_mode mode;
+	const char* address;		/* the socket address, unless loopback */
+	uint queues;				/* 0 for one per core */
+} nic_config;
+
+typedef struct nic_descriptor
+{
+	uint len;
+	uint64_t time;				/* the arrival time of an RX packet */
+	char data[NET_MTU];
+} nic_descriptor;
+
+typedef struct nic_ring
+{
+	nic_descriptor* desc;		/* NET_RING_SIZE descriptors */
+	uint head;					/* the first packet */
+	uint count;					/* the number of packets */
+} nic_ring;
+
+typedef struct nic_queue
+{
+	pthread_mutex_t lock;
+	nic_ring tx, rx;
+	int rx_armed;				/* raise NET_RX_READY when packets arrive */
+	int tx_waiting;				/* raise NET_TX_READY when the TX ring drains */
+	volatile Core* int_core;	/* core to receive interrupts */
+} nic_queue;
+
+typedef struct nic_device
+{
+	int tx_fd, rx_fd;			/* the same socket, unless loopback */
+	int rx_closed;				/* the peer has closed the connection */
+	uint nqueues;
+	nic_queue queue[NET_MAX_QUEUES];
+	uint tx_next;				/* the TX ring that the PIC serves first */
+
+	uint rx_frames;				/* interrupt coalescing */
+	uint64_t rx_delay_ns;
+} nic_device;
+
+static nic_config NIC_CONFIG[MAX_NET_DEVICES];
+static nic_device NIC[MAX_NET_DEVICES];
+
+/* Current number of NICs */
+static uint nnics = 0;
+
+/* How long a connecting NIC waits for the listening one, in msec */
+#define NIC_CONNECT_TIMEOUT 10000
+
+
+static inline nic_descriptor* nic_slot(nic_ring* ring, uint i)
+{
+	return & ring->desc[(ring->head + i) % NET_RING_SIZE];
+}
+
+static inline uint nic_count(nic_ring* ring)
+{
+	return __atomic_load_n(& ring->count, __ATOMIC_ACQUIRE);
+}
+
+/* The interrupt unit of a queue */
+static inline uint nic_unit(uint nic, uint queue)
+{
+	return nic * NET_MAX_QUEUES + queue;
+}
+
+
+/* Lock a queue from a core, with core interrupts blocked (see block_core_lock) */
+static void nic_core_lock(nic_queue* q, sigset_t* saved_mask)
+{
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_interrupt_set, saved_mask));
+	CHECKRC(pthread_mutex_lock(& q->lock));
+}
+
+static void nic_core_unlock(nic_queue* q, sigset_t* saved_mask)
+{
+	CHECKRC(pthread_mutex_unlock(& q->lock));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, saved_mask, NULL));
+}
+
+
+static struct sockaddr_un nic_address(const char* address)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	CHECK_CONDITION(address != NULL && strlen(address) < sizeof(addr.sun_path));
+	strcpy(addr.sun_path, address);
+	return addr;
+}
+
+
+/* Return a socket connected to the peer of a NIC */
+static int nic_connect(nic_config* cfg)
+{
+	struct sockaddr_un addr = nic_address(cfg->address);
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	CHECK(fd);
+
+	if(cfg->mode == VM_NIC_LISTEN) {
+		unlink(cfg->address);
+		CHECK(bind(fd, (struct sockaddr*) &addr, sizeof(addr)));
+		CHECK(listen(fd, 1));
+		int conn;
+		while((conn = accept(fd, NULL, NULL)) == -1 && errno == EINTR)
+			continue;
+		CHECK(conn);
+		CHECK(close(fd));
+		unlink(cfg->address);
+		return conn;
+	}
+
+	/* Wait for the listening VM to start */
+	int rc;
+	for(uint waited = 0; 
+		(rc = connect(fd, (struct sockaddr*) &addr, sizeof(addr))) == -1 
+		&& (errno == ENOENT || errno == ECONNREFUSED || errno == EINTR)
+		&& waited < NIC_CONNECT_TIMEOUT; waited += 10)
+		usleep(10000);
+	CHECK(rc);
+	return fd;
+}
+
+
+/*
+	Called at vm_boot, to open the configured NICs. The NICs are the 
+	configured ones, from NIC 0 up to the first unconfigured one.
+ */
+static void nic_devices_open(uint cores)
+{
+	const char* env = getenv("TINYOS_NIC");
+	if(env != NULL) {
+		nic_config* cfg = & NIC_CONFIG[0];
+		if(strcmp(env, "loopback")==0)
+			*cfg = (nic_config) { .mode = VM_NIC_LOOPBACK };
+		else if(strncmp(env, "listen:", 7)==0)
+			*cfg = (nic_config) { .mode = VM_NIC_LISTEN, .address = env+7 };
+		else if(strncmp(env, "connect:", 8)==0)
+			*cfg = (nic_config) { .mode = VM_NIC_CONNECT, .address = env+8 };
+		else
+			FATAL("TINYOS_NIC must be loopback, listen:ADDRESS or connect:ADDRESS");
+	}
+
+	nnics = 0;
+	while(nnics < MAX_NET_DEVICES && NIC_CONFIG[nnics].mode != VM_NIC_NONE) {
+		nic_config* cfg = & NIC_CONFIG[nnics];
+		nic_device* nic = & NIC[nnics];
+
+		if(cfg->mode == VM_NIC_LOOPBACK) {
+			int sv[2];
+			CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv));
+			nic->tx_fd = sv[0];
+			nic->rx_fd = sv[1];
+		}
+		else
+			nic->tx_fd = nic->rx_fd = nic_connect(cfg);
+		CHECK(fcntl(nic->tx_fd, F_SETFL, O_NONBLOCK));
+		CHECK(fcntl(nic->rx_fd, F_SETFL, O_NONBLOCK));
+		nic->rx_closed = 0;
+
+		nic->nqueues = cfg->queues ? cfg->queues : cores;
+		if(nic->nqueues > NET_MAX_QUEUES) nic->nqueues = NET_MAX_QUEUES;
+		for(uint i=0; i<nic->nqueues; i++) {
+			nic_queue* q = & nic->queue[i];
+			CHECKRC(pthread_mutex_init(& q->lock, NULL));
+			q->tx = (nic_ring) { .desc = xmalloc(NET_RING_SIZE*sizeof(nic_descriptor)) };
+			q->rx = (nic_ring) { .desc = xmalloc(NET_RING_SIZE*sizeof(nic_descriptor)) };
+			q->rx_armed = 1;
+			q->tx_waiting = 0;
+			q->int_core = & CORE[i % cores];
+		}
+		nic->tx_next = 0;
+		nic->rx_frames = 1;
+		nic->rx_delay_ns = 0;
+
+		nnics++;
+	}
+}
+
+
+/*
+	Called by the PIC daemon: send the packets of the TX rings, taking
+	one packet from each ring in turn, until the rings are empty or the
+	socket is full.
+ */
+static void nic_transmit(uint n)
+{
+	nic_device* nic = & NIC[n];
+	int progress = 1;
+
+	while(progress) {
+		progress = 0;
+		for(uint i=0; i<nic->nqueues; i++) {
+			uint qno = (nic->tx_next + i) % nic->nqueues;
+			nic_queue* q = & nic->queue[qno];
+			if(nic_count(& q->tx) == 0) continue;
+
+			nic_descriptor* desc = nic_slot(& q->tx, 0);
+			ssize_t rc = send(nic->tx_fd, desc->data, desc->len, MSG_DONTWAIT|MSG_NOSIGNAL);
+			if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				/* The socket is full; continue from this ring next time */
+				nic->tx_next = qno;
+				return;
+			}
+			/* On other errors (e.g., the peer is gone) the packet is lost */
+
+			CHECKRC(pthread_mutex_lock(& q->lock));
+			q->tx.head = (q->tx.head + 1) % NET_RING_SIZE;
+			q->tx.count--;
+			int raise = q->tx_waiting && q->tx.count <= NET_RING_SIZE/2;
+			if(raise) q->tx_waiting = 0;
+			CHECKRC(pthread_mutex_unlock(& q->lock));
+
+			if(raise)
+				raise_device_interrupt((Core*) q->int_core, nic_unit(n, qno), NET_TX_READY);
+			progress = 1;
+		}
+	}
+}
+
+
+/* Return true if every RX ring of a NIC has room */
+static int nic_rx_room(nic_device* nic)
+{
+	for(uint i=0; i<nic->nqueues; i++)
+		if(nic_count(& nic->queue[i].rx) == NET_RING_SIZE) return 0;
+	return 1;
+}
+
+
+/* The RX ring of a packet, by a hash (FNV-1a) of its flow key */
+static uint nic_steer(nic_device* nic, const char* data, uint len)
+{
+	uint32_t hash = 2166136261u;
+	for(uint i=0; i<len && i<NET_FLOW_KEY_SIZE; i++)
+		hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+	return hash % nic->nqueues;
+}
+
+
+/*
+	Called by the PIC daemon: receive packets from the socket into the 
+	RX rings, while they have room.
+ */
+static void nic_receive(uint n)
+{
+	nic_device* nic = & NIC[n];
+	char data[NET_MTU];
+
+	for(uint i=0; i<NET_RING_SIZE && nic_rx_room(nic); i++) {
+		ssize_t rc = recv(nic->rx_fd, data, NET_MTU, MSG_DONTWAIT);
+		if(rc == 0) { nic->rx_closed = 1; return; }
+		if(rc == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				nic->rx_closed = 1;
+			return;
+		}
+
+		/* The free descriptor after the last packet stays free while 
+		   cores take packets, so it is filled without the lock */
+		nic_queue* q = & nic->queue[nic_steer(nic, data, rc)];
+		CHECKRC(pthread_mutex_lock(& q->lock));
+		nic_descriptor* desc = nic_slot(& q->rx, q->rx.count);
+		CHECKRC(pthread_mutex_unlock(& q->lock));
+
+		memcpy(desc->data, data, rc);
+		desc->len = rc;
+		desc->time = bios_clock_ns();
+
+		CHECKRC(pthread_mutex_lock(& q->lock));
+		q->rx.count++;
+		CHECKRC(pthread_mutex_unlock(& q->lock));
+	}
+}
+
+
+/*
+	Called by the PIC daemon: raise NET_RX_READY on the armed queues 
+	whose coalescing condition holds.
+ */
+static void nic_rx_interrupts(uint n)
+{
+	nic_device* nic = & NIC[n];
+	uint64_t now = bios_clock_ns();
+
+	for(uint i=0; i<nic->nqueues; i++) {
+		nic_queue* q = & nic->queue[i];
+		CHECKRC(pthread_mutex_lock(& q->lock));
+		int raise = q->rx_armed && q->rx.count > 0 
+			&& (q->rx.count >= nic->rx_frames 
+				|| nic_slot(& q->rx, 0)->time + nic->rx_delay_ns <= now);
+		if(raise) q->rx_armed = 0;
+		CHECKRC(pthread_mutex_unlock(& q->lock));
+
+		if(raise)
+			raise_device_interrupt((Core*) q->int_core, nic_unit(n, i), NET_RX_READY);
+	}
+}
+
+
+/* Called by the PIC daemon, to add the fds of the NICs to select */
+static void nic_devices_fdset(fd_set* readfds, fd_set* writefds, int* maxfd)
+{
+	for(uint n=0; n<nnics; n++) {
+		nic_device* nic = & NIC[n];
+		if(! nic->rx_closed && nic_rx_room(nic))
+			fdset_add(readfds, nic->rx_fd, maxfd);
+		for(uint i=0; i<nic->nqueues; i++)
+			if(nic_count(& nic->queue[i].tx) > 0) {
+				fdset_add(writefds, nic->tx_fd, maxfd);
+				break;
+			}
+	}
+}
+
+
+/* Called by the PIC daemon, after select */
+static void nic_devices_io(fd_set* readfds, fd_set* writefds)
+{
+	for(uint n=0; n<nnics; n++) {
+		nic_device* nic = & NIC[n];
+		int sent = FD_ISSET(nic->tx_fd, writefds);
+		if(sent)
+			nic_transmit(n);
+		/* A loopback NIC can receive what it has just sent */
+		if(FD_ISSET(nic->rx_fd, readfds) || (sent && nic->rx_fd != nic->tx_fd))
+			nic_receive(n);
+		nic_rx_interrupts(n);
+	}
+}
+
+
+/*
+	Return the earliest time that a coalesced NET_RX_READY is due, or 0.
+ */
+static uint64_t nic_devices_next_event()
+{
+	uint64_t next = 0;
+	for(uint n=0; n<nnics; n++) {
+		nic_device* nic = & NIC[n];
+		for(uint i=0; i<nic->nqueues; i++) {
+			nic_queue* q = & nic->queue[i];
+			CHECKRC(pthread_mutex_lock(& q->lock));
+			if(q->rx_armed && q->rx.count > 0) {
+				uint64_t due = nic_slot(& q->rx, 0)->time + nic->rx_delay_ns;
+				if(next==0 || due < next) next = due;
+			}
+			CHECKRC(pthread_mutex_unlock(& q->lock));
+		}
+	}
+	return next;
+}
+
+
+/*
+	Called at the end of vm_boot. Packets still in the rings are lost.
+ */
+static void nic_devices_close()
+{
+	for(uint n=0; n<nnics; n++) {
+		nic_device* nic = & NIC[n];
+		if(nic->rx_fd != nic->tx_fd) CHECK(close(nic->rx_fd));
+		CHECK(close(nic->tx_fd));
+		for(uint i=0; i<nic->nqueues; i++) {
+			free(nic->queue[i].tx.desc);
+			free(nic->queue[i].rx.desc);
+			CHECKRC(pthread_mutex_destroy(& nic->queue[i].lock));
+		}
+	}
+	nnics = 0;
+}
+
+
+
+/*
+	Called by the PIC daemon while replaying, to inject the trace records
+	whose time has come.
+ */
+static void replay_inject()
+{
+	uint64_t now = bios_clock_ns();
+
+	for(; replay_next < replay_size; replay_next++) {
+		trace_record* rec = & replay_trace[replay_next];
+		if(rec->time > now) break;
+
+		if(rec->type == TRACE_SERIAL_RX) {
+			CHECK_CONDITION(rec->unit < nterm && rec->len <= sizeof(rec->data));
+			io_device* kbd = & TERM[rec->unit].kbd;
+
+			/* Wait until the cores make room */
+			if(io_device_pending(kbd) < rec->len) break;
+
+			uint pos;
+			uint size = io_buffer_segment_reserve(& kbd->buffer.space, rec->len, &pos);
+			assert(size == rec->len);
+			io_buffer_put(& kbd->buffer, pos, (char*) rec->data, size);
+			io_buffer_segment_release(& kbd->buffer.data, size);
+		}
+		else if(rec->type == TRACE_INTERRUPT) {
+			CHECK_CONDITION(rec->unit < ncores);
+			Core* core = & CORE[rec->unit];
+			Interrupt intno = rec->data[0];
+			uint serial = rec->data[1];
+
+			switch(intno) {
+			case ICI:
+				/* These are raised again by the cores themselves */
+				break;
+			case BLOCK_DONE:
+			case NET_RX_READY:
+			case NET_TX_READY:
+				/* Disk requests and packets are served live */
+				break;
+			case SERIAL_RX_READY:
+			case SERIAL_TX_READY: {
+				CHECK_CONDITION(serial < nterm);
+				io_device* dev = (intno==SERIAL_RX_READY) ? 
+					& TERM[serial].kbd : & TERM[serial].con;
+				dev->ready = 1;
+				dev->last_int = system_clock;
+				__atomic_fetch_or(& core->device_pending[intno], 1u<<serial, __ATOMIC_RELEASE);
+				post_interrupt(core, intno);
+				break;
+			}
+			default:
+				CHECK_CONDITION(intno < maximum_interrupt_no);
+				post_interrupt(core, intno);
+			}
+		}
+		/* Console output is produced by the cores again, so TX records are skipped */
+	}
+
+	if(replay_next == replay_size)
+		__atomic_store_n(&replay_active, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+	Virtual time helpers, used by the PIC daemon.
+ */
+
+/* forward */
+static inline int core_interrupt_pending(Core* core);
+
+/* 
+	The VM is idle when all cores are halted, with no pending interrupts.
+ */
+static int vtime_vm_idle()
+{
+	for(uint c=0; c<ncores; c++) {
+		Core* core = & CORE[c];
+		if(! __atomic_load_n(& core->halted, __ATOMIC_ACQUIRE)) return 0;
+		if(core_interrupt_pending(core)) return 0;
+	}
+	return 1;
+}
+
+
+/*
+	Return the time of the next timed event (a core timer expiry or a
+	serial port timeout), or 0 if there is none.
+ */
+static uint64_t vtime_next_event()
+{
+	uint64_t next = 0;
+#define NEXT(t)  do { uint64_t __t = (t); if(__t && (next==0 || __t<next)) next=__t; } while(0)
+	if(replay_active) {
+		/* Core timers and serial timeouts are replaced by the trace */
+		if(replay_next < replay_size) NEXT(replay_trace[replay_next].time);
+	}
+	else {
+		for(uint c=0; c<ncores; c++)
+			NEXT(__atomic_load_n(& CORE[c].timer_deadline, __ATOMIC_ACQUIRE));
+		for(uint i=0; i<nterm; i++) {
+			NEXT(coarse_time_ns(TERM[i].kbd.last_int + SERIAL_TIMEOUT + 1));
+			NEXT(coarse_time_ns(TERM[i].con.last_int + SERIAL_TIMEOUT + 1));
+		}
+	}
+	NEXT(block_devices_next_event());
+	NEXT(nic_devices_next_event());
+#undef NEXT
+	return next;
+}
+
+
+/*
+	Raise ALARM on the cores whose timers have expired.
+ */
+static void vtime_fire_timers()
+{
+	uint64_t now = bios_clock_ns();
+	for(uint c=0; c<ncores; c++) {
+		Core* core = & CORE[c];
+		uint64_t deadline = __atomic_load_n(& core->timer_deadline, __ATOMIC_ACQUIRE);
+		if(deadline==0 || deadline > now) continue;
+		if(__atomic_compare_exchange_n(& core->timer_deadline, &deadline, 0, 0, 
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			raise_interrupt(core, ALARM);
+	}
+}
+
+
+static int check_terminal(terminal* term)
+{
+	/* poll the read side */
+	struct pollfd fds = { .fd=term->kbd.fd, .events=POLLIN };
+	int rc;
+	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
+	CHECK(rc);
+	return (fds.revents & (POLLHUP|POLLERR))==0;
+}
+
+
+
+/* Helper for PIC_daemon */
+static void pic_drain_sigusr1(int sigusr1fd)
+{
+	struct signalfd_siginfo sfdinfo;
+	while(1) {
+		int rc = read(sigusr1fd, &sfdinfo, sizeof(sfdinfo));
+		if(rc==-1) {
+			assert(errno==EAGAIN || errno==EWOULDBLOCK);
+			break;
+		}
+		assert(rc==sizeof(sfdinfo));
+		__atomic_fetch_add(&PIC_usr1_drained,1,__ATOMIC_RELAXED);
+	}				
+}
+
+
+/*
+	The PIC daemon is the dispatcher on interrupts to core threads,
+	by calling raise_interrupt().
+
+	Interrupts sent include SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
+	io_device becomes ready. The ALARM interrupt is not routed through the
+	PIC daemon; each core timer signals its own core thread directly.
+
+ */
+static void PIC_daemon(uint serialno)
 {
 	nterm = serialno;
 
@@ -520,10 +1788,11 @@ static void PIC_daemon(uint serialno)
 
 	int sigusr1fd = signalfd(-1, &sigusr1_set, SFD_NONBLOCK);
 	CHECK(sigusr1fd);
-	int sigalrmfd = signalfd(-1, &sigalrm_set, SFD_NONBLOCK);
-	CHECK(sigalrmfd);
 
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+	/* Terminal writes are done by this thread, so SIGPIPE must be blocked */
+	sigset_t pic_signal_set = sigusr1_set;
+	CHECK(sigaddset(&pic_signal_set, SIGPIPE));
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &pic_signal_set, &saved_mask));
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -540,40 +1809,59 @@ static void PIC_daemon(uint serialno)
 		for(uint i=0; i<nterm; i++) {
 			terminal* term = & TERM[i];
 			if(!check_terminal(term)) continue;
-			if(! term->kbd.ready) fdset_add(&readfds, term->kbd.fd, &maxfd);
-			if(! term->con.ready) fdset_add(&writefds, term->con.fd, &maxfd);
+			if(io_device_pending(& term->kbd) || replay_active) 
+				fdset_add(&readfds, term->kbd.fd, &maxfd);
+			if(io_device_pending(& term->con)) fdset_add(&writefds, term->con.fd, &maxfd);
 		}
 
-		fdset_add(&readfds, sigalrmfd, &maxfd);
+		nic_devices_fdset(&readfds, &writefds, &maxfd);
 		fdset_add(&readfds, sigusr1fd, &maxfd);
 
 		/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
 		struct timeval sleeptime = { .tv_sec=0, .tv_usec = SLOW_HZ };
+
+		/* Wake up for the next timed event (a disk completion, or a timer in
+		   virtual time or replay), or just poll if the VM is idle in virtual 
+		   time, since time will jump forward */
+		uint64_t next_event = vtime_next_event();
+		int vm_idle = virtual_time && vtime_vm_idle();
+		uint64_t now = bios_clock_ns();
+		if(vm_idle && next_event)
+			sleeptime.tv_usec = 0;
+		else if(next_event && next_event < now + SLOW_HZ*1000ull)
+			sleeptime.tv_usec = (next_event > now) ? (next_event-now+999)/1000 : 0;
+		__atomic_store_n(&vtime_pic_wakeup_ns, now + sleeptime.tv_usec*1000ull, 
+			__ATOMIC_RELEASE);
+
 		int selcode = select(maxfd, &readfds, &writefds, NULL, &sleeptime);
 
 		/* process */
 		if(selcode<0) continue;
 		__atomic_fetch_add(&PIC_loops,1,__ATOMIC_RELAXED);
+		uint64_t loop_start = monotonic_ns();
+
+		/* In virtual time, jump to the next event, if nothing happened meanwhile */
+		if(virtual_time && selcode==0 && vm_idle && next_event && vtime_vm_idle()) {
+			uint64_t now = bios_clock_ns();
+			if(next_event > now)
+				__atomic_fetch_add(&vtime_skip_ns, next_event-now, __ATOMIC_RELEASE);
+		}
 
 		/* update system clock */
 		system_clock = get_coarse_time();
 
-		/* First raise ALRM as needed (timers have priority :-) */
-		if( FD_ISSET(sigalrmfd, &readfds) ) {
-			struct signalfd_siginfo sfdinfo;
+		if(pic_timers()) {
+			if(replay_active) 
+				replay_inject();
+			else
+				vtime_fire_timers();
+		}
 
-			while(1) {
-				int rc = read(sigalrmfd, &sfdinfo, sizeof(sfdinfo));
-				if(rc==-1) {
-					assert(errno==EAGAIN || errno==EWOULDBLOCK);
-					break;
-				}
-				assert(rc==sizeof(sfdinfo));
+		/* Complete the disk requests that are done */
+		block_devices_complete();
 
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
-			}
-		}
+		/* Move packets between the NIC sockets and rings */
+		nic_devices_io(&readfds, &writefds);
 
 		/* Discard any USR1 signals to PIC (their purpose was to unblock PIC 
 		   from select) */
@@ -585,27 +1873,44 @@ static void PIC_daemon(uint serialno)
 		for(uint i=0; i<nterm; i++) {
 
 			terminal* term = & TERM[i];
-			if( FD_ISSET(term->con.fd, &writefds) 
+
+			/* Move data between the fds and the buffers */
+			if( FD_ISSET(term->con.fd, &writefds) )
+				io_device_drain(& term->con);
+			if( FD_ISSET(term->kbd.fd, &readfds) ) {
+				if(replay_active)
+					io_device_discard(& term->kbd);
+				else
+					io_device_fill(& term->kbd);
+			}
+
+			/* While replaying, serial interrupts come from the trace */
+			if(replay_active) continue;
+
+			if( (!term->con.ready && io_device_available(&term->con))
 				|| (system_clock-term->con.last_int)>SERIAL_TIMEOUT
 				) 
 			{
 				term->con.ready = 1;
 				term->con.last_int = system_clock;
-				Core* core = (Core*) term->con.int_core;
-				raise_interrupt(core, SERIAL_TX_READY);
+				raise_serial_interrupt(& term->con, i, SERIAL_TX_READY);
 			}
 
 
-			if( FD_ISSET(term->kbd.fd, &readfds) 
+			if( (!term->kbd.ready && io_device_available(&term->kbd))
 				|| (system_clock-term->kbd.last_int)>SERIAL_TIMEOUT
 				) 
 			{
 				term->kbd.ready = 1;
 				term->kbd.last_int = system_clock;
-				Core* core = (Core*) term->kbd.int_core;
-				raise_interrupt(core, SERIAL_RX_READY);
+				raise_serial_interrupt(& term->kbd, i, SERIAL_RX_READY);
 			}
 		}
+
+		if(trace_mode == VM_TRACE_RECORD)
+			trace_drain();
+
+		__atomic_fetch_add(&PIC_busy_ns, monotonic_ns()-loop_start, __ATOMIC_RELAXED);
 	}
 
 	/* sync with all cores */
@@ -613,15 +1918,16 @@ static void PIC_daemon(uint serialno)
 
 	/* Close signal fds */
 	pic_drain_sigusr1(sigusr1fd);
-	CHECK(close(sigalrmfd));
 	CHECK(close(sigusr1fd));
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
 
-	/* destroy terminals */
-	for(uint i=0; i<nterm; i++)
+	/* destroy terminals, after sending out any pending output */
+	for(uint i=0; i<nterm; i++) {
+		io_device_flush(& TERM[i].con);
 		close_terminal(& TERM[i]);
+	}
 	nterm = 0;
 
 	/* Reset name */
@@ -649,13 +1955,21 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* This is called only once in the life of the process. */
 	CHECKRC(pthread_once(&init_control, initialize));
 
-	/* Install signal handler for SIGUSR1 */
+	/* Install signal handlers for SIGUSR1 and SIGALRM */
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
+	CHECK(sigaction(SIGALRM, &ALRM_sigaction, &ALRM_saved_sigaction));
 
 	/* Set pic_active to 1 */
 	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
+	/* Initialize the clock */
+	const char* vtime_env = getenv("TINYOS_VIRTUAL_TIME");
+	if(vtime_env != NULL)
+		virtual_time = (atoi(vtime_env) != 0);
+	vtime_skip_ns = 0;
+	boot_time_ns = monotonic_ns();
+
 	/* Initialize system_clock */
 	system_clock = get_coarse_time();
 
@@ -663,8 +1977,19 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	pthread_barrier_init(& system_barrier, NULL, cores+1);
 	pthread_barrier_init(& core_barrier, NULL, cores);
 
-	/* Initialize the halted list */
-	rlnode_init(&halted_list, NULL);
+	/* Initialize the halted bitmap */
+	halted_cores = 0;
+
+	/* Initialize PIC statistics */
+	PIC_loops = 0; PIC_usr1_queued = PIC_usr1_drained = 0;
+	PIC_busy_ns = 0;
+
+	/* Open the disks and the NICs */
+	block_devices_open();
+	nic_devices_open(cores);
+
+	/* Start recording or load the replayed trace */
+	trace_open(cores, serialno);
 
 	/* Launch the core threads */
 	ncores = cores;
@@ -673,15 +1998,16 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		CORE[c].bootfunc = bootfunc;
 		CORE[c].id = c;
 
-		pthread_cond_init(& CORE[c].halt_cond, NULL);
 		CORE[c].halted = 0;
-		rlnode_init(& CORE[c].halted_node, &CORE[c]);
+		for(uint intno=0; intno<maximum_interrupt_no;intno++)
+			CORE[c].device_pending[intno] = 0;
 
 		/* Initialize Core statistics */
 		CORE[c].irq_count = 0;
 		for(uint intno=0; intno<maximum_interrupt_no;intno++) {
 			CORE[c].irq_delivered[intno] = 0;
 			CORE[c].irq_raised[intno] = 0;
+			CORE[c].irq_dropped[intno] = 0;
 		}
 
 		/* Create the core thread */
@@ -691,9 +2017,6 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
 	}
 
-	/* Initialize PIC statistics */
-	PIC_loops = 0; PIC_usr1_queued = PIC_usr1_drained = 0;
-
 	/* Run the interrupt controller daemon on this thread */	
 	PIC_daemon(serialno);
 
@@ -702,28 +2025,88 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		CHECKRC(pthread_join(CORE[c].thread, NULL));
 	}
 
+	/* Write out or release the trace */
+	trace_close();
+
+	/* Close the disks and the NICs */
+	block_devices_close();
+	nic_devices_close();
+
 	/* Destroy the core barrier */
 	pthread_barrier_destroy(& system_barrier);
 	pthread_barrier_destroy(& core_barrier);
 
-	/* Restore signal mask before VM execution */
+	/* Restore signal handlers before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
+	CHECK(sigaction(SIGALRM, &ALRM_saved_sigaction, NULL));
 
 	/* Delete the Core table */
 	ncores = 0;
+}
+
 
-	/* emit statistics */
-#if 0
-	fprintf(stderr,"PIC loops: %lu  queued/drained= %lu / %lu\n", 
-		PIC_loops, PIC_usr1_queued, PIC_usr1_drained);
-	for(uint c=0;c<cores;c++) {
-		fprintf(stderr,"Core %3d: irq_count=%6d. deliv(raised):\t",
-			c, CORE[c].irq_count);
-		for(uint i=0;i<maximum_interrupt_no;i++) 
-			fprintf(stderr," %d(%d)",CORE[c].irq_delivered[i], CORE[c].irq_raised[i]);
-		fprintf(stderr,"\n");
+/*
+	The clock is read from CLOCK_MONOTONIC, which is served by the vDSO,
+	without a system call.
+ */
+uint64_t bios_clock_ns()
+{
+	uint64_t t = monotonic_ns() - boot_time_ns;
+	if(virtual_time)
+		t += __atomic_load_n(&vtime_skip_ns, __ATOMIC_ACQUIRE);
+	return t;
+}
+
+
+void vm_set_virtual_time(int enabled)
+{
+	CHECK_CONDITION(ncores==0);
+	virtual_time = enabled;
+}
+
+
+void vm_config_disk(uint disk, const char* image, TimerDuration latency, uint64_t bandwidth)
+{
+	CHECK_CONDITION(ncores==0);
+	CHECK_CONDITION(disk < MAX_BLOCK_DEVICES);
+	DISK_CONFIG[disk] = (block_device_config) {
+		.image = image, .latency = latency, .bandwidth = bandwidth
+	};
+}
+
+
+void vm_config_nic(uint nic, vm_nic_mode mode, const char* address, uint queues)
+{
+	CHECK_CONDITION(ncores==0);
+	CHECK_CONDITION(nic < MAX_NET_DEVICES && queues <= NET_MAX_QUEUES);
+	CHECK_CONDITION(mode == VM_NIC_NONE || mode == VM_NIC_LOOPBACK || address != NULL);
+	NIC_CONFIG[nic] = (nic_config) { .mode = mode, .address = address, .queues = queues };
+}
+
+
+/*
+	Take a snapshot of the statistics counters. The counters are read
+	one by one, without stopping the VM.
+ */
+void bios_get_stats(bios_stats* stats)
+{
+	stats->elapsed_ns = bios_clock_ns();
+	stats->pic_loops = __atomic_load_n(&PIC_loops, __ATOMIC_RELAXED);
+	stats->pic_busy_ns = __atomic_load_n(&PIC_busy_ns, __ATOMIC_RELAXED);
+	stats->pic_usr1_queued = __atomic_load_n(&PIC_usr1_queued, __ATOMIC_RELAXED);
+	stats->pic_usr1_drained = __atomic_load_n(&PIC_usr1_drained, __ATOMIC_RELAXED);
+
+	stats->ncores = ncores;
+	for(uint c=0; c<ncores; c++) {
+		Core* core = & CORE[c];
+		bios_core_stats* cs = & stats->core[c];
+		cs->irq_count = __atomic_load_n(& core->irq_count, __ATOMIC_RELAXED);
+		for(uint i=0; i<maximum_interrupt_no; i++) {
+			cs->irq_raised[i] = __atomic_load_n(& core->irq_raised[i], __ATOMIC_RELAXED);
+			cs->irq_delivered[i] = __atomic_load_n(& core->irq_delivered[i], __ATOMIC_RELAXED);
+			cs->irq_dropped[i] = __atomic_load_n(& core->irq_dropped[i], __ATOMIC_RELAXED);
+		}
 	}
-#endif
 }
 
 
@@ -732,54 +2115,89 @@ uint cpu_cores()
 	return ncores;
 }
 
-void cpu_core_halt()
+/* Helper for cpu_core_halt */
+static inline int core_interrupt_pending(Core* core)
+{
+	for(int intno = 0; intno < maximum_interrupt_no; intno++)
+		if(core->intpending[intno]) return 1;
+	return 0;
+}
+
+/*
+	Core halting is lock-free. 
+
+	A halted core sleeps on its own futex word (core->halted), with its
+	interrupt signals unblocked. It is woken up either by a restart, which
+	clears core->halted and wakes the futex, or by a signal (an interrupt or
+	its own timer), whose handler clears core->halted (see core_wake_halted()).
+
+	The halted_cores bitmap is only a hint, used by cpu_core_restart_one() to
+	find a halted core without scanning, and to do nothing when all cores are
+	busy. A core is restarted by whoever manages to clear its futex word.
+
+	The halted_cores bit is set before the wake condition is checked, so
+	that whoever makes the condition true and then calls 
+	cpu_core_restart_one() either is seen by the check, or sees the bit.
+ */
+void cpu_core_halt_unless(int (*wake)())
 {
-	/* unmask signals and call sigsuspend */
 	Core* core = curr_core();
 	assert(! core->int_disabled);
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
-	pthread_mutex_lock(& core_halt_mutex);
-	core->halted = 1;
-	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
-	assert(! core->halted);
-	pthread_mutex_unlock(& core_halt_mutex);
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	uint32_t mask = 1u << core->id;
+
+	__atomic_store_n(&core->halted, 1, __ATOMIC_SEQ_CST);
+	uint32_t halted = __atomic_or_fetch(&halted_cores, mask, __ATOMIC_SEQ_CST);
+
+	if(wake == NULL || ! wake()) {
+		/* In virtual time, the last core to halt lets the PIC daemon jump ahead */
+		if(virtual_time && halted == (uint32_t)((1ull << ncores) - 1))
+			interrupt_pic_thread();
+
+		while(__atomic_load_n(&core->halted, __ATOMIC_ACQUIRE) 
+			&& !core_interrupt_pending(core))
+			futex_wait(&core->halted, 1);
+	}
+
+	__atomic_fetch_and(&halted_cores, ~mask, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&core->halted, 0, __ATOMIC_RELEASE);
+
 	dispatch_interrupts(core);
 }
 
-static inline void core_restart(Core* core)
+void cpu_core_halt()
 {
-	if(core->halted) {
-		core->halted = 0;
-		rlist_remove(& core->halted_node);
-		pthread_cond_signal(& core->halt_cond);
-	}	
+	cpu_core_halt_unless(NULL);
+}
+
+/* Restart a core, returning 1 if it was halted */
+static inline int core_restart(Core* core)
+{
+	if(__atomic_exchange_n(&core->halted, 0, __ATOMIC_ACQ_REL)) {
+		futex_wake(&core->halted);
+		return 1;
+	}
+	return 0;
 }
 
 void cpu_core_restart(uint c)
 {
-	pthread_mutex_lock(& core_halt_mutex);
 	core_restart(CORE+c);
-	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
 void cpu_core_restart_one()
 {
-	pthread_mutex_lock(& core_halt_mutex);
-	if(! is_rlist_empty(&halted_list)) {
-		core_restart((Core*) rlist_pop_front(&halted_list)->obj);
-	}	
-	pthread_mutex_unlock(& core_halt_mutex);	
+	uint32_t mask = __atomic_load_n(&halted_cores, __ATOMIC_SEQ_CST);
+	while(mask) {
+		uint c = __builtin_ctz(mask);
+		if(core_restart(CORE+c)) return;
+		mask &= mask-1;
+	}
 }
 
 void cpu_core_restart_all()
 {
-	pthread_mutex_lock(& core_halt_mutex);
 	for(uint c=0; c<ncores; c++)
 		core_restart(CORE+c);
-	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
 void cpu_core_barrier_sync()
@@ -803,7 +2221,7 @@ void cpu_disable_interrupts()
 {
 	Core* core = curr_core();
 	if(! core->int_disabled) {
-		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &core_interrupt_set, NULL));
 		core->int_disabled = 1;
 	}
 }
@@ -813,7 +2231,7 @@ void cpu_enable_interrupts()
 	Core* core = curr_core();
 	if(core->int_disabled) {        
 		core->int_disabled = 0;
-		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &core_interrupt_set, NULL));      
 		dispatch_interrupts(curr_core());
 	}
 }
@@ -824,8 +2242,30 @@ void cpu_enable_interrupts()
  */
 
 
+/* 
+	The virtual time version of bios_set_timer 
+*/
+static TimerDuration vtime_set_timer(TimerDuration usec)
+{
+	Core* core = curr_core();
+	uint64_t now = bios_clock_ns();
+	uint64_t deadline = (usec==0) ? 0 : now + usec*1000ull;
+
+	uint64_t old = __atomic_exchange_n(& core->timer_deadline, deadline, __ATOMIC_ACQ_REL);
+	core->intpending[ALARM] = 0;
+
+	/* The PIC may have to wake up earlier */
+	if(deadline && deadline < __atomic_load_n(&vtime_pic_wakeup_ns, __ATOMIC_ACQUIRE)) 
+		interrupt_pic_thread();
+
+	return (old > now) ? (old-now)/1000 : 0;
+}
+
+
 TimerDuration bios_set_timer(TimerDuration usec)
 {
+	if(pic_timers()) return vtime_set_timer(usec);
+
 	time_t sec = usec / 1000000;
 	long nsec = (usec % 1000000) * 1000ull;
 	
@@ -873,13 +2313,25 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the bitmap of serial ports that raised 'intno' on
+	the current core.
+ */
+uint bios_serial_interrupt_pending(Interrupt intno)
+{
+	assert(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY);
+	Core* core = curr_core();
+	return __atomic_exchange_n(& core->device_pending[intno], 0, __ATOMIC_ACQUIRE);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& TERM[serial].kbd, ptr, 1);
 }
 
 
@@ -889,7 +2341,246 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
+}
+
+
+/*
+	Read up to 'size' bytes from serial port 'serial' into 'buf'.
+	Returns the number of bytes read.
+ */
+uint bios_read_serial_block(uint serial, char* buf, uint size)
+{
+	return io_device_read(& TERM[serial].kbd, buf, size);
+}
+
+
+/*
+	Write up to 'size' bytes from 'buf' to serial port 'serial'.
+	Returns the number of bytes written.
+ */
+uint bios_write_serial_block(uint serial, const char* buf, uint size)
+{
+	return io_device_write(& TERM[serial].con, buf, size);
+}
+
+
+
+/*
+	Block device functions.
+ */
+
+uint bios_block_devices()
+{
+	return ndisks;
+}
+
+
+uint64_t bios_block_sectors(uint disk)
+{
+	assert(disk < ndisks);
+	return DISK[disk].sectors;
+}
+
+
+void bios_block_interrupt_core(uint disk, uint coreid)
+{
+	assert(disk < ndisks);
+	assert(coreid < ncores);
+	DISK[disk].int_core = & CORE[coreid];
+}
+
+
+uint bios_block_interrupt_pending()
+{
+	Core* core = curr_core();
+	return __atomic_exchange_n(& core->device_pending[BLOCK_DONE], 0, __ATOMIC_ACQUIRE);
+}
+
+
+void bios_block_submit(uint disk, bios_block_request* req)
+{
+	assert(disk < ndisks);
+	assert(req->op == BLOCK_READ || req->op == BLOCK_WRITE);
+	block_device* d = & DISK[disk];
+
+	/* Requests outside the disk fail immediately */
+	int valid = req->count > 0 && req->sector < d->sectors 
+		&& req->count <= d->sectors - req->sector;
+	req->status = valid ? 0 : -1;
+
+	uint64_t transfer = 0;
+	if(valid && d->bandwidth)
+		transfer = (uint64_t) req->count * BLOCK_SECTOR_SIZE * 1000000000ull / d->bandwidth;
+
+	sigset_t saved_mask;
+	block_core_lock(d, &saved_mask);
+
+	uint64_t service = 0;
+	if(valid) {
+		if(req->sector != d->head) {
+			uint64_t distance = (req->sector > d->head) ? 
+				req->sector - d->head : d->head - req->sector;
+			service = d->latency_ns/2 + (d->latency_ns/2) * distance / d->sectors;
+		}
+		service += transfer;
+		d->head = req->sector + req->count;
+	}
+
+	uint64_t now = bios_clock_ns();
+	uint64_t start = (d->busy_until > now) ? d->busy_until : now;
+	req->completion_time = start + service;
+	d->busy_until = req->completion_time;
+	block_list_append(& d->queue_head, & d->queue_tail, req);
+	block_core_unlock(d, &saved_mask);
+
+	/* The PIC may have to wake up earlier */
+	if(req->completion_time < __atomic_load_n(&vtime_pic_wakeup_ns, __ATOMIC_ACQUIRE))
+		interrupt_pic_thread();
 }
 
 
+bios_block_request* bios_block_completed(uint disk)
+{
+	assert(disk < ndisks);
+	block_device* d = & DISK[disk];
+
+	sigset_t saved_mask;
+	block_core_lock(d, &saved_mask);
+	bios_block_request* list = d->done_head;
+	d->done_head = d->done_tail = NULL;
+	block_core_unlock(d, &saved_mask);
+
+	return list;
+}
+
+
+
+/*
+	Network device functions.
+ */
+
+uint bios_nic_devices()
+{
+	return nnics;
+}
+
+
+uint bios_nic_queues(uint nic)
+{
+	assert(nic < nnics);
+	return NIC[nic].nqueues;
+}
+
+
+uint bios_nic_flow_queue(uint nic, const void* data, uint len)
+{
+	assert(nic < nnics);
+	return nic_steer(& NIC[nic], data, len);
+}
+
+
+int bios_nic_send(uint nic, uint queue, const void* data, uint len)
+{
+	assert(nic < nnics && queue < NIC[nic].nqueues);
+	assert(len > 0 && len <= NET_MTU);
+	nic_queue* q = & NIC[nic].queue[queue];
+
+	sigset_t saved_mask;
+	nic_core_lock(q, &saved_mask);
+	if(q->tx.count == NET_RING_SIZE) {
+		q->tx_waiting = 1;
+		nic_core_unlock(q, &saved_mask);
+		return 0;
+	}
+	nic_descriptor* desc = nic_slot(& q->tx, q->tx.count);
+	memcpy(desc->data, data, len);
+	desc->len = len;
+	uint count = ++q->tx.count;
+	nic_core_unlock(q, &saved_mask);
+
+	/* The PIC is not watching the socket, if the rings were empty */
+	if(count == 1)
+		interrupt_pic_thread();
+	return 1;
+}
+
+
+uint bios_nic_receive(uint nic, uint queue, void* buf, uint size)
+{
+	assert(nic < nnics && queue < NIC[nic].nqueues);
+	nic_queue* q = & NIC[nic].queue[queue];
+
+	sigset_t saved_mask;
+	nic_core_lock(q, &saved_mask);
+	if(q->rx.count == 0) {
+		q->rx_armed = 1;
+		nic_core_unlock(q, &saved_mask);
+		return 0;
+	}
+	nic_descriptor* desc = nic_slot(& q->rx, 0);
+	uint len = (desc->len < size) ? desc->len : size;
+	memcpy(buf, desc->data, len);
+	q->rx.head = (q->rx.head + 1) % NET_RING_SIZE;
+	uint count = q->rx.count--;
+	nic_core_unlock(q, &saved_mask);
+
+	/* The PIC stops receiving when a ring is full */
+	if(count == NET_RING_SIZE)
+		interrupt_pic_thread();
+	return len;
+}
+
+
+uint bios_nic_rx_ready(uint nic, uint queue)
+{
+	assert(nic < nnics && queue < NIC[nic].nqueues);
+	nic_queue* q = & NIC[nic].queue[queue];
+
+	sigset_t saved_mask;
+	nic_core_lock(q, &saved_mask);
+	uint count = q->rx.count;
+	if(count == 0) q->rx_armed = 1;
+	nic_core_unlock(q, &saved_mask);
+	return count;
+}
+
+
+int bios_nic_tx_ready(uint nic, uint queue)
+{
+	assert(nic < nnics && queue < NIC[nic].nqueues);
+	nic_queue* q = & NIC[nic].queue[queue];
+
+	sigset_t saved_mask;
+	nic_core_lock(q, &saved_mask);
+	int room = q->tx.count < NET_RING_SIZE;
+	if(! room) q->tx_waiting = 1;
+	nic_core_unlock(q, &saved_mask);
+	return room;
+}
+
+
+void bios_nic_interrupt_core(uint nic, uint queue, uint coreid)
+{
+	assert(nic < nnics && queue < NIC[nic].nqueues);
+	assert(coreid < ncores);
+	NIC[nic].queue[queue].int_core = & CORE[coreid];
+}
+
+
+void bios_nic_coalesce(uint nic, uint frames, TimerDuration usec)
+{
+	assert(nic < nnics && frames > 0);
+	__atomic_store_n(& NIC[nic].rx_frames, frames, __ATOMIC_RELAXED);
+	__atomic_store_n(& NIC[nic].rx_delay_ns, usec * 1000ull, __ATOMIC_RELAXED);
+	/* The PIC may have to raise an interrupt earlier */
+	interrupt_pic_thread();
+}
+
+
+uint bios_nic_interrupt_pending(Interrupt intno)
+{
+	assert(intno == NET_RX_READY || intno == NET_TX_READY);
+	Core* core = curr_core();
+	return __atomic_exchange_n(& core->device_pending[intno], 0, __ATOMIC_ACQUIRE);
+}
@@ -50,8 +50,9 @@
 
 	The peripherals are managed via the 'bios_...' functions. 
 
-	There are two types of simulated peripherals:  _timers_ and _serial ports_ 
-	(connected to terminals). Each type of peripheral is documented below.
+	There are four types of simulated peripherals:  _timers_, _serial ports_ 
+	(connected to terminals), _block devices_ (disks) and _network devices_.
+	Each type of peripheral is documented below.
 
 	Timers
 	-------
@@ -65,9 +66,13 @@
 
 	The virtual machine has a number of serial ports connected to terminals.
 
-	Each serial port/terminal can support reading and writing of single bytes.
-	The reads return keyboard input, whereas the writes send characters to display
-	on the screen.
+	Each serial port/terminal can support reading and writing of single bytes,
+	or of whole blocks of bytes. The reads return keyboard input, whereas the 
+	writes send characters to display on the screen.
+
+	Each serial port is buffered in both directions. Block transfers copy data 
+	from/to these buffers, so their cost does not depend on the number of bytes
+	transferred (beyond the copy itself).
 
 	Terminals are numbered from 0, up to @c MAX_TERMINALS-1. 
 
@@ -94,9 +99,62 @@
 	which is ready, the write will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_TX_READY interrupt is raised.
 
+	The block operations @c bios_read_serial_block and @c bios_write_serial_block
+	may transfer fewer bytes than requested. A partial transfer makes the device
+	not-ready, exactly like a failed single-byte operation.
+
+	At most one core may be reading from, and at most one core may be writing to, 
+	a serial port at any time.
+
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	Block devices
+	-------------
+
+	A block device is an array of sectors of @c BLOCK_SECTOR_SIZE bytes,
+	simulated by a host image file. Block devices are attached by 
+	@c vm_config_disk before the VM boots, and are numbered from 0 up to
+	@c MAX_BLOCK_DEVICES-1.
+
+	Block I/O is asynchronous. A core submits a request to read or write a 
+	number of consecutive sectors, by @c bios_block_submit. The device serves
+	its requests one at a time, in the order they were submitted; the time 
+	to serve a request is the time to transfer the data at the configured
+	bandwidth, plus a positioning delay if the request does not start at 
+	the sector following the previous request. The positioning delay is 
+	half the configured latency of the device, plus up to another half 
+	in proportion to the seek distance. When a request
+	completes, a @c BLOCK_DONE interrupt is raised, and the completed
+	requests can be collected by @c bios_block_completed.
+
+	Network devices
+	---------------
+
+	A network device (NIC) sends and receives packets of up to @c NET_MTU
+	bytes. It is simulated by a host @c AF_UNIX socket of type 
+	@c SOCK_SEQPACKET, which keeps packet boundaries and does not lose
+	packets: a NIC can be connected to the NIC of another VM on the same 
+	host, or be a loopback NIC, which receives the packets it sends.
+	NICs are attached by @c vm_config_nic before the VM boots, and are 
+	numbered from 0 up to @c MAX_NET_DEVICES-1.
+
+	A NIC has a number of queues, up to @c NET_MAX_QUEUES. Each queue has a 
+	transmit (TX) ring and a receive (RX) ring of @c NET_RING_SIZE packets,
+	so that each core can use its own queue. Packets are put into a TX ring
+	by @c bios_nic_send, and are taken from an RX ring by @c bios_nic_receive.
+	A received packet is placed in the RX ring chosen by a hash of its 
+	first @c NET_FLOW_KEY_SIZE bytes (its flow key), so that the packets of
+	a flow stay in order. The interrupts of each queue are routed to a core.
+
+	When @c bios_nic_receive finds an RX ring empty, a @c NET_RX_READY 
+	interrupt will be raised for the queue after new packets arrive. To
+	reduce the interrupt rate, the interrupt is coalesced: it is raised
+	when a number of packets have arrived, or when the first of them has
+	waited for some time (see @c bios_nic_coalesce). When @c bios_nic_send
+	finds a TX ring full, a @c NET_TX_READY interrupt is raised for the 
+	queue when the ring has drained to half its size.
+
  */
 
 
@@ -120,6 +178,9 @@ typedef enum Interrupt
 						   from a serial port */
 	SERIAL_TX_READY,	/**< Raised when a serial port is ready to accept 
 						   data */
+	BLOCK_DONE,			/**< Raised when block device requests complete */
+	NET_RX_READY,		/**< Raised when packets are available in an RX ring */
+	NET_TX_READY,		/**< Raised when a TX ring has space */
 
 	maximum_interrupt_no 
 } Interrupt;
@@ -131,6 +192,27 @@ typedef enum Interrupt
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
 
+/** @brief Maximum number of block devices for a virtual machine. */
+#define MAX_BLOCK_DEVICES 4
+
+/** @brief The size of a block device sector, in bytes. */
+#define BLOCK_SECTOR_SIZE 512
+
+/** @brief Maximum number of network devices for a virtual machine. */
+#define MAX_NET_DEVICES 2
+
+/** @brief Maximum number of queues of a network device. */
+#define NET_MAX_QUEUES 16
+
+/** @brief The maximum size of a packet, in bytes. */
+#define NET_MTU 1500
+
+/** @brief The number of packets of a TX or RX ring. */
+#define NET_RING_SIZE 256
+
+/** @brief The number of bytes at the start of a packet that select its RX ring. */
+#define NET_FLOW_KEY_SIZE 4
+
 /**
 	@brief Boot a CPU with the given number of cores and boot function.
 
@@ -158,6 +240,140 @@ typedef enum Interrupt
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
 
 
+/**
+	@brief Enable or disable virtual time mode.
+
+	In virtual time mode, the VM clock runs as the real clock, except that
+	it jumps forward whenever all cores are halted with no pending 
+	interrupts, to the next timed event (a timer expiry or a serial
+	port timeout). Hence, programs which spend most of their time 
+	waiting for timers run much faster than real time, while the 
+	order of events is preserved.
+
+	The mode applies to the core timers (@c bios_set_timer), the serial 
+	port timeouts and @c bios_clock_ns. 
+
+	Virtual time mode can also be enabled by setting the environment
+	variable @c TINYOS_VIRTUAL_TIME to a non-zero integer, which 
+	overrides this setting at the next @c vm_boot.
+
+	This must not be called while the VM is running.
+
+	@param enabled non-zero to enable virtual time, zero to disable it
+ */
+void vm_set_virtual_time(int enabled);
+
+
+/**
+	@brief Attach a block device to the VM.
+
+	Block device @c disk is simulated by the host file @c image, which
+	must exist. The size of the device is the size of the file, rounded
+	down to whole sectors. Block devices must be attached in order:
+	the VM has the disks from 0 up to the first one not attached.
+
+	Disk 0 can also be attached by setting the environment variable
+	@c TINYOS_DISK to the name of the image file, which overrides this
+	setting at the next @c vm_boot.
+
+	This must not be called while the VM is running.
+
+	@param disk the disk number, less than @c MAX_BLOCK_DEVICES
+	@param image the image file, which is not copied, or NULL to 
+		detach the disk
+	@param latency the maximum positioning delay of a request, for a
+		seek across the whole device, in usec
+	@param bandwidth the data transfer rate, in bytes per second, or 0
+		for instant transfers
+ */
+void vm_config_disk(uint disk, const char* image, TimerDuration latency, uint64_t bandwidth);
+
+
+/**
+	@brief How a network device is connected.
+
+	@see vm_config_nic
+ */
+typedef enum vm_nic_mode {
+	VM_NIC_NONE,		/**< @brief Not attached */
+	VM_NIC_LOOPBACK,	/**< @brief Receive the packets sent */
+	VM_NIC_LISTEN,		/**< @brief Wait for a peer to connect to a socket address */
+	VM_NIC_CONNECT		/**< @brief Connect to a peer listening at a socket address */
+} vm_nic_mode;
+
+
+/**
+	@brief Attach a network device to the VM.
+
+	To connect two VMs, one of them attaches a NIC with @c VM_NIC_LISTEN
+	and the other with @c VM_NIC_CONNECT, at the same socket address (a
+	host file name). @c vm_boot waits for the connection to be made; a
+	connecting VM waits up to 10 seconds for the listening one to start.
+	NICs must be attached in order: the VM has the NICs from 0 up to the
+	first one not attached.
+
+	NIC 0 can also be attached by setting the environment variable
+	@c TINYOS_NIC to @c loopback, @c listen:ADDRESS or @c connect:ADDRESS,
+	which overrides this setting at the next @c vm_boot. Then, the NIC 
+	has one queue per core.
+
+	This must not be called while the VM is running.
+
+	@param nic the NIC number, less than @c MAX_NET_DEVICES
+	@param mode the connection mode, or @c VM_NIC_NONE to detach the NIC
+	@param address the socket address, which is not copied, or NULL for
+		a loopback NIC
+	@param queues the number of queues, up to @c NET_MAX_QUEUES, or 0 for
+		one queue per core
+ */
+void vm_config_nic(uint nic, vm_nic_mode mode, const char* address, uint queues);
+
+
+/**
+	@brief Trace modes of the VM.
+
+	@see vm_set_trace
+ */
+typedef enum vm_trace_mode {
+	VM_TRACE_OFF,		/**< @brief No tracing */
+	VM_TRACE_RECORD,	/**< @brief Record interrupts and serial data to a trace */
+	VM_TRACE_REPLAY		/**< @brief Replay a recorded trace */
+} vm_trace_mode;
+
+
+/**
+	@brief Record or replay the events of a VM run.
+
+	In record mode, every interrupt raised (with its core, its number,
+	its serial port if any and the time of @c bios_clock_ns) and every
+	byte transferred by a serial port is logged to a binary trace file.
+
+	In replay mode, the interrupts and the keyboard input of a trace
+	are injected at the times they were recorded, instead of the live
+	ones: the keyboard input is discarded, the core timers are not armed
+	and the serial ports raise no interrupts by themselves. Inter-core
+	interrupts are not injected, since they are raised again by the
+	cores. Console output is sent to the terminals as usual. When the
+	trace is exhausted, the VM continues with live events.
+
+	Replaying a trace needs the same number of cores and terminals as
+	the recording. Combined with virtual time, a run can be repeated
+	with the same event timing, as far as the host scheduling of the
+	core threads allows.
+
+	The environment variables @c TINYOS_RECORD and @c TINYOS_REPLAY,
+	when set to a file name, override this setting at the next
+	@c vm_boot.
+
+	This must not be called while the VM is running.
+
+	@param mode the trace mode
+	@param filename the trace file, which is not copied. It may be NULL
+		if mode is @c VM_TRACE_OFF.
+ */
+void vm_set_trace(vm_trace_mode mode, const char* filename);
+
+
 /**
 	@brief Contains the id of the current core.
  */
@@ -238,6 +454,22 @@ void cpu_enable_interrupts();
 void cpu_core_halt();
 
 
+/**
+	@brief Halt the core until an interrupt arrives, unless a condition holds.
+
+	This is like @c cpu_core_halt, except that the core does not halt if
+	@c wake() returns non-zero. The core is marked as halted before 
+	@c wake is called; hence, if another core makes the condition true
+	and then calls @c cpu_core_restart_one, either @c wake sees the change,
+	or this core is restarted. Thus, no wakeup is lost between checking
+	the condition and halting.
+
+	@param wake the condition, checked with interrupts enabled, or NULL
+	@see cpu_core_halt
+*/
+void cpu_core_halt_unless(int (*wake)());
+
+
 /**
 	@brief Restart the given core.
 
@@ -295,6 +527,18 @@ TimerDuration bios_set_timer(TimerDuration usec);
 TimerDuration bios_cancel_timer();
 
 
+/**
+	@brief Return the time since the VM booted, in nanoseconds.
+
+	This is a high-resolution, monotonic clock, shared by all cores. 
+	It is cheap enough to be called very frequently (e.g., on every 
+	context switch).
+
+	@returns the time since @c vm_boot was called, in nanoseconds
+ */
+uint64_t bios_clock_ns();
+
+
 
 /**
 	@brief Return the number of serial ports/terminals.
@@ -320,6 +564,24 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Return the serial ports that raised an interrupt on the current core.
+
+	Return a bitmap of the serial ports which have raised interrupt @c intno 
+	on the current core, since the last call; bit @f$ i @f$ is set for serial 
+	port @f$ i @f$. The bitmap of the current core is cleared.
+
+	This allows a @c SERIAL_RX_READY or @c SERIAL_TX_READY handler to service 
+	only the serial ports that actually became ready. Note that a port may 
+	appear in the bitmap because of a timeout.
+
+	@param intno the interrupt, which must be one of @c SERIAL_RX_READY or
+	    @c SERIAL_TX_READY.
+	@return a bitmap of serial ports
+ */
+uint bios_serial_interrupt_pending(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -354,4 +616,301 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read a block of bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial into @c buf.
+	The number of bytes read is returned; this may be less than @c size 
+	(or 0), if the terminal connected to the serial port has not sent enough data.
+
+	If fewer than @c size bytes are returned, a @c SERIAL_RX_READY interrupt will 
+	be raised when more data is ready to be received.
+
+	@param serial the serial device to read from
+	@param buf the location in which to store the read bytes
+	@param size the maximum number of bytes to read
+	@return the number of bytes read
+ */
+uint bios_read_serial_block(uint serial, char* buf, uint size);
+
+
+/**
+	@brief Write a block of bytes to a serial port.
+
+	Try to write up to @c size bytes from @c buf to serial port @c serial.
+	The number of bytes written is returned; this may be less than @c size
+	(or 0), if the serial port cannot accept more data at this time.
+
+	If fewer than @c size bytes are written, a @c SERIAL_TX_READY interrupt will 
+	be raised when the device is ready to accept more data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send to the serial device
+	@param size the number of bytes to write
+	@return the number of bytes written
+ */
+uint bios_write_serial_block(uint serial, const char* buf, uint size);
+
+
+/** @brief Block device operations. */
+typedef enum block_op {
+	BLOCK_READ,			/**< @brief Read sectors into the buffer */
+	BLOCK_WRITE			/**< @brief Write sectors from the buffer */
+} block_op;
+
+
+/**
+	@brief A block device request.
+
+	The first fields are set by the submitter. The request object
+	belongs to the BIOS from @c bios_block_submit until it is
+	returned by @c bios_block_completed.
+ */
+typedef struct bios_block_request
+{
+	block_op op;		/**< @brief The operation */
+	uint64_t sector;	/**< @brief The first sector */
+	uint count;			/**< @brief The number of sectors */
+	void* buffer;		/**< @brief Holds @c count*BLOCK_SECTOR_SIZE bytes */
+	void* context;		/**< @brief Not used by the BIOS */
+
+	int status;			/**< @brief Set at completion: 0 on success, -1 on error */
+
+	uint64_t completion_time;			/**< @internal */
+	struct bios_block_request* next;	/**< @brief Links completed requests */
+} bios_block_request;
+
+
+/**
+	@brief Return the number of block devices.
+ */
+uint bios_block_devices();
+
+
+/**
+	@brief Return the number of sectors of a block device.
+ */
+uint64_t bios_block_sectors(uint disk);
+
+
+/**
+	@brief Submit a request to a block device.
+
+	The request is served asynchronously. Requests which are empty or
+	extend past the end of the device fail, with @c status set to -1.
+	In all cases, completion is signalled by a @c BLOCK_DONE interrupt.
+
+	@param disk the block device
+	@param req the request
+ */
+void bios_block_submit(uint disk, bios_block_request* req);
+
+
+/**
+	@brief Collect the completed requests of a block device.
+
+	@param disk the block device
+	@return the list of the completed requests that were not already
+		collected, linked by their @c next field in the order of their 
+		completion, or NULL
+ */
+bios_block_request* bios_block_completed(uint disk);
+
+
+/**
+	@brief Route the interrupts of a block device to a core.
+
+	By default, all interrupts are sent to core 0.
+ */
+void bios_block_interrupt_core(uint disk, uint coreid);
+
+
+/**
+	@brief Return the block devices that raised @c BLOCK_DONE on this core.
+
+	The returned bitmap has bit @c d set, if disk @c d raised a 
+	@c BLOCK_DONE interrupt on the current core since the last call.
+	The bitmap is cleared by the call.
+
+	@return a bitmap of block devices
+ */
+uint bios_block_interrupt_pending();
+
+
+/**
+	@brief Return the number of network devices.
+ */
+uint bios_nic_devices();
+
+
+/**
+	@brief Return the number of queues of a network device.
+ */
+uint bios_nic_queues(uint nic);
+
+
+/**
+	@brief Return the queue of a flow.
+
+	The flow of a packet is given by its first @c NET_FLOW_KEY_SIZE 
+	bytes. A received packet is put into the RX ring of the queue of 
+	its flow. Sending the packets of a flow through the TX ring of the
+	same queue keeps them in order.
+
+	@param nic the network device
+	@param data the packet
+	@param len the size of the packet
+	@return the queue of the flow of the packet
+ */
+uint bios_nic_flow_queue(uint nic, const void* data, uint len);
+
+
+/**
+	@brief Put a packet into a TX ring.
+
+	If the TX ring of the queue is full, nothing is sent, and a 
+	@c NET_TX_READY interrupt will be raised when the ring has room.
+
+	@param nic the network device
+	@param queue the queue
+	@param data the packet
+	@param len the size of the packet, from 1 up to @c NET_MTU
+	@return 1 if the packet was queued, 0 if the ring is full
+ */
+int bios_nic_send(uint nic, uint queue, const void* data, uint len);
+
+
+/**
+	@brief Take a packet from an RX ring.
+
+	If the RX ring of the queue is empty, a @c NET_RX_READY interrupt will
+	be raised when packets arrive. A packet larger than @c size is
+	truncated.
+
+	@param nic the network device
+	@param queue the queue
+	@param buf the location to store the packet
+	@param size the size of buf
+	@return the number of bytes stored, or 0 if the ring is empty
+ */
+uint bios_nic_receive(uint nic, uint queue, void* buf, uint size);
+
+
+/**
+	@brief Check if an RX ring has packets, without taking any.
+
+	If the ring is empty, a @c NET_RX_READY interrupt will be raised when
+	packets arrive, as with @c bios_nic_receive.
+
+	@return the number of packets in the RX ring of the queue
+ */
+uint bios_nic_rx_ready(uint nic, uint queue);
+
+
+/**
+	@brief Check if a TX ring has room, without sending.
+
+	If the ring is full, a @c NET_TX_READY interrupt will be raised when 
+	it has room, as with @c bios_nic_send.
+
+	@return 1 if the TX ring of the queue has room, 0 otherwise
+ */
+int bios_nic_tx_ready(uint nic, uint queue);
+
+
+/**
+	@brief Route the interrupts of a queue of a network device to a core.
+
+	By default, the interrupts of queue @c q are sent to core @c q modulo
+	the number of cores.
+ */
+void bios_nic_interrupt_core(uint nic, uint queue, uint coreid);
+
+
+/**
+	@brief Set the interrupt coalescing of a network device.
+
+	A @c NET_RX_READY interrupt is raised when @c frames packets are in
+	the RX ring, or when the first of them has waited for @c usec 
+	microseconds, whichever comes first. By default, @c frames is 1 
+	(no coalescing).
+
+	@param nic the network device
+	@param frames the packets that raise an interrupt, at least 1
+	@param usec the maximum delay of an interrupt
+ */
+void bios_nic_coalesce(uint nic, uint frames, TimerDuration usec);
+
+
+/**
+	@brief Return the queues that raised an interrupt on this core.
+
+	The returned bitmap has bit @c nic*NET_MAX_QUEUES+q set, if queue
+	@c q of NIC @c nic raised interrupt @c intno on the current core since
+	the last call. The bitmap is cleared by the call.
+
+	@param intno the interrupt, which must be one of @c NET_RX_READY or
+	    @c NET_TX_READY.
+	@return a bitmap of queues
+ */
+uint bios_nic_interrupt_pending(Interrupt intno);
+
+
+
+/**
+	@brief Interrupt statistics of a core.
+
+	@see bios_stats
+ */
+typedef struct bios_core_stats
+{
+	unsigned long irq_count;	/**< @brief Interrupt signals received by the core. */
+
+	/** @brief Interrupts raised, per interrupt type. */
+	unsigned long irq_raised[maximum_interrupt_no];
+
+	/** @brief Interrupts dispatched, per interrupt type. 
+
+		An interrupt that is raised again while it is pending is 
+		dispatched once; hence, @c irq_raised[i]-irq_delivered[i] is 
+		(roughly) the number of coalesced interrupts. */
+	unsigned long irq_delivered[maximum_interrupt_no];
+
+	/** @brief Interrupts dispatched without a handler, per interrupt type. */
+	unsigned long irq_dropped[maximum_interrupt_no];
+} bios_core_stats;
+
+
+/**
+	@brief A snapshot of the VM statistics.
+
+	@see bios_get_stats
+ */
+typedef struct bios_stats
+{
+	uint64_t elapsed_ns;		/**< @brief Time since @c vm_boot, in nsec. */
+
+	unsigned long pic_loops;	/**< @brief Iterations of the interrupt controller loop. */
+	uint64_t pic_busy_ns;		/**< @brief Time spent by the interrupt controller, 
+									outside of @c select(), in nsec. */
+	unsigned long pic_usr1_queued;	/**< @brief Wakeups sent to the interrupt controller. */
+	unsigned long pic_usr1_drained;	/**< @brief Wakeups received by the interrupt controller. */
+
+	uint ncores;				/**< @brief The number of cores. */
+	bios_core_stats core[MAX_CORES];	/**< @brief Per-core statistics. */
+} bios_stats;
+
+
+/**
+	@brief Get a snapshot of the VM statistics.
+
+	This call can be made at any time while the VM is running.
+	The counters are not read atomically as a whole, so the
+	snapshot may be slightly inconsistent.
+
+	@param stats the location to store the snapshot into
+ */
+void bios_get_stats(bios_stats* stats);
+
+
 #endif
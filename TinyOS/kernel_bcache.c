@@ -0,0 +1,712 @@
+
+#include <assert.h>
+#include <string.h>
+#include "kernel_bcache.h"
+#include "kernel_dev.h"
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+
+/*************************************
+
+  The buffer cache
+
+  All the cache state is protected by bcache_lock. The lock is
+  released during device I/O; while a page is read in, its buffer
+  is marked busy, and while it is written back, its buffer is marked
+  writeback. Neither kind of buffer can be replaced. Threads waiting
+  for I/O to finish, or for a buffer to be unpinned, sleep on 
+  bcache_io_done.
+
+  The data of a buffer is one of the slots of bcache_data, but not
+  necessarily its own: mappings move pages between slots. Only the
+  data of a buffer that is not pinned and not in I/O is moved.
+
+ *************************************/
+
+static Mutex bcache_lock = MUTEX_INIT;
+static CondVar bcache_io_done = COND_INIT;
+
+static buffer bcache_buffer[BCACHE_BUFFERS];
+static char bcache_data[BCACHE_BUFFERS][BCACHE_PAGE_SIZE];
+static buffer* bcache_slot[BCACHE_BUFFERS]; /* the buffer of each data slot */
+static rlnode bcache_hash[BCACHE_HASH_SIZE];
+static uint bcache_hand;              /* the CLOCK hand */
+
+static uint dirty_count;              /* buffers with dirty set */
+static uint writeback_count;          /* buffers with writeback set */
+static uint bcache_waiters;           /* threads sleeping on bcache_io_done */
+
+/* Sequential read detection, per device */
+static struct {
+  uint64_t last;                      /* the last page accessed */
+  uint window;                        /* the current read-ahead, in pages */
+} bcache_ra[MAX_BLOCK_DEVICES];
+
+/* The flusher thread */
+static CondVar flusher_wakeup = COND_INIT;
+static TCB* flusher_thread;
+static int flusher_stop;
+static int flusher_exited;
+
+static cache_stats bcache_stats;
+
+
+/* Sleep until some I/O finishes or some buffer is unpinned */
+static void bcache_wait()
+{
+  bcache_waiters++;
+  Cond_Wait(& bcache_lock, & bcache_io_done);
+  bcache_waiters--;
+}
+
+
+/* The number of pages of a device; the last one may be partial */
+static inline uint64_t bcache_dev_pages(uint dev)
+{
+  return (bios_block_sectors(dev) + BCACHE_PAGE_SECTORS - 1) / BCACHE_PAGE_SECTORS;
+}
+
+static inline rlnode* bcache_bucket(uint dev, uint64_t page)
+{
+  return & bcache_hash[(page * MAX_BLOCK_DEVICES + dev) % BCACHE_HASH_SIZE];
+}
+
+static buffer* bcache_lookup(uint dev, uint64_t page)
+{
+  rlnode* bucket = bcache_bucket(dev, page);
+  for(rlnode* pos = bucket->next; pos != bucket; pos = pos->next) {
+    buffer* buf = pos->obj;
+    if(buf->page == page && buf->dev == dev) return buf;
+  }
+  return NULL;
+}
+
+
+/*
+  Transfer a run of pages of a device, from/to a contiguous buffer.
+  Sectors past the end of the device are not transferred.
+ */
+static int bcache_transfer(block_op op, uint dev, uint64_t page, uint npages, char* data)
+{
+  uint64_t sector = page * BCACHE_PAGE_SECTORS;
+  uint64_t count = npages * BCACHE_PAGE_SECTORS;
+  uint64_t sectors = bios_block_sectors(dev);
+  if(count > sectors - sector) count = sectors - sector;
+  return block_device_io(dev, op, sector, count, data);
+}
+
+
+/*
+  Write back a run of consecutive dirty pages, with a single request.
+  This is called with bcache_lock held, and returns with it held,
+  but it is released during the I/O.
+ */
+static int bcache_writeback(buffer** run, uint n)
+{
+  char* data = (n == 1) ? NULL : xmalloc(n * BCACHE_PAGE_SIZE);
+
+  for(uint i=0; i<n; i++) {
+    /* A page modified from now on will be dirty again */
+    run[i]->dirty = 0;
+    run[i]->writeback = 1;
+    if(data) memcpy(data + i*BCACHE_PAGE_SIZE, run[i]->data, BCACHE_PAGE_SIZE);
+  }
+  dirty_count -= n;
+  writeback_count += n;
+  bcache_stats.writebacks += n;
+
+  Mutex_Unlock(& bcache_lock);
+  int rc = bcache_transfer(BLOCK_WRITE, run[0]->dev, run[0]->page, n,
+    data ? data : run[0]->data);
+  Mutex_Lock(& bcache_lock);
+
+  for(uint i=0; i<n; i++)
+    run[i]->writeback = 0;
+  writeback_count -= n;
+  Cond_Broadcast(& bcache_io_done);
+
+  if(data) free(data);
+  return rc;
+}
+
+
+static inline int bcache_can_write(buffer* buf)
+{
+  return buf != NULL && buf->valid && buf->dirty && !buf->writeback;
+}
+
+
+/*
+  Write back the dirty page of buf, together with the dirty pages
+  adjacent to it, up to BCACHE_RA_MAX pages.
+ */
+static int bcache_writeback_around(buffer* buf)
+{
+  buffer* run[BCACHE_RA_MAX];
+  uint dev = buf->dev;
+  uint64_t first = buf->page;
+
+  while(first > 0 && buf->page - first < BCACHE_RA_MAX/2
+        && bcache_can_write(bcache_lookup(dev, first-1)))
+    first--;
+
+  uint n = 0;
+  for(buffer* b = bcache_lookup(dev, first); n < BCACHE_RA_MAX && bcache_can_write(b);
+      b = bcache_lookup(dev, first+n))
+    run[n++] = b;
+
+  return bcache_writeback(run, n);
+}
+
+
+/*
+  Write back every dirty buffer. The lock is held on entry and exit.
+ */
+static int bcache_flush_all()
+{
+  int rc = 0;
+  for(uint i=0; i<BCACHE_BUFFERS; i++)
+    /* The lock is dropped by the write-back, so look at buffer i again */
+    while(bcache_can_write(& bcache_buffer[i]))
+      if(bcache_writeback_around(& bcache_buffer[i])) rc = -1;
+  return rc;
+}
+
+
+/*
+  Find a buffer to replace, by the CLOCK algorithm. Buffers that are
+  pinned or in I/O are skipped. A clean buffer is preferred; if there
+  is none and wait is set, a dirty one is written back (or, if some 
+  buffers are in I/O, the I/O or an unpin is waited for) and NULL is 
+  returned, since the lock was released in the meantime. If every 
+  buffer is pinned, NULL is returned at once, with *full set.
+ */
+static buffer* bcache_victim(int wait, int* full)
+{
+  buffer* dirty = NULL;
+  int in_io = 0;
+  *full = 0;
+
+  for(uint i=0; i < 2*BCACHE_BUFFERS; i++) {
+    buffer* buf = & bcache_buffer[bcache_hand];
+    bcache_hand = (bcache_hand + 1) % BCACHE_BUFFERS;
+
+    if(buf->busy || buf->writeback) { in_io = 1; continue; }
+    if(buf->refcount > 0) continue;
+    if(! buf->valid) return buf;
+    if(buf->refbit) { buf->refbit = 0; continue; }
+    if(! buf->dirty) return buf;
+    if(dirty == NULL) dirty = buf;
+  }
+
+  if(dirty == NULL && ! in_io)
+    *full = 1;
+  else if(wait) {
+    if(dirty != NULL)
+      bcache_writeback_around(dirty);
+    else
+      bcache_wait();
+  }
+  return NULL;
+}
+
+
+/* Unhash the buffer and assign it to a new page */
+static void bcache_assign(buffer* buf, uint dev, uint64_t page)
+{
+  if(buf->valid) {
+    rlist_remove(& buf->hnode);
+    bcache_stats.evictions++;
+  }
+  buf->dev = dev;
+  buf->page = page;
+  buf->valid = 1;
+  buf->dirty = 0;
+  buf->refbit = 1;
+  rlist_push_front(bcache_bucket(dev, page), & buf->hnode);
+}
+
+
+/*
+  Read in a run of pages, whose buffers are busy. The lock is held on
+  entry and exit. On error, the buffers are invalidated.
+ */
+static int bcache_fill(buffer** run, uint n)
+{
+  /* Read directly into the buffers, if their data is consecutive */
+  int direct = 1;
+  for(uint i=1; i<n; i++)
+    if(run[i]->data != run[0]->data + i*BCACHE_PAGE_SIZE) direct = 0;
+  char* data = direct ? run[0]->data : xmalloc(n * BCACHE_PAGE_SIZE);
+
+  Mutex_Unlock(& bcache_lock);
+  /* The last page of a device may be partial */
+  memset(data + (n-1)*BCACHE_PAGE_SIZE, 0, BCACHE_PAGE_SIZE);
+  int rc = bcache_transfer(BLOCK_READ, run[0]->dev, run[0]->page, n, data);
+  if(! direct) {
+    for(uint i=0; i<n; i++)
+      memcpy(run[i]->data, data + i*BCACHE_PAGE_SIZE, BCACHE_PAGE_SIZE);
+    free(data);
+  }
+  Mutex_Lock(& bcache_lock);
+
+  for(uint i=0; i<n; i++) {
+    run[i]->busy = 0;
+    if(rc) {
+      rlist_remove(& run[i]->hnode);
+      run[i]->valid = 0;
+    }
+  }
+  Cond_Broadcast(& bcache_io_done);
+  return rc;
+}
+
+
+/*
+  Return the read-ahead for a miss on the given page, and update
+  the sequential read detection.
+ */
+static uint bcache_readahead(uint dev, uint64_t page)
+{
+  uint window = bcache_ra[dev].window;
+  if(page == bcache_ra[dev].last + 1)
+    window = (window == 0) ? BCACHE_RA_MIN : (window < BCACHE_RA_MAX ? 2*window : window);
+  else
+    window = 0;
+  bcache_ra[dev].window = window;
+  return window;
+}
+
+
+buffer* bcache_get(uint dev, uint64_t page, int fill)
+{
+  assert(dev < bios_block_devices() && page < bcache_dev_pages(dev));
+
+  buffer* buf;
+  Mutex_Lock(& bcache_lock);
+
+  /* Look up the page, waiting for any read-in to finish */
+  while((buf = bcache_lookup(dev, page)) != NULL && buf->busy)
+    bcache_wait();
+
+  if(buf != NULL) {
+    bcache_stats.hits++;
+    buf->refcount++;
+    buf->refbit = 1;
+    bcache_ra[dev].last = page;
+    Mutex_Unlock(& bcache_lock);
+    return buf;
+  }
+
+  /* A miss: get a buffer for the page */
+  int full;
+  while((buf = bcache_victim(1, &full)) == NULL) {
+    if(full) {
+      Mutex_Unlock(& bcache_lock);
+      return NULL;
+    }
+    /* The lock was released, the page may have arrived */
+    while((buf = bcache_lookup(dev, page)) != NULL && buf->busy)
+      bcache_wait();
+    if(buf != NULL) {
+      Mutex_Unlock(& bcache_lock);
+      return bcache_get(dev, page, fill);
+    }
+  }
+
+  bcache_stats.misses++;
+  bcache_assign(buf, dev, page);
+  buf->refcount = 1;
+
+  if(! fill) {
+    memset(buf->data, 0, BCACHE_PAGE_SIZE);
+    bcache_ra[dev].last = page;
+    bcache_ra[dev].window = 0;
+    Mutex_Unlock(& bcache_lock);
+    return buf;
+  }
+
+  /* Read in the page, together with the read-ahead pages that are
+     not in the cache */
+  buffer* run[1 + BCACHE_RA_MAX];
+  uint n = 0;
+  run[n++] = buf;
+  buf->busy = 1;
+
+  uint64_t npages = bcache_dev_pages(dev);
+  uint window = bcache_readahead(dev, page);
+  for(uint i=1; i<=window && page+i < npages && bcache_lookup(dev, page+i)==NULL; i++) {
+    /* Read-ahead does not wait for dirty victims to be written back */
+    buffer* rabuf = bcache_victim(0, &full);
+    if(rabuf == NULL) break;
+    bcache_assign(rabuf, dev, page+i);
+    rabuf->refcount = 0;
+    rabuf->refbit = 0;
+    rabuf->busy = 1;
+    run[n++] = rabuf;
+  }
+  bcache_stats.readahead += n-1;
+  bcache_ra[dev].last = page;
+
+  int rc = bcache_fill(run, n);
+  if(rc) {
+    buf->refcount = 0;
+    buf = NULL;
+  }
+  Mutex_Unlock(& bcache_lock);
+  return buf;
+}
+
+
+void bcache_mark_dirty(buffer* buf)
+{
+  assert(buf->refcount > 0);
+  Mutex_Lock(& bcache_lock);
+  if(! buf->dirty) {
+    buf->dirty = 1;
+    dirty_count++;
+    if(dirty_count > BCACHE_DIRTY_HIGH)
+      Cond_Signal(& flusher_wakeup);
+  }
+  Mutex_Unlock(& bcache_lock);
+}
+
+
+void bcache_put(buffer* buf)
+{
+  Mutex_Lock(& bcache_lock);
+  assert(buf->refcount > 0);
+  if(--buf->refcount == 0 && bcache_waiters > 0)
+    Cond_Broadcast(& bcache_io_done);
+  Mutex_Unlock(& bcache_lock);
+}
+
+
+
+/*============================================
+
+  Mappings
+
+  A mapping of n pages occupies a window of n consecutive data slots.
+  A window can be used if every slot either holds its page already,
+  or belongs to a buffer that can be evicted: one that is not pinned,
+  not in I/O, not dirty and not holding another page of the mapping.
+
+ ============================================*/
+
+static inline uint bcache_slot_of(buffer* buf)
+{
+  return (buf->data - bcache_data[0]) / BCACHE_PAGE_SIZE;
+}
+
+/* Pages of the mapping being set up, marked by buffer */
+static char bcache_target[BCACHE_BUFFERS];
+
+
+static int bcache_window_ok(uint s, buffer** cur, uint n)
+{
+  for(uint j=0; j<n; j++) {
+    buffer* owner = bcache_slot[s+j];
+    if(owner == cur[j]) continue;
+    if(owner->refcount > 0 || owner->busy || owner->writeback || owner->dirty
+       || bcache_target[owner - bcache_buffer])
+      return 0;
+    if(cur[j] != NULL && cur[j]->refcount > 0) return 0;
+  }
+  return 1;
+}
+
+
+/*
+  Find a window for a mapping, whose pages are cached in cur[] (or NULL).
+  Return its first slot, or -1 if there is none.
+ */
+static int bcache_find_window(buffer** cur, uint n)
+{
+  /* Prefer a window that keeps cached pages in place */
+  for(uint j=0; j<n; j++) {
+    if(cur[j] == NULL) continue;
+    uint slot = bcache_slot_of(cur[j]);
+    if(slot >= j && slot - j + n <= BCACHE_BUFFERS && bcache_window_ok(slot - j, cur, n))
+      return slot - j;
+  }
+  for(uint s=0; s + n <= BCACHE_BUFFERS; s++)
+    if(bcache_window_ok(s, cur, n)) return s;
+  return -1;
+}
+
+
+/* Put the page of cached buffer buf into the slot of owner, which is evicted */
+static void bcache_move(buffer* buf, buffer* owner)
+{
+  if(owner->valid) {
+    rlist_remove(& owner->hnode);
+    owner->valid = 0;
+    bcache_stats.evictions++;
+  }
+  memcpy(owner->data, buf->data, BCACHE_PAGE_SIZE);
+
+  char* data = buf->data;
+  buf->data = owner->data;
+  owner->data = data;
+  bcache_slot[bcache_slot_of(buf)] = buf;
+  bcache_slot[bcache_slot_of(owner)] = owner;
+}
+
+
+char* bcache_map(uint dev, const uint64_t* pages, uint n, buffer** bufs)
+{
+  assert(n > 0 && n <= BCACHE_MAP_MAX && dev < bios_block_devices());
+  for(uint j=0; j<n; j++)
+    assert(pages[j] < bcache_dev_pages(dev));
+
+  buffer* cur[n];
+  int s, flushed = 0;
+  Mutex_Lock(& bcache_lock);
+
+  for(;;) {
+    int wait = 0;
+    for(uint j=0; j<n; j++) {
+      cur[j] = bcache_lookup(dev, pages[j]);
+      if(cur[j] == NULL) continue;
+      bcache_target[cur[j] - bcache_buffer] = 1;
+      /* A page in use for a short time is waited for; a mapped page can
+         only be used in place */
+      if(cur[j]->busy || cur[j]->writeback
+         || (cur[j]->refcount > 0 && cur[j]->mapped == 0))
+        wait = 1;
+    }
+    s = wait ? -1 : bcache_find_window(cur, n);
+    for(uint j=0; j<n; j++)
+      if(cur[j] != NULL) bcache_target[cur[j] - bcache_buffer] = 0;
+    if(s >= 0) break;
+
+    if(wait) {
+      bcache_wait();
+    }
+    else if(! flushed) {
+      /* Make dirty buffers evictable, and try once more */
+      bcache_flush_all();
+      while(writeback_count > 0)
+        bcache_wait();
+      flushed = 1;
+    }
+    else {
+      Mutex_Unlock(& bcache_lock);
+      return NULL;
+    }
+  }
+
+  /* Place the pages; the lock is held throughout */
+  buffer* run[n];
+  uint nrun = 0;
+  for(uint j=0; j<n; j++) {
+    buffer* owner = bcache_slot[s+j];
+    buffer* buf = cur[j];
+
+    if(buf != NULL) {
+      if(buf != owner) bcache_move(buf, owner);
+      bcache_stats.hits++;
+    }
+    else {
+      buf = owner;
+      bcache_assign(buf, dev, pages[j]);
+      buf->busy = 1;
+      run[nrun++] = buf;
+      bcache_stats.misses++;
+    }
+    buf->refcount++;
+    buf->mapped++;
+    buf->refbit = 1;
+    bufs[j] = buf;
+  }
+
+  /* Read in the missing pages, with one request per run of consecutive pages */
+  int rc = 0;
+  for(uint i=0, k; i<nrun; i=k) {
+    for(k = i+1; k<nrun && run[k]->page == run[k-1]->page + 1
+        && run[k]->data == run[k-1]->data + BCACHE_PAGE_SIZE; k++);
+    if(bcache_fill(run+i, k-i)) rc = -1;
+  }
+  Mutex_Unlock(& bcache_lock);
+
+  if(rc) {
+    bcache_unmap(bufs, n);
+    return NULL;
+  }
+  return bufs[0]->data;
+}
+
+
+void bcache_unmap(buffer** bufs, uint n)
+{
+  Mutex_Lock(& bcache_lock);
+  for(uint j=0; j<n; j++) {
+    assert(bufs[j]->mapped > 0 && bufs[j]->refcount > 0);
+    bufs[j]->mapped--;
+    bufs[j]->refcount--;
+  }
+  if(bcache_waiters > 0)
+    Cond_Broadcast(& bcache_io_done);
+  Mutex_Unlock(& bcache_lock);
+}
+
+
+int bcache_sync()
+{
+  Mutex_Lock(& bcache_lock);
+  int rc = bcache_flush_all();
+  /* Wait for the write-backs started by other threads */
+  while(writeback_count > 0)
+    bcache_wait();
+  Mutex_Unlock(& bcache_lock);
+  return rc;
+}
+
+
+
+/*============================================
+
+  The flusher thread
+
+  The flusher writes back dirty buffers when there are more than
+  BCACHE_DIRTY_HIGH of them, or when it has not been woken up for 
+  BCACHE_FLUSH_INTERVAL msec. It runs until finalize_bcache().
+
+ ============================================*/
+
+static void bcache_flusher()
+{
+  Mutex_Lock(& bcache_lock);
+  while(! flusher_stop) {
+    if(dirty_count > BCACHE_DIRTY_HIGH)
+      bcache_flush_all();
+    else if(! Cond_TimedWait(& bcache_lock, & flusher_wakeup, BCACHE_FLUSH_INTERVAL)
+        && dirty_count > 0 && ! flusher_stop)
+      bcache_flush_all();
+  }
+
+  flusher_exited = 1;
+  Cond_Broadcast(& bcache_io_done);
+  sleep_releasing(EXITED, & bcache_lock);
+}
+
+
+void initialize_bcache()
+{
+  for(uint i=0; i<BCACHE_HASH_SIZE; i++)
+    rlnode_new(& bcache_hash[i]);
+
+  for(uint i=0; i<BCACHE_BUFFERS; i++) {
+    bcache_buffer[i] = (buffer) { .data = bcache_data[i] };
+    rlnode_init(& bcache_buffer[i].hnode, & bcache_buffer[i]);
+    bcache_slot[i] = & bcache_buffer[i];
+    bcache_target[i] = 0;
+  }
+  bcache_hand = 0;
+  dirty_count = 0;
+  writeback_count = 0;
+  bcache_waiters = 0;
+  for(uint d=0; d<MAX_BLOCK_DEVICES; d++)
+    bcache_ra[d].window = bcache_ra[d].last = 0;
+
+  bcache_stats = (cache_stats) { .buffers = BCACHE_BUFFERS };
+
+  flusher_stop = 0;
+  flusher_exited = 0;
+  flusher_thread = NULL;
+  if(bios_block_devices() > 0) {
+    flusher_thread = spawn_thread(get_pcb(0), bcache_flusher);
+    wakeup(flusher_thread);
+  }
+}
+
+
+void finalize_bcache()
+{
+  if(flusher_thread == NULL) return;
+
+  Mutex_Lock(& bcache_lock);
+  flusher_stop = 1;
+  Cond_Signal(& flusher_wakeup);
+  while(! flusher_exited)
+    bcache_wait();
+  flusher_thread = NULL;
+  Mutex_Unlock(& bcache_lock);
+
+  bcache_sync();
+}
+
+
+
+/*============================================
+
+  The cache statistics stream
+
+  A read-only stream returning a single cache_stats
+  block, taken when the stream is opened.
+
+ ============================================*/
+
+typedef struct cache_info_stream {
+  uint pos;               /* bytes of stats already read */
+  cache_stats stats;
+} cache_info_stream;
+
+
+static int cacheinfo_read(void* dev, char *buf, unsigned int size)
+{
+  cache_info_stream* info = (cache_info_stream*) dev;
+
+  uint remain = sizeof(cache_stats) - info->pos;
+  if(size > remain) size = remain;
+
+  memcpy(buf, ((char*) & info->stats) + info->pos, size);
+  info->pos += size;
+  return size;
+}
+
+
+static int cacheinfo_close(void* dev)
+{
+  free(dev);
+  return 0;
+}
+
+
+static file_ops cacheinfo_fops = {
+  .Read = cacheinfo_read,
+  .Close = cacheinfo_close
+};
+
+
+Fid_t OpenCacheInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  cache_info_stream* info = xmalloc(sizeof(cache_info_stream));
+  info->pos = 0;
+  Mutex_Lock(& bcache_lock);
+  info->stats = bcache_stats;
+  info->stats.dirty = dirty_count;
+  Mutex_Unlock(& bcache_lock);
+  if(bios_block_devices() == 0)
+    info->stats = (cache_stats) { 0 };
+
+  Mutex_Lock(&kernel_mutex);
+
+  if(FCB_reserve(1, &fid, &fcb)) {
+    fcb->streamobj = info;
+    fcb->streamfunc = & cacheinfo_fops;
+  }
+  else {
+    fid = NOFILE;
+    free(info);
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return fid;
+}
@@ -0,0 +1,178 @@
+#ifndef __KERNEL_BCACHE_H
+#define __KERNEL_BCACHE_H
+
+#include "tinyos.h"
+#include "util.h"
+#include "bios.h"
+
+/**
+  @file kernel_bcache.h
+  @brief The buffer cache.
+
+  @defgroup bcache Buffer cache
+  @ingroup kernel
+  @brief The buffer cache of block devices.
+
+  The buffer cache holds pages of block devices in memory. A page
+  is @c BCACHE_PAGE_SIZE bytes, i.e., @c BCACHE_PAGE_SECTORS
+  consecutive sectors, aligned to its size.
+
+  The cache has @c BCACHE_BUFFERS buffers, each holding one page.
+  Buffers are found by a hash table on (device, page), and are
+  replaced by the CLOCK algorithm. A buffer is pinned while it is
+  used, and pinned buffers are never replaced.
+
+  Writes are cached: modified buffers are marked dirty and are written
+  back later, by a flusher thread, by replacement, or by @ref bcache_sync.
+  The flusher thread is woken up when the number of dirty buffers
+  exceeds @c BCACHE_DIRTY_HIGH, and every @c BCACHE_FLUSH_INTERVAL
+  msec, so that no page stays dirty for long. Write-back transfers runs of
+  consecutive dirty pages as a single request.
+
+  Sequential reads are detected per device, and trigger read-ahead:
+  a miss on the page following the previously accessed page is served
+  by reading a run of pages with a single request. The run length
+  starts at @c BCACHE_RA_MIN pages and doubles on each sequential miss,
+  up to @c BCACHE_RA_MAX pages.
+
+  A run of pages can be mapped with @ref bcache_map: the pages are
+  pinned, and their data is placed in consecutive buffers of the cache
+  memory, so that the run can be accessed in place as one array. Pages
+  that are not in the cache are read in directly to their place.
+
+  @{
+*/
+
+/** @brief The number of sectors of a cache page */
+#define BCACHE_PAGE_SECTORS 8
+
+/** @brief The size of a cache page in bytes */
+#define BCACHE_PAGE_SIZE (BCACHE_PAGE_SECTORS*BLOCK_SECTOR_SIZE)
+
+/** @brief The number of buffers in the cache */
+#define BCACHE_BUFFERS 1024
+
+/** @brief The number of hash buckets */
+#define BCACHE_HASH_SIZE 1021
+
+/** @brief The number of dirty buffers that wakes up the flusher */
+#define BCACHE_DIRTY_HIGH (BCACHE_BUFFERS/4)
+
+/** @brief The period of the flusher, in msec */
+#define BCACHE_FLUSH_INTERVAL 1000
+
+/** @brief Minimum read-ahead, in pages */
+#define BCACHE_RA_MIN 4
+
+/** @brief Maximum read-ahead (and write-back run), in pages */
+#define BCACHE_RA_MAX 32
+
+/** @brief The maximum number of pages of a mapping: a quarter of the cache, 
+    plus a page for a mapping that does not start at a page boundary */
+#define BCACHE_MAP_MAX (BCACHE_BUFFERS/4 + 1)
+
+
+/** @brief A buffer of the cache. */
+typedef struct buffer
+{
+  uint dev;                 /**< @brief The block device */
+  uint64_t page;            /**< @brief The page number */
+  char* data;               /**< @brief The page data */
+
+  int valid;                /**< @brief The buffer holds a page */
+  int busy;                 /**< @brief The page is being read in */
+  int dirty;                /**< @brief The page must be written back */
+  int writeback;            /**< @brief The page is being written back */
+  int refbit;               /**< @brief CLOCK reference bit */
+  uint refcount;            /**< @brief Pin count */
+  uint mapped;              /**< @brief Pins held by mappings */
+
+  rlnode hnode;             /**< @brief Node in the hash bucket */
+} buffer;
+
+
+/** @brief Flag for @ref bcache_get: read the page from the device */
+#define BCACHE_FILL   1
+
+/** @brief Flag for @ref bcache_get: the page will be overwritten */
+#define BCACHE_NOFILL 0
+
+
+/**
+  @brief Initialize the buffer cache.
+
+  This is called at kernel startup, after the scheduler is initialized.
+  If there are block devices, it starts the flusher thread.
+ */
+void initialize_bcache();
+
+
+/**
+  @brief Write back all dirty buffers and stop the flusher thread.
+
+  This is called when the init process exits.
+ */
+void finalize_bcache();
+
+
+/**
+  @brief Return the pinned buffer of a page.
+
+  If the page is not in the cache, a buffer is replaced. With
+  @c BCACHE_FILL, the page is read from the device (possibly with
+  read-ahead); with @c BCACHE_NOFILL, the buffer is zeroed instead,
+  since the caller will overwrite the whole page.
+
+  @returns the buffer, or NULL on an I/O error, or if the page is not
+    cached and every buffer is pinned
+ */
+buffer* bcache_get(uint dev, uint64_t page, int fill);
+
+
+/**
+  @brief Mark a pinned buffer as modified.
+ */
+void bcache_mark_dirty(buffer* buf);
+
+
+/**
+  @brief Unpin a buffer.
+ */
+void bcache_put(buffer* buf);
+
+
+/**
+  @brief Pin a run of pages at consecutive addresses.
+
+  The pages @c pages[0..n-1] of device @c dev are pinned, with their
+  data in consecutive buffers of the cache memory, and their buffers
+  are stored in @c bufs. Pages already in place (e.g., because they 
+  are mapped by an earlier call) are shared; other cached pages are
+  moved to their place, and the rest are read in. A page can only
+  be at one place, so a page mapped as part of a different run cannot
+  be mapped again.
+
+  The mapping is released by @ref bcache_unmap. At most 
+  @c BCACHE_MAP_MAX pages can be mapped by one call.
+
+  @returns the data of the first page, or NULL on failure
+ */
+char* bcache_map(uint dev, const uint64_t* pages, uint n, buffer** bufs);
+
+/**
+  @brief Release the buffers of a mapping.
+ */
+void bcache_unmap(buffer** bufs, uint n);
+
+/**
+  @brief Write back all dirty buffers.
+
+  This returns after all the buffers that were dirty at the time of
+  the call have been written back.
+  @returns 0 on success, -1 if some write-back failed
+ */
+int bcache_sync();
+
+/** @} */
+
+#endif
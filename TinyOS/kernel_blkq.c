@@ -0,0 +1,360 @@
+
+#include <assert.h>
+#include <string.h>
+#include "kernel_blkq.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+
+/*************************************
+
+  Block I/O request queues
+
+ *************************************/
+
+
+/*============================================
+
+  Elevators
+
+ ============================================*/
+
+/*
+  The noop elevator keeps the queue in arrival order.
+ */
+static void noop_add(block_queue* q, block_request* req)
+{
+  rlist_push_back(& q->queue, & req->qnode);
+}
+
+static void noop_remove(block_queue* q, block_request* req)
+{
+  rlist_remove(& req->qnode);
+}
+
+static block_request* noop_next(block_queue* q)
+{
+  return q->queue.next->obj;
+}
+
+
+/*
+  The C-LOOK elevator keeps the queue sorted by sector.
+ */
+static void clook_add(block_queue* q, block_request* req)
+{
+  rlnode* pos = q->queue.next;
+  while(pos != & q->queue && ((block_request*)pos->obj)->sector <= req->sector)
+    pos = pos->next;
+  /* Insert before pos */
+  rlist_push_back(pos, & req->qnode);
+}
+
+static void clook_remove(block_queue* q, block_request* req)
+{
+  rlist_remove(& req->qnode);
+}
+
+/* The first request at or after the head, or the lowest one */
+static block_request* clook_next(block_queue* q)
+{
+  for(rlnode* pos = q->queue.next; pos != & q->queue; pos = pos->next) {
+    block_request* req = pos->obj;
+    if(req->sector >= q->head) return req;
+  }
+  return q->queue.next->obj;
+}
+
+
+/*
+  The deadline elevator keeps the queue sorted by sector, as C-LOOK,
+  and also in a FIFO sorted by deadline.
+ */
+static void deadline_add(block_queue* q, block_request* req)
+{
+  clook_add(q, req);
+
+  req->deadline = bios_clock_ns() +
+    ((req->op == BLOCK_READ) ? BLKQ_READ_EXPIRE : BLKQ_WRITE_EXPIRE);
+
+  /* Deadlines mostly arrive in order, so search from the back */
+  rlnode* pos = q->fifo.prev;
+  while(pos != & q->fifo && ((block_request*)pos->obj)->deadline > req->deadline)
+    pos = pos->prev;
+  /* Insert after pos */
+  rlist_push_front(pos, & req->fifo_node);
+}
+
+static void deadline_remove(block_queue* q, block_request* req)
+{
+  rlist_remove(& req->qnode);
+  rlist_remove(& req->fifo_node);
+}
+
+static block_request* deadline_next(block_queue* q)
+{
+  block_request* oldest = q->fifo.next->obj;
+  if(oldest->deadline <= bios_clock_ns())
+    return oldest;
+  return clook_next(q);
+}
+
+
+static const elevator_type elevators[] = {
+  { .name = "noop", .add = noop_add, .remove = noop_remove, .next = noop_next },
+  { .name = "clook", .add = clook_add, .remove = clook_remove, .next = clook_next },
+  { .name = "deadline", .add = deadline_add, .remove = deadline_remove, .next = deadline_next },
+};
+
+#define NUM_ELEVATORS (sizeof(elevators)/sizeof(elevator_type))
+
+
+static const elevator_type* find_elevator(const char* name)
+{
+  for(uint i=0; i<NUM_ELEVATORS; i++)
+    if(strcmp(elevators[i].name, name)==0) return & elevators[i];
+  return NULL;
+}
+
+
+
+/*============================================
+
+  Queue operations
+
+  All of these must be called with the queue spinlock held
+  and preemption off.
+
+ ============================================*/
+
+static void blkq_add(block_queue* q, block_request* req)
+{
+  rlnode_init(& req->qnode, req);
+  rlnode_init(& req->fifo_node, req);
+  q->elevator->add(q, req);
+  q->pending++;
+}
+
+static void blkq_remove(block_queue* q, block_request* req)
+{
+  q->elevator->remove(q, req);
+  q->pending--;
+}
+
+
+/*
+  Find a pending request of the given op that can be merged with the
+  range [start, end): either it starts at end, or it ends at start.
+ */
+static block_request* blkq_find_adjacent(block_queue* q, block_op op,
+  uint64_t start, uint64_t end, uint maxcount)
+{
+  for(rlnode* pos = q->queue.next; pos != & q->queue; pos = pos->next) {
+    block_request* req = pos->obj;
+    if(req->op != op || req->count > maxcount) continue;
+    if(req->sector == end || req->sector + req->count == start)
+      return req;
+  }
+  return NULL;
+}
+
+
+/*
+  Take the next request from the elevator, merge adjacent pending
+  requests into it, and submit the result to the BIOS.
+ */
+static void blkq_dispatch_one(block_queue* q, block_dispatch* d)
+{
+  block_request* first = q->elevator->next(q);
+  blkq_remove(q, first);
+  first->next_merged = NULL;
+
+  block_request* last = first;
+  uint64_t start = first->sector;
+  uint64_t end = first->sector + first->count;
+
+  block_request* req;
+  while(end-start < BLKQ_MAX_SECTORS) {
+    req = blkq_find_adjacent(q, first->op, start, end, BLKQ_MAX_SECTORS - (end-start));
+    if(req == NULL) break;
+    blkq_remove(q, req);
+    if(req->sector == end) {
+      last->next_merged = req;
+      req->next_merged = NULL;
+      last = req;
+      end += req->count;
+    } else {
+      req->next_merged = first;
+      first = req;
+      start = req->sector;
+    }
+    q->stats.merged++;
+  }
+
+  d->reqs = first;
+  d->busy = 1;
+  d->breq = (bios_block_request) {
+    .op = first->op, .sector = start, .count = end-start, .context = d
+  };
+
+  if(first->next_merged == NULL)
+    /* A single request is transferred in place */
+    d->breq.buffer = first->buf;
+  else {
+    d->breq.buffer = d->bounce;
+    if(first->op == BLOCK_WRITE)
+      for(req = first; req; req = req->next_merged)
+        memcpy(d->bounce + (req->sector-start)*BLOCK_SECTOR_SIZE, req->buf,
+          req->count*BLOCK_SECTOR_SIZE);
+  }
+
+  q->head = end;
+  q->inflight++;
+  q->stats.dispatched++;
+  bios_block_submit(q->devno, & d->breq);
+}
+
+
+/*
+  Dispatch pending requests into all free slots.
+ */
+static void blkq_dispatch(block_queue* q)
+{
+  for(uint i=0; i<BLKQ_DEPTH && q->pending > 0; i++)
+    if(! q->slot[i].busy)
+      blkq_dispatch_one(q, & q->slot[i]);
+}
+
+
+/*
+  Wake up the requests of a completed dispatch.
+ */
+static void blkq_finish(block_queue* q, block_dispatch* d)
+{
+  block_request* req = d->reqs;
+  int merged = (req->next_merged != NULL);
+
+  while(req) {
+    block_request* next = req->next_merged;
+    if(merged && req->op == BLOCK_READ)
+      memcpy(req->buf, d->bounce + (req->sector - d->breq.sector)*BLOCK_SECTOR_SIZE,
+        req->count*BLOCK_SECTOR_SIZE);
+    req->status = d->breq.status;
+    req->done = 1;
+    Cond_Signal(& req->completed);
+    req = next;
+  }
+
+  d->reqs = NULL;
+  d->busy = 0;
+  q->inflight--;
+}
+
+
+
+/*============================================
+
+  The queue API
+
+ ============================================*/
+
+void blkq_init(block_queue* q, uint devno)
+{
+  q->devno = devno;
+  q->spinlock = MUTEX_INIT;
+  q->elevator = find_elevator("clook");
+  rlnode_new(& q->queue);
+  rlnode_new(& q->fifo);
+  q->pending = 0;
+  q->head = 0;
+  q->inflight = 0;
+  for(uint i=0; i<BLKQ_DEPTH; i++) {
+    q->slot[i].busy = 0;
+    q->slot[i].reqs = NULL;
+    q->slot[i].bounce = xmalloc(BLKQ_MAX_SECTORS*BLOCK_SECTOR_SIZE);
+  }
+  q->stats = (block_queue_stats){ 0 };
+}
+
+
+int blkq_io(block_queue* q, block_op op, uint64_t sector, uint count, void* buf)
+{
+  block_request req = {
+    .op = op, .sector = sector, .count = count, .buf = buf,
+    .status = 0, .done = 0, .completed = COND_INIT
+  };
+
+  /* Invalid requests are not queued, so that they are not merged
+     with valid ones */
+  uint64_t sectors = bios_block_sectors(q->devno);
+  if(count == 0 || sector >= sectors || count > sectors - sector)
+    return -1;
+
+  preempt_off;            /* Stop preemption */
+  Mutex_Lock(& q->spinlock);
+
+  q->stats.requests++;
+  blkq_add(q, & req);
+  blkq_dispatch(q);
+  while(! req.done)
+    Cond_Wait(& q->spinlock, & req.completed);
+
+  Mutex_Unlock(& q->spinlock);
+  preempt_on;           /* Restart preemption */
+
+  return req.status;
+}
+
+
+void blkq_complete(block_queue* q)
+{
+  Mutex_Lock(& q->spinlock);
+
+  bios_block_request* breq = bios_block_completed(q->devno);
+  while(breq) {
+    bios_block_request* next = breq->next;
+    blkq_finish(q, (block_dispatch*) breq->context);
+    breq = next;
+  }
+  blkq_dispatch(q);
+
+  Mutex_Unlock(& q->spinlock);
+}
+
+
+int blkq_set_elevator(block_queue* q, const char* name)
+{
+  const elevator_type* elv = find_elevator(name);
+  if(elv == NULL) return -1;
+
+  int pre = preempt_off;
+  Mutex_Lock(& q->spinlock);
+
+  /* Move the pending requests to the new elevator */
+  rlnode moved;
+  rlnode_new(& moved);
+  while(q->pending > 0) {
+    block_request* req = q->elevator->next(q);
+    blkq_remove(q, req);
+    rlist_push_back(& moved, & req->qnode);
+  }
+
+  q->elevator = elv;
+  while(! is_rlist_empty(& moved)) {
+    block_request* req = rlist_pop_front(& moved)->obj;
+    blkq_add(q, req);
+  }
+
+  Mutex_Unlock(& q->spinlock);
+  if(pre) preempt_on;
+  return 0;
+}
+
+
+void blkq_get_stats(block_queue* q, block_queue_stats* stats)
+{
+  int pre = preempt_off;
+  Mutex_Lock(& q->spinlock);
+  *stats = q->stats;
+  Mutex_Unlock(& q->spinlock);
+  if(pre) preempt_on;
+}
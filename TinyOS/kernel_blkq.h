@@ -0,0 +1,167 @@
+#ifndef __KERNEL_BLKQ_H
+#define __KERNEL_BLKQ_H
+
+#include "tinyos.h"
+#include "util.h"
+#include "bios.h"
+
+/**
+  @file kernel_blkq.h
+  @brief Block I/O request queues.
+
+  @defgroup blkq Block request queues
+  @ingroup kernel
+  @brief Block I/O request queues.
+
+  A request queue sits between the users of a block device and the
+  BIOS. Threads submit their requests to the queue and sleep until
+  their request completes. The queue orders the pending requests
+  according to an I/O scheduler (elevator), merges requests for
+  adjacent sectors into a single BIOS request, and keeps up to
+  @c BLKQ_DEPTH BIOS requests in flight.
+
+  The available elevators are:
+  - @c "noop": requests are served in the order they arrive.
+  - @c "clook": requests are served in ascending sector order,
+    sweeping from the current position of the device to the highest
+    pending sector, and then wrapping around to the lowest one.
+  - @c "deadline": like @c "clook", except that a request that has
+    waited past its deadline (@c BLKQ_READ_EXPIRE or @c BLKQ_WRITE_EXPIRE
+    nsec) is served first.
+
+  @{
+*/
+
+/** @brief The maximum number of BIOS requests in flight, per device */
+#define BLKQ_DEPTH 4
+
+/** @brief The maximum size of a merged request, in sectors */
+#define BLKQ_MAX_SECTORS 256
+
+/** @brief The deadline of reads, in nsec */
+#define BLKQ_READ_EXPIRE  50000000ull
+
+/** @brief The deadline of writes, in nsec */
+#define BLKQ_WRITE_EXPIRE 500000000ull
+
+
+/** @brief A request submitted to a queue by a thread. */
+typedef struct block_request
+{
+  block_op op;
+  uint64_t sector;
+  uint count;
+  char* buf;
+
+  uint64_t deadline;          /**< @brief Used by the deadline elevator */
+  int status;                 /**< @brief 0 on success, -1 on error */
+  int done;                   /**< @brief Set on completion */
+  CondVar completed;          /**< @brief Signalled on completion */
+
+  rlnode qnode;               /**< @brief Node in the elevator queue */
+  rlnode fifo_node;           /**< @brief Node in the deadline FIFO */
+  struct block_request* next_merged;  /**< @brief Next request of a merged dispatch */
+} block_request;
+
+
+/** @brief A BIOS request in flight, serving one or more merged requests. */
+typedef struct block_dispatch
+{
+  bios_block_request breq;
+  block_request* reqs;        /**< @brief The requests served, in sector order */
+  char* bounce;               /**< @brief Buffer used for merged requests */
+  int busy;
+} block_dispatch;
+
+
+typedef struct block_queue block_queue;
+
+
+/** @brief The operations of an elevator. */
+typedef struct elevator_type
+{
+  const char* name;
+
+  /** @brief Add a request to the queue. */
+  void (*add)(block_queue* q, block_request* req);
+
+  /** @brief Remove a request from the queue. */
+  void (*remove)(block_queue* q, block_request* req);
+
+  /** @brief Return the request to dispatch next, without removing it. */
+  block_request* (*next)(block_queue* q);
+} elevator_type;
+
+
+/** @brief Queue statistics. */
+typedef struct block_queue_stats
+{
+  unsigned long requests;     /**< @brief Requests submitted */
+  unsigned long merged;       /**< @brief Requests merged into other requests */
+  unsigned long dispatched;   /**< @brief BIOS requests submitted */
+} block_queue_stats;
+
+
+/** @brief A block device request queue. */
+struct block_queue
+{
+  uint devno;                 /**< @brief The BIOS block device */
+  Mutex spinlock;
+
+  const elevator_type* elevator;
+  rlnode queue;               /**< @brief Pending requests, in elevator order */
+  rlnode fifo;                /**< @brief Pending requests, by deadline */
+  uint pending;               /**< @brief Number of pending requests */
+  uint64_t head;              /**< @brief The sector after the last dispatch */
+
+  uint inflight;              /**< @brief Number of busy dispatch slots */
+  block_dispatch slot[BLKQ_DEPTH];
+
+  block_queue_stats stats;
+};
+
+
+/**
+  @brief Initialize a queue for a BIOS block device.
+
+  The queue uses the @c "clook" elevator.
+ */
+void blkq_init(block_queue* q, uint devno);
+
+
+/**
+  @brief Read or write sectors through a queue.
+
+  The calling thread sleeps until the transfer is complete.
+  It returns 0 on success and -1 on failure.
+ */
+int blkq_io(block_queue* q, block_op op, uint64_t sector, uint count, void* buf);
+
+
+/**
+  @brief Complete the BIOS requests of a queue that are done.
+
+  This is called by the @c BLOCK_DONE interrupt handler, with
+  preemption off. It wakes up the threads whose requests are complete,
+  and dispatches more requests.
+ */
+void blkq_complete(block_queue* q);
+
+
+/**
+  @brief Change the elevator of a queue.
+
+  Any pending requests are moved to the new elevator.
+  It returns 0 on success and -1 if there is no elevator by that name.
+ */
+int blkq_set_elevator(block_queue* q, const char* name);
+
+
+/**
+  @brief Return a copy of the statistics of a queue.
+ */
+void blkq_get_stats(block_queue* q, block_queue_stats* stats);
+
+/** @} */
+
+#endif
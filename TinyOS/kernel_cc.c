@@ -131,6 +131,107 @@ int Cond_Wait(Mutex* mutex, CondVar* cv)
 
 
 
+/*
+	Timed waits.
+
+	The threads in Cond_TimedWait are also in a list of timed waits, 
+	which the ALARM handlers scan for expired timeouts. A thread whose
+	timeout expires is removed from the waitset of its condition 
+	variable and woken up, unless it has already been signalled.
+	
+	The handlers only try the locks, since the interrupted thread may
+	be holding them; a timeout missed because of this expires at a 
+	later quantum.
+ */
+typedef struct __cv_timed_wait {
+  __cv_waitset_node* node;
+  CondVar* cv;
+  TimerDuration deadline;         /* in nsec of the BIOS clock */
+  int expired;
+  struct __cv_timed_wait* next;
+} __cv_timed_wait;
+
+static __cv_timed_wait* cv_timed_waits = NULL;
+static Mutex cv_timed_lock = MUTEX_INIT;
+
+
+static inline int Mutex_TryLock(Mutex* lock)
+{
+  return ! __atomic_test_and_set(lock, __ATOMIC_ACQUIRE);
+}
+
+
+int Cond_TimedWait(Mutex* mutex, CondVar* cv, long int timeout)
+{
+  if(timeout < 0) return Cond_Wait(mutex, cv);
+
+  __cv_waitset_node newnode;
+  newnode.thread = CURTHREAD;
+
+  __cv_timed_wait tw = { 
+    .node = &newnode, .cv = cv, .expired = 0,
+    .deadline = bios_clock_ns() + (TimerDuration) timeout * 1000000ull
+  };
+
+  int pre = preempt_off;
+  Mutex_Lock(& cv_timed_lock);
+  tw.next = cv_timed_waits;
+  cv_timed_waits = &tw;
+  Mutex_Unlock(& cv_timed_lock);
+  if(pre) preempt_on;
+
+  /* As in Cond_Wait */
+  Mutex_Lock(&(cv->waitset_lock));
+  newnode.next = cv->waitset;
+  cv->waitset = &newnode;
+  Mutex_Unlock(mutex);
+  sleep_releasing(STOPPED, &(cv->waitset_lock));
+
+  /* Leave the list, unless the timeout removed us */
+  pre = preempt_off;
+  Mutex_Lock(& cv_timed_lock);
+  for(__cv_timed_wait** p = &cv_timed_waits; *p != NULL; p = &(*p)->next)
+    if(*p == &tw) { *p = tw.next; break; }
+  Mutex_Unlock(& cv_timed_lock);
+  if(pre) preempt_on;
+
+  Mutex_Lock(mutex);
+  return ! tw.expired;
+}
+
+
+void Cond_ExpireTimeouts()
+{
+  if(__atomic_load_n(& cv_timed_waits, __ATOMIC_RELAXED) == NULL) return;
+  if(! Mutex_TryLock(& cv_timed_lock)) return;
+
+  TimerDuration now = bios_clock_ns();
+  for(__cv_timed_wait** p = &cv_timed_waits; *p != NULL; ) {
+    __cv_timed_wait* tw = *p;
+    int woken = 0;
+
+    if(tw->deadline <= now && Mutex_TryLock(& tw->cv->waitset_lock)) {
+      /* The node is in the waitset, unless the thread was signalled,
+         or it has not gone to sleep yet */
+      for(__cv_waitset_node** q = (__cv_waitset_node**) &tw->cv->waitset; *q != NULL; q = &(*q)->next)
+        if(*q == tw->node) {
+          *q = tw->node->next;
+          *p = tw->next;
+          tw->expired = 1;
+          wakeup(tw->node->thread);
+          woken = 1;
+          break;
+        }
+      Mutex_Unlock(& tw->cv->waitset_lock);
+    }
+
+    if(! woken) p = &tw->next;
+  }
+
+  Mutex_Unlock(& cv_timed_lock);
+}
+
+
 /**
   @internal
   Helper for Cond_Signal and Cond_Broadcast
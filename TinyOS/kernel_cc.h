@@ -98,6 +98,14 @@ int get_core_preemption();
 #define preempt_on  (set_core_preemption(1))
 
 
+/** @brief Wake up the threads whose @c Cond_TimedWait has timed out.
+
+	This is called by the @c ALARM handler, on every core.
+	@see Cond_TimedWait
+ */
+void Cond_ExpireTimeouts();
+
+
 /** @} */
 
 #endif
@@ -1,7 +1,9 @@
 
 #include <assert.h>
+#include <sys/mman.h>
 #include "kernel_cc.h"
 #include "kernel_dev.h"
+#include "kernel_bcache.h"
 #include "kernel_sched.h"
 #include "kernel_streams.h"
 #include "kernel_proc.h"
@@ -47,13 +49,24 @@ void* nulldev_open(uint minor)
   return NULL;
 }
 
+int nulldev_poll(void* dev, int events)
+{
+  return events;
+}
+
 static file_ops nulldev_fops = {
   .Open = nulldev_open,
   .Read = nulldev_read,
   .Write = nulldev_write,
-  .Close = nulldev_close
+  .Close = nulldev_close,
+  .Poll = nulldev_poll
 };
 
+static void nulldev_init()
+{
+  register_device(DEV_NULL, "null", &nulldev_fops, 1);
+}
+
 
 /*============================================
 
@@ -70,11 +83,102 @@ typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  CondVar tx_ready;       /* signalled when tx_buffer has space */
+  io_buffer tx_buffer;    /* data waiting to be sent to the device */
+  int rx_peeked;          /* a byte was read ahead by serial_poll */
+  char rx_peek;
+
+  uint irq_core;          /* the core receiving the interrupts of this device */
+  uint reader_core;       /* the core where a reader last ran */
+  uint irq_load;          /* interrupts since the last balancing */
+
+  unsigned long rx_signals;   /* RX interrupts that signalled rx_ready */
+  unsigned long rx_wakeups;   /* readers woken up from rx_ready */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
 
 
+/*============================================
+
+  Serial interrupt balancing
+
+  The RX and TX interrupts of each terminal are routed to a single
+  core. Initially, terminals are spread round-robin over the cores.
+  Every IRQ_BALANCE_PERIOD serial interrupts, the routing is
+  recomputed: each terminal is routed to the core where its readers
+  last ran, unless the interrupt load of that core would exceed the
+  load of the least-loaded core by more than the terminal's own load;
+  then it is routed to the least-loaded core.
+
+ ============================================*/
+
+#define IRQ_BALANCE_PERIOD 128
+
+static uint irq_balance_count = 0;
+static Mutex irq_balance_spinlock = MUTEX_INIT;
+
+/* Route all interrupts of a terminal to a core */
+static void serial_route_irq(serial_dcb_t* dcb, uint core)
+{
+  dcb->irq_core = core;
+  bios_serial_interrupt_core(dcb->devno, SERIAL_RX_READY, core);
+  bios_serial_interrupt_core(dcb->devno, SERIAL_TX_READY, core);
+}
+
+
+static void serial_irq_balance()
+{
+  uint ncores = cpu_cores();
+  uint nterm = bios_serial_ports();
+  uint core_load[MAX_CORES] = { 0 };
+  uint load[MAX_TERMINALS];
+  int done[MAX_TERMINALS] = { 0 };
+
+  for(uint i=0; i<nterm; i++)
+    load[i] = __atomic_exchange_n(& serial_dcb[i].irq_load, 0, __ATOMIC_RELAXED);
+
+  /* Place the busiest terminals first */
+  for(uint n=0; n<nterm; n++) {
+    int t = -1;
+    for(uint i=0; i<nterm; i++)
+      if(!done[i] && (t<0 || load[i] > load[t])) t = i;
+    done[t] = 1;
+
+    serial_dcb_t* dcb = & serial_dcb[t];
+
+    uint least = 0;
+    for(uint c=1; c<ncores; c++)
+      if(core_load[c] < core_load[least]) least = c;
+
+    uint core = dcb->reader_core;
+    if(core_load[core] > core_load[least] + load[t])
+      core = least;
+
+    core_load[core] += load[t];
+    if(core != dcb->irq_core)
+      serial_route_irq(dcb, core);
+  }
+}
+
+
+/*
+  Called by the serial interrupt handlers, once for each interrupt 
+  received from a device. Must be called with preemption off.
+ */
+static void serial_irq_account(serial_dcb_t* dcb)
+{
+  __atomic_add_fetch(& dcb->irq_load, 1, __ATOMIC_RELAXED);
+  uint count = __atomic_add_fetch(& irq_balance_count, 1, __ATOMIC_RELAXED);
+
+  if(count % IRQ_BALANCE_PERIOD == 0 && cpu_cores() > 1) {
+    Mutex_Lock(& irq_balance_spinlock);
+    serial_irq_balance();
+    Mutex_Unlock(& irq_balance_spinlock);
+  }
+}
+
+
 
 /*
   Interrupt-driven driver for serial-device reads.
@@ -84,44 +188,56 @@ void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
-  for(int i=0;i<bios_serial_ports();i++) {
+  /* Signal only the terminals that are ready */
+  uint pending = bios_serial_interrupt_pending(SERIAL_RX_READY);
+  while(pending) {
+    int i = __builtin_ctz(pending);
+    pending &= pending-1;
     serial_dcb_t* dcb = &serial_dcb[i];
     Mutex_Lock(& dcb->spinlock);
+    dcb->rx_signals++;
     Cond_Broadcast(&dcb->rx_ready);
     Mutex_Unlock(& dcb->spinlock);
+    serial_irq_account(dcb);
+    stream_notify(dcb);
   }
   if(pre) preempt_on;
 }
 
 /*
-  Read from the device, sleeping if needed.
+  Read from the device, sleeping if needed, or returning -1 if
+  nonblock is set.
  */
-int serial_read(void* dev, char *buf, unsigned int size)
+static int serial_transfer_in(serial_dcb_t* dcb, char *buf, unsigned int size, int nonblock)
 {
-  serial_dcb_t* dcb = (serial_dcb_t*)dev;
-
   preempt_off;            /* Stop preemption */
   Mutex_Lock(& dcb->spinlock);
 
-  uint count =  0;
+  int count =  0;
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
-    }
-    else if(count==0) {
-      CURTHREAD->interactive = 1;
-      printf("\n READ:%d \n",CURTHREAD->interactive);
-      Cond_Wait(&dcb->spinlock, &dcb->rx_ready);
+  while(size>0) {
+    dcb->reader_core = cpu_core_id;
+
+    /* A byte read ahead comes first */
+    if(dcb->rx_peeked) {
+      buf[0] = dcb->rx_peek;
+      dcb->rx_peeked = 0;
+      count = 1 + bios_read_serial_block(dcb->devno, buf+1, size-1);
+      break;
     }
-    else
+    count = bios_read_serial_block(dcb->devno, buf, size);
+    
+    if (count>0) 
       break;
+
+    if(nonblock) {
+      count = -1;
+      break;
+    }
+
+    CURTHREAD->interactive = 1;
+    Cond_Wait(&dcb->spinlock, &dcb->rx_ready);
+    dcb->rx_wakeups++;
   }
   CURTHREAD->interactive = 0;
   Mutex_Unlock(& dcb->spinlock);
@@ -130,43 +246,120 @@ int serial_read(void* dev, char *buf, unsigned int size)
   return count;
 }
 
+int serial_read(void* dev, char *buf, unsigned int size)
+{
+  return serial_transfer_in((serial_dcb_t*)dev, buf, size, 0);
+}
+
+int serial_try_read(void* dev, char *buf, unsigned int size)
+{
+  return serial_transfer_in((serial_dcb_t*)dev, buf, size, 1);
+}
+
 
 /*
-  A polling driver for serial writes
-  */
+  Interrupt-driven driver for serial-device writes.
+
+  Writers copy their data into the tx_buffer of the device and
+  return; the data is pushed to the device from there, by the writers
+  themselves and by the SERIAL_TX_READY handler. Writers sleep only
+  when tx_buffer is full.
+ */
+
+/*
+  Send as much of tx_buffer to the device as it will accept.
+  Must be called with the device spinlock held.
+  Returns the number of bytes sent.
+ */
+static uint serial_tx_push(serial_dcb_t* dcb)
+{
+  io_buffer* txbuf = & dcb->tx_buffer;
+
+  uint pos;
+  uint size = io_buffer_segment_reserve(& txbuf->data, IO_BUFFER_CAPACITY, &pos);
+
+  uint sent = 0;
+  while(sent < size) {
+    uint off = (pos+sent) % IO_BUFFER_CAPACITY;
+    uint chunk = size - sent;
+    if(off + chunk > IO_BUFFER_CAPACITY) 
+      chunk = IO_BUFFER_CAPACITY - off;
+
+    uint n = bios_write_serial_block(dcb->devno, txbuf->storage + off, chunk);
+    sent += n;
+    if(n < chunk) break;
+  }
+
+  /* Return what was not sent */
+  io_buffer_segment_unreserve(& txbuf->data, size-sent);
+  io_buffer_segment_release(& txbuf->space, sent);
+  return sent;
+}
+
 
 /* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  uint pending = bios_serial_interrupt_pending(SERIAL_TX_READY);
+  while(pending) {
+    int i = __builtin_ctz(pending);
+    pending &= pending-1;
+    serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(& dcb->spinlock);
+    int sent = serial_tx_push(dcb) > 0;
+    if(sent)
+      Cond_Broadcast(&dcb->tx_ready);
+    Mutex_Unlock(& dcb->spinlock);
+    serial_irq_account(dcb);
+    if(sent) stream_notify(dcb);
+  }
+  if(pre) preempt_on;
 }
 
 /* 
-  Write call 
-  This is currently a polling driver.
+  Write call; with nonblock set, return -1 instead of sleeping
 */
-int serial_write(void* dev, const char* buf, unsigned int size)
+static int serial_transfer_out(serial_dcb_t* dcb, const char* buf, unsigned int size, int nonblock)
 {
-  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  preempt_off;            /* Stop preemption */
+  Mutex_Lock(& dcb->spinlock);
 
-  unsigned int count = 0;
-  while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
-
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield();
-    }
-    else
+  int count = 0;
+  while(size>0) {
+    count = io_buffer_write(& dcb->tx_buffer, (char*) buf, size);
+    uint sent = serial_tx_push(dcb);
+
+    if(count>0)
       break;
+
+    /* The buffer is full and the device is busy */
+    if(sent==0) {
+      if(nonblock) {
+        count = -1;
+        break;
+      }
+      Cond_Wait(&dcb->spinlock, &dcb->tx_ready);
+    }
   }
 
+  Mutex_Unlock(& dcb->spinlock);
+  preempt_on;           /* Restart preemption */
+
   return count;  
 }
 
+int serial_write(void* dev, const char* buf, unsigned int size)
+{
+  return serial_transfer_out((serial_dcb_t*)dev, buf, size, 0);
+}
+
+int serial_try_write(void* dev, const char* buf, unsigned int size)
+{
+  return serial_transfer_out((serial_dcb_t*)dev, buf, size, 1);
+}
+
 
 int serial_close(void* dev) 
 {
@@ -182,14 +375,728 @@ void* serial_open(uint term)
 
 
 
+/*
+  The device cannot tell if it has data without reading it, so a
+  byte is read ahead, to be returned by the next read. A failed 
+  read makes the device raise SERIAL_RX_READY when data arrives.
+ */
+int serial_poll(void* dev, int events)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  int ready = 0;
+
+  int pre = preempt_off;
+  Mutex_Lock(& dcb->spinlock);
+  if(events & POLL_READ) {
+    if(! dcb->rx_peeked && bios_read_serial(dcb->devno, & dcb->rx_peek))
+      dcb->rx_peeked = 1;
+    if(dcb->rx_peeked) ready |= POLL_READ;
+  }
+  if((events & POLL_WRITE) && dcb->tx_buffer.space.available > 0)
+    ready |= POLL_WRITE;
+  Mutex_Unlock(& dcb->spinlock);
+  if(pre) preempt_on;
+
+  return ready;
+}
+
+
 file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Poll = serial_poll,
+  .TryRead = serial_try_read,
+  .TryWrite = serial_try_write
+};
+
+
+static void serial_init()
+{
+  register_device(DEV_SERIAL, "serial", &serial_fops, bios_serial_ports());
+
+  for(int i=0; i<bios_serial_ports(); i++) {
+    serial_dcb[i].devno = i;
+    serial_dcb[i].rx_ready = COND_INIT;
+    serial_dcb[i].tx_ready = COND_INIT;
+    io_buffer_init(& serial_dcb[i].tx_buffer);
+    serial_dcb[i].rx_peeked = 0;
+    serial_dcb[i].rx_signals = 0;
+    serial_dcb[i].rx_wakeups = 0;
+
+    /* Spread the interrupts over the cores */
+    serial_dcb[i].reader_core = i % cpu_cores();
+    serial_dcb[i].irq_load = 0;
+    serial_route_irq(& serial_dcb[i], i % cpu_cores());
+    serial_dcb[i].spinlock = MUTEX_INIT;
+  }
+}
+
+
+void serial_get_stats(uint minor, serial_stats* stats)
+{
+  assert(minor < bios_serial_ports());
+  serial_dcb_t* dcb = & serial_dcb[minor];
+
+  int pre = preempt_off;
+  Mutex_Lock(& dcb->spinlock);
+  stats->rx_signals = dcb->rx_signals;
+  stats->rx_wakeups = dcb->rx_wakeups;
+  Mutex_Unlock(& dcb->spinlock);
+  if(pre) preempt_on;
+}
+
+
+static void serial_core_init()
+{
+  cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
+  cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+}
+
+
+/* Push out the serial output, polling the devices */
+static void serial_finalize()
+{
+  for(int i=0; i<bios_serial_ports(); i++) {
+    serial_dcb_t* dcb = &serial_dcb[i];
+    io_buffer_segment* data = & dcb->tx_buffer.data;
+    while(__atomic_load_n(& data->available, __ATOMIC_ACQUIRE) > 0) {
+      int pre = preempt_off;
+      Mutex_Lock(& dcb->spinlock);
+      serial_tx_push(dcb);
+      Mutex_Unlock(& dcb->spinlock);
+      if(pre) preempt_on;
+    }
+  }
+}
+
+
+
+/*============================================
+
+  The block device driver
+
+  Block I/O goes through the request queue of each device (see
+  kernel_blkq.h). The BLOCK_DONE handler completes the requests 
+  of the queue.
+
+  Block device streams give sequential, byte-level access to a 
+  device, through the buffer cache (see kernel_bcache.h).
+
+ ============================================*/
+
+typedef struct block_device_control_block {
+  uint devno;
+  block_queue queue;
+} block_dcb_t;
+
+block_dcb_t block_dcb[MAX_BLOCK_DEVICES];
+
+
+void block_done_handler()
+{
+  int pre = preempt_off;
+
+  uint pending = bios_block_interrupt_pending();
+  while(pending) {
+    int d = __builtin_ctz(pending);
+    pending &= pending-1;
+    blkq_complete(& block_dcb[d].queue);
+  }
+  if(pre) preempt_on;
+}
+
+
+int block_device_io(uint minor, block_op op, uint64_t sector, uint count, void* buf)
+{
+  assert(minor < bios_block_devices());
+  return blkq_io(& block_dcb[minor].queue, op, sector, count, buf);
+}
+
+
+int block_set_elevator(uint minor, const char* name)
+{
+  assert(minor < bios_block_devices());
+  return blkq_set_elevator(& block_dcb[minor].queue, name);
+}
+
+
+void block_get_queue_stats(uint minor, block_queue_stats* stats)
+{
+  assert(minor < bios_block_devices());
+  blkq_get_stats(& block_dcb[minor].queue, stats);
+}
+
+
+typedef struct block_stream {
+  block_dcb_t* dcb;
+  uint64_t pos;           /* byte offset of the next transfer */
+} block_stream;
+
+
+/*
+  Transfer data at the current position of a block stream, through
+  the buffer cache. A write that covers a whole page does not read
+  the page in.
+  Returns the number of bytes transferred, 0 at the end of the device,
+  or -1 on error.
+ */
+static int block_stream_transfer(block_stream* bs, block_op op, char* buf, unsigned int size)
+{
+  uint devno = bs->dcb->devno;
+  uint64_t devsize = bios_block_sectors(devno) * BLOCK_SECTOR_SIZE;
+
+  if(bs->pos >= devsize) return 0;
+  if(size > devsize - bs->pos) size = devsize - bs->pos;
+
+  uint count = 0;
+  while(count < size) {
+    uint64_t page = bs->pos / BCACHE_PAGE_SIZE;
+    uint offset = bs->pos % BCACHE_PAGE_SIZE;
+    uint chunk = size - count;
+    if(chunk > BCACHE_PAGE_SIZE - offset) chunk = BCACHE_PAGE_SIZE - offset;
+
+    int whole = (op == BLOCK_WRITE && offset == 0 
+      && (chunk == BCACHE_PAGE_SIZE || bs->pos + chunk == devsize));
+    buffer* pbuf = bcache_get(devno, page, whole ? BCACHE_NOFILL : BCACHE_FILL);
+    if(pbuf == NULL) return (count > 0) ? count : -1;
+
+    if(op == BLOCK_READ)
+      memcpy(buf + count, pbuf->data + offset, chunk);
+    else {
+      memcpy(pbuf->data + offset, buf + count, chunk);
+      bcache_mark_dirty(pbuf);
+    }
+    bcache_put(pbuf);
+
+    bs->pos += chunk;
+    count += chunk;
+  }
+
+  return count;
+}
+
+
+int block_read(void* dev, char *buf, unsigned int size)
+{
+  return block_stream_transfer((block_stream*) dev, BLOCK_READ, buf, size);
+}
+
+
+int block_write(void* dev, const char* buf, unsigned int size)
+{
+  block_stream* bs = (block_stream*) dev;
+
+  /* There is no room past the end of the device */
+  if(size > 0 && bs->pos >= bios_block_sectors(bs->dcb->devno) * BLOCK_SECTOR_SIZE)
+    return -1;
+  return block_stream_transfer(bs, BLOCK_WRITE, (char*) buf, size);
+}
+
+
+Off_t block_seek(void* dev, Off_t offset, seek_whence whence)
+{
+  block_stream* bs = (block_stream*) dev;
+  Off_t devsize = bios_block_sectors(bs->dcb->devno) * BLOCK_SECTOR_SIZE;
+
+  switch(whence) {
+    case SEEK_FROM_START: break;
+    case SEEK_FROM_CURRENT: offset += bs->pos; break;
+    case SEEK_FROM_END: offset += devsize; break;
+    default: return -1;
+  }
+  if(offset < 0 || offset > devsize) return -1;
+  bs->pos = offset;
+  return offset;
+}
+
+
+int block_close(void* dev)
+{
+  free(dev);
+  return 0;
+}
+
+
+void* block_open(uint minor)
+{
+  assert(minor < bios_block_devices());
+  block_stream* bs = xmalloc(sizeof(block_stream));
+  bs->dcb = & block_dcb[minor];
+  bs->pos = 0;
+  return bs;
+}
+
+
+file_ops block_fops = {
+  .Open = block_open,
+  .Read = block_read,
+  .Write = block_write,
+  .Close = block_close,
+  .Seek = block_seek
+};
+
+
+static void block_init()
+{
+  register_device(DEV_BLOCK, "block", &block_fops, bios_block_devices());
+
+  for(int i=0; i<bios_block_devices(); i++) {
+    block_dcb[i].devno = i;
+    blkq_init(& block_dcb[i].queue, i);
+    bios_block_interrupt_core(i, i % cpu_cores());
+  }
+}
+
+
+static void block_core_init()
+{
+  cpu_interrupt_handler(BLOCK_DONE, block_done_handler);
+}
+
+
+
+/*============================================
+
+  The network device driver
+
+  A network device stream reads and writes whole packets. A write
+  puts the packet into the TX queue of its flow, so that the packets
+  of a flow stay in order; a read takes a packet from any RX queue, 
+  starting with the queue of the current core. Readers and writers sleep only when the queues are empty 
+  (resp. full), and are woken up by the NET_RX_READY and NET_TX_READY 
+  handlers.
+
+ ============================================*/
+
+typedef struct net_device_control_block {
+  uint devno;
+  uint nqueues;
+  Mutex spinlock;
+  CondVar rx_ready;
+  CondVar tx_ready;
+} net_dcb_t;
+
+net_dcb_t net_dcb[MAX_NET_DEVICES];
+
+
+/* Wake up the sleepers of the devices whose queues raised intno */
+static void net_wakeup(Interrupt intno)
+{
+  int pre = preempt_off;
+
+  uint pending = bios_nic_interrupt_pending(intno);
+  const uint queues = (1u << NET_MAX_QUEUES) - 1;
+  for(uint n=0; n<bios_nic_devices(); n++) {
+    if(((pending >> (n*NET_MAX_QUEUES)) & queues) == 0) continue;
+    net_dcb_t* dcb = & net_dcb[n];
+    Mutex_Lock(& dcb->spinlock);
+    Cond_Broadcast(intno == NET_RX_READY ? & dcb->rx_ready : & dcb->tx_ready);
+    Mutex_Unlock(& dcb->spinlock);
+    stream_notify(dcb);
+  }
+  if(pre) preempt_on;
+}
+
+void net_rx_handler()
+{
+  net_wakeup(NET_RX_READY);
+}
+
+void net_tx_handler()
+{
+  net_wakeup(NET_TX_READY);
+}
+
+
+/* Take a packet from some RX queue, or return 0 */
+static uint net_poll(net_dcb_t* dcb, char* buf, unsigned int size)
+{
+  uint first = cpu_core_id;
+  for(uint i=0; i<dcb->nqueues; i++) {
+    uint len = bios_nic_receive(dcb->devno, (first+i) % dcb->nqueues, buf, size);
+    if(len > 0) return len;
+  }
+  return 0;
+}
+
+
+int net_read(void* dev, char *buf, unsigned int size)
+{
+  net_dcb_t* dcb = (net_dcb_t*) dev;
+  if(size == 0) return 0;
+
+  /* Try without the device lock first */
+  uint len = net_poll(dcb, buf, size);
+  if(len > 0) return len;
+
+  preempt_off;
+  Mutex_Lock(& dcb->spinlock);
+  while((len = net_poll(dcb, buf, size)) == 0)
+    Cond_Wait(& dcb->spinlock, & dcb->rx_ready);
+  Mutex_Unlock(& dcb->spinlock);
+  preempt_on;
+
+  return len;
+}
+
+
+int net_try_read(void* dev, char *buf, unsigned int size)
+{
+  net_dcb_t* dcb = (net_dcb_t*) dev;
+  if(size == 0) return 0;
+
+  uint len = net_poll(dcb, buf, size);
+  return (len > 0) ? (int) len : -1;
+}
+
+
+int net_write(void* dev, const char* buf, unsigned int size)
+{
+  net_dcb_t* dcb = (net_dcb_t*) dev;
+  if(size == 0 || size > NET_MTU) return -1;
+
+  uint queue = bios_nic_flow_queue(dcb->devno, buf, size);
+  if(bios_nic_send(dcb->devno, queue, buf, size)) return size;
+
+  /* The TX queue is full */
+  preempt_off;
+  Mutex_Lock(& dcb->spinlock);
+  while(! bios_nic_send(dcb->devno, queue, buf, size))
+    Cond_Wait(& dcb->spinlock, & dcb->tx_ready);
+  Mutex_Unlock(& dcb->spinlock);
+  preempt_on;
+
+  return size;
+}
+
+
+int net_try_write(void* dev, const char* buf, unsigned int size)
+{
+  net_dcb_t* dcb = (net_dcb_t*) dev;
+  if(size == 0 || size > NET_MTU) return -1;
+
+  uint queue = bios_nic_flow_queue(dcb->devno, buf, size);
+  return bios_nic_send(dcb->devno, queue, buf, size) ? (int) size : -1;
+}
+
+
+int net_close(void* dev)
+{
+  return 0;
+}
+
+
+void* net_open(uint minor)
+{
+  assert(minor < bios_nic_devices());
+  return & net_dcb[minor];
+}
+
+
+void net_set_coalesce(uint minor, uint frames, TimerDuration usec)
+{
+  assert(minor < bios_nic_devices());
+  bios_nic_coalesce(minor, frames, usec);
+}
+
+
+/* 
+  Reads may take a packet from any queue. A write may go to any queue,
+  depending on its flow, so the stream is writable when all the TX 
+  queues have room.
+ */
+int net_poll_events(void* dev, int events)
+{
+  net_dcb_t* dcb = (net_dcb_t*) dev;
+  int ready = 0;
+
+  if(events & POLL_READ)
+    for(uint q=0; q<dcb->nqueues; q++)
+      if(bios_nic_rx_ready(dcb->devno, q)) { ready |= POLL_READ; break; }
+  if(events & POLL_WRITE) {
+    ready |= POLL_WRITE;
+    for(uint q=0; q<dcb->nqueues; q++)
+      if(! bios_nic_tx_ready(dcb->devno, q)) { ready &= ~POLL_WRITE; break; }
+  }
+  return ready;
+}
+
+
+file_ops net_fops = {
+  .Open = net_open,
+  .Read = net_read,
+  .Write = net_write,
+  .Close = net_close,
+  .Poll = net_poll_events,
+  .TryRead = net_try_read,
+  .TryWrite = net_try_write
+};
+
+
+/* The interrupts of queue q go to core q */
+static void net_init()
+{
+  register_device(DEV_NET, "net", &net_fops, bios_nic_devices());
+
+  for(int i=0; i<bios_nic_devices(); i++) {
+    net_dcb[i].devno = i;
+    net_dcb[i].nqueues = bios_nic_queues(i);
+    net_dcb[i].spinlock = MUTEX_INIT;
+    net_dcb[i].rx_ready = COND_INIT;
+    net_dcb[i].tx_ready = COND_INIT;
+    for(uint q=0; q<net_dcb[i].nqueues; q++)
+      bios_nic_interrupt_core(i, q, q % cpu_cores());
+  }
+}
+
+
+static void net_core_init()
+{
+  cpu_interrupt_handler(NET_RX_READY, net_rx_handler);
+  cpu_interrupt_handler(NET_TX_READY, net_tx_handler);
+}
+
+
+
+/*============================================
+
+  The RAM disk driver
+
+  A RAM disk is an anonymous host mapping, whose pages are allocated 
+  (zero-filled) when first touched. If RAMDISK_HUGEPAGES is set at
+  build time and the host supports it, the mapping is backed by huge
+  pages; this is off by default, since huge pages make a sparsely used
+  RAM disk take much more host memory. The data is copied without any 
+  locking, as with any other memory shared between threads. Copies use
+  memmove, since a splice between two streams of the same RAM disk
+  copies between overlapping ranges.
+
+ ============================================*/
+
+#ifndef RAMDISK_HUGEPAGES
+#define RAMDISK_HUGEPAGES 0
+#endif
+
+static char* ramdisk[MAX_RAMDISKS];
+
+typedef struct ramdisk_stream {
+  char* data;
+  Off_t pos;
+} ramdisk_stream;
+
+
+int ramdisk_read(void* dev, char *buf, unsigned int size)
+{
+  ramdisk_stream* rs = (ramdisk_stream*) dev;
+  if(size > RAMDISK_SIZE - rs->pos) size = RAMDISK_SIZE - rs->pos;
+  memmove(buf, rs->data + rs->pos, size);
+  rs->pos += size;
+  return size;
+}
+
+
+int ramdisk_write(void* dev, const char* buf, unsigned int size)
+{
+  ramdisk_stream* rs = (ramdisk_stream*) dev;
+
+  /* There is no room past the end of the disk */
+  if(size > 0 && rs->pos >= RAMDISK_SIZE)
+    return -1;
+  if(size > RAMDISK_SIZE - rs->pos) size = RAMDISK_SIZE - rs->pos;
+  memmove(rs->data + rs->pos, buf, size);
+  rs->pos += size;
+  return size;
+}
+
+
+Off_t ramdisk_seek(void* dev, Off_t offset, seek_whence whence)
+{
+  ramdisk_stream* rs = (ramdisk_stream*) dev;
+
+  switch(whence) {
+    case SEEK_FROM_START: break;
+    case SEEK_FROM_CURRENT: offset += rs->pos; break;
+    case SEEK_FROM_END: offset += RAMDISK_SIZE; break;
+    default: return -1;
+  }
+  if(offset < 0 || offset > RAMDISK_SIZE) return -1;
+  rs->pos = offset;
+  return offset;
+}
+
+
+/* Copy between the disk and the buffers of iov, at most up to the end of the disk */
+static int ramdisk_copyv(ramdisk_stream* rs, const io_vector* iov, unsigned int iovcnt, int write)
+{
+  int total = 0;
+  for(unsigned int i=0; i<iovcnt && rs->pos < RAMDISK_SIZE; i++) {
+    unsigned int size = iov[i].len;
+    if(size > RAMDISK_SIZE - rs->pos) size = RAMDISK_SIZE - rs->pos;
+    if(write)
+      memmove(rs->data + rs->pos, iov[i].base, size);
+    else
+      memmove(iov[i].base, rs->data + rs->pos, size);
+    rs->pos += size;
+    total += size;
+  }
+  return total;
+}
+
+
+int ramdisk_readv(void* dev, const io_vector* iov, unsigned int iovcnt)
+{
+  return ramdisk_copyv((ramdisk_stream*) dev, iov, iovcnt, 0);
+}
+
+
+int ramdisk_writev(void* dev, const io_vector* iov, unsigned int iovcnt)
+{
+  ramdisk_stream* rs = (ramdisk_stream*) dev;
+
+  /* There is no room past the end of the disk */
+  int total = ramdisk_copyv(rs, iov, iovcnt, 1);
+  if(total == 0 && rs->pos >= RAMDISK_SIZE) {
+    for(unsigned int i=0; i<iovcnt; i++)
+      if(iov[i].len > 0) return -1;
+  }
+  return total;
+}
+
+
+/* Write the disk out directly */
+int ramdisk_splice(void* dev, void* out, file_ops* outops, unsigned int len)
+{
+  ramdisk_stream* rs = (ramdisk_stream*) dev;
+  if(len > RAMDISK_SIZE - rs->pos) len = RAMDISK_SIZE - rs->pos;
+  if(len == 0) return 0;
+
+  unsigned int count = stream_write_all(out, outops, rs->data + rs->pos, len);
+  rs->pos += count;
+  return (count > 0) ? (int) count : -1;
+}
+
+
+int ramdisk_close(void* dev)
+{
+  free(dev);
+  return 0;
+}
+
+
+void* ramdisk_open(uint minor)
+{
+  assert(minor < MAX_RAMDISKS);
+  ramdisk_stream* rs = xmalloc(sizeof(ramdisk_stream));
+  rs->data = ramdisk[minor];
+  rs->pos = 0;
+  return rs;
+}
+
+
+file_ops ramdisk_fops = {
+  .Open = ramdisk_open,
+  .Read = ramdisk_read,
+  .Write = ramdisk_write,
+  .Close = ramdisk_close,
+  .Seek = ramdisk_seek,
+  .ReadV = ramdisk_readv,
+  .WriteV = ramdisk_writev,
+  .Splice = ramdisk_splice
 };
 
 
+static void ramdisk_init()
+{
+  for(int i=0; i<MAX_RAMDISKS; i++) {
+    void* ptr = mmap(NULL, RAMDISK_SIZE, PROT_READ|PROT_WRITE, 
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    CHECK_CONDITION(ptr != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+    if(RAMDISK_HUGEPAGES)
+      madvise(ptr, RAMDISK_SIZE, MADV_HUGEPAGE);   /* a hint; it may fail */
+#endif
+    ramdisk[i] = ptr;
+  }
+  register_device(DEV_RAMDISK, "ramdisk", &ramdisk_fops, MAX_RAMDISKS);
+}
+
+
+static void ramdisk_finalize()
+{
+  for(int i=0; i<MAX_RAMDISKS; i++) {
+    CHECK(munmap(ramdisk[i], RAMDISK_SIZE));
+    ramdisk[i] = NULL;
+  }
+}
+
+
+
+/*============================================
+
+  The BIOS statistics stream
+
+  A read-only stream returning a single bios_stats
+  block, taken when the stream is opened.
+
+ ============================================*/
+
+typedef struct bios_info_stream {
+  uint pos;               /* bytes of stats already read */
+  bios_stats stats;
+} bios_info_stream;
+
+
+static int biosinfo_read(void* dev, char *buf, unsigned int size)
+{
+  bios_info_stream* info = (bios_info_stream*) dev;
+
+  uint remain = sizeof(bios_stats) - info->pos;
+  if(size > remain) size = remain;
+
+  memcpy(buf, ((char*) & info->stats) + info->pos, size);
+  info->pos += size;
+  return size;
+}
+
+
+static int biosinfo_close(void* dev)
+{
+  free(dev);
+  return 0;
+}
+
+
+static file_ops biosinfo_fops = {
+  .Read = biosinfo_read,
+  .Close = biosinfo_close
+};
+
+
+Fid_t OpenBiosInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  Mutex_Lock(&kernel_mutex);
+
+  if(FCB_reserve(1, &fid, &fcb)) {
+    bios_info_stream* info = xmalloc(sizeof(bios_info_stream));
+    info->pos = 0;
+    bios_get_stats(& info->stats);
+
+    fcb->streamobj = info;
+    fcb->streamfunc = & biosinfo_fops;
+  }
+  else
+    fid = NOFILE;
+
+  Mutex_Unlock(&kernel_mutex);
+  return fid;
+}
+
+
 
 /***********************************
 
@@ -197,46 +1104,152 @@ file_ops serial_fops = {
 
 ***********************************/
 
-DCB devtable[DEV_MAX];
+/* The drivers of the kernel, in initialization order */
+static const device_driver device_drivers[] = {
+  { "null", nulldev_init, NULL, NULL },
+  { "serial", serial_init, serial_core_init, serial_finalize },
+  { "block", block_init, block_core_init, NULL },
+  { "net", net_init, net_core_init, NULL },
+  { "ramdisk", ramdisk_init, NULL, ramdisk_finalize }
+};
+
+#define NDRIVERS (sizeof(device_drivers)/sizeof(device_driver))
 
+DCB devtable[MAX_DEVICE_TYPES];
 
+/* Protects devtable, which may change after initialization */
+static Mutex devtable_lock = MUTEX_INIT;
 
-void initialize_devices()
+
+/* Return the major number of a driver name, or -1. Call with devtable_lock held. */
+static int devtable_find(const char* name)
 {
+  for(int major=0; major<MAX_DEVICE_TYPES; major++)
+    if(devtable[major].name != NULL && strcmp(devtable[major].name, name)==0)
+      return major;
+  return -1;
+}
 
-  devtable[DEV_NULL].type = DEV_NULL;
-  devtable[DEV_NULL].devnum = 1;
-  devtable[DEV_NULL].dev_fops = nulldev_fops;
 
-  devtable[DEV_SERIAL].type = DEV_SERIAL;
-  devtable[DEV_SERIAL].devnum = bios_serial_ports();
-  devtable[DEV_SERIAL].dev_fops = serial_fops;
+int register_device(Device_type major, const char* name, file_ops* fops, uint nminors)
+{
+  if(name == NULL || fops == NULL || fops->Open == NULL)
+    return -1;
 
-  /* Initialize the serial devices */
-  for(int i=0; i<bios_serial_ports(); i++) {
-    serial_dcb[i].devno = i;
-    serial_dcb[i].rx_ready = COND_INIT;
-    serial_dcb[i].spinlock = MUTEX_INIT;
+  int pre = preempt_off;
+  Mutex_Lock(& devtable_lock);
+
+  if(major == DEV_DYNAMIC) {
+    for(major = DEV_MAX; major < MAX_DEVICE_TYPES; major++)
+      if(devtable[major].name == NULL) break;
   }
 
-  cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
-  cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+  int rc = -1;
+  if((uint) major < MAX_DEVICE_TYPES && devtable[major].name == NULL 
+      && devtable_find(name) == -1) {
+    devtable[major] = (DCB) {
+      .type = major, .name = name, .devnum = nminors, .dev_fops = fops
+    };
+    rc = major;
+  }
+
+  Mutex_Unlock(& devtable_lock);
+  if(pre) preempt_on;
+  return rc;
+}
+
+
+int unregister_device(Device_type major)
+{
+  int pre = preempt_off;
+  Mutex_Lock(& devtable_lock);
+
+  int rc = -1;
+  if((uint) major < MAX_DEVICE_TYPES && devtable[major].name != NULL) {
+    devtable[major] = (DCB) { .type = major };
+    rc = 0;
+  }
+
+  Mutex_Unlock(& devtable_lock);
+  if(pre) preempt_on;
+  return rc;
+}
+
+
+int device_lookup(const char* name)
+{
+  int pre = preempt_off;
+  Mutex_Lock(& devtable_lock);
+  int major = devtable_find(name);
+  Mutex_Unlock(& devtable_lock);
+  if(pre) preempt_on;
+  return major;
+}
+
+
+int device_major(file_ops* ops)
+{
+  int major = -1;
+  int pre = preempt_off;
+  Mutex_Lock(& devtable_lock);
+  for(int i=0; i<MAX_DEVICE_TYPES; i++)
+    if(devtable[i].name != NULL && devtable[i].dev_fops == ops) { major = i; break; }
+  Mutex_Unlock(& devtable_lock);
+  if(pre) preempt_on;
+  return major;
+}
+
+
+void initialize_devices()
+{
+  /* The table may hold the devices of a previous boot */
+  memset(devtable, 0, sizeof(devtable));
+
+  for(uint i=0; i<NDRIVERS; i++)
+    if(device_drivers[i].Init) device_drivers[i].Init();
+}
+
+
+void initialize_core_devices()
+{
+  for(uint i=0; i<NDRIVERS; i++)
+    if(device_drivers[i].CoreInit) device_drivers[i].CoreInit();
+}
+
+
+void finalize_devices()
+{
+  for(uint i=0; i<NDRIVERS; i++)
+    if(device_drivers[i].Finalize) device_drivers[i].Finalize();
 }
 
 
 int device_open(Device_type major, uint minor, void** obj, file_ops** ops)
 {
-  assert(major < DEV_MAX);  
-  if(minor >= devtable[major].devnum)
-    return -1;
-  *obj = devtable[major].dev_fops.Open(minor);
-  *ops = &devtable[major].dev_fops;
-  return 0;
+  int pre = preempt_off;
+  Mutex_Lock(& devtable_lock);
+
+  int rc = -1;
+  if((uint) major < MAX_DEVICE_TYPES && devtable[major].name != NULL 
+      && minor < devtable[major].devnum) {
+    *ops = devtable[major].dev_fops;
+    rc = 0;
+  }
+
+  Mutex_Unlock(& devtable_lock);
+  if(pre) preempt_on;
+
+  /* The driver may block, so it is called without the lock */
+  if(rc == 0)
+    *obj = (*ops)->Open(minor);
+  return rc;
 }
 
+
 uint device_no(Device_type major)
 {
-  return devtable[major].devnum;
+  if((uint) major >= MAX_DEVICE_TYPES) return 0;
+  return __atomic_load_n(& devtable[major].devnum, __ATOMIC_RELAXED);
 }
 
 
@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "kernel_blkq.h"
 
 /**
   @file kernel_dev.h
@@ -30,6 +31,14 @@
   a pointer to a file_ops object, which contains driver routines
   for this device.
 
+  Drivers add their devices to the device table with 
+  @c register_device. The drivers of the kernel are listed in a 
+  table of @c device_driver records, whose hooks are called at kernel 
+  startup and shutdown. The major numbers from @c DEV_MAX up to
+  @c MAX_DEVICE_TYPES-1 are free, for drivers which register their 
+  devices with @c DEV_DYNAMIC. A major number can be looked up by 
+  the name of its driver, with @c device_lookup.
+
   @{ 
 */
 
@@ -93,6 +102,69 @@ typedef struct file_operations {
      */
     int (*Close)(void* this);
 
+    /** @brief Seek operation.
+
+      Set the position of stream 'this', as in @c Seek. This function
+      returns the new position, or -1 on error. Streams that cannot be
+      positioned leave it NULL.
+     */
+    Off_t (*Seek)(void* this, Off_t offset, seek_whence whence);
+
+    /** @brief Vectored read operation.
+
+      Read into the @c iovcnt buffers of @c iov, as in @c ReadV. This
+      function returns the total number of bytes read, or -1 on error.
+      Streams which leave it NULL are read by calling @c Read for 
+      each buffer.
+     */
+    int (*ReadV)(void* this, const io_vector* iov, unsigned int iovcnt);
+
+    /** @brief Vectored write operation.
+
+      Write the @c iovcnt buffers of @c iov, as in @c WriteV. This
+      function returns the total number of bytes written, or -1 on error.
+      Streams which leave it NULL are written by calling @c Write for 
+      each buffer.
+     */
+    int (*WriteV)(void* this, const io_vector* iov, unsigned int iovcnt);
+
+    /** @brief Splice operation.
+
+      Move up to @c len bytes from stream 'this' to stream @c out, by 
+      passing the data to the @c Write method of @c outops directly from
+      the storage of 'this'. This function returns the number of bytes
+      moved, or -1 on error. Streams which leave it NULL are spliced
+      through a kernel buffer.
+      @see Splice
+     */
+    int (*Splice)(void* this, void* out, struct file_operations* outops, unsigned int len);
+
+    /** @brief Readiness operation.
+
+      Return the events of @c events (a combination of @c POLL_READ and 
+      @c POLL_WRITE) for which the stream would not block, plus 
+      @c POLL_CLOSED if its other end is closed. A stream which returns 
+      not ready must call @c stream_notify when it becomes ready.
+      Streams which leave it NULL never block.
+      @see Poll
+     */
+    int (*Poll)(void* this, int events);
+
+    /** @brief Non-blocking read operation.
+
+      As @c Read, but return -1 instead of sleeping when no data is
+      available. Streams whose @c Read never blocks leave it NULL.
+      @see SetNonBlocking
+     */
+    int (*TryRead)(void* this, char *buf, unsigned int size);
+
+    /** @brief Non-blocking write operation.
+
+      As @c Write, but return -1 instead of sleeping when no data can
+      be written. Streams whose @c Write never blocks leave it NULL.
+      @see SetNonBlocking
+     */
+    int (*TryWrite)(void* this, const char* buf, unsigned int size);
 
 
     
@@ -108,10 +180,18 @@ typedef struct file_operations {
 typedef enum { 
 	DEV_NULL,    /**< Null device */
 	DEV_SERIAL,  /**< Serial device */
-	DEV_MAX      /**< placeholder for maximum device number */
+	DEV_BLOCK,   /**< Block device */
+	DEV_NET,     /**< Network device */
+	DEV_RAMDISK, /**< RAM disk */
+	DEV_MAX,     /**< placeholder for maximum device number */
+	DEV_DYNAMIC = -1  /**< Register with any free major number */
 }  Device_type;
 
 
+/** @brief The size of the device table, i.e., the limit of major numbers */
+#define MAX_DEVICE_TYPES 16
+
+
 /**
   @brief Device control block.
 
@@ -122,14 +202,77 @@ typedef struct device_control_block
 {
   Device_type type;     /**< @brief Device type. 
                             Much like 'major number' in Unix, determines the driver. */
+  const char* name;     /**< @brief The name of the driver, or NULL if unused */
   uint devnum;           /**< @brief Number of devices for this major number.
                           */
 
-  file_ops dev_fops;	/**< @brief Device operations
+  file_ops* dev_fops;	/**< @brief Device operations
   							This structure is provided by the device driver. */
 } DCB;
 
 
+/**
+  @brief A device driver of the kernel.
+
+  The hooks of each driver are called at kernel startup and shutdown;
+  any of them may be NULL. 
+*/
+typedef struct device_driver
+{
+  const char* name;       /**< @brief The name of the driver */
+
+  /** @brief Initialize the driver and register its devices.
+      This is called once, on core 0. */
+  void (*Init)();
+
+  /** @brief Install the interrupt handlers of the driver.
+      This is called on every core. */
+  void (*CoreInit)();
+
+  /** @brief Flush the driver at kernel shutdown. */
+  void (*Finalize)();
+} device_driver;
+
+
+/**
+  @brief Register the devices of a driver.
+
+  Add @c nminors devices of major number @c major, to be accessed
+  through @c fops, to the device table. If @c major is @c DEV_DYNAMIC,
+  the first free major number, from @c DEV_MAX on, is used. The 
+  strings @c name and the @c fops record must outlive the registration.
+
+  It returns the major number, or -1 if the major number or the name 
+  is already registered, the major number is out of range, or 
+  @c fops has no @c Open method.
+  */
+int register_device(Device_type major, const char* name, file_ops* fops, uint nminors);
+
+/**
+  @brief Remove a major number from the device table.
+
+  Streams already open on the devices are not affected.
+  It returns 0 on success and -1 if @c major is not registered.
+  */
+int unregister_device(Device_type major);
+
+/**
+  @brief Look up a major number by driver name.
+
+  It returns the major number, or -1 if no driver of that name is 
+  registered.
+  */
+int device_lookup(const char* name);
+
+/**
+  @brief Find the major number of a stream.
+
+  It returns the major number whose devices are accessed through 
+  @c ops, or -1 if @c ops does not belong to a device.
+  */
+int device_major(file_ops* ops);
+
+
 /** 
   @brief Initialization for devices.
 
@@ -138,6 +281,24 @@ typedef struct device_control_block
 void initialize_devices();
 
 
+/** 
+  @brief Per-core initialization for devices.
+
+  This function is called at kernel startup, on every core, 
+  to install the device interrupt handlers.
+ */
+void initialize_core_devices();
+
+
+/** 
+  @brief Finalization for devices.
+
+  This function is called at kernel shutdown. It sends out
+  any buffered device output.
+ */
+void finalize_devices();
+
+
 /**
   @brief Open a device.
 
@@ -149,11 +310,59 @@ void initialize_devices();
   */
 int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
 
+/**
+  @brief Synchronous I/O on a block device.
+
+  Read or write @c count sectors of block device @c minor, starting 
+  at @c sector, from/to @c buf, which must hold 
+  @c count*BLOCK_SECTOR_SIZE bytes. The calling thread sleeps until
+  the transfer is complete.
+
+  The request goes through the request queue of the device.
+  It returns 0 on success and -1 on failure.
+  */
+int block_device_io(uint minor, block_op op, uint64_t sector, uint count, void* buf);
+
+/**
+  @brief Select the elevator of a block device.
+
+  It returns 0 on success and -1 if there is no elevator by that name.
+  @see kernel_blkq.h
+  */
+int block_set_elevator(uint minor, const char* name);
+
+/**
+  @brief Get the request queue statistics of a block device.
+  */
+void block_get_queue_stats(uint minor, block_queue_stats* stats);
+
+/**
+  @brief Reader wakeup counters of a serial device.
+  */
+typedef struct serial_stats {
+  unsigned long rx_signals;   /**< @brief RX interrupts that woke up the readers of the device */
+  unsigned long rx_wakeups;   /**< @brief Readers woken up, including those that found no data */
+} serial_stats;
+
+/**
+  @brief Get the reader wakeup counters of a serial device.
+  */
+void serial_get_stats(uint minor, serial_stats* stats);
+
+/**
+  @brief Set the interrupt coalescing of a network device.
+
+  A receive interrupt is raised when @c frames packets have arrived,
+  or when the first of them has waited for @c usec microseconds.
+  @see bios_nic_coalesce
+  */
+void net_set_coalesce(uint minor, uint frames, TimerDuration usec);
+
 /**
   @brief Get the number of devices of a particular major number.
 
   The number of devices M determines the legal range of minor numbers,
-  namely 0<= minor < M.
+  namely 0<= minor < M. It is 0 for an unregistered major number.
   */
 uint device_no(Device_type major);
 
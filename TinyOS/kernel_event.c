@@ -0,0 +1,500 @@
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_proc.h"
+#include "kernel_streams.h"
+
+/*************************************
+
+  Event objects
+
+  Each stream in the interest list of an event object has a watch.
+  The watches are hashed by the stream object, so that stream_notify
+  finds the watches of a stream without a scan. A notified watch is
+  queued on the ready list of its event object; EventWait checks
+  only the queued watches, by calling the Poll method of their stream.
+
+  A level-triggered watch that is ready is queued again after it is
+  reported, so that it is checked by the next EventWait; a watch that
+  is not ready, or an edge-triggered watch, leaves the ready list until
+  its stream is notified again.
+
+  The hash table and the ready lists are protected by event_lock,
+  which is taken from interrupt handlers, hence always with preemption
+  off. The interest lists are protected by kernel_mutex. 
+
+  event_lock is a spinlock, held only for short sections that never
+  sleep, so it may be taken with kernel_mutex held, in the same way as
+  stream_notify is called by the Close methods of streams. What the
+  stream calls never do with kernel_mutex held is to call the driver
+  methods that serve a request (Read, Write, Poll...), which may sleep
+  in the non-preemptive domain. Hence, EventWait takes the queued 
+  watches and checks them without kernel_mutex; a watch that is removed
+  meanwhile is freed when the check is done.
+
+  Poll uses the same watches, through a private event object, so that
+  a polling thread is woken only by the notifications of its own 
+  streams, and checks only the streams notified since its last check.
+  The watches of Poll are in no interest list, and report no fid.
+
+ *************************************/
+
+#define EVENT_BUCKETS 1024
+
+typedef struct event_object event_object;
+
+typedef struct event_watch {
+  event_object* eo;     /* the event object */
+  FCB* fcb;             /* the stream; the watch holds a reference */
+  Fid_t fid;            /* the fid to report */
+  int events;           /* POLL_READ, POLL_WRITE and EVENT_EDGE */
+  int busy;             /* EventWait calls checking the watch */
+  int removed;          /* Free when no longer busy */
+
+  rlnode hash_node;     /* in the bucket of the stream object */
+  rlnode watch_node;    /* in the interest list */
+  rlnode ready_node;    /* in the ready list, when queued */
+} event_watch;
+
+struct event_object {
+  rlnode watches;       /* the interest list */
+  rlnode ready;         /* the queued watches */
+  CondVar ready_cv;     /* EventWait sleeps here */
+  int waiters;
+};
+
+static Mutex event_lock = MUTEX_INIT;
+static rlnode event_hash[EVENT_BUCKETS];
+static unsigned int event_nwatches = 0;
+
+
+static inline rlnode* event_bucket(void* streamobj)
+{
+  uintptr_t h = (uintptr_t) streamobj;
+  h ^= h >> 12;
+  return & event_hash[(h >> 4) % EVENT_BUCKETS];
+}
+
+static inline int watch_queued(event_watch* w)
+{
+  return w->ready_node.next != & w->ready_node;
+}
+
+/* Call with event_lock held */
+static void watch_queue(event_watch* w)
+{
+  if(watch_queued(w)) return;
+  rlist_push_back(& w->eo->ready, & w->ready_node);
+  if(w->eo->waiters)
+    Cond_Broadcast(& w->eo->ready_cv);
+}
+
+
+void initialize_events()
+{
+  for(int i=0; i<EVENT_BUCKETS; i++)
+    rlnode_new(& event_hash[i]);
+}
+
+
+void event_notify(void* streamobj)
+{
+  if(__atomic_load_n(& event_nwatches, __ATOMIC_SEQ_CST) == 0) return;
+
+  int pre = preempt_off;
+  Mutex_Lock(& event_lock);
+  rlnode* bucket = event_bucket(streamobj);
+  for(rlnode* p = bucket->next; p != bucket; p = p->next) {
+    event_watch* w = p->obj;
+    if(w->fcb->streamobj == streamobj)
+      watch_queue(w);
+  }
+  Mutex_Unlock(& event_lock);
+  if(pre) preempt_on;
+}
+
+
+/* Drop the stream of a removed watch and free it. Call with kernel_mutex held */
+static void watch_free(event_watch* w)
+{
+  FCB_decref(w->fcb);
+  free(w);
+}
+
+/* 
+  Remove a watch; it is freed now, or by the EventWait that checks it.
+  Call with kernel_mutex held.
+ */
+static void watch_destroy(event_watch* w)
+{
+  int pre = preempt_off;
+  Mutex_Lock(& event_lock);
+  rlist_remove(& w->hash_node);
+  rlist_remove(& w->ready_node);
+  __atomic_sub_fetch(& event_nwatches, 1, __ATOMIC_SEQ_CST);
+  int busy = w->busy;
+  w->removed = 1;
+  Mutex_Unlock(& event_lock);
+  if(pre) preempt_on;
+
+  rlist_remove(& w->watch_node);
+  if(! busy) watch_free(w);
+}
+
+
+static int event_close(void* this)
+{
+  event_object* eo = this;
+  while(! is_rlist_empty(& eo->watches))
+    watch_destroy(eo->watches.next->obj);
+  free(eo);
+  return 0;
+}
+
+static file_ops event_fops = {
+  .Open = NULL,
+  .Close = event_close
+};
+
+
+static event_object* get_event_object(Fid_t efd)
+{
+  FCB* fcb = get_fcb(efd);
+  return (fcb && fcb->streamfunc == &event_fops) ? fcb->streamobj : NULL;
+}
+
+/* 
+  Find a watch on fcb, of eo (or any event object if eo is NULL), for 
+  fid (or any fid if fid is NOFILE); return NULL if there is none.
+ */
+static event_watch* watch_find(event_object* eo, FCB* fcb, Fid_t fid)
+{
+  event_watch* found = NULL;
+  int pre = preempt_off;
+  Mutex_Lock(& event_lock);
+  rlnode* bucket = event_bucket(fcb->streamobj);
+  for(rlnode* p = bucket->next; p != bucket; p = p->next) {
+    event_watch* w = p->obj;
+    if(w->fcb == fcb && (eo == NULL || w->eo == eo) && (fid == NOFILE || w->fid == fid)) { 
+      found = w; 
+      break; 
+    }
+  }
+  Mutex_Unlock(& event_lock);
+  if(pre) preempt_on;
+  return found;
+}
+
+
+void event_forget(Fid_t fid, FCB* fcb)
+{
+  if(__atomic_load_n(& event_nwatches, __ATOMIC_SEQ_CST) == 0) return;
+
+  event_watch* w;
+  while((w = watch_find(NULL, fcb, fid)) != NULL)
+    watch_destroy(w);
+}
+
+
+Fid_t EventCreate()
+{
+  Fid_t fid;
+  FCB* fcb;
+  Mutex_Lock(&kernel_mutex);
+
+  if(! FCB_reserve(1, &fid, &fcb)) {
+    fid = NOFILE;
+  }
+  else {
+    event_object* eo = xmalloc(sizeof(event_object));
+    rlnode_new(& eo->watches);
+    rlnode_new(& eo->ready);
+    eo->ready_cv = COND_INIT;
+    eo->waiters = 0;
+    fcb->streamobj = eo;
+    fcb->streamfunc = &event_fops;
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return fid;
+}
+
+
+int EventCtl(Fid_t efd, event_ctl_op op, Fid_t fd, int events)
+{
+  int retcode = -1;
+  Mutex_Lock(&kernel_mutex);
+
+  event_object* eo = get_event_object(efd);
+  FCB* fcb = get_fcb(fd);
+  if(eo == NULL || fcb == NULL || fcb->streamfunc == &event_fops) goto finish;
+
+  events &= POLL_READ | POLL_WRITE | EVENT_EDGE;
+  event_watch* w = watch_find(eo, fcb, NOFILE);
+
+  switch(op) {
+    case EVENT_ADD:
+      if(w) goto finish;
+      w = xmalloc(sizeof(event_watch));
+      w->eo = eo;
+      w->fcb = fcb;
+      w->fid = fd;
+      w->events = events;
+      w->busy = 0;
+      w->removed = 0;
+      FCB_incref(fcb);
+      rlist_push_back(& eo->watches, rlnode_init(& w->watch_node, w));
+      rlnode_init(& w->hash_node, w);
+      rlnode_new(& w->ready_node)->obj = w;
+      break;
+
+    case EVENT_MOD:
+      if(w == NULL) goto finish;
+      w->events = events;
+      break;
+
+    case EVENT_DEL:
+      if(w == NULL) goto finish;
+      watch_destroy(w);
+      retcode = 0;
+      goto finish;
+
+    default:
+      goto finish;
+  }
+
+  /* The stream is checked by the next EventWait */
+  int pre = preempt_off;
+  Mutex_Lock(& event_lock);
+  if(op == EVENT_ADD) {
+    rlist_push_back(event_bucket(fcb->streamobj), & w->hash_node);
+    __atomic_add_fetch(& event_nwatches, 1, __ATOMIC_SEQ_CST);
+  }
+  watch_queue(w);
+  Mutex_Unlock(& event_lock);
+  if(pre) preempt_on;
+  retcode = 0;
+
+finish:
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
+/*
+  Check up to max queued watches of eo, storing the ready ones in evs.
+  Call with kernel_mutex held; it is released while the streams are 
+  checked.
+ */
+static int event_collect(event_object* eo, event_record* evs, unsigned int max)
+{
+  unsigned int nwatches = __atomic_load_n(& event_nwatches, __ATOMIC_SEQ_CST);
+  if(max > nwatches) max = nwatches;
+  if(max == 0) return 0;
+  event_watch** batch = xmalloc(max * sizeof(event_watch*));
+  int* ready = xmalloc(max * sizeof(int));
+
+  /* Take the queued watches; a notification from now on queues them again */
+  unsigned int n = 0;
+  int pre = preempt_off;
+  Mutex_Lock(& event_lock);
+  while(n < max && ! is_rlist_empty(& eo->ready)) {
+    event_watch* w = rlist_pop_front(& eo->ready)->obj;
+    w->busy++;
+    ready[n] = w->events & (POLL_READ | POLL_WRITE);
+    batch[n++] = w;
+  }
+  Mutex_Unlock(& event_lock);
+  if(pre) preempt_on;
+
+  Mutex_Unlock(&kernel_mutex);
+  for(unsigned int i=0; i<n; i++)
+    ready[i] = stream_ready(batch[i]->fcb, ready[i]);
+  Mutex_Lock(&kernel_mutex);
+
+  /* A watch whose fid no longer refers to its stream is stale; mark it with -1 */
+  for(unsigned int i=0; i<n; i++)
+    if(get_fcb(batch[i]->fid) != batch[i]->fcb) ready[i] = -1;
+
+  unsigned int count = 0;
+  pre = preempt_off;
+  Mutex_Lock(& event_lock);
+  for(unsigned int i=0; i<n; i++) {
+    event_watch* w = batch[i];
+    w->busy--;
+    if(w->removed || ready[i] < 0) continue;
+    if(ready[i]) {
+      evs[count].fid = w->fid;
+      evs[count].events = ready[i];
+      count++;
+      if(! (w->events & EVENT_EDGE))
+        watch_queue(w);
+    }
+  }
+  Mutex_Unlock(& event_lock);
+  if(pre) preempt_on;
+
+  /* Free the watches removed while they were checked, and drop the stale ones */
+  for(unsigned int i=0; i<n; i++) {
+    if(batch[i]->removed) {
+      if(batch[i]->busy == 0) watch_free(batch[i]);
+    }
+    else if(ready[i] < 0)
+      watch_destroy(batch[i]);
+  }
+
+  free(ready);
+  free(batch);
+  return count;
+}
+
+
+int EventWait(Fid_t efd, event_record* evs, unsigned int maxevents, long int timeout)
+{
+  TimerDuration deadline = bios_clock_ns() + (TimerDuration) timeout * 1000000ull;
+  int retcode = -1;
+
+  Mutex_Lock(&kernel_mutex);
+
+  FCB* efcb = get_fcb(efd);
+  event_object* eo = get_event_object(efd);
+  if(eo == NULL || (maxevents > 0 && evs == NULL)) {
+    Mutex_Unlock(&kernel_mutex);
+    return -1;
+  }
+  if(maxevents == 0) {
+    Mutex_Unlock(&kernel_mutex);
+    return 0;
+  }
+
+  /* The event object must not be closed while we wait */
+  FCB_incref(efcb);
+
+  while(1) {
+    retcode = event_collect(eo, evs, maxevents);
+    if(retcode > 0 || timeout == 0) break;
+
+    long int remaining = -1;
+    if(timeout > 0) {
+      TimerDuration now = bios_clock_ns();
+      if(now >= deadline) break;
+      remaining = (deadline - now + 999999) / 1000000;
+    }
+
+    int pre = preempt_off;
+    Mutex_Lock(& event_lock);
+    if(is_rlist_empty(& eo->ready)) {
+      Mutex_Unlock(&kernel_mutex);
+      eo->waiters++;
+      Cond_TimedWait(& event_lock, & eo->ready_cv, remaining);
+      eo->waiters--;
+      Mutex_Unlock(& event_lock);
+      if(pre) preempt_on;
+      Mutex_Lock(&kernel_mutex);
+    }
+    else {
+      Mutex_Unlock(& event_lock);
+      if(pre) preempt_on;
+    }
+  }
+
+  FCB_decref(efcb);
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
+int event_poll(FCB** fcbs, int* events, unsigned int n, long int timeout)
+{
+  TimerDuration deadline = bios_clock_ns() + (TimerDuration) timeout * 1000000ull;
+  int count = 0;
+
+  if(timeout == 0) {
+    for(unsigned int i=0; i<n; i++) {
+      events[i] = fcbs[i] ? stream_ready(fcbs[i], events[i]) : 0;
+      if(events[i]) count++;
+    }
+    return count;
+  }
+
+  event_object eo;
+  rlnode_new(& eo.watches);
+  rlnode_new(& eo.ready);
+  eo.ready_cv = COND_INIT;
+  eo.waiters = 0;
+
+  event_watch* watches = xmalloc((n > 0 ? n : 1) * sizeof(event_watch));
+  unsigned int* notified = xmalloc((n > 0 ? n : 1) * sizeof(unsigned int));
+
+  /* Hash the watches before the first check, so that no notification is missed */
+  int pre = preempt_off;
+  Mutex_Lock(& event_lock);
+  for(unsigned int i=0; i<n; i++) {
+    event_watch* w = & watches[i];
+    w->eo = &eo;
+    w->fcb = fcbs[i];
+    w->fid = NOFILE;
+    w->events = events[i];
+    w->busy = 0;
+    w->removed = 0;
+    rlnode_init(& w->watch_node, w);
+    rlnode_init(& w->hash_node, w);
+    rlnode_new(& w->ready_node)->obj = w;
+    if(w->fcb) {
+      rlist_push_back(event_bucket(w->fcb->streamobj), & w->hash_node);
+      __atomic_add_fetch(& event_nwatches, 1, __ATOMIC_SEQ_CST);
+    }
+  }
+  Mutex_Unlock(& event_lock);
+  if(pre) preempt_on;
+
+  for(unsigned int i=0; i<n; i++) {
+    events[i] = fcbs[i] ? stream_ready(fcbs[i], watches[i].events) : 0;
+    if(events[i]) count++;
+  }
+
+  /* A stream which was not ready stays so until it is notified */
+  while(count == 0) {
+    long int remaining = -1;
+    if(timeout > 0) {
+      TimerDuration now = bios_clock_ns();
+      if(now >= deadline) break;
+      remaining = (deadline - now + 999999) / 1000000;
+    }
+
+    unsigned int k = 0;
+    pre = preempt_off;
+    Mutex_Lock(& event_lock);
+    if(is_rlist_empty(& eo.ready)) {
+      eo.waiters++;
+      Cond_TimedWait(& event_lock, & eo.ready_cv, remaining);
+      eo.waiters--;
+    }
+    while(! is_rlist_empty(& eo.ready)) {
+      event_watch* w = rlist_pop_front(& eo.ready)->obj;
+      notified[k++] = w - watches;
+    }
+    Mutex_Unlock(& event_lock);
+    if(pre) preempt_on;
+
+    for(unsigned int j=0; j<k; j++) {
+      unsigned int i = notified[j];
+      events[i] = stream_ready(fcbs[i], watches[i].events);
+      if(events[i]) count++;
+    }
+  }
+
+  pre = preempt_off;
+  Mutex_Lock(& event_lock);
+  for(unsigned int i=0; i<n; i++) {
+    if(watches[i].fcb == NULL) continue;
+    rlist_remove(& watches[i].hash_node);
+    rlist_remove(& watches[i].ready_node);
+    __atomic_sub_fetch(& event_nwatches, 1, __ATOMIC_SEQ_CST);
+  }
+  Mutex_Unlock(& event_lock);
+  if(pre) preempt_on;
+
+  free(notified);
+  free(watches);
+  return count;
+}
@@ -0,0 +1,1034 @@
+
+#include <assert.h>
+#include <string.h>
+#include "kernel_fs.h"
+#include "kernel_dev.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+/*************************************
+
+  The file system
+
+  The mount state, the bitmap, the inode table and the inode cache
+  are protected by fs_lock. The size, extents and data of a file are
+  protected by the sleeping lock of its inode (inode_lock), which is
+  held across data I/O. The inode lock is taken before fs_lock.
+
+  Mounting and formatting read and pin the metadata blocks without
+  fs_lock; meanwhile, the file system is marked as mounting, and other
+  threads that need it wait on fs_mount_done.
+
+ *************************************/
+
+static Mutex fs_lock = MUTEX_INIT;
+static CondVar fs_mount_done = COND_INIT;
+
+static struct {
+  int mounted;
+  int mounting;             /* a mount or format is doing I/O */
+  fs_superblock* sb;
+  buffer** meta;            /* the pinned blocks 0 .. data_start-1 */
+  uint32_t alloc_hint;      /* where the next allocation search starts */
+  rlnode icache;            /* cached inodes, most recently used first */
+  uint icache_unused;       /* cached inodes with refcount 0 */
+  rlnode mappings;          /* the file mappings of all processes */
+} fs;
+
+
+#define BITS_PER_BLOCK (FS_BLOCK_SIZE*8)
+
+static inline uint32_t blocks_for(uint64_t size)
+{
+  return (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+}
+
+
+/*============================================
+
+  Mounting and formatting
+
+ ============================================*/
+
+static int fs_valid_layout(fs_superblock* sb)
+{
+  uint64_t devblocks = bios_block_sectors(FS_DEVICE) / BCACHE_PAGE_SECTORS;
+  return sb->magic == FS_MAGIC
+    && sb->nblocks <= devblocks
+    && sb->bitmap_start == 1
+    && (uint64_t) sb->bitmap_blocks * BITS_PER_BLOCK >= sb->nblocks
+    && sb->inode_start == sb->bitmap_start + sb->bitmap_blocks
+    && sb->ninodes <= FS_MAX_INODES
+    && sb->ninodes <= sb->inode_blocks * FS_INODES_PER_BLOCK
+    && sb->data_start == sb->inode_start + sb->inode_blocks
+    && sb->data_start < sb->nblocks
+    && sb->data_start <= FS_META_MAX;
+}
+
+
+/* Start using the pinned metadata blocks */
+static void fs_attach(buffer** meta)
+{
+  fs.meta = meta;
+  fs.sb = (fs_superblock*) meta[0]->data;
+  fs.alloc_hint = fs.sb->data_start;
+  rlnode_new(& fs.icache);
+  fs.icache_unused = 0;
+  rlnode_new(& fs.mappings);
+  fs.mounted = 1;
+}
+
+
+/* Pin the metadata blocks 0..n-1, reading them in if fill is set */
+static buffer** fs_pin_meta(uint32_t n, int fill)
+{
+  buffer** meta = xmalloc(n * sizeof(buffer*));
+  for(uint32_t b=0; b<n; b++)
+    if((meta[b] = bcache_get(FS_DEVICE, b, fill)) == NULL) {
+      while(b > 0) bcache_put(meta[--b]);
+      free(meta);
+      return NULL;
+    }
+  return meta;
+}
+
+
+/* Wait for a mount or format in progress. This is called with fs_lock held. */
+static void fs_mount_wait()
+{
+  while(fs.mounting)
+    Cond_Wait(& fs_lock, & fs_mount_done);
+}
+
+/* Read the superblock and pin the metadata, or return NULL */
+static buffer** fs_read_meta()
+{
+  buffer* sbuf = bcache_get(FS_DEVICE, 0, BCACHE_FILL);
+  if(sbuf == NULL) return NULL;
+  fs_superblock sb = *(fs_superblock*) sbuf->data;
+  bcache_put(sbuf);
+  if(! fs_valid_layout(& sb)) return NULL;
+
+  return fs_pin_meta(sb.data_start, BCACHE_FILL);
+}
+
+/*
+  Mount the file system, if it is not mounted.
+  This is called with fs_lock held, which is released during the I/O.
+ */
+static int fs_mount()
+{
+  fs_mount_wait();
+  if(fs.mounted) return 0;
+  if(bios_block_devices() <= FS_DEVICE) return -1;
+
+  fs.mounting = 1;
+  Mutex_Unlock(& fs_lock);
+  buffer** meta = fs_read_meta();
+  Mutex_Lock(& fs_lock);
+  fs.mounting = 0;
+  Cond_Broadcast(& fs_mount_done);
+
+  if(meta == NULL) return -1;
+  fs_attach(meta);
+  return 0;
+}
+
+
+static void fs_unmount()
+{
+  if(! fs.mounted) return;
+
+  assert(is_rlist_empty(& fs.mappings));
+  while(! is_rlist_empty(& fs.icache)) {
+    fs_inode* ip = rlist_pop_front(& fs.icache)->obj;
+    assert(ip->refcount == 0);
+    free(ip);
+  }
+  for(uint32_t b=0; b < fs.sb->data_start; b++)
+    bcache_put(fs.meta[b]);
+  free(fs.meta);
+  fs.mounted = 0;
+}
+
+
+void finalize_fs()
+{
+  Mutex_Lock(& fs_lock);
+  fs_mount_wait();
+  fs_unmount();
+  Mutex_Unlock(& fs_lock);
+}
+
+
+static void fs_mark_blocks(uint32_t start, uint32_t len, int used);
+
+/* The layout of a file system of nblocks blocks */
+static void fs_layout(fs_superblock* sb, uint32_t nblocks)
+{
+  *sb = (fs_superblock) { .magic = FS_MAGIC, .bitmap_start = 1 };
+  sb->nblocks = nblocks;
+  sb->bitmap_blocks = (sb->nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  sb->inode_start = sb->bitmap_start + sb->bitmap_blocks;
+
+  /* One inode per 16 blocks, in whole inode table blocks */
+  uint32_t ninodes = sb->nblocks / 16;
+  if(ninodes > FS_MAX_INODES) ninodes = FS_MAX_INODES;
+  sb->inode_blocks = (ninodes + FS_INODES_PER_BLOCK - 1) / FS_INODES_PER_BLOCK;
+  if(sb->inode_blocks == 0) sb->inode_blocks = 1;
+  sb->ninodes = sb->inode_blocks * FS_INODES_PER_BLOCK;
+  if(sb->ninodes > FS_MAX_INODES) sb->ninodes = FS_MAX_INODES;
+  sb->data_start = sb->inode_start + sb->inode_blocks;
+}
+
+int FormatFS()
+{
+  int rc = -1;
+  Mutex_Lock(& fs_lock);
+  fs_mount_wait();
+
+  if(bios_block_devices() <= FS_DEVICE) goto finish;
+
+  /* Files must not be in use */
+  if(fs.mounted)
+    for(rlnode* pos = fs.icache.next; pos != & fs.icache; pos = pos->next)
+      if(((fs_inode*) pos->obj)->refcount > 0) goto finish;
+
+  uint64_t devblocks = bios_block_sectors(FS_DEVICE) / BCACHE_PAGE_SECTORS;
+  fs_superblock sb;
+  fs_layout(& sb, (devblocks < FS_MAX_BLOCKS) ? devblocks : FS_MAX_BLOCKS);
+  /* The metadata must fit in FS_META_MAX blocks */
+  if(sb.data_start > FS_META_MAX)
+    fs_layout(& sb, (FS_META_MAX - sb.inode_blocks - 1) * BITS_PER_BLOCK);
+
+  if(! fs_valid_layout(& sb)) goto finish;
+
+  fs_unmount();
+
+  /* The metadata blocks start out zeroed, i.e., all inodes are free */
+  fs.mounting = 1;
+  Mutex_Unlock(& fs_lock);
+  buffer** meta = fs_pin_meta(sb.data_start, BCACHE_NOFILL);
+  if(meta != NULL) {
+    for(uint32_t b=0; b < sb.data_start; b++) {
+      memset(meta[b]->data, 0, FS_BLOCK_SIZE);
+      bcache_mark_dirty(meta[b]);
+    }
+    *(fs_superblock*) meta[0]->data = sb;
+  }
+  Mutex_Lock(& fs_lock);
+  fs.mounting = 0;
+  Cond_Broadcast(& fs_mount_done);
+  if(meta == NULL) goto finish;
+
+  fs_attach(meta);
+  fs_mark_blocks(0, sb.data_start, 1);
+  rc = 0;
+
+finish:
+  Mutex_Unlock(& fs_lock);
+  return rc;
+}
+
+
+
+/*============================================
+
+  Block allocation
+
+ ============================================*/
+
+static inline uint8_t* fs_bitmap_byte(uint32_t b)
+{
+  buffer* bbuf = fs.meta[fs.sb->bitmap_start + b / BITS_PER_BLOCK];
+  return (uint8_t*) bbuf->data + (b % BITS_PER_BLOCK) / 8;
+}
+
+static inline int fs_block_used(uint32_t b)
+{
+  return (*fs_bitmap_byte(b) >> (b % 8)) & 1;
+}
+
+static void fs_mark_blocks(uint32_t start, uint32_t len, int used)
+{
+  for(uint32_t b = start; b < start+len; b++) {
+    assert(fs_block_used(b) != used);
+    if(used)
+      *fs_bitmap_byte(b) |= 1 << (b % 8);
+    else
+      *fs_bitmap_byte(b) &= ~(1 << (b % 8));
+  }
+  for(uint32_t k = start / BITS_PER_BLOCK; k <= (start+len-1) / BITS_PER_BLOCK; k++)
+    bcache_mark_dirty(fs.meta[fs.sb->bitmap_start + k]);
+}
+
+
+/* The length of the free run starting at b, up to max */
+static uint32_t fs_free_run(uint32_t b, uint32_t max)
+{
+  uint32_t len = 0;
+  while(len < max && b+len < fs.sb->nblocks && ! fs_block_used(b+len))
+    len++;
+  return len;
+}
+
+
+/*
+  Allocate a run of up to 'want' blocks. The run starts at 'goal' if
+  that block is free; else, it is the first run of 'want' free blocks
+  after the allocation hint, or else the longest free run.
+  Returns the first block and stores the length in *got, or returns
+  0 if there are no free blocks.
+ */
+static uint32_t fs_alloc(uint32_t goal, uint32_t want, uint32_t* got)
+{
+  uint32_t lo = fs.sb->data_start, hi = fs.sb->nblocks;
+  uint32_t start = 0, len = 0;
+
+  if(goal >= lo && goal < hi && ! fs_block_used(goal)) {
+    start = goal;
+    len = fs_free_run(goal, want);
+  }
+  else {
+    uint32_t b = (fs.alloc_hint >= lo && fs.alloc_hint < hi) ? fs.alloc_hint : lo;
+    uint32_t scanned = 0;
+    while(scanned < hi - lo && len < want) {
+      uint32_t run;
+      if(b % 8 == 0 && b+8 <= hi && *fs_bitmap_byte(b) == 0xff)
+        run = 8;     /* skip a full byte */
+      else if(fs_block_used(b))
+        run = 1;
+      else {
+        run = fs_free_run(b, want);
+        if(run > len) { start = b; len = run; }
+      }
+      scanned += run;
+      b += run;
+      if(b >= hi) b = lo;
+    }
+    if(len == 0) return 0;
+  }
+
+  fs_mark_blocks(start, len, 1);
+  fs.alloc_hint = start + len;
+  *got = len;
+  return start;
+}
+
+
+static inline fs_extent* fs_last_extent(fs_dinode* d)
+{
+  return (d->nextents > 0) ? & d->extent[d->nextents-1] : NULL;
+}
+
+/* The number of blocks allocated to an inode */
+static uint32_t fs_iblocks(fs_dinode* d)
+{
+  uint32_t n = 0;
+  for(uint i=0; i<d->nextents; i++) n += d->extent[i].length;
+  return n;
+}
+
+/* The device block of a file block, which must be allocated */
+static uint32_t fs_bmap(fs_dinode* d, uint32_t lblock)
+{
+  for(uint i=0; i<d->nextents; i++) {
+    if(lblock < d->extent[i].length) return d->extent[i].start + lblock;
+    lblock -= d->extent[i].length;
+  }
+  assert(0);
+  return 0;
+}
+
+static inline void fs_inode_dirty(fs_inode* ip)
+{
+  bcache_mark_dirty(fs.meta[fs.sb->inode_start + ip->ino / FS_INODES_PER_BLOCK]);
+}
+
+
+/*
+  Allocate blocks to an inode, until it has at least 'need' blocks.
+  Returns the number of blocks of the inode, which is less than 'need'
+  if the device is full or the inode has no free extents.
+  This is called with fs_lock held.
+ */
+static uint32_t fs_grow(fs_inode* ip, uint32_t need)
+{
+  fs_dinode* d = ip->d;
+  uint32_t have = fs_iblocks(d);
+
+  while(have < need) {
+    /* Preallocate in proportion to the file size */
+    uint32_t want = need - have;
+    uint32_t pre = (have < FS_PREALLOC_MIN) ? FS_PREALLOC_MIN
+      : (have < FS_PREALLOC_MAX ? have : FS_PREALLOC_MAX);
+    if(want < pre) want = pre;
+
+    fs_extent* last = fs_last_extent(d);
+    uint32_t goal = last ? last->start + last->length : fs.alloc_hint;
+    uint32_t got;
+    uint32_t start = fs_alloc(goal, want, &got);
+    if(start == 0) break;
+
+    if(last && start == goal)
+      last->length += got;
+    else if(d->nextents < FS_EXTENTS)
+      d->extent[d->nextents++] = (fs_extent) { .start = start, .length = got };
+    else {
+      fs_mark_blocks(start, got, 0);
+      break;
+    }
+    have += got;
+    fs_inode_dirty(ip);
+  }
+
+  return have;
+}
+
+
+/*
+  Release the blocks of an inode past the first 'keep' blocks.
+  This is called with fs_lock held.
+ */
+static void fs_shrink(fs_inode* ip, uint32_t keep)
+{
+  fs_dinode* d = ip->d;
+  uint32_t have = fs_iblocks(d);
+
+  while(have > keep) {
+    fs_extent* last = fs_last_extent(d);
+    uint32_t cut = have - keep;
+    if(cut > last->length) cut = last->length;
+    fs_mark_blocks(last->start + last->length - cut, cut, 0);
+    last->length -= cut;
+    have -= cut;
+    if(last->length == 0) d->nextents--;
+    fs_inode_dirty(ip);
+  }
+}
+
+
+
+/*============================================
+
+  The inode cache
+
+ ============================================*/
+
+static inline fs_dinode* fs_dinode_of(uint ino)
+{
+  buffer* ibuf = fs.meta[fs.sb->inode_start + ino / FS_INODES_PER_BLOCK];
+  return ((fs_dinode*) ibuf->data) + ino % FS_INODES_PER_BLOCK;
+}
+
+
+/*
+  Return the cached inode of ino, with its reference count increased.
+  This is called with fs_lock held.
+ */
+static fs_inode* fs_iget(uint ino)
+{
+  for(rlnode* pos = fs.icache.next; pos != & fs.icache; pos = pos->next) {
+    fs_inode* ip = pos->obj;
+    if(ip->ino == ino) {
+      if(ip->refcount++ == 0) fs.icache_unused--;
+      rlist_remove(& ip->cnode);
+      rlist_push_front(& fs.icache, & ip->cnode);
+      return ip;
+    }
+  }
+
+  fs_inode* ip = xmalloc(sizeof(fs_inode));
+  ip->ino = ino;
+  ip->d = fs_dinode_of(ino);
+  ip->refcount = 1;
+  ip->unlinked = 0;
+  ip->locked = 0;
+  ip->unlocked = COND_INIT;
+  rlnode_init(& ip->cnode, ip);
+  rlist_push_front(& fs.icache, & ip->cnode);
+  return ip;
+}
+
+
+/*
+  Drop a reference to a cached inode. On the last reference, the
+  inode is released if it is unlinked; else, its preallocated blocks
+  are released, and it stays in the cache.
+  This is called with fs_lock held.
+ */
+static void fs_iput(fs_inode* ip)
+{
+  assert(ip->refcount > 0);
+  if(--ip->refcount > 0) return;
+
+  if(ip->unlinked) {
+    fs_shrink(ip, 0);
+    ip->d->type = FS_FREE;
+    fs_inode_dirty(ip);
+    rlist_remove(& ip->cnode);
+    free(ip);
+    return;
+  }
+
+  fs_shrink(ip, blocks_for(ip->d->size));
+
+  /* Drop the least recently used unused inode */
+  if(++fs.icache_unused > FS_ICACHE_SIZE) {
+    for(rlnode* pos = fs.icache.prev; pos != & fs.icache; pos = pos->prev) {
+      fs_inode* victim = pos->obj;
+      if(victim->refcount == 0) {
+        rlist_remove(& victim->cnode);
+        free(victim);
+        fs.icache_unused--;
+        break;
+      }
+    }
+  }
+}
+
+
+static void fs_iput_unlocked(fs_inode* ip)
+{
+  Mutex_Lock(& fs_lock);
+  fs_iput(ip);
+  Mutex_Unlock(& fs_lock);
+}
+
+
+/* The sleeping lock of an inode */
+static void inode_lock(fs_inode* ip)
+{
+  Mutex_Lock(& fs_lock);
+  while(ip->locked)
+    Cond_Wait(& fs_lock, & ip->unlocked);
+  ip->locked = 1;
+  Mutex_Unlock(& fs_lock);
+}
+
+static void inode_unlock(fs_inode* ip)
+{
+  Mutex_Lock(& fs_lock);
+  ip->locked = 0;
+  Cond_Signal(& ip->unlocked);
+  Mutex_Unlock(& fs_lock);
+}
+
+
+
+/*============================================
+
+  The directory
+
+ ============================================*/
+
+static int fs_valid_name(const char* name)
+{
+  if(name == NULL) return 0;
+  size_t len = strnlen(name, MAX_NAME_LENGTH+1);
+  return len > 0 && len <= MAX_NAME_LENGTH;
+}
+
+
+/* Return the inode of a file, or -1. This is called with fs_lock held. */
+static int fs_lookup(const char* name)
+{
+  for(uint ino = 0; ino < fs.sb->ninodes; ino++) {
+    fs_dinode* d = fs_dinode_of(ino);
+    if(d->type == FS_FILE && strncmp(d->name, name, MAX_NAME_LENGTH+1) == 0)
+      return ino;
+  }
+  return -1;
+}
+
+
+/* Allocate an inode for a new file, or return -1. This is called with fs_lock held. */
+static int fs_ialloc(const char* name)
+{
+  for(uint ino = 0; ino < fs.sb->ninodes; ino++) {
+    fs_dinode* d = fs_dinode_of(ino);
+    if(d->type == FS_FREE) {
+      memset(d, 0, sizeof(fs_dinode));
+      d->type = FS_FILE;
+      strncpy(d->name, name, MAX_NAME_LENGTH);
+      bcache_mark_dirty(fs.meta[fs.sb->inode_start + ino / FS_INODES_PER_BLOCK]);
+      return ino;
+    }
+  }
+  return -1;
+}
+
+
+/*
+  Look up a file by name, mounting the file system if needed, and
+  return its cached inode, or NULL.
+ */
+static fs_inode* fs_namei(const char* name)
+{
+  fs_inode* ip = NULL;
+  if(! fs_valid_name(name)) return NULL;
+
+  Mutex_Lock(& fs_lock);
+  if(fs_mount() == 0) {
+    int ino = fs_lookup(name);
+    if(ino >= 0) ip = fs_iget(ino);
+  }
+  Mutex_Unlock(& fs_lock);
+  return ip;
+}
+
+
+
+/*============================================
+
+  File streams
+
+ ============================================*/
+
+typedef struct fs_file {
+  fs_inode* ip;
+  Off_t pos;                /* protected by the inode lock */
+  open_mode mode;
+} fs_file;
+
+
+static int fs_file_read(void* this, char *buf, unsigned int size)
+{
+  fs_file* f = (fs_file*) this;
+  fs_inode* ip = f->ip;
+  if(! (f->mode & OPEN_READ)) return -1;
+
+  inode_lock(ip);
+  uint64_t fsize = ip->d->size;
+  Off_t pos = f->pos;
+  uint count = 0;
+
+  while(count < size && pos < fsize) {
+    uint32_t lblock = pos / FS_BLOCK_SIZE;
+    uint offset = pos % FS_BLOCK_SIZE;
+    uint chunk = FS_BLOCK_SIZE - offset;
+    if(chunk > size - count) chunk = size - count;
+    if(chunk > fsize - pos) chunk = fsize - pos;
+
+    buffer* dbuf = bcache_get(FS_DEVICE, fs_bmap(ip->d, lblock), BCACHE_FILL);
+    if(dbuf == NULL) break;
+    memcpy(buf + count, dbuf->data + offset, chunk);
+    bcache_put(dbuf);
+
+    pos += chunk;
+    count += chunk;
+  }
+
+  f->pos = pos;
+  inode_unlock(ip);
+  return (count == 0 && size > 0 && pos < fsize) ? -1 : count;
+}
+
+
+static file_ops fs_file_fops;
+
+/*
+  Write out the data of the file from its buffers in the cache. The 
+  inode stays locked while the output is written, so the output cannot
+  be the same file.
+ */
+static int fs_file_splice(void* this, void* out, file_ops* outops, unsigned int len)
+{
+  fs_file* f = (fs_file*) this;
+  fs_inode* ip = f->ip;
+  if(! (f->mode & OPEN_READ)) return -1;
+  if(outops == & fs_file_fops && ((fs_file*) out)->ip == ip) return -1;
+
+  inode_lock(ip);
+  uint64_t fsize = ip->d->size;
+  Off_t pos = f->pos;
+  uint count = 0;
+
+  while(count < len && pos < fsize) {
+    uint32_t lblock = pos / FS_BLOCK_SIZE;
+    uint offset = pos % FS_BLOCK_SIZE;
+    uint chunk = FS_BLOCK_SIZE - offset;
+    if(chunk > len - count) chunk = len - count;
+    if(chunk > fsize - pos) chunk = fsize - pos;
+
+    buffer* dbuf = bcache_get(FS_DEVICE, fs_bmap(ip->d, lblock), BCACHE_FILL);
+    if(dbuf == NULL) break;
+    uint written = stream_write_all(out, outops, dbuf->data + offset, chunk);
+    bcache_put(dbuf);
+
+    pos += written;
+    count += written;
+    if(written < chunk) break;
+  }
+
+  f->pos = pos;
+  inode_unlock(ip);
+  return (count == 0 && pos < fsize) ? -1 : count;
+}
+
+
+/*
+  Write zeros to the file from 'from' up to 'to', extending the file.
+  The blocks are allocated. This is called with the inode locked.
+ */
+static int fs_zero_fill(fs_inode* ip, uint64_t from, uint64_t to)
+{
+  while(from < to) {
+    uint offset = from % FS_BLOCK_SIZE;
+    uint chunk = FS_BLOCK_SIZE - offset;
+    if(chunk > to - from) chunk = to - from;
+
+    /* A block is zeroed by the cache, if it is not read in */
+    buffer* dbuf = bcache_get(FS_DEVICE, fs_bmap(ip->d, from / FS_BLOCK_SIZE),
+      (offset == 0) ? BCACHE_NOFILL : BCACHE_FILL);
+    if(dbuf == NULL) return -1;
+    memset(dbuf->data + offset, 0, chunk);
+    bcache_mark_dirty(dbuf);
+    bcache_put(dbuf);
+
+    from += chunk;
+    ip->d->size = from;
+  }
+  return 0;
+}
+
+
+static int fs_file_write(void* this, const char* buf, unsigned int size)
+{
+  fs_file* f = (fs_file*) this;
+  fs_inode* ip = f->ip;
+  fs_dinode* d = ip->d;
+  if(! (f->mode & OPEN_WRITE)) return -1;
+  if(size == 0) return 0;
+
+  inode_lock(ip);
+  Off_t pos = (f->mode & OPEN_APPEND) ? (Off_t) d->size : f->pos;
+  uint64_t oldsize = d->size;
+  uint count = 0;
+
+  /* Allocate the blocks; on a full device, write as much as fits */
+  uint64_t end = pos + size;
+  if(end > (uint64_t) fs.sb->nblocks * FS_BLOCK_SIZE)
+    end = (uint64_t) fs.sb->nblocks * FS_BLOCK_SIZE;
+  Mutex_Lock(& fs_lock);
+  uint64_t room = (uint64_t) fs_grow(ip, blocks_for(end)) * FS_BLOCK_SIZE;
+  Mutex_Unlock(& fs_lock);
+  if(end > room) end = room;
+  if((uint64_t) pos >= end) goto finish;
+
+  /* A gap past the end of the file reads as zeros */
+  if((uint64_t) pos > d->size && fs_zero_fill(ip, d->size, pos)) goto finish;
+
+  while(pos < end) {
+    uint32_t lblock = pos / FS_BLOCK_SIZE;
+    uint offset = pos % FS_BLOCK_SIZE;
+    uint chunk = FS_BLOCK_SIZE - offset;
+    if(chunk > end - pos) chunk = end - pos;
+
+    /* A block that is overwritten, or has no data yet, is not read in */
+    int nofill = (chunk == FS_BLOCK_SIZE) || ((uint64_t) lblock * FS_BLOCK_SIZE >= d->size);
+    buffer* dbuf = bcache_get(FS_DEVICE, fs_bmap(d, lblock),
+      nofill ? BCACHE_NOFILL : BCACHE_FILL);
+    if(dbuf == NULL) break;
+    memcpy(dbuf->data + offset, buf + count, chunk);
+    bcache_mark_dirty(dbuf);
+    bcache_put(dbuf);
+
+    pos += chunk;
+    count += chunk;
+    if((uint64_t) pos > d->size) d->size = pos;
+  }
+
+finish:
+  if(d->size != oldsize) fs_inode_dirty(ip);
+  f->pos = pos;
+  inode_unlock(ip);
+  return (count > 0) ? (int) count : -1;
+}
+
+
+static Off_t fs_file_seek(void* this, Off_t offset, seek_whence whence)
+{
+  fs_file* f = (fs_file*) this;
+  inode_lock(f->ip);
+
+  switch(whence) {
+    case SEEK_FROM_START: break;
+    case SEEK_FROM_CURRENT: offset += f->pos; break;
+    case SEEK_FROM_END: offset += f->ip->d->size; break;
+    default: offset = -1;
+  }
+  if(offset >= 0)
+    f->pos = offset;
+  else
+    offset = -1;
+
+  inode_unlock(f->ip);
+  return offset;
+}
+
+
+static int fs_file_close(void* this)
+{
+  fs_file* f = (fs_file*) this;
+  fs_iput_unlocked(f->ip);
+  free(f);
+  return 0;
+}
+
+
+static file_ops fs_file_fops = {
+  .Read = fs_file_read,
+  .Write = fs_file_write,
+  .Close = fs_file_close,
+  .Seek = fs_file_seek,
+  .Splice = fs_file_splice
+};
+
+
+/* Open a stream on a referenced inode; the reference passes to the stream */
+static Fid_t fs_open_stream(fs_inode* ip, open_mode mode)
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  fs_file* f = xmalloc(sizeof(fs_file));
+  f->ip = ip;
+  f->pos = 0;
+  f->mode = mode;
+
+  Mutex_Lock(&kernel_mutex);
+
+  if(FCB_reserve(1, &fid, &fcb)) {
+    fcb->streamobj = f;
+    fcb->streamfunc = & fs_file_fops;
+  }
+  else
+    fid = NOFILE;
+
+  Mutex_Unlock(&kernel_mutex);
+
+  if(fid == NOFILE) {
+    free(f);
+    fs_iput_unlocked(ip);
+  }
+  return fid;
+}
+
+
+
+/*============================================
+
+  The file system calls
+
+ ============================================*/
+
+Fid_t Open(const char* name, open_mode mode)
+{
+  if((mode & ~(OPEN_RDWR|OPEN_APPEND)) || ! (mode & OPEN_RDWR)) return NOFILE;
+  if((mode & OPEN_APPEND) && ! (mode & OPEN_WRITE)) return NOFILE;
+
+  fs_inode* ip = fs_namei(name);
+  if(ip == NULL) return NOFILE;
+  return fs_open_stream(ip, mode);
+}
+
+
+Fid_t Create(const char* name)
+{
+  if(! fs_valid_name(name)) return NOFILE;
+
+  fs_inode* ip = NULL;
+  int exists = 0;
+
+  Mutex_Lock(& fs_lock);
+  if(fs_mount() == 0) {
+    int ino = fs_lookup(name);
+    exists = (ino >= 0);
+    if(! exists) ino = fs_ialloc(name);
+    if(ino >= 0) ip = fs_iget(ino);
+  }
+  Mutex_Unlock(& fs_lock);
+  if(ip == NULL) return NOFILE;
+
+  /* Truncate an existing file */
+  if(exists) {
+    inode_lock(ip);
+    Mutex_Lock(& fs_lock);
+    fs_shrink(ip, 0);
+    ip->d->size = 0;
+    fs_inode_dirty(ip);
+    Mutex_Unlock(& fs_lock);
+    inode_unlock(ip);
+  }
+
+  return fs_open_stream(ip, OPEN_RDWR);
+}
+
+
+int Unlink(const char* name)
+{
+  if(! fs_valid_name(name)) return -1;
+  int rc = -1;
+
+  Mutex_Lock(& fs_lock);
+  if(fs_mount() == 0) {
+    int ino = fs_lookup(name);
+    if(ino >= 0) {
+      /* The name goes now, the storage on the last fs_iput() */
+      fs_inode* ip = fs_iget(ino);
+      ip->unlinked = 1;
+      memset(ip->d->name, 0, sizeof(ip->d->name));
+      fs_inode_dirty(ip);
+      fs_iput(ip);
+      rc = 0;
+    }
+  }
+  Mutex_Unlock(& fs_lock);
+  return rc;
+}
+
+
+int Stat(const char* name, file_stat* st)
+{
+  fs_inode* ip = fs_namei(name);
+  if(ip == NULL) return -1;
+
+  inode_lock(ip);
+  st->inode = ip->ino;
+  st->size = ip->d->size;
+  st->blocks = fs_iblocks(ip->d);
+  st->extents = ip->d->nextents;
+  inode_unlock(ip);
+
+  fs_iput_unlocked(ip);
+  return 0;
+}
+
+
+
+/*============================================
+
+  File mappings
+
+  A mapping pins the blocks of a range of a file in the buffer cache,
+  at consecutive addresses (see bcache_map), and holds a reference to
+  the inode. Mappings belong to processes, and are released when their
+  process exits.
+
+ ============================================*/
+
+typedef struct fs_mapping {
+  const char* addr;         /* the address returned to the process */
+  PCB* owner;
+  fs_inode* ip;
+  uint npages;
+  buffer** bufs;            /* the pinned blocks */
+  rlnode mnode;             /* node in fs.mappings */
+} fs_mapping;
+
+
+const void* MapFile(Fid_t fd, Off_t offset, unsigned int len)
+{
+  if(offset < 0 || len == 0 || len > MAX_MAP_LENGTH) return NULL;
+
+  /* Get a reference to the inode of the stream */
+  fs_inode* ip = NULL;
+  Mutex_Lock(&kernel_mutex);
+  FCB* fcb = get_fcb(fd);
+  if(fcb && fcb->streamfunc == & fs_file_fops 
+     && (((fs_file*) fcb->streamobj)->mode & OPEN_READ)) {
+    ip = ((fs_file*) fcb->streamobj)->ip;
+    Mutex_Lock(& fs_lock);
+    ip->refcount++;
+    Mutex_Unlock(& fs_lock);
+  }
+  Mutex_Unlock(&kernel_mutex);
+  if(ip == NULL) return NULL;
+
+  const char* addr = NULL;
+  fs_mapping* m = NULL;
+
+  inode_lock(ip);
+  if((uint64_t) offset + len <= ip->d->size) {
+    uint32_t first = offset / FS_BLOCK_SIZE;
+    uint npages = (offset + len - 1) / FS_BLOCK_SIZE - first + 1;
+    assert(npages <= BCACHE_MAP_MAX);
+
+    uint64_t pages[npages];
+    for(uint j=0; j<npages; j++)
+      pages[j] = fs_bmap(ip->d, first + j);
+
+    m = xmalloc(sizeof(fs_mapping));
+    m->bufs = xmalloc(npages * sizeof(buffer*));
+    char* base = bcache_map(FS_DEVICE, pages, npages, m->bufs);
+    if(base != NULL) {
+      addr = base + offset % FS_BLOCK_SIZE;
+      m->addr = addr;
+      m->owner = CURPROC;
+      m->ip = ip;
+      m->npages = npages;
+      rlnode_init(& m->mnode, m);
+    }
+  }
+  inode_unlock(ip);
+
+  Mutex_Lock(& fs_lock);
+  if(addr != NULL)
+    rlist_push_front(& fs.mappings, & m->mnode);
+  else {
+    if(m) { free(m->bufs); free(m); }
+    fs_iput(ip);
+  }
+  Mutex_Unlock(& fs_lock);
+  return addr;
+}
+
+
+/* Release a mapping, which is removed from fs.mappings. This is called with fs_lock held. */
+static void fs_unmap(fs_mapping* m)
+{
+  bcache_unmap(m->bufs, m->npages);
+  fs_iput(m->ip);
+  free(m->bufs);
+  free(m);
+}
+
+
+int UnmapFile(const void* addr)
+{
+  int rc = -1;
+  Mutex_Lock(& fs_lock);
+  if(fs.mounted) {
+    for(rlnode* pos = fs.mappings.next; pos != & fs.mappings; pos = pos->next) {
+      fs_mapping* m = pos->obj;
+      if(m->addr == addr && m->owner == CURPROC) {
+        rlist_remove(& m->mnode);
+        fs_unmap(m);
+        rc = 0;
+        break;
+      }
+    }
+  }
+  Mutex_Unlock(& fs_lock);
+  return rc;
+}
+
+
+void fs_unmap_process(PCB* pcb)
+{
+  Mutex_Lock(& fs_lock);
+  if(fs.mounted) {
+    rlnode* pos = fs.mappings.next;
+    while(pos != & fs.mappings) {
+      fs_mapping* m = pos->obj;
+      pos = pos->next;
+      if(m->owner == pcb) {
+        rlist_remove(& m->mnode);
+        fs_unmap(m);
+      }
+    }
+  }
+  Mutex_Unlock(& fs_lock);
+}
@@ -0,0 +1,152 @@
+#ifndef __KERNEL_FS_H
+#define __KERNEL_FS_H
+
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_bcache.h"
+#include "kernel_proc.h"
+
+/**
+  @file kernel_fs.h
+  @brief The file system.
+
+  @defgroup fs File system
+  @ingroup kernel
+  @brief An extent-based file system.
+
+  The file system resides on block device 0. It is divided into
+  blocks of @c FS_BLOCK_SIZE bytes, which are exactly the pages of the
+  buffer cache; all file system I/O goes through the cache.
+
+  The layout of the device is:
+  - block 0: the superblock.
+  - the free-space bitmap, with one bit per block of the device.
+  - the inode table. Each inode holds the name of its file; hence, the
+    inode table is also the (single) directory.
+  - the data blocks.
+
+  The data of a file is stored in at most @c FS_EXTENTS extents, i.e.,
+  runs of consecutive blocks. To keep files contiguous, a file that
+  grows is extended at the end of its last extent if possible, and
+  extra blocks are preallocated in proportion to the file size (from
+  @c FS_PREALLOC_MIN up to @c FS_PREALLOC_MAX blocks). Preallocated 
+  blocks are released when the last stream on the file is closed.
+  Sequential reads of a contiguous file are served by the read-ahead
+  of the buffer cache.
+
+  The superblock, bitmap and inode table blocks stay pinned in the
+  buffer cache while the file system is mounted, so that metadata
+  updates never wait for I/O. They take at most @c FS_META_MAX blocks,
+  which limits the size of the file system. Inodes in use are held in an in-memory
+  inode cache, which also keeps recently used inodes.
+
+  Files can be mapped into memory with @c MapFile: the blocks of the
+  mapped range are pinned in the buffer cache at consecutive 
+  addresses, and are read in place.
+
+  @{
+*/
+
+/** @brief The block size of the file system */
+#define FS_BLOCK_SIZE BCACHE_PAGE_SIZE
+
+/** @brief The block device of the file system */
+#define FS_DEVICE 0
+
+/** @brief The magic number of the superblock ("TFS1") */
+#define FS_MAGIC 0x31534654u
+
+/** @brief The number of extents of an inode */
+#define FS_EXTENTS 10
+
+/** @brief The inodes per block of the inode table */
+#define FS_INODES_PER_BLOCK (FS_BLOCK_SIZE / sizeof(fs_dinode))
+
+/** @brief The maximum number of blocks of a file system (larger devices are not used fully) */
+#define FS_MAX_BLOCKS (1u<<31)
+
+/** @brief The maximum number of inodes of a file system */
+#define FS_MAX_INODES 1024
+
+/** @brief The maximum number of metadata blocks, which stay pinned in the buffer cache */
+#define FS_META_MAX (BCACHE_BUFFERS/4)
+
+/** @brief The minimum preallocation for a growing file, in blocks */
+#define FS_PREALLOC_MIN 8
+
+/** @brief The maximum preallocation for a growing file, in blocks */
+#define FS_PREALLOC_MAX 2048
+
+/** @brief The number of unused inodes kept in the inode cache */
+#define FS_ICACHE_SIZE 64
+
+
+/** @brief The superblock, stored at the start of block 0. */
+typedef struct fs_superblock
+{
+  uint32_t magic;
+  uint32_t nblocks;           /**< @brief Blocks of the file system */
+  uint32_t bitmap_start;      /**< @brief First block of the bitmap */
+  uint32_t bitmap_blocks;
+  uint32_t inode_start;       /**< @brief First block of the inode table */
+  uint32_t inode_blocks;
+  uint32_t ninodes;
+  uint32_t data_start;        /**< @brief First data block */
+} fs_superblock;
+
+
+/** @brief A run of consecutive blocks. */
+typedef struct fs_extent
+{
+  uint32_t start;
+  uint32_t length;
+} fs_extent;
+
+
+/** @brief The inode types */
+enum { FS_FREE = 0, FS_FILE = 1 };
+
+/** @brief An inode, as stored in the inode table. */
+typedef struct fs_dinode
+{
+  uint32_t type;                    /**< @brief @c FS_FREE or @c FS_FILE */
+  uint32_t nextents;                /**< @brief Extents in use */
+  uint64_t size;                    /**< @brief File size in bytes */
+  char name[MAX_NAME_LENGTH+1];     /**< @brief Null-terminated file name */
+  fs_extent extent[FS_EXTENTS];     /**< @brief The blocks of the file, in order */
+} fs_dinode;
+
+
+/** @brief An inode in the inode cache. */
+typedef struct fs_inode
+{
+  uint ino;                   /**< @brief The inode number */
+  fs_dinode* d;               /**< @brief The inode, in its pinned table block */
+  uint refcount;              /**< @brief Streams and calls using the inode */
+  int unlinked;               /**< @brief Release the inode on the last put */
+
+  int locked;                 /**< @brief Sleeping lock on size, extents and data */
+  CondVar unlocked;
+
+  rlnode cnode;               /**< @brief Node in the inode cache */
+} fs_inode;
+
+/**
+  @brief Release the file mappings of a process.
+
+  This is called when a process exits.
+  @see MapFile
+ */
+void fs_unmap_process(PCB* pcb);
+
+/**
+  @brief Unmount the file system.
+
+  This is called when the init process exits, after all files are
+  closed and before the buffer cache is written back.
+ */
+void finalize_fs();
+
+/** @} */
+
+#endif
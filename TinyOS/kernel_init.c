@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_bcache.h"
 
 
 
@@ -38,13 +39,19 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
+    initialize_events();
+    initialize_sockets();
     initialize_scheduler();
+    initialize_bcache();
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
       FATAL("The init process does not have PID==1");
   }
 
+  /* Every core may receive device interrupts */
+  initialize_core_devices();
+
   cpu_core_barrier_sync();
 
 #ifndef NVALGRIND
@@ -54,7 +61,8 @@ void boot_tinyos_kernel()
   run_scheduler();
 
   if(cpu_core_id==0) {
-    /* Here, we could add cleanup after the scheduler has ended. */    
+    /* Cleanup after the scheduler has ended. */    
+    finalize_devices();
   }
 }
 
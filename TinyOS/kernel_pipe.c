@@ -85,6 +85,7 @@ int pipe_read(void* this, char* buf, unsigned int size) { //Pipe_read: reads siz
 	if (((pipeCB *)this)->write_flag == 0) { //Returns 0 after the reading process if the pipe write end is closed
   		return 0;
  	}
+	stream_notify(this); // The writers of the pipe may proceed
  
 
 	//MSG("\nBuf is: %s \n",buf);
@@ -95,6 +96,7 @@ int pipe_read(void* this, char* buf, unsigned int size) { //Pipe_read: reads siz
 int pipe_read_close(void *this) { // Closing the read stream and the respective fid. Also setting a flag for error handling in our pipe_write function
 
 	((pipeCB *)this)->read_flag = 0;
+	stream_notify(this);
 	//Close(((pipeCB *)this)->fid_2);
 
 	if(((pipeCB *)this)->error_flag == 1){
@@ -167,12 +169,14 @@ int pipe_write(void* this, char* buf, unsigned int size) { //Pipe_write: writes
  	}
 	//}
 	MSG("\n this is: %s\n",((pipeCB *)this)->buffer);
+	stream_notify(this); // The readers of the pipe may proceed
 	return size;
 }
 
 int pipe_write_close(void *this) { // Closing the write stream and the respective fid. Also setting a flag for error handling in our pipe_read function
 
 	((pipeCB *)this)->write_flag = 0; 
+	stream_notify(this);
 	//Close(((pipeCB *)this)->fid_1); 
 
 	if(((pipeCB *)this)->error_flag == 1){
@@ -183,18 +187,32 @@ int pipe_write_close(void *this) { // Closing the write stream and the respectiv
 
 }
 
+/* The pipe never blocks; it only reports a closed end */
+int pipe_read_poll(void *this, int events) {
+	int ready = events & POLL_READ;
+	if (((pipeCB *)this)->write_flag == 0) ready |= POLL_CLOSED;
+	return ready;
+}
+
+int pipe_write_poll(void *this, int events) {
+	if (((pipeCB *)this)->read_flag == 0) return POLL_CLOSED;
+	return events & POLL_WRITE;
+}
+
 static file_ops writefops = { //file operations for the pipe->write fid and the respective FCB  
   .Open = NULL,
   .Read = pipe_read,
   .Write = pipe_write, 
-  .Close = pipe_write_close
+  .Close = pipe_write_close,
+  .Poll = pipe_write_poll
 };
 
 static file_ops readfops = { //file operations for the pipe->read fid and the respective FCB  
   .Open = NULL,
   .Read = pipe_read, 
   .Write = pipe_write,
-  .Close = pipe_read_close
+  .Close = pipe_read_close,
+  .Poll = pipe_read_poll
 };
 
 int Pipe(pipe_t* pipe) // Function to create a pipe and initialize its control block as well as the two streams which will be created
@@ -3,6 +3,7 @@
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_streams.h"
+#include "kernel_fs.h"
 #include "tinyos.h"
 
 
@@ -38,8 +39,9 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->argl = 0;
   pcb->args = NULL;
 
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  pcb->FIDT = NULL;
+  pcb->fid_limit = MAX_FILEID;
+  pcb->exit_funcs = 0;
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
@@ -156,16 +158,13 @@ Pid_t Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    fidt_inherit(newproc, curproc);
   }
 
 
   /* Set the main thread's function */
   newproc->main_task = call;
+  newproc->exit_funcs = 0;
 
   /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
@@ -290,12 +289,39 @@ Pid_t WaitChild(Pid_t cpid, int* status)
 }
 
 
+int AtExit(void (*func)())
+{
+  PCB* curproc = CURPROC;
+  if(func == NULL) return -1;
+  for(unsigned int i=0; i<curproc->exit_funcs; i++)
+    if(curproc->exit_func[i] == func) return 0;
+  if(curproc->exit_funcs == MAX_EXIT_FUNCS) return -1;
+  curproc->exit_func[curproc->exit_funcs++] = func;
+  return 0;
+}
+
+
 void Exit(int exitval)
 {
+  /* Let the process clean up, while its files are open */
+  while(CURPROC->exit_funcs > 0)
+    CURPROC->exit_func[--CURPROC->exit_funcs]();
+
+  /* Release our file mappings */
+  fs_unmap_process(CURPROC);
+
   /* Right here, we must check that we are not the boot task. If we are, 
      we must wait until all processes exit. */
   if(GetPid()==1) {
     while(WaitChild(NOPROC,NULL)!=NOPROC);
+
+    /* Close our files and unmount the file system, so that all 
+       updates are written back with the buffer cache */
+    Mutex_Lock(& kernel_mutex);
+    fidt_release(CURPROC);
+    Mutex_Unlock(& kernel_mutex);
+    finalize_fs();
+    finalize_bcache();
   }
 
   /* Now, we exit */
@@ -310,12 +336,7 @@ void Exit(int exitval)
   }
 
   /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
+  fidt_release(curproc);
 
   /* Reparent any children of the exiting process to the 
      initial task */
@@ -43,6 +43,8 @@ typedef struct process_control_block {
 
   TCB* main_thread;       /**< The main thread */
   Task main_task;         /**< The main thread's function */
+  void (*exit_func[MAX_EXIT_FUNCS])();  /**< The functions called at @c Exit */
+  unsigned int exit_funcs;  /**< The number of functions in @c exit_func */
   int argl;               /**< The main thread's argument length */
   void* args;             /**< The main thread's argument string */
 
@@ -53,7 +55,8 @@ typedef struct process_control_block {
   rlnode exited_node;     /**< Intrusive node for @c exited_list */
   CondVar child_exit;     /**< Condition variable for @c WaitChild */
 
-  FCB* FIDT[MAX_FILEID];  /**< The fileid table of the process */
+  struct fid_table* FIDT; /**< The fileid table of the process, or NULL */
+  unsigned int fid_limit; /**< The limit of fids, see @c SetFileLimit */
   PTCB* ptcb_ptr;
   int index_pid;
 
@@ -101,6 +104,14 @@ typedef struct request_control_block {
   rlnode* requests; //list of requests
 }RCB;
 
+/**
+  @brief Initialize the socket table.
+
+  This function is called during kernel initialization, to mark
+  all the entries of the socket table as free.
+*/
+void initialize_sockets();
+
 /**
   @brief Initialize the process table.
 
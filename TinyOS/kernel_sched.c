@@ -143,17 +143,14 @@ static void thread_start()
 
 
 /*
-  Initialize and return a new TCB
+  Initialize the attributes of a new TCB. The TCB memory is reused, so 
+  every field that the scheduler reads must be set here.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)())
+static void initialize_TCB(TCB* tcb, PCB* pcb, void (*func)())
 {
-  /* The allocated thread size must be a multiple of page size */
-  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
-
   /* Set the owner */
   tcb->owner_pcb = pcb;
 
-  /* Initialize the other attributes */
   tcb->type = NORMAL_THREAD;
   tcb->state = INIT;
   tcb->phase = CTX_CLEAN;
@@ -161,6 +158,23 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
   tcb->thread_func = func;
   tcb->index_tid = thread_idx;
   tcb->tid = thread_idx;
+
+  /* Scheduler data */
+  tcb->prev = tcb->next = NULL;
+  tcb->priority = 0;
+  tcb->interactive = 0;
+  tcb->interrupt_flag = 0;
+}
+
+
+/*
+  Initialize and return a new TCB
+*/
+TCB* spawn_thread(PCB* pcb, void (*func)())
+{
+  /* The allocated thread size must be a multiple of page size */
+  TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
+  initialize_TCB(tcb, pcb, func);
   thread_idx++;
 
   rlnode_init(& tcb->sched_node, tcb);  /* Intrusive list node */
@@ -192,19 +206,7 @@ TCB* spawn_thread_2(PCB* pcb, void (*func)(),Task task, int argl, void* args)
 {
   /* The allocated thread size must be a multiple of page size */
   TCB* tcb = (TCB*) allocate_thread(THREAD_SIZE);
-
-  /* Set the owner */
-  tcb->owner_pcb = pcb;
-
-  /* Initialize the other attributes */
-  tcb->type = NORMAL_THREAD;
-  tcb->state = INIT;
-  tcb->phase = CTX_CLEAN;
-  tcb->state_spinlock = MUTEX_INIT;
-  tcb->thread_func = func;
-  tcb->index_tid = thread_idx;
-  tcb->tid = thread_idx;
-  tcb->interrupt_flag = 0;
+  initialize_TCB(tcb, pcb, func);
 
   Tid_t tid= tcb->index_tid;
   ptcb_table[tid].ref_cnt = 1;
@@ -298,6 +300,7 @@ void yield_handler()
 	if (CURTHREAD->priority != (MAX_QUEUE-1)) {    //the yield handler function is called when the quantum is over,
 		CURTHREAD->priority++;           //therefore we change the priority accordingly(0 is highest, MAX_QUEUE-1 is lowest)
 	}
+  Cond_ExpireTimeouts();
   yield(); 
 }
 
@@ -342,6 +345,24 @@ TCB* sched_queue_select()       //selects the appropriate element according to t
 } 
 
 
+/*
+  Return 1 if there is a ready thread in the scheduler queues. The queues 
+  are checked under sched_spinlock, so that a thread added by another core
+  before it calls cpu_core_restart_one() is seen.
+*/
+static int sched_queue_ready()
+{
+  int ready = 0;
+  int pre = preempt_off;
+  Mutex_Lock(& sched_spinlock);
+  for(int i=0;i<MAX_QUEUE;i++)
+    if(! is_rlist_empty(&SCHED[i])) { ready = 1; break; }
+  Mutex_Unlock(& sched_spinlock);
+  if(pre) preempt_on;
+  return ready;
+}
+
+
 /*
   Make the process ready. 
  */
@@ -553,7 +574,9 @@ static void idle_thread()
 
   /* We come here whenever we cannot find a ready thread for our core */
   while(active_threads>0) {
-    cpu_core_halt();
+    /* A thread may have been woken up since our last yield; then, the 
+       core must not halt until the next interrupt. */
+    cpu_core_halt_unless(sched_queue_ready);
     yield();
   }
 
@@ -608,3 +631,12 @@ void run_scheduler()
 }
 
 
+
+
+/*
+  The system clock. This is served directly by the BIOS clock.
+ */
+Time_t GetTime()
+{
+  return bios_clock_ns();
+}
@@ -21,6 +21,7 @@
   @{
 */
 
+#include <signal.h>
 #include <ucontext.h>
 #include "util.h"
 #include "bios.h"
@@ -12,6 +12,13 @@ pipeCB pipeobj[1];
 socketCB socketobj[MAX_FILEID];  
 
 
+void initialize_sockets()
+{
+	for(int i=0; i<MAX_FILEID; i++)
+		socketobj[i].fid = NOFILE;
+}
+
+
 Fid_t Socket(port_t port)
 {
 
@@ -28,7 +35,7 @@ Fid_t Socket(port_t port)
 		return NOFILE;
 	}
 	
-	Fid_t ffid;			
+	Fid_t ffid = NOFILE;
 
 	for(int i=0; i<MAX_FILEID; i++){				//initiallize a new socket
 		if(socketobj[i].fid == NOFILE){				
@@ -42,6 +49,9 @@ Fid_t Socket(port_t port)
 			break;
 		}
 	}
+
+	if(ffid == NOFILE)								//the socket table is full
+		FCB_unreserve(1,&fid,&fcb);
 	
 	return ffid;		//fid of the newly created socket
 }
@@ -138,7 +148,7 @@ Fid_t Accept(Fid_t lsock)
 int Connect(Fid_t sock, port_t port, timeout_t timeout)
 {	
 
-	if(sock < 0 || sock > MAX_FILEID || port < 0 || port > MAX_PORT){
+	if(sock < 0 || sock > MAX_FILEID || port == NOPORT || port < 0 || port > MAX_PORT){
 		return -1;
 	}
 
@@ -150,6 +160,14 @@ int Connect(Fid_t sock, port_t port, timeout_t timeout)
 		}
 	}
 
+	int listened = 0;
+	for(int i=0; i<MAX_FILEID; i++){		//there must be a listener on the port
+		if(socketobj[i].fid != NOFILE && socketobj[i].socket_type == LISTENER && socketobj[i].port == port)
+			listened = 1;
+	}
+	if(!listened)
+		return -1;
+
 	return 0;
 }
 
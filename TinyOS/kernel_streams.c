@@ -1,4 +1,6 @@
 
+#include <limits.h>
+#include <string.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
@@ -6,38 +8,125 @@
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 
-#define MAX_FILES MAX_PROC
+/*
+  The FCB allocator.
+
+  FCBs are carved from slabs of FCB_SLAB_SIZE, which are allocated on
+  demand. Free FCBs are kept in a depot, protected by fcb_lock, and in
+  a cache per core. A core takes FCB_CACHE_BATCH FCBs from the depot 
+  when its cache is empty, and returns as many when the cache holds 
+  twice that. Each cache has its own lock, which is contended only
+  when a thread moves to another core in the middle of an operation.
+  The slabs are freed at the next boot.
+ */
+
+#define FCB_SLAB_SIZE 256
+#define FCB_CACHE_BATCH 32
+
+typedef struct fcb_slab {
+  struct fcb_slab* next;
+  FCB fcb[FCB_SLAB_SIZE];
+} fcb_slab;
+
+typedef struct fcb_cache {
+  Mutex lock;
+  rlnode free;
+  uint count;
+} fcb_cache;
 
-FCB FT[MAX_FILES];
-rlnode FCB_freelist;
+static Mutex fcb_lock = MUTEX_INIT;
+static fcb_slab* fcb_slabs = NULL;
+static rlnode fcb_depot;
+static uint fcb_depot_count;
+static fcb_cache fcb_core_cache[MAX_CORES];
 
 
 void initialize_files()
 {
-  rlnode_init(&FCB_freelist,NULL);
-  for(int i=0;i<MAX_FILES;i++) {
+  while(fcb_slabs) {
+    fcb_slab* slab = fcb_slabs;
+    fcb_slabs = slab->next;
+    free(slab);
+  }
+  rlnode_new(& fcb_depot);
+  fcb_depot_count = 0;
+  for(int c=0; c<MAX_CORES; c++) {
+    fcb_core_cache[c].lock = MUTEX_INIT;
+    rlnode_new(& fcb_core_cache[c].free);
+    fcb_core_cache[c].count = 0;
+  }
+}
+
 
-    FT[i].refcount = 0;
-    rlnode_init(& FT[i].freelist_node, &FT[i]);
-    rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
+/* Move a batch of FCBs from the depot to a cache, growing the depot if needed */
+static void fcb_cache_refill(fcb_cache* cache)
+{
+  Mutex_Lock(& fcb_lock);
+  if(fcb_depot_count < FCB_CACHE_BATCH) {
+    fcb_slab* slab = xmalloc(sizeof(fcb_slab));
+    slab->next = fcb_slabs;
+    fcb_slabs = slab;
+    for(int i=0; i<FCB_SLAB_SIZE; i++)
+      rlist_push_back(& fcb_depot, rlnode_init(& slab->fcb[i].freelist_node, & slab->fcb[i]));
+    fcb_depot_count += FCB_SLAB_SIZE;
   }
+  for(int i=0; i<FCB_CACHE_BATCH; i++)
+    rlist_push_back(& cache->free, rlist_pop_front(& fcb_depot));
+  fcb_depot_count -= FCB_CACHE_BATCH;
+  cache->count += FCB_CACHE_BATCH;
+  Mutex_Unlock(& fcb_lock);
 }
 
+/* Return a batch of FCBs from a cache to the depot */
+static void fcb_cache_drain(fcb_cache* cache)
+{
+  Mutex_Lock(& fcb_lock);
+  for(int i=0; i<FCB_CACHE_BATCH; i++)
+    rlist_push_back(& fcb_depot, rlist_pop_front(& cache->free));
+  fcb_depot_count += FCB_CACHE_BATCH;
+  cache->count -= FCB_CACHE_BATCH;
+  Mutex_Unlock(& fcb_lock);
+}
+
+
+/* The stream of an FCB that was not attached to a stream (e.g., by Socket) */
+static int nostream_close(void* this)
+{
+  return 0;
+}
+
+static file_ops nostream_fops = {
+  .Open = NULL,
+  .Close = nostream_close
+};
+
 
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
-    fcb->refcount = 0;
-    return fcb;
-  }
-  else
-    return NULL;
+  fcb_cache* cache = & fcb_core_cache[cpu_core_id];
+  Mutex_Lock(& cache->lock);
+  if(cache->count == 0)
+    fcb_cache_refill(cache);
+  FCB* fcb = rlist_pop_front(& cache->free)->fcb;
+  cache->count--;
+  Mutex_Unlock(& cache->lock);
+
+  fcb->refcount = 0;
+  fcb->flags = 0;
+  fcb->streamobj = NULL;
+  fcb->streamfunc = &nostream_fops;
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  fcb_cache* cache = & fcb_core_cache[cpu_core_id];
+  Mutex_Lock(& cache->lock);
+  rlist_push_front(& cache->free, rlnode_init(& fcb->freelist_node, fcb));
+  cache->count++;
+  if(cache->count >= 2*FCB_CACHE_BATCH)
+    fcb_cache_drain(cache);
+  Mutex_Unlock(& cache->lock);
 }
 
 
@@ -62,35 +151,172 @@ int FCB_decref(FCB* fcb)
 
 
 
+/*
+ *
+ *   The fid tables
+ *
+ */
+
+static fid_table* fidt_new(uint size)
+{
+  fid_table* t = xmalloc(sizeof(fid_table));
+  t->refcount = 1;
+  t->size = size;
+  t->fcb = xmalloc(size * sizeof(FCB*));
+  t->used = xmalloc(size/64 * sizeof(uint64_t));
+  t->full = xmalloc((size/64 + 63)/64 * sizeof(uint64_t));
+  memset(t->fcb, 0, size * sizeof(FCB*));
+  memset(t->used, 0, size/64 * sizeof(uint64_t));
+  memset(t->full, 0, (size/64 + 63)/64 * sizeof(uint64_t));
+  return t;
+}
+
+static void fidt_free(fid_table* t)
+{
+  free(t->fcb);
+  free(t->used);
+  free(t->full);
+  free(t);
+}
+
+/* Copy the fids of t into table n, which is at least as large */
+static void fidt_copy(fid_table* n, fid_table* t)
+{
+  memcpy(n->fcb, t->fcb, t->size * sizeof(FCB*));
+  memcpy(n->used, t->used, t->size/64 * sizeof(uint64_t));
+  memcpy(n->full, t->full, (t->size/64 + 63)/64 * sizeof(uint64_t));
+}
+
+static inline void fidt_mark(fid_table* t, Fid_t fid)
+{
+  uint w = fid / 64;
+  t->used[w] |= 1ull << (fid % 64);
+  if(t->used[w] == ~0ull)
+    t->full[w / 64] |= 1ull << (w % 64);
+}
+
+static inline void fidt_unmark(fid_table* t, Fid_t fid)
+{
+  uint w = fid / 64;
+  t->used[w] &= ~(1ull << (fid % 64));
+  t->full[w / 64] &= ~(1ull << (w % 64));
+}
+
+/* Return the lowest free fid, or t->size if the table is full */
+static Fid_t fidt_lowest_free(fid_table* t)
+{
+  uint nwords = t->size / 64;
+  for(uint f = 0; f*64 < nwords; f++) {
+    if(t->full[f] == ~0ull) continue;
+    uint w = f*64 + __builtin_ctzll(~t->full[f]);
+    if(w >= nwords) break;
+    return w*64 + __builtin_ctzll(~t->used[w]);
+  }
+  return t->size;
+}
+
+/* Return 1 if pcb has at least num free fids below its limit */
+static int fidt_has_free(PCB* pcb, size_t num)
+{
+  fid_table* t = pcb->FIDT;
+  uint limit = pcb->fid_limit;
+  uint size = (t == NULL) ? 0 : t->size;
+  size_t nfree = (limit > size) ? limit - size : 0;
+  for(uint w = 0; w*64 < size && w*64 < limit && nfree < num; w++) {
+    uint64_t bits = ~t->used[w];
+    if(limit - w*64 < 64) bits &= (1ull << (limit - w*64)) - 1;
+    nfree += __builtin_popcountll(bits);
+  }
+  return nfree >= num;
+}
+
+/*
+  Return the fid table of pcb, private to it and with more than 'fid' 
+  entries (pass NOFILE for any size), growing or copying it as needed.
+ */
+static fid_table* fidt_writable(PCB* pcb, Fid_t fid)
+{
+  fid_table* t = pcb->FIDT;
+  uint size = (t == NULL) ? FIDT_MIN_SIZE : t->size;
+  while(fid >= 0 && size <= (uint) fid) size *= 2;
+
+  if(t == NULL) {
+    t = fidt_new(size);
+  }
+  else if(t->refcount > 1 || size > t->size) {
+    fid_table* n = fidt_new(size);
+    fidt_copy(n, t);
+    if(t->refcount > 1) {
+      /* The copy holds its own references to the streams */
+      t->refcount--;
+      for(uint i=0; i<t->size; i++)
+        if(t->fcb[i]) FCB_incref(t->fcb[i]);
+    }
+    else
+      fidt_free(t);
+    t = n;
+  }
+  pcb->FIDT = t;
+  return t;
+}
+
+/* Set the entry of a fid of the current process */
+static void fid_set(Fid_t fid, FCB* fcb)
+{
+  fid_table* t = fidt_writable(CURPROC, fid);
+  t->fcb[fid] = fcb;
+  if(fcb)
+    fidt_mark(t, fid);
+  else
+    fidt_unmark(t, fid);
+}
+
+
+void fidt_inherit(PCB* newproc, PCB* parent)
+{
+  newproc->FIDT = parent->FIDT;
+  newproc->fid_limit = parent->fid_limit;
+  if(newproc->FIDT) newproc->FIDT->refcount++;
+}
+
+
+void fidt_release(PCB* pcb)
+{
+  fid_table* t = pcb->FIDT;
+  if(t == NULL) return;
+  pcb->FIDT = NULL;
+
+  if(--t->refcount > 0) return;
+  for(uint w=0; w < t->size/64; w++)
+    for(uint64_t bits = t->used[w]; bits; bits &= bits-1)
+      FCB_decref(t->fcb[w*64 + __builtin_ctzll(bits)]);
+  fidt_free(t);
+}
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
-    size_t f=0;
     uint i;
 
-    /* Find distinct fids */
-    for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
-	fid[i] = f; f++;
-    }
-    if(i<num) return 0;
-    /* Allocate FCBs */
+    /* Check for free fids and allocate FCBs, before a shared fid table is copied */
+    if(! fidt_has_free(cur, num))
+	return 0;
     for(i=0;i<num;i++)
-	if((fcb[i] = acquire_FCB()) == NULL)
-	    break;
-    if(i<num) {
-	/* Roll back */
-	while(i>0) {
-	    release_FCB(fcb[i-1]);
-	    i--;
+	if((fcb[i] = acquire_FCB()) == NULL) {
+	    while(i>0) release_FCB(fcb[--i]);
+	    return 0;
 	}
-	return 0;
-    }
-    /* Found all */
-    for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
+
+    /* Take the lowest free fids */
+    fid_table* t = fidt_writable(cur, NOFILE);
+    for(i=0; i<num; i++) {
+	Fid_t f = fidt_lowest_free(t);
+	assert((uint) f < cur->fid_limit);
+	if((uint) f == t->size) t = fidt_writable(cur, f);
+	fid[i] = f;
+	fidt_mark(t, f);
+	t->fcb[f] = fcb[i];
 	FCB_incref(fcb[i]);
     }
     return 1;
@@ -100,16 +326,42 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	assert(get_fcb(fid[i])==fcb[i]);
+	fid_set(fid[i], NULL);
 	release_FCB(fcb[i]);
     }
 }
 
 
 
+int SetFileLimit(unsigned int limit)
+{
+  int retcode = -1;
+  if(limit == 0 || limit > MAX_FILEID_LIMIT) return -1;
+  Mutex_Lock(&kernel_mutex);
+
+  /* Check that no fid at or above the limit is open */
+  fid_table* t = CURPROC->FIDT;
+  uint w = (t == NULL) ? 0 : t->size/64;
+  while(w > 0 && t->used[w-1] == 0) w--;
+  Fid_t highest = (w == 0) ? NOFILE : (w-1)*64 + 63 - __builtin_clzll(t->used[w-1]);
+
+  if(highest < (Fid_t) limit) {
+    CURPROC->fid_limit = limit;
+    retcode = 0;
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
+unsigned int GetFileLimit()
+{
+  return CURPROC->fid_limit;
+}
+
 
 
 
@@ -122,9 +374,31 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 
 FCB* get_fcb(Fid_t fid)
 {
-  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+  fid_table* t = CURPROC->FIDT;
+  if(t == NULL || fid < 0 || (uint) fid >= t->size) return NULL;
 
-  return CURPROC->FIDT[fid];
+  return t->fcb[fid];
+}
+
+
+/* 
+  The Read and Write methods of a stream. A non-blocking stream is 
+  accessed by the non-blocking methods of its driver, if it has them;
+  else, it never blocks.
+ */
+typedef int (*read_method)(void*, char*, uint);
+typedef int (*write_method)(void*, const char*, uint);
+
+static read_method stream_read_method(FCB* fcb)
+{
+  file_ops* ops = fcb->streamfunc;
+  return ((fcb->flags & FCB_NONBLOCK) && ops->TryRead) ? ops->TryRead : ops->Read;
+}
+
+static write_method stream_write_method(FCB* fcb)
+{
+  file_ops* ops = fcb->streamfunc;
+  return ((fcb->flags & FCB_NONBLOCK) && ops->TryWrite) ? ops->TryWrite : ops->Write;
 }
 
 
@@ -142,7 +416,7 @@ int Read(Fid_t fd, char *buf, unsigned int size)
 //  MSG("\n GET FCB\n");
   if(fcb) {
     sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
+    devread = stream_read_method(fcb);
 
     /* make sure that the stream will not be closed (by another thread) 
        while we are using it! */
@@ -228,7 +502,7 @@ int Write(Fid_t fd, const char *buf, unsigned int size)
   if(fcb) {
 
     sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
+    devwrite = stream_write_method(fcb);
 
     /* make sure that the stream will not be closed (by another thread) 
        while we are using it! */
@@ -253,15 +527,299 @@ int Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+/* Return true if the buffers of a vectored call are acceptable */
+static int iov_valid(const io_vector* iov, unsigned int iovcnt)
+{
+  if(iovcnt > 0 && iov == NULL) return 0;
+  size_t total = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    total += iov[i].len;
+    if(total > INT_MAX) return 0;
+  }
+  return 1;
+}
+
+
+/* 
+  Read a stream without a ReadV method, by a Read per buffer. This 
+  stops at a short read, so that it does not block after some data
+  was read.
+ */
+static int readv_loop(read_method devread, void* sobj,
+                      const io_vector* iov, unsigned int iovcnt)
+{
+  int total = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = devread(sobj, iov[i].base, iov[i].len);
+    if(rc < 0) return (total > 0) ? total : -1;
+    total += rc;
+    if(rc < iov[i].len) break;
+  }
+  return total;
+}
+
+
+/* Write a stream without a WriteV method, by a Write per buffer */
+static int writev_loop(write_method devwrite, void* sobj,
+                       const io_vector* iov, unsigned int iovcnt)
+{
+  int total = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = devwrite(sobj, iov[i].base, iov[i].len);
+    if(rc < 0) return (total > 0) ? total : -1;
+    total += rc;
+    if(rc < iov[i].len) break;
+  }
+  return total;
+}
+
+
+int ReadV(Fid_t fd, const io_vector* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
+  if(! iov_valid(iov, iovcnt)) return -1;
+
+  Mutex_Lock(&kernel_mutex);
+
+  FCB* fcb = get_fcb(fd);
+  if(fcb) {
+    void* sobj = fcb->streamobj;
+    file_ops* ops = fcb->streamfunc;
+    read_method devread = stream_read_method(fcb);
+
+    /* The stream must not be closed while we are using it */
+    FCB_incref(fcb);
+    Mutex_Unlock(&kernel_mutex);
+
+    if(ops->ReadV && devread == ops->Read)
+      retcode = ops->ReadV(sobj, iov, iovcnt);
+    else if(devread)
+      retcode = readv_loop(devread, sobj, iov, iovcnt);
+
+    Mutex_Lock(&kernel_mutex);
+    FCB_decref(fcb);
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
+int WriteV(Fid_t fd, const io_vector* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
+  if(! iov_valid(iov, iovcnt)) return -1;
+
+  Mutex_Lock(&kernel_mutex);
+
+  FCB* fcb = get_fcb(fd);
+  if(fcb) {
+    void* sobj = fcb->streamobj;
+    file_ops* ops = fcb->streamfunc;
+    write_method devwrite = stream_write_method(fcb);
+
+    /* The stream must not be closed while we are using it */
+    FCB_incref(fcb);
+    Mutex_Unlock(&kernel_mutex);
+
+    if(ops->WriteV && devwrite == ops->Write)
+      retcode = ops->WriteV(sobj, iov, iovcnt);
+    else if(devwrite)
+      retcode = writev_loop(devwrite, sobj, iov, iovcnt);
+
+    Mutex_Lock(&kernel_mutex);
+    FCB_decref(fcb);
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
+unsigned int stream_write_all(void* obj, file_ops* ops, const char* buf, unsigned int size)
+{
+  unsigned int count = 0;
+  while(count < size) {
+    int rc = ops->Write(obj, buf+count, size-count);
+    if(rc <= 0) break;
+    count += rc;
+  }
+  return count;
+}
+
+
+/* The kernel buffer of Splice, for streams without a Splice method */
+#define SPLICE_BUFFER_SIZE 65536
+
+/*
+  Copy through a kernel buffer. The data is read by 'devread' and
+  written by the Write method of 'outops', which may be non-blocking;
+  data that was read is then completed by the blocking 'devwrite', 
+  since it cannot be returned to the input stream. For the same reason,
+  nothing is read while the output reports that its other end is closed.
+ */
+static int splice_copy(void* in, read_method devread, void* out, file_ops* outops, 
+                       write_method devwrite, unsigned int len)
+{
+  unsigned int bufsize = (len < SPLICE_BUFFER_SIZE) ? len : SPLICE_BUFFER_SIZE;
+  char* buf = xmalloc(bufsize);
+  int total = 0;
+
+  while(total < len) {
+    if(outops->Poll && (outops->Poll(out, POLL_WRITE) & POLL_CLOSED)) {
+      if(total == 0) total = -1;
+      break;
+    }
+
+    unsigned int want = (len - total < bufsize) ? len - total : bufsize;
+    int rc = devread(in, buf, want);
+    if(rc <= 0) {
+      if(rc < 0 && total == 0) total = -1;
+      break;
+    }
+    unsigned int written = stream_write_all(out, outops, buf, rc);
+    if(written == 0 && total == 0 && outops->Write == devwrite) { total = -1; break; }
+    if(written < rc && outops->Write != devwrite) {
+      file_ops blocking = *outops;
+      blocking.Write = devwrite;
+      written += stream_write_all(out, &blocking, buf+written, rc-written);
+    }
+    total += written;
+    if(written < rc || rc < want) break;
+  }
+
+  free(buf);
+  return total;
+}
+
+
+int Splice(Fid_t fid_in, Fid_t fid_out, unsigned int len)
+{
+  int retcode = -1;
+  if(len > INT_MAX) len = INT_MAX;
+  if(len == 0) return 0;
+
+  Mutex_Lock(&kernel_mutex);
+
+  FCB* fin = get_fcb(fid_in);
+  FCB* fout = get_fcb(fid_out);
+  if(fin && fout && fin != fout 
+      && fin->streamfunc->Read && fout->streamfunc->Write) {
+    void* in = fin->streamobj;
+    void* out = fout->streamobj;
+    file_ops* inops = fin->streamfunc;
+    read_method devread = stream_read_method(fin);
+
+    /* The output is written by the method for its mode */
+    file_ops* outops = fout->streamfunc;
+    file_ops tryops;
+    if(stream_write_method(fout) != outops->Write) {
+      tryops = *outops;
+      tryops.Write = outops->TryWrite;
+      outops = &tryops;
+    }
+
+    /* The streams must not be closed while we are using them */
+    FCB_incref(fin);
+    FCB_incref(fout);
+    Mutex_Unlock(&kernel_mutex);
+
+    if(inops->Splice && devread == inops->Read)
+      retcode = inops->Splice(in, out, outops, len);
+    else
+      retcode = splice_copy(in, devread, out, outops, fout->streamfunc->Write, len);
+
+    Mutex_Lock(&kernel_mutex);
+    FCB_decref(fin);
+    FCB_decref(fout);
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
+void stream_notify(void* streamobj)
+{
+  event_notify(streamobj);
+}
+
+
+int stream_ready(FCB* fcb, int events)
+{
+  file_ops* ops = fcb->streamfunc;
+  if(ops->Poll)
+    return ops->Poll(fcb->streamobj, events) & (events | POLL_CLOSED);
+  else
+    return events & ((ops->Read ? POLL_READ : 0) | (ops->Write ? POLL_WRITE : 0));
+}
+
+
+int Poll(const Fid_t* fids, int* events, unsigned int n, long int timeout)
+{
+  if(n > 0 && (fids == NULL || events == NULL)) return -1;
+
+  FCB** fcbs = xmalloc((n > 0 ? n : 1) * sizeof(FCB*));
+  int retcode = 0;
+
+  Mutex_Lock(&kernel_mutex);
+  for(unsigned int i=0; i<n; i++) {
+    fcbs[i] = (fids[i] == NOFILE) ? NULL : get_fcb(fids[i]);
+    if(fids[i] != NOFILE && fcbs[i] == NULL) retcode = -1;
+  }
+
+  if(retcode == 0) {
+    /* The streams must not be closed while we are using them */
+    for(unsigned int i=0; i<n; i++) {
+      events[i] &= POLL_READ | POLL_WRITE;
+      if(fcbs[i]) FCB_incref(fcbs[i]);
+    }
+    Mutex_Unlock(&kernel_mutex);
+
+    retcode = event_poll(fcbs, events, n, timeout);
+
+    Mutex_Lock(&kernel_mutex);
+    for(unsigned int i=0; i<n; i++)
+      if(fcbs[i]) FCB_decref(fcbs[i]);
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  free(fcbs);
+  return retcode;
+}
+
+
+int SetNonBlocking(Fid_t fd, int nonblock)
+{
+  int retcode = -1;
+  Mutex_Lock(&kernel_mutex);
+
+  FCB* fcb = get_fcb(fd);
+  if(fcb) {
+    if(nonblock)
+      fcb->flags |= FCB_NONBLOCK;
+    else
+      fcb->flags &= ~FCB_NONBLOCK;
+    retcode = 0;
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
 int Close(int fd)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
   Mutex_Lock(&kernel_mutex);
+  int retcode = (fd>=0 && (uint) fd<CURPROC->fid_limit) ? 0 : -1;  /* Closing a closed fd is legal! */
 
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+    event_forget(fd, fcb);
+    fid_set(fd, NULL);
     retcode = FCB_decref(fcb);    
   }
 
@@ -270,6 +828,35 @@ int Close(int fd)
 }
 
 
+Off_t Seek(Fid_t fd, Off_t offset, seek_whence whence)
+{
+  Off_t retcode = -1;
+  Off_t (*devseek)(void*, Off_t, seek_whence) = NULL;
+  void* sobj = NULL;
+
+  Mutex_Lock(&kernel_mutex);
+
+  FCB* fcb = get_fcb(fd);
+  if(fcb) {
+    sobj = fcb->streamobj;
+    devseek = fcb->streamfunc->Seek;
+
+    /* The stream must not be closed while we are using it */
+    FCB_incref(fcb);
+    Mutex_Unlock(&kernel_mutex);
+
+    if(devseek)
+      retcode = devseek(sobj, offset, whence);
+
+    Mutex_Lock(&kernel_mutex);
+    FCB_decref(fcb);
+  }
+
+  Mutex_Unlock(&kernel_mutex);
+  return retcode;
+}
+
+
 /*
   Copy file descriptor oldfd into file descriptor newfd.
 
@@ -280,21 +867,21 @@ int Close(int fd)
 int Dup2(int oldfd, int newfd)
 {
   int retcode=0;
-  if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
-    return -1;
   Mutex_Lock(&kernel_mutex);
 
   FCB* old = get_fcb(oldfd);
   FCB* new = get_fcb(newfd);
 
-  if(old==NULL) {
+  if(old==NULL || newfd<0 || (uint) newfd>=CURPROC->fid_limit) {
     retcode = -1;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    fid_set(newfd, old);
+    if(new) {
+      event_forget(newfd, new);
+      FCB_decref(new);
+    }
   }
 
   Mutex_Unlock(&kernel_mutex);  
@@ -347,3 +934,46 @@ Fid_t OpenTerminal(unsigned int termno)
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+int IsTerminal(Fid_t fd)
+{
+  file_ops* ops = NULL;
+  Mutex_Lock(&kernel_mutex);
+  FCB* fcb = get_fcb(fd);
+  if(fcb) ops = fcb->streamfunc;
+  Mutex_Unlock(&kernel_mutex);
+
+  if(ops == NULL) return -1;
+  return device_major(ops) == DEV_SERIAL;
+}
+
+
+unsigned int GetBlockDevices()
+{
+  return device_no(DEV_BLOCK);
+}
+
+
+Fid_t OpenBlockDevice(unsigned int diskno)
+{
+  return open_stream(DEV_BLOCK, diskno);
+}
+
+
+unsigned int GetNetworkDevices()
+{
+  return device_no(DEV_NET);
+}
+
+
+Fid_t OpenNetworkDevice(unsigned int nicno)
+{
+  return open_stream(DEV_NET, nicno);
+}
+
+
+Fid_t OpenRamDisk(unsigned int diskno)
+{
+  return open_stream(DEV_RAMDISK, diskno);
+}
+
@@ -43,10 +43,40 @@ typedef struct file_control_block
   uint refcount;  			/**< @brief Reference counter. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  unsigned int flags;		/**< @brief Stream flags (e.g., @c FCB_NONBLOCK) */
   rlnode freelist_node;		/**< @brief Intrusive list node */
 } FCB;
 
 
+/** @brief The stream is in non-blocking mode. @see SetNonBlocking */
+#define FCB_NONBLOCK 1
+
+
+/** @brief The file id table of a process.
+
+	The table maps fids to FCBs. It grows by doubling, up to the file
+	limit of the process (see @c SetFileLimit). Bitmap @c used has a bit
+	for each fid in use, and bitmap @c full a bit for each full word of
+	@c used, so that the lowest free fid is found by testing one bit
+	for every 4096 fids.
+
+	A child process shares the table of its parent until either of 
+	them changes its fids; then, it gets a private copy of the table.
+	The table is accessed under @c kernel_mutex.
+ */
+typedef struct fid_table
+{
+  uint refcount;			/**< @brief The processes sharing the table */
+  uint size;				/**< @brief Number of entries, a multiple of 64 */
+  FCB** fcb;				/**< @brief The FCB of each fid, or NULL */
+  uint64_t* used;			/**< @brief Bitmap of the fids in use */
+  uint64_t* full;			/**< @brief Bitmap of the full words of @c used */
+} fid_table;
+
+/** @brief The initial size of a file id table */
+#define FIDT_MIN_SIZE 64
+
+
 
 /** 
   @brief Initialization for files and streams.
@@ -118,6 +148,22 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Give a new process the file ids of its parent.
+
+	The child shares the fid table of @c parent, and inherits its file 
+	limit. Call with @c kernel_mutex held.
+ */
+void fidt_inherit(PCB* newproc, PCB* parent);
+
+
+/** @brief Release the fid table of a process.
+
+	The streams are closed when no other process shares the table.
+	Call with @c kernel_mutex held.
+ */
+void fidt_release(PCB* pcb);
+
+
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
@@ -128,6 +174,70 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Write a whole buffer to a stream object.
+
+	This calls the @c Write method of @c ops until all of @c buf has
+	been written, or the method fails. It is used by the @c Splice 
+	methods of streams.
+
+	@returns the number of bytes written.
+ */
+unsigned int stream_write_all(void* obj, file_ops* ops, const char* buf, unsigned int size);
+
+
+/** @brief Notify that a stream may have become ready.
+
+	Streams with a @c Poll method call this whenever they may become
+	ready, e.g., from their interrupt handlers, passing their stream
+	object. This queues the stream on the ready lists of the event 
+	objects watching it, including those of the threads in @c Poll. It must not be 
+	called with a lock held that a thread may hold with preemption on.
+ */
+void stream_notify(void* streamobj);
+
+
+/** @brief Return the events of @c events for which a stream is ready.
+
+	This calls the @c Poll method of the stream, if it has one; streams
+	without it are ready for the operations they provide.
+	The caller must hold a reference to @c fcb.
+ */
+int stream_ready(FCB* fcb, int events);
+
+
+/** @brief Initialization for event objects.
+
+	This function is called at kernel startup.
+	@see EventCreate
+ */
+void initialize_events();
+
+
+/** @brief Queue a stream on the ready lists of the event objects watching it.
+
+	This is called by @c stream_notify.
+ */
+void event_notify(void* streamobj);
+
+
+/** @brief Remove the watches of a file id from all event objects.
+
+	This is called with @c kernel_mutex held, when file id @c fid of
+	the current process stops referring to @c fcb.
+ */
+void event_forget(Fid_t fid, FCB* fcb);
+
+
+/** @brief Wait until one of @c n streams is ready.
+
+	On entry, @c events[i] holds the events to wait for on @c fcbs[i]
+	(which may be NULL); on return, it holds the ready events. Return
+	the number of ready streams, or 0 on timeout. This is called by 
+	@c Poll, without @c kernel_mutex, holding a reference to each stream.
+ */
+int event_poll(FCB** fcbs, int* events, unsigned int n, long int timeout);
+
+
 /** @} */
 
 #endif
@@ -42,10 +42,14 @@ typedef int Pid_t;		/* The PID type  */
 /** @brief The type of a file ID. */
 typedef int Fid_t;  
 
-/** @brief The maximum number of open files per process. 
-   Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
+/** @brief The default maximum number of open files per process. 
+   Only values 0 to MAX_FILEID-1 are legal for file descriptors, unless
+   the limit is changed with @c SetFileLimit. */
 #define MAX_FILEID 16
 
+/** @brief The largest limit of file ids of a process. */
+#define MAX_FILEID_LIMIT 65536
+
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
 
@@ -168,6 +172,21 @@ typedef struct {
   */
 int Cond_Wait(Mutex* mx, CondVar* cv);
 
+/** @brief Wait on a condition variable, for a limited time.
+
+  This is the same as @c Cond_Wait, except that the thread also wakes
+  up when @c timeout milliseconds have passed. The timeout is checked
+  at every scheduler quantum, so it may expire up to a quantum late.
+  A negative timeout means "infinite timeout".
+
+  @param mx The mutex to be unlocked as the thread sleeps.
+  @param cv The condition variable to sleep on.
+  @param timeout The maximum time to sleep, in milliseconds.
+  @returns 0 if the timeout expired, 1 otherwise
+  @see Cond_Wait
+  */
+int Cond_TimedWait(Mutex* mx, CondVar* cv, long int timeout);
+
 /** @brief Signal a condition variable. 
    
    This call wakes up exactly one thread sleeping on this condition
@@ -242,6 +261,28 @@ Pid_t Exec(Task task, int argl, void* args);
    */
 void Exit(int val);
 
+
+/** @brief The maximum number of @c AtExit functions of a process */
+#define MAX_EXIT_FUNCS 8
+
+/** @brief Add a function to be called when the current process exits.
+
+  The functions are called by the main thread of the process when it 
+  calls @c Exit, or returns from its main function, before the files 
+  of the process are closed, in the reverse order of their addition.
+  A function already added is not added again. A new process starts
+  with no such functions.
+
+  This is intended for programs and libraries that must clean up, 
+  e.g., to flush buffered output.
+
+  @param func the function to call
+  @return 0 on success, or -1 if @c func is NULL or the process 
+    already has @c MAX_EXIT_FUNCS functions.
+  @see Exit
+ */
+int AtExit(void (*func)());
+
 /** @brief Wait on a terminating child.
 
    This function will return the exit status of a terminated 
@@ -415,6 +456,85 @@ unsigned int GetTerminalDevices();
  */
 Fid_t OpenTerminal(unsigned int termno);
 
+/** @brief Check if a stream is a terminal.
+
+  @param fd the file id to check
+  @return 1 if @c fd is a stream on a terminal device, 0 if it is 
+    another stream, or -1 if the file id is invalid.
+ */
+int IsTerminal(Fid_t fd);
+
+
+/** @brief Return the number of block devices available. 
+
+  Block devices are numbered starting from 0. 
+ */
+unsigned int GetBlockDevices();
+
+/** @brief Open a stream on block device 'diskno'.
+
+  The stream reads and writes the bytes of the device sequentially,
+  starting at the beginning of the device. Reads return 0 at the end
+  of the device, and writes past the end of the device fail.
+
+  @param diskno the block device to open
+  @return the file ID of the new descriptor
+    On success, OpenBlockDevice returns the file id for a new file for 
+    this device. On error, it returns @c NOFILE. Possible errors are:
+   - The block device does not exist.
+   - The maximum number of file descriptors has been reached.
+ */
+Fid_t OpenBlockDevice(unsigned int diskno);
+
+
+/** @brief Return the number of network devices available. 
+
+  Network devices are numbered starting from 0. 
+ */
+unsigned int GetNetworkDevices();
+
+/** @brief Open a stream on network device 'nicno'.
+
+  Each write on the stream sends a packet of 1 up to @c NET_MTU (1500)
+  bytes, and returns its size; larger or empty packets fail with -1.
+  Each read returns the next packet received, blocking until a packet
+  arrives; if the packet is larger than the read buffer, the rest of
+  it is lost. Packets that start with the same 4 bytes are received
+  in the order they were sent.
+
+  @param nicno the network device to open
+  @return the file ID of the new descriptor
+    On success, OpenNetworkDevice returns the file id for a new file for 
+    this device. On error, it returns @c NOFILE. Possible errors are:
+   - The network device does not exist.
+   - The maximum number of file descriptors has been reached.
+ */
+Fid_t OpenNetworkDevice(unsigned int nicno);
+
+
+/** @brief The number of RAM disks */
+#define MAX_RAMDISKS 2
+
+/** @brief The size of a RAM disk, in bytes */
+#define RAMDISK_SIZE (64<<20)
+
+/** @brief Open a stream on RAM disk 'diskno'.
+
+  A RAM disk is a device of @c RAMDISK_SIZE bytes, kept in memory and
+  initially zero. Its contents last until the kernel shuts down.
+  The stream reads and writes bytes at any position, starting at the
+  beginning of the disk, and can be moved with @c Seek. Reads return
+  0 at the end of the disk, and writes past the end fail.
+
+  @param diskno the RAM disk to open, less than @c MAX_RAMDISKS
+  @return the file ID of the new descriptor
+    On success, OpenRamDisk returns the file id for a new file for 
+    this device. On error, it returns @c NOFILE. Possible errors are:
+   - The RAM disk does not exist.
+   - The maximum number of file descriptors has been reached.
+ */
+Fid_t OpenRamDisk(unsigned int diskno);
+
 
 /** @brief Open a stream on the null device.
 
@@ -474,6 +594,243 @@ int Read_2(Fid_t fd, char *buf, unsigned int size,int i);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief A buffer of a vectored read or write.
+  @see ReadV
+  @see WriteV
+ */
+typedef struct io_vector
+{
+	void* base;				/**< @brief The start of the buffer */
+	unsigned int len;		/**< @brief The size of the buffer */
+} io_vector;
+
+
+/** @brief Read bytes from a stream into several buffers.
+
+  This call reads into the @c iovcnt buffers of @c iov, filling each
+  buffer before the next one, with a single system call. It behaves 
+  like a sequence of @c Read calls, one per buffer, which stops at the
+  first call that returns fewer bytes than the size of its buffer.
+
+  @param fd  the file ID of the stream to read from
+  @param iov the buffers
+  @param iovcnt the number of buffers
+  @return the total number of bytes read, 0 at the end of file, or -1 
+   on error. If an error occurs after some bytes were read, the call
+   returns those bytes. Possible errors are:
+   - The file id is invalid.
+   - The total size of the buffers is larger than @c INT_MAX.
+   - There was a I/O runtime problem.
+  @see Read
+ */
+int ReadV(Fid_t fd, const io_vector* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes from several buffers to a stream.
+
+  This call writes the @c iovcnt buffers of @c iov in order, with a 
+  single system call. It behaves like a sequence of @c Write calls, one
+  per buffer, which stops at the first call that writes fewer bytes 
+  than the size of its buffer. For instance, a message and its length
+  header can be sent with one call.
+
+  @param fd  the file ID of the stream to write to
+  @param iov the buffers
+  @param iovcnt the number of buffers
+  @return the total number of bytes written, or -1 on error. If an
+   error occurs after some bytes were written, the call returns those
+   bytes. Possible errors are:
+   - The file id is invalid.
+   - The total size of the buffers is larger than @c INT_MAX.
+   - There was a I/O runtime problem.
+  @see Write
+ */
+int WriteV(Fid_t fd, const io_vector* iov, unsigned int iovcnt);
+
+
+/** @brief Move data from one stream to another.
+
+  This call reads up to @c len bytes from stream @c fid_in and writes
+  them to stream @c fid_out, without copying them through a buffer of
+  the caller. Streams kept in memory (files and RAM disks) are written
+  out directly from their own storage.
+
+  Like @c Read, the call blocks until some data can be read, and returns
+  early after a read that returns less than was asked for; hence, 
+  it should be called in a loop until it returns 0. Nothing is read
+  while the other end of the output stream is closed; if the output
+  stream fails otherwise (e.g., a full device), the data already read
+  from the input stream is lost.
+
+  @param fid_in the file ID of the stream to read from
+  @param fid_out the file ID of the stream to write to
+  @param len the maximum number of bytes to move
+  @return the number of bytes moved, 0 at the end of @c fid_in, or -1 
+   on error. Possible errors are:
+   - A file id is invalid.
+   - @c fid_in cannot be read, or @c fid_out cannot be written.
+   - @c fid_in and @c fid_out are the same file.
+   - There was a I/O runtime problem.
+ */
+int Splice(Fid_t fid_in, Fid_t fid_out, unsigned int len);
+
+
+/** @brief The events of a stream, as reported by @c Poll. */
+typedef enum poll_events {
+	POLL_READ = 1,	/**< @brief The stream can be read without blocking */
+	POLL_WRITE = 2,	/**< @brief The stream can be written without blocking */
+	POLL_CLOSED = 4	/**< @brief The other end of the stream is closed */
+} poll_events;
+
+
+/** @brief Wait until some streams are ready for I/O.
+
+  For each @c i less than @c n, @c events[i] gives the events of 
+  stream @c fids[i] to wait for, a combination of @c POLL_READ and
+  @c POLL_WRITE. Entries whose fid is @c NOFILE are ignored.
+
+  The call returns when one of the streams has one of the events, or
+  after @c timeout milliseconds. Then, @c events[i] is set to the 
+  events of stream @c fids[i] that are ready, plus @c POLL_CLOSED if its
+  other end is closed. A negative timeout means "infinite timeout",
+  and a zero timeout returns at once.
+
+  Streams always ready for I/O, such as files and block devices, are
+  always reported ready.
+
+  @param fids the file IDs of the streams
+  @param events the events to wait for; on return, the ready events
+  @param n the number of streams
+  @param timeout the maximum time to wait, in milliseconds
+  @return the number of streams with ready events, 0 if the timeout 
+   expired, or -1 on error. Possible errors are:
+   - A file id is invalid.
+ */
+int Poll(const Fid_t* fids, int* events, unsigned int n, long int timeout);
+
+
+/** @brief Set the non-blocking mode of a stream.
+
+  In non-blocking mode, a @c Read, @c Write, @c ReadV, @c WriteV or 
+  @c Splice that would block fails with -1 instead. The mode belongs to
+  the stream, so it is shared by the file ids copied with @c Dup2.
+  Streams which never block (e.g., files) are not affected.
+  A @c Splice into a non-blocking stream, from a stream which is not
+  a file or RAM disk, still waits to write the data it has read.
+
+  @param fd the file id of the stream
+  @param nonblock 1 to set non-blocking mode, 0 to clear it
+  @return 0 on success, or -1 if the file id is invalid.
+  @see Poll
+ */
+int SetNonBlocking(Fid_t fd, int nonblock);
+
+
+/** @brief Request edge-triggered events from @c EventCtl. */
+#define EVENT_EDGE 0x100
+
+/** @brief The operations of @c EventCtl. */
+typedef enum event_ctl_op {
+	EVENT_ADD,	/**< @brief Add a stream to the interest list */
+	EVENT_MOD,	/**< @brief Change the events of a stream */
+	EVENT_DEL	/**< @brief Remove a stream from the interest list */
+} event_ctl_op;
+
+/** @brief A ready stream, as reported by @c EventWait. */
+typedef struct event_record {
+	Fid_t fid;		/**< @brief The file id given to @c EventCtl */
+	int events;		/**< @brief The ready events, as in @c Poll */
+} event_record;
+
+
+/** @brief Create an event object.
+
+  An event object keeps an interest list of streams in the kernel. 
+  Unlike @c Poll, which checks every stream in each call, 
+  @c EventWait only checks the streams that have signalled since the
+  last call; hence, its cost depends on the number of ready streams,
+  not on the size of the interest list. The event object is closed 
+  with @c Close.
+
+  @return the file id of the event object, or @c NOFILE on error.
+  Possible errors are:
+  - The maximum number of file ids for the process has been reached.
+  @see EventCtl
+  @see EventWait
+ */
+Fid_t EventCreate();
+
+
+/** @brief Change the interest list of an event object.
+
+  With @c EVENT_ADD, stream @c fd is added to the interest list of 
+  event object @c efd, to wait for @c events, a combination of 
+  @c POLL_READ and @c POLL_WRITE. With @c EVENT_MOD the events of 
+  @c fd are changed, and with @c EVENT_DEL @c fd is removed.
+
+  By default, events are level-triggered: a stream is reported by
+  every @c EventWait while it is ready. If @c events includes 
+  @c EVENT_EDGE, the stream is reported once, and then again only after
+  it signals new activity (e.g., more input arrives). 
+
+  A stream is removed from the interest list when @c fd is closed, or
+  replaced by @c Dup2, so that a reused file id is never reported for
+  the stream it referred to before.
+
+  @param efd the file id of the event object
+  @param op the operation
+  @param fd the file id of the stream
+  @param events the events to wait for (ignored by @c EVENT_DEL)
+  @return 0 on success, or -1 on error. Possible errors are:
+  - @c efd is not an event object, or @c fd is not a valid stream.
+  - @c fd is itself an event object.
+  - @c EVENT_ADD and @c fd is already in the interest list, or
+    @c EVENT_MOD or @c EVENT_DEL and it is not.
+ */
+int EventCtl(Fid_t efd, event_ctl_op op, Fid_t fd, int events);
+
+
+/** @brief Wait for ready streams of an event object.
+
+  The call returns when some streams of the interest list of 
+  @c efd are ready, or after @c timeout milliseconds. Up to 
+  @c maxevents ready streams are stored in @c evs. A negative timeout 
+  means "infinite timeout", and a zero timeout returns at once.
+
+  @param efd the file id of the event object
+  @param evs the array of ready streams
+  @param maxevents the size of @c evs
+  @param timeout the maximum time to wait, in milliseconds
+  @return the number of records stored in @c evs, 0 if the timeout 
+   expired, or -1 on error. Possible errors are:
+   - @c efd is not an event object.
+ */
+int EventWait(Fid_t efd, event_record* evs, unsigned int maxevents, long int timeout);
+
+
+/** @brief Set the limit of file ids of the current process.
+
+  After the call, file ids 0 to @c limit-1 are legal for the process.
+  The limit is inherited by the children of the process. The file id 
+  table grows as needed, so a large limit costs nothing until it is
+  used.
+
+  @param limit the new limit, from 1 to @c MAX_FILEID_LIMIT
+  @return 0 on success, or -1 on error. Possible errors are:
+  - The limit is out of range.
+  - A file id not less than @c limit is open.
+  @see GetFileLimit
+ */
+int SetFileLimit(unsigned int limit);
+
+
+/** @brief Return the limit of file ids of the current process.
+
+  This is @c MAX_FILEID, unless it was changed by @c SetFileLimit.
+ */
+unsigned int GetFileLimit();
+
+
 /** @brief Close a file id.
    
 
@@ -718,6 +1075,196 @@ int ShutDown(Fid_t sock, shutdown_mode how);
 
 
 
+/*******************************************
+ *
+ * Files
+ *
+ *******************************************/
+
+/**
+  @brief The type of file offsets.
+  */
+typedef int64_t Off_t;
+
+/**
+  @brief The maximum length of a file name.
+  */
+#define MAX_NAME_LENGTH 31
+
+
+/**
+  @brief Create an empty file system.
+
+  The file system resides on block device 0. It has a single directory
+  of files, which are named by strings of 1 to @c MAX_NAME_LENGTH 
+  characters. Any previous contents of the device are lost.
+
+  The file system on block device 0 is also used by the kernel when 
+  it was created by a previous boot.
+
+  @returns 0 on success and -1 on error. Possible reasons for error:
+    - there is no block device 0, or it is too small.
+    - some file is open.
+  */
+int FormatFS();
+
+
+/**
+  These constants define the legal values for the second argument of
+  @c Open. @c OPEN_APPEND may be combined with @c OPEN_WRITE.
+
+  @see Open
+*/
+typedef enum {
+  OPEN_READ=1,      /**< Open for reading. */
+  OPEN_WRITE=2,     /**< Open for writing. */
+  OPEN_RDWR=3,      /**< Open for reading and writing. */
+  OPEN_APPEND=4     /**< Every write appends to the end of the file. */
+} open_mode;
+
+
+/**
+  @brief Open an existing file.
+
+  The stream reads and writes the bytes of the file, starting at the
+  beginning of the file. Writes past the end of the file extend the file.
+
+  @param name the name of the file
+  @param mode the access mode
+  @returns the file id of the new stream, or @c NOFILE on error. 
+    Possible reasons for error:
+    - there is no file system, or no file by that name.
+    - the mode is invalid.
+    - the maximum number of file descriptors has been reached.
+  */
+Fid_t Open(const char* name, open_mode mode);
+
+
+/**
+  @brief Create a file.
+
+  If the file exists, it is truncated to length 0. The file is opened
+  for reading and writing, as with @c OPEN_RDWR.
+
+  @param name the name of the file
+  @returns the file id of the new stream, or @c NOFILE on error. 
+    Possible reasons for error:
+    - there is no file system.
+    - the name is empty or longer than @c MAX_NAME_LENGTH.
+    - there is no free inode.
+    - the maximum number of file descriptors has been reached.
+  */
+Fid_t Create(const char* name);
+
+
+/**
+  @brief Remove a file.
+
+  The name is removed at once. The storage of the file is released 
+  when the last stream on the file is closed.
+
+  @param name the name of the file
+  @returns 0 on success and -1 if there is no file by that name.
+  */
+int Unlink(const char* name);
+
+
+/**
+  These constants define the legal values for the third argument of
+  @c Seek.
+
+  @see Seek
+*/
+typedef enum {
+  SEEK_FROM_START,    /**< The offset is relative to the start. */
+  SEEK_FROM_CURRENT,  /**< The offset is relative to the current position. */
+  SEEK_FROM_END       /**< The offset is relative to the end. */
+} seek_whence;
+
+
+/**
+  @brief Set the position of a stream.
+
+  The position of a file may be set past the end of the file; a 
+  subsequent write extends the file, and the gap reads as zeros.
+
+  @param fd the file id of the stream
+  @param offset the new position, relative to @c whence
+  @param whence where the offset is counted from
+  @returns the new position, or -1 on error. Possible reasons for error:
+    - the file id is invalid.
+    - the stream cannot be positioned (it is not a file or a block device).
+    - the new position would be negative (or past the end of a block device).
+  */
+Off_t Seek(Fid_t fd, Off_t offset, seek_whence whence);
+
+
+/**
+  @brief Information about a file.
+
+  @see Stat
+  */
+typedef struct file_stat
+{
+  unsigned int inode;     /**< @brief The inode number of the file. */
+  Off_t size;             /**< @brief The size of the file in bytes. */
+  unsigned int blocks;    /**< @brief The number of blocks allocated to the file. */
+  unsigned int extents;   /**< @brief The number of extents of the file. */
+} file_stat;
+
+
+/**
+  @brief Return information about a file.
+
+  @param name the name of the file
+  @param st the location to store the information
+  @returns 0 on success and -1 if there is no file by that name.
+  */
+int Stat(const char* name, file_stat* st);
+
+
+/** @brief The maximum length of a file mapping, in bytes. */
+#define MAX_MAP_LENGTH (1<<20)
+
+/**
+  @brief Map a part of a file into memory.
+
+  This call returns a pointer to bytes @c offset to @c offset+len-1
+  of the file open at @c fd, which can then be read in place: the
+  pointer is into the pages of the file in the kernel's buffer cache, 
+  so no data is copied. The pages stay in memory until the mapping 
+  is released by @c UnmapFile, or the process exits.
+
+  The mapping is read-only, but it reflects later writes to the file.
+  Mapping the same part of a file again (by any process) returns the
+  same pointer. If the file is truncated, the contents of the mapping
+  are undefined.
+
+  @param fd the file id of a file stream open for reading
+  @param offset the first byte of the file to map
+  @param len the number of bytes to map, at most @c MAX_MAP_LENGTH
+  @returns the address of the mapped data, or NULL on error. Possible 
+    reasons for error:
+    - the file id is invalid, or not a file open for reading.
+    - the range is empty, too long, or not within the file.
+    - part of the range is already mapped at a different address, or
+      the buffer cache has no room for the mapping.
+    - there was an I/O error.
+  @see UnmapFile
+  */
+const void* MapFile(Fid_t fd, Off_t offset, unsigned int len);
+
+/**
+  @brief Release a file mapping.
+
+  @param addr an address returned by @c MapFile to the current process
+  @returns 0 on success and -1 if there is no such mapping.
+  @see MapFile
+  */
+int UnmapFile(const void* addr);
+
+
+
 /*******************************************
  *
  * System information
@@ -783,6 +1330,80 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+	@brief Open a BIOS statistics stream.
+
+	This is a read-only stream that returns a single 
+	@c bios_stats structure (declared in bios.h), packed into a 
+	block of size @c sizeof(bios_stats). The statistics are a 
+	snapshot, taken when the stream is opened.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see bios_get_stats
+ */
+Fid_t OpenBiosInfo();
+
+
+/**
+	@brief Statistics of the buffer cache of block devices.
+
+	This structure is returned by cache information streams.
+	@see OpenCacheInfo
+  */
+typedef struct cache_stats
+{
+	unsigned long hits;       /**< @brief Page lookups found in the cache. */
+	unsigned long misses;     /**< @brief Page lookups not found in the cache. */
+	unsigned long readahead;  /**< @brief Pages read in ahead of a miss. */
+	unsigned long evictions;  /**< @brief Pages replaced by other pages. */
+	unsigned long writebacks; /**< @brief Dirty pages written to the devices. */
+	unsigned int dirty;       /**< @brief Pages currently dirty. */
+	unsigned int buffers;     /**< @brief The number of buffers of the cache. */
+} cache_stats;
+
+
+/**
+	@brief Open a buffer cache statistics stream.
+
+	This is a read-only stream that returns a single
+	@c cache_stats structure, packed into a block of size
+	@c sizeof(cache_stats). The statistics are a snapshot, taken
+	when the stream is opened. If there are no block devices,
+	all the statistics are zero.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+ */
+Fid_t OpenCacheInfo();
+
+
+
+
+/*******************************************
+ *
+ * Time
+ *
+ *******************************************/
+
+/**
+	@brief A type for time, in nanoseconds.
+*/
+typedef uint64_t Time_t;
+
+
+/**
+	@brief Return the time since the system booted.
+
+	This is a high-resolution, monotonic clock, which is the same for
+	all processes and threads.
+
+	@returns the time since boot, in nanoseconds
+ */
+Time_t GetTime();
+
 
 
 /*******************************************
@@ -21,6 +21,7 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int BiosStat(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -38,6 +39,7 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"biosstat", BiosStat, 0, "Print interrupt and interrupt controller statistics."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -205,6 +207,59 @@ int SystemInfo(size_t argc, const char** argv)
 }
 
 
+int BiosStat(size_t argc, const char** argv)
+{
+	static const char* irqname[maximum_interrupt_no] = 
+		{ "ICI", "ALARM", "RX_READY", "TX_READY", "BLK_DONE", "NET_RX", "NET_TX" };
+
+	Fid_t finfo = OpenBiosInfo();
+	if(finfo==NOFILE) {
+		printf("Cannot open the BIOS statistics stream\n");
+		return 1;
+	}
+
+	/* The stats are big, read them in pieces */
+	bios_stats* stats = malloc(sizeof(bios_stats));
+	size_t count = 0;
+	int rc;
+	while(count < sizeof(bios_stats) && 
+		(rc = Read(finfo, ((char*)stats)+count, sizeof(bios_stats)-count)) > 0)
+		count += rc;
+	Close(finfo);
+
+	if(count < sizeof(bios_stats)) {
+		printf("Cannot read the BIOS statistics\n");
+		free(stats);
+		return 1;
+	}
+
+	double secs = stats->elapsed_ns * 1E-9;
+	printf("Uptime                  = %.3f sec\n", secs);
+	printf("PIC loops               = %lu (%.1f/sec)\n", 
+		stats->pic_loops, stats->pic_loops/secs);
+	printf("PIC busy                = %.3f%%\n", 
+		100.0 * stats->pic_busy_ns / stats->elapsed_ns);
+	printf("PIC wakeups (sent/recv) = %lu / %lu\n",
+		stats->pic_usr1_queued, stats->pic_usr1_drained);
+	printf("\n%4s %9s %10s %10s %10s %10s %10s\n",
+		"Core", "Interrupt", "Raised", "Raised/sec", "Delivered", "Coalesced", "Dropped");
+
+	for(uint c=0; c<stats->ncores; c++) {
+		bios_core_stats* cs = & stats->core[c];
+		for(uint i=0; i<maximum_interrupt_no; i++) {
+			unsigned long coalesced = (cs->irq_raised[i] > cs->irq_delivered[i]) ?
+				cs->irq_raised[i] - cs->irq_delivered[i] : 0;
+			printf("%4u %9s %10lu %10.1f %10lu %10lu %10lu\n", c, irqname[i],
+				cs->irq_raised[i], cs->irq_raised[i]/secs, 
+				cs->irq_delivered[i], coalesced, cs->irq_dropped[i]);
+		}
+	}
+
+	free(stats);
+	return 0;
+}
+
+
 int HelpMessage(size_t argc, const char** argv)
 {
 	printf("This is a simple shell for tinyos.\n\
@@ -328,6 +383,7 @@ int More(size_t argc, const char** argv)
 			if(count % page == 0) {
 				/* Here, we have to use getline, unless we change terminal */
 				fprintf(fout, "press enter to continue:");
+				fflush(fout);
 				(void)getline(&_line, &_lno, fkbd);
 			}
 		}
@@ -709,14 +765,22 @@ finish:
    the client program
 ************************/
 
-/* helper for RemoteClient */
-static void send_message(Fid_t sock, void* buf, size_t len)
+/* helper for RemoteClient: send the buffers of iov, usually with one call */
+static void send_message(Fid_t sock, io_vector* iov, unsigned int iovcnt)
 {
-	size_t count = 0;
-	while(count<len) {
-		int rc = Write(sock, buf+count, len-count);
+	size_t len = 0, count = 0;
+	for(unsigned int i=0; i<iovcnt; i++) len += iov[i].len;
+
+	while(iovcnt>0) {
+		int rc = WriteV(sock, iov, iovcnt);
 		if(rc<1) break;  /* Error or End of stream */
 		count += rc;
+		/* Skip what was written */
+		for(; iovcnt>0 && rc >= iov->len; iov++, iovcnt--) rc -= iov->len;
+		if(iovcnt>0) {
+			iov->base = (char*)iov->base + rc;
+			iov->len -= rc;
+		}
 	}
 	if(count!=len) {
 		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
@@ -743,20 +807,15 @@ int RemoteClient(size_t argc, const char** argv)
 	char args[argl];
 	argvpack(args, argc-1, argv+1);
 
-	/* Send message */
-	send_message(sock, &argl, sizeof(argl));
-	send_message(sock, args, argl);
+	/* Send message, with its length first */
+	io_vector msg[2] = { { &argl, sizeof(argl) }, { args, argl } };
+	send_message(sock, msg, 2);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
-	/* Read the server data and display */
-	char c;
-	FILE* fin = fidopen(sock, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(c, fout);
-	}
-	fclose(fin);
-	fclose(fout);
+	/* Forward the server data to the display */
+	while(Splice(sock, 1, 4096) > 0)
+		;
+	Close(sock);
 	return 0;
 }
 
@@ -892,6 +951,7 @@ int Shell(size_t argc, const char** argv)
 
 		/* Read the command line */
 		fprintf(fout, "%% "); 
+		fflush(fout);
 		ssize_t rc;
 
 		again:
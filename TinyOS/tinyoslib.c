@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 #include <stdio_ext.h>
 
 #include "util.h"
@@ -11,20 +12,48 @@
 
 
 
+/*
+	The C streams opened by fidopen.
+
+	The cookie of each stream records its fid and its owner process.
+	The streams of a process that are still open when it exits are 
+	closed (hence, flushed) by an AtExit function. The standard 
+	streams have no owner.
+ */
+typedef struct fid_stream {
+	Fid_t fid;
+	Pid_t owner;				/* NOPROC for the standard streams */
+	char* buffer;				/* NULL, or allocated by fidopen */
+	FILE* file;
+	struct fid_stream* next;	/* in the list of owned streams */
+} fid_stream;
+
+static fid_stream* owned_streams = NULL;
+static Mutex owned_streams_lock = MUTEX_INIT;
+
+
 static ssize_t tinyos_fid_read(void *cookie, char *buf, size_t size)
 {
-	return Read(*(Fid_t*)cookie, buf, size); 
+	return Read(((fid_stream*)cookie)->fid, buf, size); 
 }
 
 static ssize_t tinyos_fid_write(void *cookie, const char *buf, size_t size)
 {
-	int ret = Write(*(Fid_t*)cookie, buf, size); 
+	int ret = Write(((fid_stream*)cookie)->fid, buf, size); 
 	return (ret<0) ? 0 : ret;
 }
 
 static int tinyos_fid_close(void* cookie)
 {
-	free(cookie);
+	fid_stream* fs = cookie;
+	if(fs->owner != NOPROC) {
+		Mutex_Lock(&owned_streams_lock);
+		for(fid_stream** p = &owned_streams; *p; p = &(*p)->next)
+			if(*p == fs) { *p = fs->next; break; }
+		Mutex_Unlock(&owned_streams_lock);
+	}
+	free(fs->buffer);
+	free(fs);
 	return 0;
 }
 
@@ -36,27 +65,94 @@ static cookie_io_functions_t  tinyos_fid_functions =
 	tinyos_fid_close
 };
 
-static FILE* get_std_stream(int fid, const char* mode)
+
+/* Close the streams of the current process; called at Exit */
+static void close_owned_streams()
 {
-	FILE* term = fidopen(fid, mode);
-	assert(term);
-	/* This is glibc-specific and tunrs off fstream locking */
-	__fsetlocking(term, FSETLOCKING_BYCALLER);	
-	return term;
+	Pid_t pid = GetPid();
+	for(;;) {
+		FILE* f = NULL;
+		Mutex_Lock(&owned_streams_lock);
+		for(fid_stream* fs = owned_streams; fs; fs = fs->next)
+			if(fs->owner == pid) { f = fs->file; break; }
+		Mutex_Unlock(&owned_streams_lock);
+		if(f == NULL) break;
+		fclose(f);
+	}
+}
+
+
+static FILE* open_fid_stream(Fid_t fid, const char* mode, int bufmode, size_t size, Pid_t owner)
+{
+	/* 
+	   Input from a terminal is not buffered, so that the input typed 
+	   ahead is left to the next reader of the terminal (e.g., a child
+	   of a shell).
+	 */
+	if(bufmode == FIDOPEN_AUTO) {
+		if(IsTerminal(fid)!=1)
+			bufmode = _IOFBF;
+		else if(strchr(mode, 'r') || strchr(mode, '+'))
+			bufmode = _IONBF;
+		else
+			bufmode = _IOLBF;
+	}
+	if(size == 0)
+		size = FIDOPEN_BUFSIZ;
+
+	fid_stream* fs = (fid_stream *) xmalloc(sizeof(fid_stream));
+	fs->fid = fid;
+	fs->owner = owner;
+	fs->buffer = NULL;
+	FILE* f = fopencookie(fs, mode, tinyos_fid_functions);
+	if(f == NULL) {
+		free(fs);
+		return NULL;
+	}
+	fs->file = f;
+
+	if(bufmode != _IONBF)
+		fs->buffer = xmalloc(size);
+	CHECKRC(setvbuf(f, fs->buffer, bufmode, size));
+
+	if(owner != NOPROC) {
+		Mutex_Lock(&owned_streams_lock);
+		fs->next = owned_streams;
+		owned_streams = fs;
+		Mutex_Unlock(&owned_streams_lock);
+		AtExit(close_owned_streams);
+	}
+	return f;
+}
+
+
+FILE* fidopen_buffered(Fid_t fid, const char* mode, int bufmode, size_t size)
+{
+	return open_fid_stream(fid, mode, bufmode, size, GetPid());
 }
 
 
 FILE* fidopen(Fid_t fid, const char* mode)
 {
+	return fidopen_buffered(fid, mode, FIDOPEN_AUTO, 0);
+}
 
-	Fid_t* fidloc = (Fid_t *) malloc(sizeof(Fid_t));
-	* fidloc = fid;
-	FILE* f = fopencookie(fidloc, mode, tinyos_fid_functions);
 
-	CHECKRC(setvbuf(f, NULL, _IONBF, 0));
-	return f;
+static FILE* get_std_stream(int fid, const char* mode)
+{
+	/* 
+	   The standard streams are shared by all processes, and each 
+	   process writes to its own fid 1; a buffer would mix up their
+	   output. 
+	 */
+	FILE* term = open_fid_stream(fid, mode, _IONBF, 0, NOPROC);
+	assert(term);
+	/* This is glibc-specific and tunrs off fstream locking */
+	__fsetlocking(term, FSETLOCKING_BYCALLER);	
+	return term;
 }
 
+
 FILE *saved_in = NULL, *saved_out = NULL;
 
 
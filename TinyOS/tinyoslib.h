@@ -13,14 +13,41 @@
   */
 
 
+/** @brief The default buffer size of the streams of @c fidopen */
+#define FIDOPEN_BUFSIZ 4096
+
+/** @brief Select the buffering of a stream by its file id, see @c fidopen_buffered */
+#define FIDOPEN_AUTO (-1)
+
 /**
     @brief Open a C stream on a tinyos file descriptor.
 
+	On a terminal, an output stream is line-buffered and a stream
+	that reads is unbuffered, so that input typed ahead stays in the
+	terminal. On other streams, the stream is fully buffered. Buffers
+	have @c FIDOPEN_BUFSIZ bytes.
 	This call returns a new FILE pointer on success and NULL
 	on failure.
+	@see fidopen_buffered
 */
 FILE* fidopen(Fid_t fid, const char* mode);
 
+/**
+    @brief Open a C stream on a tinyos file descriptor, with the given buffering.
+
+	The buffering mode @c bufmode is one of @c _IOFBF, @c _IOLBF and 
+	@c _IONBF, as in @c setvbuf, or @c FIDOPEN_AUTO to choose it as
+	@c fidopen does. A @c size of 0 selects @c FIDOPEN_BUFSIZ.
+
+	Streams that the process has not closed when it exits are closed 
+	by @c Exit, so that their buffered output is written. To do this,
+	the call adds an @c AtExit function to the process.
+
+	This call returns a new FILE pointer on success and NULL
+	on failure.
+*/
+FILE* fidopen_buffered(Fid_t fid, const char* mode, int bufmode, size_t size);
+
 void tinyos_replace_stdio();
 void tinyos_restore_stdio();
 void tinyos_pseudo_console();
@@ -22,6 +22,7 @@
 
 #include "unit_testing.h"
 #include "util.h"
+#include "bios.h"
 
 
 /*
@@ -560,15 +561,38 @@ int execute(void (*procfunc)(void), unsigned int timeout)
 
 
 
-int execute_boot(int ncores, int nterm, Task bootfunc, int argl, void* args, unsigned int timeout)
+int execute_boot(int ncores, int nterm, unsigned int disk_sectors, unsigned int disk_latency,
+	unsigned int nic_queues, Task bootfunc, int argl, void* args, unsigned int timeout)
 {
 	void run_boot() 
 	{
 		for(uint i=0;i<nterm; i++)
 			term_proxy_init(&PROXY[i], i);
 
+		/* The scratch disk is an unlinked temporary file, reopened by the 
+		   VM through /proc, so that nothing is left behind. */
+		int diskfd = -1;
+		char diskname[32];
+		if(disk_sectors > 0) {
+			char tmpname[] = "/tmp/tinyos_disk.XXXXXX";
+			diskfd = mkstemp(tmpname);
+			CHECK(diskfd);
+			CHECK(unlink(tmpname));
+			CHECK(ftruncate(diskfd, (off_t) disk_sectors * BLOCK_SECTOR_SIZE));
+			sprintf(diskname, "/proc/self/fd/%d", diskfd);
+			vm_config_disk(0, diskname, disk_latency, 0);
+		}
+		if(nic_queues > 0)
+			vm_config_nic(0, VM_NIC_LOOPBACK, NULL, nic_queues);
+
 		boot(ncores, nterm, bootfunc, argl, args);		
 
+		if(diskfd != -1) {
+			vm_config_disk(0, NULL, 0, 0);
+			CHECK(close(diskfd));
+		}
+		if(nic_queues > 0)
+			vm_config_nic(0, VM_NIC_NONE, NULL, 0);
 
 		for(uint i=0;i<nterm; i++)
 			term_proxy_close(&PROXY[i]);
@@ -596,7 +620,8 @@ int run_boot_test(const Test* test, uint ncores, uint nterm, int argl, void* arg
 	assert(test->type == BOOT_FUNC);
 
 	if(! skipped) {
-		status = execute_boot(ncores, nterm, test->boot, argl, args, test->timeout);
+		status = execute_boot(ncores, nterm, test->disk_sectors, test->disk_latency, test->nic_queues,
+			test->boot, argl, args, test->timeout);
 		result = WIFEXITED(status) && WEXITSTATUS(status)==129 ? 1 : 0;
 		if(WIFSIGNALED(status))
 			MSG("Test crashed, signal=%d (%s)\n", 
@@ -319,6 +319,12 @@ typedef struct Test
 	unsigned int timeout;				/**< time to kill test (see DEFAULT_TIMEOUT) */
 	unsigned int minimum_terminals;		/**< Minimum no. of terminals required. Default: 0 */
 	unsigned int minimum_cores;			/**< Minimum no. of cores required. Default: 1 */
+	unsigned int disk_sectors;			/**< Sectors of a scratch block device 0, attached 
+											 for boot tests. Default: 0 (no disk) */
+	unsigned int disk_latency;			/**< Latency of the scratch block device, in usec. 
+											 Default: 0 */
+	unsigned int nic_queues;			/**< Queues of a loopback network device 0, attached
+											 for boot tests. Default: 0 (no network device) */
 } Test;
 
 
@@ -10,6 +10,7 @@
 #include "symposium.h"
 #include "tinyoslib.h"
 #include "unit_testing.h"
+#include "kernel_fs.h"
 
 
 /*
@@ -365,6 +366,608 @@ BOOT_TEST(test_get_terminals,
 	return 0;
 }
 
+
+BOOT_TEST(test_bios_info_stream,
+	"Test that the BIOS statistics stream returns a single bios_stats block,\n"
+	"describing the running VM."
+	)
+{
+	Fid_t finfo = OpenBiosInfo();
+	ASSERT(finfo!=NOFILE);
+
+	bios_stats* stats = malloc(sizeof(bios_stats));
+	size_t count = 0;
+	int rc;
+	while((rc = Read(finfo, ((char*)stats)+count, sizeof(bios_stats)-count)) > 0)
+		count += rc;
+
+	ASSERT(rc==0);
+	ASSERT(count==sizeof(bios_stats));
+	ASSERT(stats->ncores==cpu_cores());
+	ASSERT(stats->elapsed_ns > 0);
+	for(uint c=0; c<stats->ncores; c++)
+		for(uint i=0; i<maximum_interrupt_no; i++)
+			ASSERT(stats->core[c].irq_delivered[i] <= stats->core[c].irq_raised[i]);
+
+	ASSERT(Close(finfo)==0);
+	free(stats);
+	return 0;
+}
+
+BOOT_TEST(test_get_time,
+	"Test that GetTime() is monotonic, and that it has a sub-millisecond\n"
+	"resolution."
+	)
+{
+	Time_t t0 = GetTime();
+	Time_t tprev = t0;
+	Time_t t = t0;
+
+	/* Spin until the clock changes, checking monotonicity */
+	for(int i=0; i<1000000 && t==t0; i++) {
+		t = GetTime();
+		ASSERT(t >= tprev);
+		tprev = t;
+	}
+	ASSERT(t > t0);
+	ASSERT(t - t0 < 1000000);
+	return 0;
+}
+
+
+BOOT_TEST(test_block_device_rw,
+	"Test that data written to a block device stream, in whole and in partial\n"
+	"sectors, is read back, and that the stream ends at the end of the device.",
+	.disk_sectors = 64
+	)
+{
+	ASSERT(GetBlockDevices()==1);
+	const uint devsize = 64*BLOCK_SECTOR_SIZE;
+
+	/* Write the whole device, in pieces not aligned to sectors */
+	char* data = malloc(devsize);
+	for(uint i=0; i<devsize; i++) data[i] = (i*7) % 251;
+
+	Fid_t fdisk = OpenBlockDevice(0);
+	ASSERT(fdisk!=NOFILE);
+	uint count = 0;
+	while(count < devsize) {
+		uint size = (count % 3 == 0) ? 1000 : 300;
+		if(size > devsize-count) size = devsize-count;
+		int rc = Write(fdisk, data+count, size);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	ASSERT(Write(fdisk, data, 1)==-1);
+	ASSERT(Close(fdisk)==0);
+
+	/* Read it back */
+	char* buffer = malloc(devsize);
+	fdisk = OpenBlockDevice(0);
+	ASSERT(fdisk!=NOFILE);
+	count = 0;
+	int rc;
+	while((rc = Read(fdisk, buffer+count, 777)) > 0)
+		count += rc;
+	ASSERT(rc==0);
+	ASSERT(count==devsize);
+	ASSERT(memcmp(data, buffer, devsize)==0);
+	ASSERT(Close(fdisk)==0);
+
+	ASSERT(OpenBlockDevice(1)==NOFILE);
+
+	free(data);
+	free(buffer);
+	return 0;
+}
+
+
+BOOT_TEST(test_fs_write_read_seek,
+	"Test that files can be created, written, read back and positioned, and\n"
+	"that a file written sequentially is stored in a single extent.",
+	.disk_sectors = 16384
+	)
+{
+	/* A blank device has no file system */
+	ASSERT(Open("data", OPEN_READ)==NOFILE);
+	ASSERT(FormatFS()==0);
+	ASSERT(Open("data", OPEN_READ)==NOFILE);
+
+	const uint fsize = 1<<20;
+	char* buffer = malloc(fsize);
+	for(uint i=0; i<fsize; i++) buffer[i] = (i*13) % 253;
+
+	Fid_t f = Create("data");
+	ASSERT(f!=NOFILE);
+	for(uint pos=0; pos<fsize; ) {
+		uint size = (fsize-pos < 7000) ? fsize-pos : 7000;
+		ASSERT(Write(f, buffer+pos, size)==size);
+		pos += size;
+	}
+	ASSERT(Close(f)==0);
+
+	file_stat st;
+	ASSERT(Stat("data", &st)==0);
+	ASSERT(st.size==fsize);
+	ASSERT(st.extents==1);
+	ASSERT(st.blocks==fsize/FS_BLOCK_SIZE);
+
+	/* Read back */
+	char* rbuf = malloc(fsize);
+	f = Open("data", OPEN_READ);
+	ASSERT(f!=NOFILE);
+	uint count = 0;
+	int rc;
+	while((rc = Read(f, rbuf+count, 5000)) > 0)
+		count += rc;
+	ASSERT(rc==0);
+	ASSERT(count==fsize);
+	ASSERT(memcmp(buffer, rbuf, fsize)==0);
+	ASSERT(Write(f, buffer, 1)==-1);
+
+	/* Seek */
+	ASSERT(Seek(f, 12345, SEEK_FROM_START)==12345);
+	ASSERT(Read(f, rbuf, 10)==10);
+	ASSERT(memcmp(buffer+12345, rbuf, 10)==0);
+	ASSERT(Seek(f, -10, SEEK_FROM_CURRENT)==12345);
+	ASSERT(Seek(f, -10, SEEK_FROM_END)==fsize-10);
+	ASSERT(Read(f, rbuf, 100)==10);
+	ASSERT(memcmp(buffer+fsize-10, rbuf, 10)==0);
+	ASSERT(Seek(f, -1, SEEK_FROM_START)==-1);
+	ASSERT(Close(f)==0);
+
+	/* Append */
+	f = Open("data", OPEN_WRITE|OPEN_APPEND);
+	ASSERT(f!=NOFILE);
+	ASSERT(Seek(f, 0, SEEK_FROM_START)==0);
+	ASSERT(Write(f, "tail", 4)==4);
+	ASSERT(Close(f)==0);
+	ASSERT(Stat("data", &st)==0);
+	ASSERT(st.size==fsize+4);
+
+	/* Create truncates */
+	f = Create("data");
+	ASSERT(f!=NOFILE);
+	ASSERT(Stat("data", &st)==0);
+	ASSERT(st.size==0 && st.blocks==0);
+	ASSERT(Read(f, rbuf, 10)==0);
+	ASSERT(Close(f)==0);
+
+	/* Names */
+	char name[MAX_NAME_LENGTH+2];
+	memset(name, 'n', sizeof(name));
+	name[MAX_NAME_LENGTH+1] = '\0';
+	ASSERT(Create(name)==NOFILE);
+	name[MAX_NAME_LENGTH] = '\0';
+	f = Create(name);
+	ASSERT(f!=NOFILE);
+	ASSERT(Close(f)==0);
+	ASSERT(Create("")==NOFILE);
+	ASSERT(Open("data", 0)==NOFILE);
+	ASSERT(Open("data", OPEN_READ|OPEN_APPEND)==NOFILE);
+
+	free(buffer);
+	free(rbuf);
+	return 0;
+}
+
+
+BOOT_TEST(test_fs_unlink_and_gaps,
+	"Test that unlinked files stay usable until closed, that their space is\n"
+	"then reclaimed, and that a gap written past the end of a file reads as zeros.",
+	.disk_sectors = 4096
+	)
+{
+	ASSERT(FormatFS()==0);
+
+	/* A gap */
+	char buf[4096];
+	memset(buf, 'x', sizeof(buf));
+	Fid_t f = Create("gap");
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, buf, 100)==100);
+	ASSERT(Seek(f, 10000, SEEK_FROM_START)==10000);
+	ASSERT(Write(f, "z", 1)==1);
+	ASSERT(Seek(f, 0, SEEK_FROM_START)==0);
+	char* rbuf = malloc(10001);
+	uint count = 0;
+	int rc;
+	while((rc = Read(f, rbuf+count, 10001-count)) > 0)
+		count += rc;
+	ASSERT(count==10001);
+	for(uint i=0; i<10001; i++)
+		ASSERT(rbuf[i] == (i<100 ? 'x' : (i<10000 ? 0 : 'z')));
+	free(rbuf);
+
+	/* FormatFS fails while a file is open */
+	ASSERT(FormatFS()==-1);
+
+	/* Unlink an open file */
+	file_stat st;
+	ASSERT(Stat("gap", &st)==0);
+	uint ino = st.inode;
+	ASSERT(Unlink("gap")==0);
+	ASSERT(Unlink("gap")==-1);
+	ASSERT(Stat("gap", &st)==-1);
+	ASSERT(Open("gap", OPEN_READ)==NOFILE);
+	ASSERT(Seek(f, 10000, SEEK_FROM_START)==10000);
+	ASSERT(Read(f, buf, 10)==1 && buf[0]=='z');
+
+	Fid_t g = Create("gap");
+	ASSERT(g!=NOFILE);
+	ASSERT(Stat("gap", &st)==0);
+	ASSERT(st.inode != ino);
+	ASSERT(Close(g)==0);
+	ASSERT(Close(f)==0);
+
+	/* Fill the device twice, with the space of the first file reclaimed */
+	uint total[2];
+	memset(buf, 'y', sizeof(buf));
+	for(int k=0; k<2; k++) {
+		f = Create("big");
+		ASSERT(f!=NOFILE);
+		total[k] = 0;
+		while((rc = Write(f, buf, sizeof(buf))) > 0)
+			total[k] += rc;
+		ASSERT(Close(f)==0);
+		ASSERT(total[k] > 500*4096);
+		ASSERT(Unlink("big")==0);
+	}
+	ASSERT(total[0]==total[1]);
+	return 0;
+}
+
+
+static int map_file_child(int argl, void* args)
+{
+	const char* addr = *(const char**) args;
+	Fid_t f = Open("data", OPEN_READ);
+	ASSERT(f!=NOFILE);
+	/* The mapping is released on exit */
+	ASSERT(MapFile(f, 0, 3*FS_BLOCK_SIZE)==addr);
+	ASSERT(MapFile(f, 10, 100)==addr+10);
+	return 0;
+}
+
+BOOT_TEST(test_map_file,
+	"Test that MapFile returns the data of a file in place, that mappings of\n"
+	"the same data are shared, and that UnmapFile and Exit release them.",
+	.disk_sectors = 16384
+	)
+{
+	ASSERT(FormatFS()==0);
+
+	const uint fsize = 2<<20;
+	char* buffer = malloc(fsize);
+	for(uint i=0; i<fsize; i++) buffer[i] = (i*7) % 251;
+
+	Fid_t f = Create("data");
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, buffer, fsize)==fsize);
+
+	/* Map a file that is (partly) in the cache */
+	const char* addr = MapFile(f, 0, 300000);
+	ASSERT(addr!=NULL);
+	ASSERT(memcmp(addr, buffer, 300000)==0);
+	ASSERT(MapFile(f, 0, 300000)==addr);
+	ASSERT(MapFile(f, 5000, 100)==addr+5000);
+
+	/* Writes are visible in the mapping */
+	ASSERT(Seek(f, 10, SEEK_FROM_START)==10);
+	ASSERT(Write(f, "hello", 5)==5);
+	ASSERT(memcmp(addr+10, "hello", 5)==0);
+	memcpy(buffer+10, "hello", 5);
+
+	/* Other processes share the mapping */
+	ASSERT(Exec(map_file_child, sizeof(addr), &addr)!=NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	ASSERT(UnmapFile(addr)==0);
+	ASSERT(UnmapFile(addr)==0);
+	ASSERT(UnmapFile(addr)==-1);
+	ASSERT(UnmapFile(addr+5000)==0);
+	ASSERT(UnmapFile(NULL)==-1);
+
+	/* A long mapping, at an unaligned offset, outlives the stream */
+	const uint offset = 3*FS_BLOCK_SIZE + 7;
+	addr = MapFile(f, offset, MAX_MAP_LENGTH);
+	ASSERT(addr!=NULL);
+	ASSERT(Close(f)==0);
+	ASSERT(memcmp(addr, buffer+offset, MAX_MAP_LENGTH)==0);
+	ASSERT(UnmapFile(addr)==0);
+
+	/* Errors */
+	f = Open("data", OPEN_READ);
+	ASSERT(f!=NOFILE);
+	ASSERT(MapFile(f, fsize-10, 20)==NULL);
+	ASSERT(MapFile(f, -1, 20)==NULL);
+	ASSERT(MapFile(f, 0, 0)==NULL);
+	ASSERT(MapFile(f, 0, MAX_MAP_LENGTH+1)==NULL);
+	ASSERT(MapFile(NOFILE, 0, 10)==NULL);
+	Fid_t g = Open("data", OPEN_WRITE);
+	ASSERT(g!=NOFILE);
+	ASSERT(MapFile(g, 0, 10)==NULL);
+	ASSERT(Close(g)==0);
+
+	/* An unlinked file lives while it is mapped */
+	addr = MapFile(f, fsize - 1000, 1000);
+	ASSERT(addr!=NULL);
+	ASSERT(Close(f)==0);
+	ASSERT(Unlink("data")==0);
+	ASSERT(memcmp(addr, buffer+fsize-1000, 1000)==0);
+	ASSERT(UnmapFile(addr)==0);
+
+	free(buffer);
+	return 0;
+}
+
+
+/* A test packet: a flow key, a sequence number and some payload */
+static uint net_test_packet(char* pkt, int flow, int seq)
+{
+	uint len = 8 + (seq*flow) % 100;
+	memcpy(pkt, "flow", 4);
+	pkt[3] = flow;
+	memcpy(pkt+4, &seq, sizeof(int));
+	for(uint i=8; i<len; i++) pkt[i] = seq + i;
+	return len;
+}
+
+static int net_sender(int argl, void* args)
+{
+	Fid_t nic = *(Fid_t*) args;
+	char pkt[NET_MTU];
+	for(int i=0; i<10; i++) {
+		uint len = net_test_packet(pkt, 9, i);
+		ASSERT(Write(nic, pkt, len)==len);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_net_loopback,
+	"Test that a loopback network device returns the packets written to it,\n"
+	"keeping the packets of each flow in order.",
+	.nic_queues = 2
+	)
+{
+	ASSERT(GetNetworkDevices()==1);
+	ASSERT(OpenNetworkDevice(1)==NOFILE);
+	Fid_t nic = OpenNetworkDevice(0);
+	ASSERT(nic!=NOFILE);
+
+	char pkt[NET_MTU+1], rbuf[NET_MTU+1];
+	memset(pkt, 'p', sizeof(pkt));
+	ASSERT(Write(nic, pkt, 0)==-1);
+	ASSERT(Write(nic, pkt, NET_MTU+1)==-1);
+
+	/* Interleaved flows, which may be steered to different queues */
+	const int nflows = 4, npkts = 50;
+	for(int i=0; i<npkts; i++)
+		for(int f=0; f<nflows; f++) {
+			uint len = net_test_packet(pkt, f, i);
+			ASSERT(Write(nic, pkt, len)==len);
+		}
+
+	int next[4] = { 0 };
+	for(int k=0; k<nflows*npkts; k++) {
+		int len = Read(nic, rbuf, sizeof(rbuf));
+		ASSERT(len >= 8 && memcmp(rbuf, "flo", 3)==0);
+		int f = rbuf[3], seq;
+		memcpy(&seq, rbuf+4, sizeof(int));
+		ASSERT(f < nflows && seq == next[f]);
+		next[f]++;
+		ASSERT(len == net_test_packet(pkt, f, seq));
+		ASSERT(memcmp(rbuf, pkt, len)==0);
+	}
+
+	/* Whole and truncated packets */
+	memset(pkt, 'q', NET_MTU);
+	ASSERT(Write(nic, pkt, NET_MTU)==NET_MTU);
+	ASSERT(Read(nic, rbuf, sizeof(rbuf))==NET_MTU);
+	ASSERT(memcmp(rbuf, pkt, NET_MTU)==0);
+	ASSERT(Write(nic, pkt, 100)==100);
+	ASSERT(Read(nic, rbuf, 10)==10);
+
+	/* Readers sleep until packets arrive */
+	ASSERT(Exec(net_sender, sizeof(nic), &nic)!=NOPROC);
+	for(int i=0; i<10; i++) {
+		int len = Read(nic, rbuf, sizeof(rbuf));
+		ASSERT(len == net_test_packet(pkt, 9, i));
+		ASSERT(memcmp(rbuf, pkt, len)==0);
+	}
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	ASSERT(Close(nic)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_ramdisk,
+	"Test reading and writing RAM disks at arbitrary positions."
+	)
+{
+	ASSERT(OpenRamDisk(MAX_RAMDISKS)==NOFILE);
+	Fid_t rd = OpenRamDisk(0);
+	ASSERT(rd!=NOFILE);
+
+	char buf[1000];
+	ASSERT(Read(rd, buf, 1000)==1000);
+	for(int i=0; i<1000; i++) ASSERT(buf[i]==0);
+
+	/* Writes at unaligned positions */
+	ASSERT(Seek(rd, 12345, SEEK_FROM_START)==12345);
+	ASSERT(Write(rd, "Hello world", 11)==11);
+	ASSERT(Seek(rd, 0, SEEK_FROM_CURRENT)==12356);
+
+	/* Another stream sees the data; the other disk does not */
+	Fid_t rd2 = OpenRamDisk(0);
+	ASSERT(Seek(rd2, 12350, SEEK_FROM_START)==12350);
+	ASSERT(Read(rd2, buf, 6)==6);
+	ASSERT(memcmp(buf, " world", 6)==0);
+	ASSERT(Close(rd2)==0);
+	Fid_t rd1 = OpenRamDisk(1);
+	ASSERT(Seek(rd1, 12345, SEEK_FROM_START)==12345);
+	ASSERT(Read(rd1, buf, 5)==5);
+	ASSERT(buf[0]==0 && buf[4]==0);
+	ASSERT(Close(rd1)==0);
+
+	/* The end of the disk */
+	ASSERT(Seek(rd, -4, SEEK_FROM_END)==RAMDISK_SIZE-4);
+	ASSERT(Write(rd, "abcdef", 6)==4);
+	ASSERT(Write(rd, "abcdef", 6)==-1);
+	ASSERT(Read(rd, buf, 10)==0);
+	ASSERT(Seek(rd, -2, SEEK_FROM_CURRENT)==RAMDISK_SIZE-2);
+	ASSERT(Read(rd, buf, 10)==2);
+	ASSERT(memcmp(buf, "cd", 2)==0);
+	ASSERT(Seek(rd, 1, SEEK_FROM_END)==-1);
+	ASSERT(Seek(rd, -1, SEEK_FROM_START)==-1);
+
+	ASSERT(Close(rd)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_readv_writev,
+	"Test vectored reads and writes, on a stream with vectored operations\n"
+	"(a RAM disk) and on one without (the null device)."
+	)
+{
+	char hdr[4] = "HDR:", body[10] = "0123456789", out[14];
+	io_vector wv[3] = { { hdr, 4 }, { NULL, 0 }, { body, 10 } };
+
+	/* Bad arguments */
+	ASSERT(WriteV(NOFILE, wv, 3)==-1);
+	ASSERT(WriteV(MAX_FILEID, wv, 3)==-1);
+	Fid_t rd = OpenRamDisk(0);
+	ASSERT(rd!=NOFILE);
+	ASSERT(WriteV(rd, NULL, 1)==-1);
+	io_vector huge[2] = { { body, 1u<<31 }, { body, 1u<<31 } };
+	ASSERT(WriteV(rd, huge, 2)==-1);
+	ASSERT(WriteV(rd, wv, 0)==0);
+
+	ASSERT(WriteV(rd, wv, 3)==14);
+	ASSERT(Seek(rd, 0, SEEK_FROM_START)==0);
+	ASSERT(Read(rd, out, 14)==14);
+	ASSERT(memcmp(out, "HDR:0123456789", 14)==0);
+
+	/* Scatter */
+	char a[5], b[9];
+	io_vector rv[2] = { { a, 5 }, { b, 9 } };
+	ASSERT(Seek(rd, 0, SEEK_FROM_START)==0);
+	ASSERT(ReadV(rd, rv, 2)==14);
+	ASSERT(memcmp(a, "HDR:0", 5)==0 && memcmp(b, "123456789", 9)==0);
+
+	/* At the end of the disk */
+	ASSERT(Seek(rd, -6, SEEK_FROM_END)==RAMDISK_SIZE-6);
+	ASSERT(WriteV(rd, wv, 3)==6);
+	ASSERT(WriteV(rd, wv, 3)==-1);
+	ASSERT(Seek(rd, -6, SEEK_FROM_END)==RAMDISK_SIZE-6);
+	ASSERT(ReadV(rd, rv, 2)==6);
+	ASSERT(memcmp(a, "HDR:0", 5)==0 && b[0]=='1');
+	ASSERT(ReadV(rd, rv, 2)==0);
+	ASSERT(Close(rd)==0);
+
+	/* Without vectored operations */
+	Fid_t nul = OpenNull();
+	ASSERT(WriteV(nul, wv, 3)==14);
+	ASSERT(ReadV(nul, rv, 2)==14);
+	ASSERT(a[0]==0 && b[8]==0);
+	ASSERT(Close(nul)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice,
+	"Test moving data between files, RAM disks and the null device with\n"
+	"Splice.",
+	.disk_sectors = 16384
+	)
+{
+	ASSERT(FormatFS()==0);
+	const int size = 3*FS_BLOCK_SIZE + 100;
+	static char data[3*FS_BLOCK_SIZE + 100], back[3*FS_BLOCK_SIZE + 100];
+	for(int i=0; i<size; i++) data[i] = i % 251;
+
+	Fid_t rd = OpenRamDisk(0);
+	ASSERT(Write(rd, data, size)==size);
+	ASSERT(Seek(rd, 0, SEEK_FROM_START)==0);
+
+	/* Bad arguments */
+	Fid_t f = Create("spliced");
+	ASSERT(Splice(NOFILE, f, 10)==-1);
+	ASSERT(Splice(rd, NOFILE, 10)==-1);
+	ASSERT(Splice(rd, rd, 10)==-1);
+	ASSERT(Splice(rd, f, 0)==0);
+
+	/* RAM disk to file */
+	ASSERT(Splice(rd, f, size)==size);
+	file_stat st;
+	ASSERT(Stat("spliced", &st)==0 && st.size==size);
+
+	/* File to file: the same file is refused */
+	Fid_t f2 = Open("spliced", OPEN_READ);
+	ASSERT(Splice(f2, f, 10)==-1);
+	Fid_t g = Create("copy");
+	int moved = 0, rc;
+	while((rc = Splice(f2, g, 1000)) > 0) moved += rc;
+	ASSERT(rc==0 && moved==size);
+
+	/* File to RAM disk, in parts that cross blocks */
+	Fid_t rd1 = OpenRamDisk(1);
+	ASSERT(Seek(g, 0, SEEK_FROM_START)==0);
+	ASSERT(Splice(g, rd1, FS_BLOCK_SIZE+7)==FS_BLOCK_SIZE+7);
+	ASSERT(Splice(g, rd1, size)==size-FS_BLOCK_SIZE-7);
+	ASSERT(Splice(g, rd1, size)==0);
+	ASSERT(Seek(rd1, 0, SEEK_FROM_START)==0);
+	ASSERT(Read(rd1, back, size)==size);
+	ASSERT(memcmp(data, back, size)==0);
+
+	/* Through the kernel buffer: the null device has no Splice method */
+	Fid_t nul = OpenNull();
+	ASSERT(Splice(nul, rd1, 100)==100);
+	ASSERT(Seek(rd1, -100, SEEK_FROM_CURRENT)==size);
+	ASSERT(Read(rd1, back, 100)==100 && back[0]==0 && back[99]==0);
+	ASSERT(Seek(rd, 0, SEEK_FROM_START)==0);
+	ASSERT(Splice(rd, nul, 1000)==1000);
+
+	/* Between two streams of a RAM disk, with overlapping ranges */
+	Fid_t rd2 = OpenRamDisk(0);
+	ASSERT(Seek(rd, 0, SEEK_FROM_START)==0);
+	ASSERT(Seek(rd2, 100, SEEK_FROM_START)==100);
+	ASSERT(Splice(rd, rd2, 1000)==1000);
+	ASSERT(Seek(rd2, 100, SEEK_FROM_START)==100);
+	ASSERT(Read(rd2, back, 1000)==1000);
+	ASSERT(memcmp(data, back, 1000)==0);
+	Close(rd2);
+
+	/* Writing past the end of a RAM disk fails */
+	ASSERT(Seek(rd1, 0, SEEK_FROM_END)==RAMDISK_SIZE);
+	ASSERT(Splice(nul, rd1, 10)==-1);
+
+	Close(nul); Close(rd1); Close(g); Close(f2); Close(f); Close(rd);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice_closed_output,
+	"Test that Splice reads nothing from the keyboard into a pipe whose\n"
+	"reader is closed.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Close(pipe.read)==0);
+
+	sendme(0, "Hello");
+	ASSERT(Splice(fterm, pipe.write, 5)==-1);
+	checked_read(fterm, "Hello");
+	return 0;
+}
+
+
 BOOT_TEST(test_dup2_error_on_nonfile,
 	"Test that Dup2 will return an error if oldfd is not a file.")
 {
@@ -564,6 +1167,464 @@ BOOT_TEST(test_read_from_many_terminals,
 
 
 
+static Mutex timedwait_mx = MUTEX_INIT;
+static CondVar timedwait_cv = COND_INIT;
+
+static int timedwait_signaller(int argl, void* args)
+{
+	Mutex_Lock(&timedwait_mx);
+	Cond_Signal(&timedwait_cv);
+	Mutex_Unlock(&timedwait_mx);
+	return 0;
+}
+
+BOOT_TEST(test_cond_timedwait,
+	"Test that Cond_TimedWait returns after its timeout, or when signalled."
+	)
+{
+	Mutex* mx = &timedwait_mx;
+	CondVar* cv = &timedwait_cv;
+
+	Time_t t0 = GetTime();
+	Mutex_Lock(mx);
+	ASSERT(Cond_TimedWait(mx, cv, 100)==0);
+	Mutex_Unlock(mx);
+	ASSERT(GetTime()-t0 >= 100000000ull);
+
+	/* The child cannot signal before we release the mutex */
+	Mutex_Lock(mx);
+	ASSERT(Exec(timedwait_signaller, 0, NULL)!=NOPROC);
+	ASSERT(Cond_TimedWait(mx, cv, 10000)==1);
+	Mutex_Unlock(mx);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+
+/* Send a packet to the network device argl */
+static int net_send_one(int argl, void* args)
+{
+	ASSERT(Write(argl, "ping", 4)==4);
+	return 0;
+}
+
+BOOT_TEST(test_poll,
+	"Test Poll and non-blocking mode, on terminals, network devices and\n"
+	"the null device.",
+	.minimum_terminals = 1, .nic_queues = 2
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	Fid_t fnull = OpenNull();
+	Fid_t fnic = OpenNetworkDevice(0);
+	ASSERT(fterm!=NOFILE && fnull!=NOFILE && fnic!=NOFILE);
+
+	/* Bad arguments; NOFILE entries are ignored */
+	Fid_t bad[2] = { fnull, MAX_FILEID };
+	int ev[3] = { POLL_READ, POLL_READ, POLL_READ };
+	ASSERT(Poll(bad, ev, 2, 0)==-1);
+	Fid_t some[2] = { NOFILE, fnull };
+	ASSERT(Poll(some, ev, 2, 0)==1);
+	ASSERT(ev[0]==0 && ev[1]==POLL_READ);
+
+	/* A terminal without input can be written */
+	ev[0] = POLL_READ | POLL_WRITE;
+	ASSERT(Poll(&fterm, ev, 1, 0)==1);
+	ASSERT(ev[0]==POLL_WRITE);
+
+	/* Timeouts */
+	Fid_t idle[2] = { fterm, fnic };
+	ev[0] = ev[1] = POLL_READ;
+	Time_t t0 = GetTime();
+	ASSERT(Poll(idle, ev, 2, 100)==0);
+	ASSERT(ev[0]==0 && ev[1]==0);
+	ASSERT(GetTime()-t0 >= 100000000ull);
+
+	/* Non-blocking reads fail */
+	char buf[16];
+	ASSERT(SetNonBlocking(fterm, 1)==0 && SetNonBlocking(fnic, 1)==0);
+	ASSERT(SetNonBlocking(MAX_FILEID, 1)==-1);
+	ASSERT(Read(fterm, buf, 16)==-1);
+	ASSERT(Read(fnic, buf, 16)==-1);
+	ASSERT(Write(fterm, "", 0)==0);
+
+	/* Wait for input from either stream */
+	sendme(0, "Hello");
+	ev[0] = ev[1] = POLL_READ;
+	ASSERT(Poll(idle, ev, 2, -1)==1);
+	ASSERT(ev[0]==POLL_READ && ev[1]==0);
+	int count = 0;
+	while(count < 5) {
+		int rc = Read(fterm, buf+count, 5-count);
+		if(rc == -1) {
+			ev[0] = POLL_READ;
+			ASSERT(Poll(&fterm, ev, 1, -1)==1);
+		}
+		else
+			count += rc;
+	}
+	ASSERT(memcmp(buf, "Hello", 5)==0);
+
+	ASSERT(Exec(net_send_one, fnic, NULL)!=NOPROC);
+	ev[0] = ev[1] = POLL_READ;
+	ASSERT(Poll(idle, ev, 2, -1)==1);
+	ASSERT(ev[0]==0 && ev[1]==POLL_READ);
+	ASSERT(Read(fnic, buf, 16)==4);
+	ASSERT(memcmp(buf, "ping", 4)==0);
+	ASSERT(Read(fnic, buf, 16)==-1);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* Non-blocking writes fail when the queues fill up, since nobody reads */
+	int sent = 0;
+	while(sent < 1000000 && Write(fnic, "ping", 4)==4)
+		sent++;
+	ASSERT(sent > 0 && sent < 1000000);
+
+	ASSERT(Close(fnic)==0 && Close(fnull)==0 && Close(fterm)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_event_objects,
+	"Test EventCreate, EventCtl and EventWait, with level- and edge-triggered\n"
+	"streams.",
+	.minimum_terminals = 1, .nic_queues = 2
+	)
+{
+	Fid_t efd = EventCreate();
+	Fid_t fterm = OpenTerminal(0);
+	Fid_t fnull = OpenNull();
+	Fid_t fnic = OpenNetworkDevice(0);
+	ASSERT(efd!=NOFILE && fterm!=NOFILE && fnull!=NOFILE && fnic!=NOFILE);
+	event_record evs[4];
+
+	/* Bad arguments */
+	ASSERT(EventCtl(fnull, EVENT_ADD, fterm, POLL_READ)==-1);
+	ASSERT(EventCtl(efd, EVENT_ADD, efd, POLL_READ)==-1);
+	ASSERT(EventCtl(efd, EVENT_ADD, MAX_FILEID, POLL_READ)==-1);
+	ASSERT(EventCtl(efd, EVENT_DEL, fterm, 0)==-1);
+	ASSERT(EventCtl(efd, EVENT_MOD, fterm, POLL_READ)==-1);
+	ASSERT(EventWait(fnull, evs, 4, 0)==-1);
+
+	ASSERT(EventCtl(efd, EVENT_ADD, fterm, POLL_READ)==0);
+	ASSERT(EventCtl(efd, EVENT_ADD, fterm, POLL_READ)==-1);
+	ASSERT(EventCtl(efd, EVENT_ADD, fnic, POLL_READ|EVENT_EDGE)==0);
+	ASSERT(EventCtl(efd, EVENT_ADD, fnull, POLL_WRITE)==0);
+
+	/* Level-triggered: reported while ready */
+	for(int i=0; i<2; i++) {
+		ASSERT(EventWait(efd, evs, 4, 0)==1);
+		ASSERT(evs[0].fid==fnull && evs[0].events==POLL_WRITE);
+	}
+	ASSERT(EventCtl(efd, EVENT_DEL, fnull, 0)==0);
+
+	/* Timeouts */
+	Time_t t0 = GetTime();
+	ASSERT(EventWait(efd, evs, 4, 100)==0);
+	ASSERT(GetTime()-t0 >= 100000000ull);
+
+	/* A terminal stays ready until it is drained */
+	char buf[16];
+	sendme(0, "Hello");
+	ASSERT(EventWait(efd, evs, 4, -1)==1);
+	ASSERT(evs[0].fid==fterm && evs[0].events==POLL_READ);
+	ASSERT(EventWait(efd, evs, 4, 0)==1);
+	ASSERT(SetNonBlocking(fterm, 1)==0);
+	int count = 0;
+	while(count < 5) {
+		int rc = Read(fterm, buf+count, 5-count);
+		if(rc == -1)
+			ASSERT(EventWait(efd, evs, 4, -1)==1);
+		else
+			count += rc;
+	}
+	ASSERT(memcmp(buf, "Hello", 5)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==0);
+
+	/* Edge-triggered: reported once per arrival */
+	ASSERT(Exec(net_send_one, fnic, NULL)!=NOPROC);
+	ASSERT(EventWait(efd, evs, 4, -1)==1);
+	ASSERT(evs[0].fid==fnic && evs[0].events==POLL_READ);
+	ASSERT(EventWait(efd, evs, 4, 0)==0);
+	ASSERT(Read(fnic, buf, 16)==4);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* Edge-triggered pipe: each write signals the reader, each read the writer */
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(EventCtl(efd, EVENT_ADD, pipe.read, POLL_READ|EVENT_EDGE)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==1);
+	ASSERT(EventWait(efd, evs, 4, 0)==0);
+	for(int i=0; i<2; i++) {
+		ASSERT(Write(pipe.write, "x", 1)==1);
+		ASSERT(EventWait(efd, evs, 4, -1)==1);
+		ASSERT(evs[0].fid==pipe.read && evs[0].events==POLL_READ);
+		ASSERT(EventWait(efd, evs, 4, 0)==0);
+	}
+	ASSERT(EventCtl(efd, EVENT_DEL, pipe.read, 0)==0);
+	ASSERT(EventCtl(efd, EVENT_ADD, pipe.write, POLL_WRITE|EVENT_EDGE)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==1);
+	ASSERT(Read(pipe.read, buf, 1)==1);
+	ASSERT(EventWait(efd, evs, 4, -1)==1);
+	ASSERT(evs[0].fid==pipe.write && evs[0].events==POLL_WRITE);
+	ASSERT(EventCtl(efd, EVENT_DEL, pipe.write, 0)==0);
+	ASSERT(Close(pipe.read)==0 && Close(pipe.write)==0);
+
+	ASSERT(Close(fnic)==0);
+	ASSERT(EventCtl(efd, EVENT_MOD, fterm, POLL_WRITE)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==1);
+	ASSERT(evs[0].fid==fterm && evs[0].events==POLL_WRITE);
+
+	ASSERT(Close(efd)==0 && Close(fnull)==0 && Close(fterm)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_event_closed_fid,
+	"Test that closing a watched file id, or replacing it with Dup2, removes\n"
+	"it from the event objects, so that a reused file id is not reported."
+	)
+{
+	Fid_t efd = EventCreate();
+	Fid_t f = OpenNull();
+	ASSERT(efd!=NOFILE && f!=NOFILE);
+	event_record evs[4];
+
+	ASSERT(EventCtl(efd, EVENT_ADD, f, POLL_READ)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==1);
+	ASSERT(evs[0].fid==f && evs[0].events==POLL_READ);
+	ASSERT(Close(f)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==0);
+	ASSERT(EventCtl(efd, EVENT_DEL, f, 0)==-1);
+
+	/* The fid is reused for a stream which is not watched */
+	ASSERT(OpenNull()==f);
+	ASSERT(EventWait(efd, evs, 4, 0)==0);
+	ASSERT(EventCtl(efd, EVENT_ADD, f, POLL_WRITE)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==1);
+	ASSERT(evs[0].fid==f && evs[0].events==POLL_WRITE);
+
+	/* Dup2 replaces a watched fid */
+	Fid_t g = OpenNull();
+	ASSERT(g!=NOFILE);
+	ASSERT(EventCtl(efd, EVENT_ADD, g, POLL_READ)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==2);
+	ASSERT(Dup2(f, g)==0);
+	ASSERT(EventWait(efd, evs, 4, 0)==1);
+	ASSERT(evs[0].fid==f && evs[0].events==POLL_WRITE);
+
+	ASSERT(Close(efd)==0 && Close(f)==0 && Close(g)==0);
+	return 0;
+}
+
+
+/* Check the fids inherited from test_file_limit, then change them */
+static int file_limit_child(int argl, void* args)
+{
+	ASSERT(GetFileLimit()==4096);
+	ASSERT(Write(4095, "x", 1)==1);
+	ASSERT(Close(4095)==0 && Close(5)==0);
+	ASSERT(OpenNull()==5);
+	return 0;
+}
+
+BOOT_TEST(test_file_limit,
+	"Test that the file id table grows up to the limit set by SetFileLimit,\n"
+	"and that children get a copy of it."
+	)
+{
+	const int nfids = 3000;
+
+	ASSERT(GetFileLimit()==MAX_FILEID);
+	ASSERT(SetFileLimit(0)==-1);
+	ASSERT(SetFileLimit(MAX_FILEID_LIMIT+1)==-1);
+	ASSERT(SetFileLimit(4096)==0);
+	ASSERT(GetFileLimit()==4096);
+
+	/* The lowest free fid is allocated */
+	for(Fid_t f=0; f<nfids; f++)
+		ASSERT(OpenNull()==f);
+	ASSERT(Close(1000)==0 && Close(7)==0);
+	ASSERT(OpenNull()==7);
+	ASSERT(OpenNull()==1000);
+
+	ASSERT(Dup2(0, 4095)==0);
+	ASSERT(Dup2(0, 4096)==-1);
+	ASSERT(Close(4096)==-1);
+	ASSERT(SetFileLimit(4095)==-1);
+
+	/* The child changes its own copy of the table */
+	ASSERT(Exec(file_limit_child, 0, NULL)!=NOPROC);
+	int status;
+	ASSERT(WaitChild(NOPROC, &status)!=NOPROC && status==0);
+	ASSERT(Write(4095, "x", 1)==1);
+	ASSERT(Write(5, "x", 1)==1);
+
+	for(Fid_t f=0; f<nfids; f++)
+		ASSERT(Close(f)==0);
+	ASSERT(Close(4095)==0);
+	ASSERT(OpenNull()==0);
+	ASSERT(SetFileLimit(MAX_FILEID)==0);
+	return 0;
+}
+
+
+static Mutex many_fcbs_mx = MUTEX_INIT;
+static CondVar many_fcbs_cv = COND_INIT;
+static int many_fcbs_opened = 0, many_fcbs_done = 0;
+
+/* Hold argl streams open, until the parent has opened as many */
+static int many_fcbs_child(int argl, void* args)
+{
+	for(int i=0; i<argl; i++)
+		ASSERT(OpenNull()!=NOFILE);
+	Mutex_Lock(&many_fcbs_mx);
+	many_fcbs_opened = 1;
+	Cond_Broadcast(&many_fcbs_cv);
+	while(! many_fcbs_done)
+		Cond_Wait(&many_fcbs_mx, &many_fcbs_cv);
+	Mutex_Unlock(&many_fcbs_mx);
+	return 0;
+}
+
+BOOT_TEST(test_many_fcbs,
+	"Test that the number of open streams is not limited by MAX_PROC."
+	)
+{
+	const int nfcbs = MAX_PROC/2 + 8000;
+
+	ASSERT(SetFileLimit(MAX_FILEID_LIMIT)==0);
+	ASSERT(Exec(many_fcbs_child, nfcbs, NULL)!=NOPROC);
+	for(int i=0; i<nfcbs; i++)
+		ASSERT(OpenNull()==i);
+	ASSERT(Write(nfcbs-1, "x", 1)==1);
+
+	/* Both processes hold nfcbs streams */
+	Mutex_Lock(&many_fcbs_mx);
+	while(! many_fcbs_opened)
+		Cond_Wait(&many_fcbs_mx, &many_fcbs_cv);
+	many_fcbs_done = 1;
+	Cond_Broadcast(&many_fcbs_cv);
+	Mutex_Unlock(&many_fcbs_mx);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+
+static Fid_t buffered_writer_fid;
+
+static void buffered_writer_done()
+{
+	ASSERT(Write(buffered_writer_fid, "!", 1)==1);
+}
+
+BOOT_TEST(test_unattached_fcb,
+	"Test that the streams of new FCBs which are not attached to a device,\n"
+	"such as sockets, can be used and closed."
+	)
+{
+	/* Use FCBs from a fresh slab */
+	for(int i=0; i<8; i++) {
+		Fid_t s = Socket(80);
+		ASSERT(s!=NOFILE);
+		int ev = POLL_READ|POLL_WRITE;
+		ASSERT(Poll(&s, &ev, 1, 0)==0);
+		ASSERT(Seek(s, 0, SEEK_FROM_START)==-1);
+		char c;
+		ASSERT(Read(s, &c, 1)==-1);
+		ASSERT(Close(s)==0);
+	}
+	return 0;
+}
+
+
+static int buffered_writer(int argl, void* args)
+{
+	/* This is called after the streams are flushed */
+	buffered_writer_fid = argl;
+	ASSERT(AtExit(buffered_writer_done)==0);
+	ASSERT(AtExit(buffered_writer_done)==0);
+	ASSERT(AtExit(NULL)==-1);
+
+	FILE* f = fidopen_buffered(argl, "w", _IOFBF, 0);
+	ASSERT(f!=NULL);
+	ASSERT(fputs("bye", f)>=0);
+	/* Not closed; Exit must flush it */
+	return 0;
+}
+
+BOOT_TEST(test_fidopen_buffering,
+	"Test the buffering of fidopen streams, IsTerminal, and that Exit flushes\n"
+	"the streams that a process left open and calls its AtExit functions.",
+	.minimum_terminals = 1, .disk_sectors = 1024
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	Fid_t fnull = OpenNull();
+	ASSERT(IsTerminal(fterm)==1);
+	ASSERT(IsTerminal(fnull)==0);
+	ASSERT(IsTerminal(NOFILE)==-1);
+	ASSERT(IsTerminal(MAX_FILEID-1)==-1);
+
+	ASSERT(FormatFS()==0);
+	Fid_t fout = Create("out");
+	ASSERT(fout!=NOFILE);
+	ASSERT(IsTerminal(fout)==0);
+	file_stat st;
+
+	/* A file is fully buffered */
+	FILE* f = fidopen(fout, "w");
+	ASSERT(f!=NULL);
+	ASSERT(fputs("hello\n", f)>=0);
+	ASSERT(Stat("out", &st)==0 && st.size==0);
+	ASSERT(fflush(f)==0);
+	ASSERT(Stat("out", &st)==0 && st.size==6);
+
+	/* An unbuffered stream writes at once */
+	FILE* g = fidopen_buffered(fout, "w", _IONBF, 0);
+	ASSERT(fputs("now", g)>=0);
+	ASSERT(Stat("out", &st)==0 && st.size==9);
+	ASSERT(fclose(g)==0);
+
+	/* The child exits without closing its stream */
+	Pid_t pid = Exec(buffered_writer, fout, NULL);
+	ASSERT(pid!=NOPROC);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(Stat("out", &st)==0 && st.size==13);
+
+	/* The parent's stream is flushed when it is closed */
+	ASSERT(fputs("last", f)>=0);
+	ASSERT(fclose(f)==0);
+
+	/* Output to a terminal is line-buffered */
+	FILE* tout = fidopen(fterm, "w");
+	expect(0, "first line\n");
+	ASSERT(fputs("line", tout)>=0);
+	ASSERT(Write(fterm, "first ", 6)==6);
+	ASSERT(fputs("\n", tout)>=0);
+	ASSERT(fclose(tout)==0);
+
+	/* Input from a terminal is not read ahead */
+	FILE* tin = fidopen(fterm, "r");
+	sendme(0, "cap\nhello\n");
+	char* line = NULL;
+	size_t llen = 0;
+	ASSERT(getline(&line, &llen, tin)==4 && strcmp(line, "cap\n")==0);
+	ASSERT(fclose(tin)==0);
+	free(line);
+	char rest[6];
+	for(int n=0, rc; n<6; n+=rc)
+		ASSERT((rc = Read(fterm, rest+n, 6-n)) > 0);
+	ASSERT(memcmp(rest, "hello\n", 6)==0);
+
+	Fid_t fin = Open("out", OPEN_READ);
+	ASSERT(fin!=NOFILE);
+	checked_read(fin, "hello\nnowbye!last");
+	ASSERT(Close(fin)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_child_inherits_files,
 	"Test that a child process inherits files.",
 	.minimum_terminals = 1
@@ -748,6 +1809,17 @@ TEST_SUITE(basic_tests,
 	&test_orphans_adopted_by_init,
 	&test_null_device,
 	&test_get_terminals,
+	&test_bios_info_stream,
+	&test_get_time,
+	&test_block_device_rw,
+	&test_fs_write_read_seek,
+	&test_fs_unlink_and_gaps,
+	&test_map_file,
+	&test_net_loopback,
+	&test_ramdisk,
+	&test_readv_writev,
+	&test_splice,
+	&test_splice_closed_output,
 	&test_open_terminals,
 	&test_dup2_error_on_nonfile,
 	&test_dup2_error_on_invalid_fid,
@@ -763,6 +1835,14 @@ TEST_SUITE(basic_tests,
 	&test_write_con_big,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
+	&test_cond_timedwait,
+	&test_poll,
+	&test_event_objects,
+	&test_event_closed_fid,
+	&test_file_limit,
+	&test_many_fcbs,
+	&test_unattached_fcb,
+	&test_fidopen_buffering,
 	&test_child_inherits_files,
 	NULL
 };
@@ -2002,11 +3082,272 @@ BARE_TEST(dummy_user_test,
 }
 
 
+BOOT_TEST(bench_fs_sequential,
+	"Benchmark sequential writing and reading of a large file.",
+	.disk_sectors = 65536, .disk_latency = 1000, .timeout = 100
+	)
+{
+	const int chunk = 65536;
+	const int nchunks = 32;		/* 2 MB, which fits in the buffer cache */
+	static char buf[65536];
+	memset(buf, 'x', chunk);
+
+	ASSERT(FormatFS()==0);
+
+	struct timeval t0;
+	mark_time(&t0);
+	Fid_t fid = Create("big");
+	ASSERT(fid!=NOFILE);
+	for(int i=0; i<nchunks; i++)
+		ASSERT(Write(fid, buf, chunk)==chunk);
+	ASSERT(Close(fid)==0);
+	double Tw = time_since(&t0);
+
+	file_stat st;
+	ASSERT(Stat("big", &st)==0);
+
+	mark_time(&t0);
+	fid = Open("big", OPEN_READ);
+	ASSERT(fid!=NOFILE);
+	int n;
+	size_t total = 0;
+	while((n = Read(fid, buf, chunk)) > 0)
+		total += n;
+	ASSERT(total == (size_t)chunk*nchunks);
+	double Tr = time_since(&t0);
+
+	/* Scan the file through mappings, without copying */
+	mark_time(&t0);
+	unsigned long sum = 0;
+	for(Off_t pos = 0; pos < (Off_t) total; pos += MAX_MAP_LENGTH) {
+		const char* addr = MapFile(fid, pos, MAX_MAP_LENGTH);
+		ASSERT(addr != NULL);
+		for(int i=0; i<MAX_MAP_LENGTH; i++) sum += addr[i];
+		ASSERT(UnmapFile(addr)==0);
+	}
+	ASSERT(sum == 'x' * total);
+	ASSERT(Close(fid)==0);
+	double Tm = time_since(&t0);
+
+	double mb = (double)chunk*nchunks / (1<<20);
+	MSG("%.0f MB file in %u extents: write %f MB/s, read %f MB/s, mapped scan %f MB/s\n",
+		mb, st.extents, mb/Tw, mb/Tr, mb/Tm);
+	return 0;
+}
+
+
+BOOT_TEST(bench_ramdisk_throughput,
+	"Benchmark Read and Write on a RAM disk, by chunk size. For small\n"
+	"chunks, this measures the overhead of a stream call.",
+	.timeout = 100
+	)
+{
+	static char buf[1<<20];
+	memset(buf, 'r', sizeof(buf));
+	Fid_t rd = OpenRamDisk(0);
+	ASSERT(rd!=NOFILE);
+
+	for(uint chunk = 1; chunk <= sizeof(buf); chunk *= 16) {
+		/* Enough calls to take a while, within the disk */
+		size_t total = (size_t) chunk * 200000;
+		if(total > RAMDISK_SIZE) total = RAMDISK_SIZE;
+		size_t ncalls = total / chunk;
+
+		struct timeval t0;
+		ASSERT(Seek(rd, 0, SEEK_FROM_START)==0);
+		mark_time(&t0);
+		for(size_t i=0; i<ncalls; i++)
+			ASSERT(Write(rd, buf, chunk)==chunk);
+		double Tw = time_since(&t0);
+
+		ASSERT(Seek(rd, 0, SEEK_FROM_START)==0);
+		mark_time(&t0);
+		for(size_t i=0; i<ncalls; i++)
+			ASSERT(Read(rd, buf, chunk)==chunk);
+		double Tr = time_since(&t0);
+
+		double mb = (double) total / (1<<20);
+		MSG("chunk %7u: write %9.1f MB/s %7.0f ns/call, read %9.1f MB/s %7.0f ns/call\n",
+			chunk, mb/Tw, Tw*1e9/ncalls, mb/Tr, Tr*1e9/ncalls);
+	}
+
+	ASSERT(Close(rd)==0);
+	return 0;
+}
+
+
+BOOT_TEST(bench_writev_framing,
+	"Benchmark writing framed messages (a length header and a body) with\n"
+	"two Write calls and with one WriteV call."
+	)
+{
+	const int nmsg = 200000;
+	char body[60];
+	memset(body, 'm', sizeof(body));
+	int len = sizeof(body);
+	io_vector msg[2] = { { &len, sizeof(len) }, { body, sizeof(body) } };
+
+	/* The null device cannot seek, and has no vectored operations */
+	Fid_t fids[2] = { OpenRamDisk(0), OpenNull() };
+	const char* names[2] = { "ramdisk", "null" };
+
+	for(int f=0; f<2; f++) {
+		Fid_t fid = fids[f];
+		ASSERT(fid!=NOFILE);
+		struct timeval t0;
+
+		Seek(fid, 0, SEEK_FROM_START);
+		mark_time(&t0);
+		for(int i=0; i<nmsg; i++) {
+			ASSERT(Write(fid, (char*) &len, sizeof(len))==sizeof(len));
+			ASSERT(Write(fid, body, sizeof(body))==sizeof(body));
+		}
+		double T2 = time_since(&t0);
+
+		Seek(fid, 0, SEEK_FROM_START);
+		mark_time(&t0);
+		for(int i=0; i<nmsg; i++)
+			ASSERT(WriteV(fid, msg, 2)==sizeof(len)+sizeof(body));
+		double T1 = time_since(&t0);
+
+		MSG("%s: %d messages, Write+Write %.0f ns/msg, WriteV %.0f ns/msg\n",
+			names[f], nmsg, T2*1e9/nmsg, T1*1e9/nmsg);
+		ASSERT(Close(fid)==0);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(bench_splice_copy,
+	"Benchmark copying a file to a RAM disk, with Read/Write through a\n"
+	"user buffer and with Splice.",
+	.disk_sectors = 65536, .timeout = 100
+	)
+{
+	const int chunk = 65536;
+	const int nchunks = 32;		/* 2 MB, which fits in the buffer cache */
+	static char buf[65536];
+	memset(buf, 'x', chunk);
+
+	ASSERT(FormatFS()==0);
+	Fid_t fid = Create("big");
+	for(int i=0; i<nchunks; i++)
+		ASSERT(Write(fid, buf, chunk)==chunk);
+	Fid_t rd = OpenRamDisk(0);
+	struct timeval t0;
+
+	/* Both runs read the file from the buffer cache, where it was written */
+	ASSERT(Seek(fid, 0, SEEK_FROM_START)==0);
+	mark_time(&t0);
+	int n;
+	while((n = Read(fid, buf, chunk)) > 0)
+		ASSERT(Write(rd, buf, n)==n);
+	double Trw = time_since(&t0);
+
+	ASSERT(Seek(fid, 0, SEEK_FROM_START)==0);
+	ASSERT(Seek(rd, 0, SEEK_FROM_START)==0);
+	mark_time(&t0);
+	while((n = Splice(fid, rd, chunk)) > 0)
+		;
+	ASSERT(n==0);
+	double Tsp = time_since(&t0);
+
+	double mb = (double)chunk*nchunks / (1<<20);
+	MSG("%.0f MB file to RAM disk: Read/Write %f MB/s, Splice %f MB/s\n",
+		mb, mb/Trw, mb/Tsp);
+	ASSERT(Close(fid)==0);
+	ASSERT(Close(rd)==0);
+	return 0;
+}
+
+
+static int fid_bench_child(int argl, void* args)
+{
+	return 0;
+}
+
+BOOT_TEST(bench_fid_table,
+	"Benchmark opening and closing many file ids, and Exec from a process\n"
+	"with many open file ids.",
+	.timeout = 100
+	)
+{
+	const int nfids = 60000;
+	const int nexec = 1000;
+	struct timeval t0;
+
+	ASSERT(SetFileLimit(MAX_FILEID_LIMIT)==0);
+	mark_time(&t0);
+	for(int i=0; i<nfids; i++)
+		ASSERT(OpenNull()!=NOFILE);
+	double Topen = time_since(&t0);
+
+	mark_time(&t0);
+	for(int i=0; i<nexec; i++) {
+		ASSERT(Exec(fid_bench_child, 0, NULL)!=NOPROC);
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	}
+	double Texec = time_since(&t0);
+
+	/* Reuse a free fid among many open ones */
+	mark_time(&t0);
+	for(int i=0; i<nfids; i++) {
+		ASSERT(Close(nfids/2)==0);
+		ASSERT(OpenNull()==nfids/2);
+	}
+	double Treuse = time_since(&t0);
+
+	mark_time(&t0);
+	for(Fid_t f=0; f<nfids; f++)
+		ASSERT(Close(f)==0);
+	double Tclose = time_since(&t0);
+
+	MSG("%d fids: open %.0f ns, close+open %.0f ns, close %.0f ns each; "
+		"Exec+WaitChild %.1f us\n", nfids,
+		Topen*1E9/nfids, Treuse*1E9/nfids, Tclose*1E9/nfids, Texec*1E6/nexec);
+	return 0;
+}
+
+
+BOOT_TEST(bench_fidopen_filter,
+	"Benchmark character output through fidopen streams, unbuffered and\n"
+	"fully buffered, as done by text filters."
+	)
+{
+	const int nchars = 1<<20;
+	struct timeval t0;
+	double T[2];
+	int mode[2] = { _IONBF, _IOFBF };
+
+	for(int m=0; m<2; m++) {
+		Fid_t fid = OpenNull();
+		FILE* f = fidopen_buffered(fid, "w", mode[m], 0);
+		ASSERT(f!=NULL);
+		mark_time(&t0);
+		for(int i=0; i<nchars; i++)
+			fputc('a' + i%26, f);
+		ASSERT(fclose(f)==0);
+		T[m] = time_since(&t0);
+		ASSERT(Close(fid)==0);
+	}
+
+	MSG("fputc of %d chars: unbuffered %.1f ns, buffered %.1f ns per char\n",
+		nchars, T[0]*1E9/nchars, T[1]*1E9/nchars);
+	return 0;
+}
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&bench_fs_sequential,
+	&bench_ramdisk_throughput,
+	&bench_writev_framing,
+	&bench_splice_copy,
+	&bench_fid_table,
+	&bench_fidopen_filter,
 	NULL
 };
 
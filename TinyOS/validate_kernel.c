@@ -0,0 +1,693 @@
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "tinyoslib.h"
+#include "unit_testing.h"
+#include "kernel_dev.h"
+#include "kernel_bcache.h"
+
+
+/*
+ *
+ *   KERNEL TESTS
+ *
+ *   These tests call kernel functions directly, which programs on
+ *   tinyos3 cannot do. The tests of the tinyos3 API, which only use
+ *   system calls, are in validate_api.c.
+ *
+ */
+
+
+static void mark_time(struct timeval* t)
+{
+	CHECK(gettimeofday(t, NULL));
+}
+static double time_since(struct timeval* t0)
+{
+	struct timeval t1;
+	mark_time(&t1);
+
+	return ((double)(t1.tv_sec-t0->tv_sec)) + 1E-6* (t1.tv_usec - t0->tv_usec);
+}
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Virtual time tests
+ *
+ *
+ *
+ *********************************************/
+
+
+/* Wait on a timed condition for argl msec, and check the elapsed VM time */
+static int vtime_sleeper(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Time_t t0 = GetTime();
+	Mutex_Lock(&mx);
+	ASSERT(Cond_TimedWait(&mx, &cv, argl)==0);
+	Mutex_Unlock(&mx);
+	ASSERT(GetTime()-t0 >= argl*1000000ull);
+	return 0;
+}
+
+
+BARE_TEST(test_virtual_time_skips_idle,
+	"Test that, in virtual time mode, a kernel which waits on a 2 sec\n"
+	"timeout finishes much faster than real time, on 1 and 2 cores."
+	)
+{
+	for(uint ncores=1; ncores<=2; ncores++) {
+		struct timeval t0;
+		vm_set_virtual_time(1);
+		mark_time(&t0);
+		boot(ncores, 0, vtime_sleeper, 2000, NULL);
+		double T = time_since(&t0);
+		vm_set_virtual_time(0);
+		ASSERT_MSG(T < 0.5, "cores=%u: T= %f\n", ncores, T);
+	}
+}
+
+
+/* 
+	The wakeups of the trace_sleeper processes, with their times, and the
+	interrupts raised up to the last one.
+ */
+#define TRACE_SLEEPERS 3
+#define TRACE_ROUNDS 3
+#define TRACE_WAKEUPS (TRACE_SLEEPERS*TRACE_ROUNDS)
+static Mutex trace_mx = MUTEX_INIT;
+static int trace_wakeups[TRACE_WAKEUPS];
+static Time_t trace_times[TRACE_WAKEUPS];
+static int trace_nwakeups;
+static bios_stats trace_stats;
+
+/* 
+	Sleep TRACE_ROUNDS times, for a period of 350, 950 or 1550 msec, logging 
+	the wakeups. The wakeups are at least 200 msec apart.
+ */
+static int trace_sleeper(int argl, void* args)
+{
+	static const int period[TRACE_SLEEPERS] = { 350, 950, 1550 };
+	CondVar cv = COND_INIT;
+	for(int r=0; r<TRACE_ROUNDS; r++) {
+		Mutex_Lock(&trace_mx);
+		Cond_TimedWait(&trace_mx, &cv, period[argl]);
+		trace_times[trace_nwakeups] = GetTime();
+		trace_wakeups[trace_nwakeups++] = argl;
+		if(trace_nwakeups == TRACE_WAKEUPS)
+			bios_get_stats(&trace_stats);
+		Mutex_Unlock(&trace_mx);
+	}
+	return 0;
+}
+
+static int trace_program(int argl, void* args)
+{
+	trace_nwakeups = 0;
+	for(int i=0; i<TRACE_SLEEPERS; i++)
+		ASSERT(Exec(trace_sleeper, i, NULL)!=NOPROC);
+	for(int i=0; i<TRACE_SLEEPERS; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* Keep running, so that the last wakeup is well inside the trace */
+	return vtime_sleeper(200, NULL);
+}
+
+
+BARE_TEST(test_trace_replay,
+	"Test that a run replayed from its trace, in virtual time, raises the\n"
+	"same interrupts and wakes up its processes in the same order as the\n"
+	"recorded run, and that time still skips ahead while replaying."
+	)
+{
+	char tracename[] = "/tmp/tinyos_trace.XXXXXX";
+	int fd = mkstemp(tracename);
+	CHECK(fd);
+	CHECK(close(fd));
+
+	/* Keep the fifos of terminal 0 open, so that the VM can open them */
+	int con, kbd;
+	CHECK(con = open("con0", O_RDWR|O_NONBLOCK));
+	CHECK(kbd = open("kbd0", O_RDWR|O_NONBLOCK));
+
+	vm_set_virtual_time(1);
+	vm_set_trace(VM_TRACE_RECORD, tracename);
+	boot(1, 1, trace_program, 0, NULL);
+	int recorded[TRACE_WAKEUPS];
+	Time_t recorded_times[TRACE_WAKEUPS];
+	memcpy(recorded, trace_wakeups, sizeof(recorded));
+	memcpy(recorded_times, trace_times, sizeof(recorded_times));
+	bios_core_stats rec = trace_stats.core[0];
+
+	struct timeval t0;
+	vm_set_trace(VM_TRACE_REPLAY, tracename);
+	mark_time(&t0);
+	boot(1, 1, trace_program, 0, NULL);
+	double T = time_since(&t0);
+	bios_core_stats rep = trace_stats.core[0];
+
+	vm_set_trace(VM_TRACE_OFF, NULL);
+	vm_set_virtual_time(0);
+	CHECK(unlink(tracename));
+	CHECK(close(con));
+	CHECK(close(kbd));
+
+	ASSERT(trace_nwakeups == TRACE_WAKEUPS);
+	ASSERT(memcmp(recorded, trace_wakeups, sizeof(recorded))==0);
+
+	/* 
+		A replayed timeout may expire a little after the recorded one, and
+		miss the alarm that woke up the recorded run; then, it is woken by
+		a later alarm. Hence, nothing happens earlier than in the recorded
+		run, and every recorded interrupt is replayed.
+	 */
+	for(int w=0; w<TRACE_WAKEUPS; w++)
+		ASSERT_MSG(trace_times[w] + 10000000 >= recorded_times[w], 
+			"wakeup %d: recorded at %llu, replayed at %llu\n", w, 
+			(unsigned long long) recorded_times[w], (unsigned long long) trace_times[w]);
+	for(Interrupt i=0; i<maximum_interrupt_no; i++) {
+		if(i==ICI) continue;
+		ASSERT_MSG(rec.irq_raised[i] <= rep.irq_raised[i], 
+			"interrupt %d: recorded %lu, replayed %lu\n", i, rec.irq_raised[i], rep.irq_raised[i]);
+	}
+	ASSERT_MSG(T < 0.5, "replay: T= %f\n", T);
+}
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Block device tests
+ *
+ *
+ *
+ *********************************************/
+
+
+/* Write sectors 8k+t, for k=0,...,15, where t = argl % 8, to block device 0 */
+static int block_queue_writer(int argl, void* args)
+{
+	char sector[BLOCK_SECTOR_SIZE];
+	int t = argl % 8;
+	for(int k=0; k<16; k++) {
+		memset(sector, argl+k, sizeof(sector));
+		if(block_device_io(0, BLOCK_WRITE, 8*k+t, 1, sector)) return 1;
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_block_queue_elevators,
+	"Test that concurrent writes to adjacent sectors are merged by the block\n"
+	"request queue, and are stored correctly, with each elevator.",
+	.disk_sectors = 128, .disk_latency = 1000
+	)
+{
+	const char* elevators[] = { "noop", "clook", "deadline" };
+	ASSERT(block_set_elevator(0, "nosuch")==-1);
+
+	char* buffer = malloc(128*BLOCK_SECTOR_SIZE);
+	for(int e=0; e<3; e++) {
+		ASSERT(block_set_elevator(0, elevators[e])==0);
+
+		for(int t=0; t<8; t++)
+			ASSERT(Exec(block_queue_writer, 8*e+t, NULL)!=NOPROC);
+		for(int t=0; t<8; t++)
+			ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+		ASSERT(block_device_io(0, BLOCK_READ, 0, 128, buffer)==0);
+		for(int s=0; s<128; s++) {
+			char expected = 8*e + s%8 + s/8;
+			for(int i=0; i<BLOCK_SECTOR_SIZE; i++)
+				ASSERT(buffer[s*BLOCK_SECTOR_SIZE+i]==expected);
+		}
+	}
+
+	/* Invalid requests fail */
+	ASSERT(block_device_io(0, BLOCK_READ, 127, 2, buffer)==-1);
+	free(buffer);
+
+	block_queue_stats stats;
+	block_get_queue_stats(0, &stats);
+	ASSERT(stats.merged > 0);
+	ASSERT(stats.requests == stats.dispatched + stats.merged);
+	return 0;
+}
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Device driver tests
+ *
+ *
+ *
+ *********************************************/
+
+
+/* A test device driver, returning its minor number on every read */
+static void* regdev_open(uint minor) { return (void*)(uintptr_t) (minor+1); }
+static int regdev_read(void* dev, char* buf, unsigned int size) 
+{
+	memset(buf, (int)(uintptr_t) dev, size);
+	return size;
+}
+static int regdev_close(void* dev) { return 0; }
+static file_ops regdev_fops = {
+	.Open = regdev_open, .Read = regdev_read, .Close = regdev_close
+};
+
+BOOT_TEST(test_device_registry,
+	"Test the registration and lookup of device drivers."
+	)
+{
+	ASSERT(device_lookup("null")==DEV_NULL);
+	ASSERT(device_lookup("serial")==DEV_SERIAL);
+	ASSERT(device_lookup("regdev")==-1);
+
+	/* Taken major numbers and names, bad arguments */
+	ASSERT(register_device(DEV_SERIAL, "regdev", &regdev_fops, 1)==-1);
+	ASSERT(register_device(DEV_DYNAMIC, "null", &regdev_fops, 1)==-1);
+	ASSERT(register_device(MAX_DEVICE_TYPES, "regdev", &regdev_fops, 1)==-1);
+	ASSERT(register_device(DEV_DYNAMIC, "regdev", &(file_ops){ .Read = regdev_read }, 1)==-1);
+
+	int major = register_device(DEV_DYNAMIC, "regdev", &regdev_fops, 3);
+	ASSERT(major >= DEV_MAX && major < MAX_DEVICE_TYPES);
+	ASSERT(device_lookup("regdev")==major);
+	ASSERT(device_no(major)==3);
+	ASSERT(register_device(DEV_DYNAMIC, "regdev", &regdev_fops, 3)==-1);
+
+	void* obj = NULL;
+	file_ops* ops = NULL;
+	ASSERT(device_open(major, 3, &obj, &ops)==-1);
+	ASSERT(device_open(major, 2, &obj, &ops)==0);
+	ASSERT(ops == &regdev_fops);
+	char buf[4];
+	ASSERT(ops->Read(obj, buf, 4)==4);
+	ASSERT(buf[0]==3 && buf[3]==3);
+	ASSERT(ops->Close(obj)==0);
+
+	ASSERT(unregister_device(major)==0);
+	ASSERT(unregister_device(major)==-1);
+	ASSERT(device_lookup("regdev")==-1);
+	ASSERT(device_no(major)==0);
+	ASSERT(device_open(major, 0, &obj, &ops)==-1);
+
+	/* The major number can be registered again */
+	ASSERT(register_device(major, "regdev", &regdev_fops, 1)==major);
+	ASSERT(unregister_device(major)==0);
+	return 0;
+}
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Buffer cache tests
+ *
+ *
+ *
+ *********************************************/
+
+
+static inline char bcache_test_byte(uint pos)
+{
+	return (pos/BLOCK_SECTOR_SIZE)*31 + pos%251;
+}
+
+BOOT_TEST(test_buffer_cache,
+	"Test that a block device larger than the buffer cache is written and read\n"
+	"back correctly through the cache, that the dirty pages reach the device\n"
+	"on sync, and that the cache statistics show hits, read-ahead and evictions.",
+	.disk_sectors = 16384
+	)
+{
+	const uint devsize = 16384*BLOCK_SECTOR_SIZE;
+	const uint chunk = 10000;
+	char* buffer = malloc(chunk);
+
+	/* Write the whole device, in chunks not aligned to pages */
+	Fid_t fdisk = OpenBlockDevice(0);
+	ASSERT(fdisk!=NOFILE);
+	for(uint pos=0; pos < devsize; ) {
+		uint size = (devsize-pos < chunk) ? devsize-pos : chunk;
+		for(uint i=0; i<size; i++) buffer[i] = bcache_test_byte(pos+i);
+		int rc = Write(fdisk, buffer, size);
+		ASSERT(rc>0);
+		pos += rc;
+	}
+	ASSERT(Close(fdisk)==0);
+	ASSERT(bcache_sync()==0);
+
+	/* The device holds the data */
+	char sector[BLOCK_SECTOR_SIZE];
+	for(uint s=0; s<16384; s+=97) {
+		ASSERT(block_device_io(0, BLOCK_READ, s, 1, sector)==0);
+		for(uint i=0; i<BLOCK_SECTOR_SIZE; i++)
+			ASSERT(sector[i]==bcache_test_byte(s*BLOCK_SECTOR_SIZE+i));
+	}
+
+	/* Read it back through the cache */
+	fdisk = OpenBlockDevice(0);
+	ASSERT(fdisk!=NOFILE);
+	uint pos = 0;
+	int rc;
+	while((rc = Read(fdisk, buffer, chunk)) > 0) {
+		for(int i=0; i<rc; i++)
+			ASSERT(buffer[i]==bcache_test_byte(pos+i));
+		pos += rc;
+	}
+	ASSERT(rc==0);
+	ASSERT(pos==devsize);
+	ASSERT(Close(fdisk)==0);
+	free(buffer);
+
+	cache_stats stats;
+	Fid_t finfo = OpenCacheInfo();
+	ASSERT(finfo!=NOFILE);
+	ASSERT(Read(finfo, (char*)&stats, sizeof(stats))==sizeof(stats));
+	ASSERT(Read(finfo, (char*)&stats, sizeof(stats))==0);
+	ASSERT(Close(finfo)==0);
+
+	ASSERT(stats.buffers==BCACHE_BUFFERS);
+	ASSERT(stats.dirty==0);
+	ASSERT(stats.writebacks >= 16384/BCACHE_PAGE_SECTORS);
+	ASSERT(stats.hits > 0);
+	ASSERT(stats.readahead > 0);
+	ASSERT(stats.evictions > 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_buffer_cache_all_pinned,
+	"Test that getting a page which is not cached fails when every buffer\n"
+	"of the cache is pinned, and succeeds after a buffer is unpinned.",
+	.disk_sectors = 2*BCACHE_BUFFERS*BCACHE_PAGE_SECTORS
+	)
+{
+	buffer** bufs = malloc(BCACHE_BUFFERS * sizeof(buffer*));
+	for(uint p=0; p<BCACHE_BUFFERS; p++) {
+		bufs[p] = bcache_get(0, p, BCACHE_NOFILL);
+		ASSERT(bufs[p]!=NULL);
+	}
+
+	/* Cached pages can still be pinned again */
+	ASSERT(bcache_get(0, 0, BCACHE_FILL)==bufs[0]);
+	bcache_put(bufs[0]);
+
+	ASSERT(bcache_get(0, BCACHE_BUFFERS, BCACHE_FILL)==NULL);
+	ASSERT(bcache_get(0, BCACHE_BUFFERS, BCACHE_NOFILL)==NULL);
+
+	bcache_put(bufs[0]);
+	bufs[0] = bcache_get(0, BCACHE_BUFFERS, BCACHE_FILL);
+	ASSERT(bufs[0]!=NULL);
+
+	for(uint p=0; p<BCACHE_BUFFERS; p++)
+		bcache_put(bufs[p]);
+	free(bufs);
+	return 0;
+}
+
+
+/* Return the number of dirty buffers of the cache */
+static uint bcache_test_dirty()
+{
+	cache_stats stats;
+	Fid_t finfo = OpenCacheInfo();
+	ASSERT(finfo!=NOFILE);
+	ASSERT(Read(finfo, (char*)&stats, sizeof(stats))==sizeof(stats));
+	ASSERT(Close(finfo)==0);
+	return stats.dirty;
+}
+
+BOOT_TEST(test_buffer_cache_periodic_flush,
+	"Test that the flusher writes back a dirty page within two flush\n"
+	"intervals, although there are few dirty pages.",
+	.disk_sectors = 64
+	)
+{
+	buffer* buf = bcache_get(0, 1, BCACHE_NOFILL);
+	ASSERT(buf!=NULL);
+	memset(buf->data, 'd', BCACHE_PAGE_SIZE);
+	bcache_mark_dirty(buf);
+	bcache_put(buf);
+	ASSERT(bcache_test_dirty()==1);
+
+	vtime_sleeper(2*BCACHE_FLUSH_INTERVAL, NULL);
+	ASSERT(bcache_test_dirty()==0);
+
+	char sector[BLOCK_SECTOR_SIZE];
+	ASSERT(block_device_io(0, BLOCK_READ, BCACHE_PAGE_SECTORS, 1, sector)==0);
+	ASSERT(sector[0]=='d' && sector[BLOCK_SECTOR_SIZE-1]=='d');
+	return 0;
+}
+
+
+TEST_SUITE(kernel_tests,
+	"A suite of tests of the kernel internals."
+	)
+{
+	&test_virtual_time_skips_idle,
+	&test_trace_replay,
+	&test_device_registry,
+	&test_block_queue_elevators,
+	&test_buffer_cache,
+	&test_buffer_cache_all_pinned,
+	&test_buffer_cache_periodic_flush,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Benchmarks
+ *
+ *
+ *
+ *********************************************/
+
+
+/* Read a character from terminal argl */
+static int read_char_from_terminal(int argl, void* args)
+{
+	Fid_t f = OpenTerminal(argl);
+	ASSERT(f!=NOFILE);
+	char c;
+	ASSERT(Read(f, &c, 1)==1);
+	return 0;
+}
+
+/* Send nchars characters to terminal 0 one at a time, each to a new reader */
+static double term_run_input(uint nchars)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	for(uint i=0; i<nchars; i++) {
+		Pid_t pid = Exec(read_char_from_terminal, 0, NULL);
+		ASSERT(pid!=NOPROC);
+		sendme(0, "A");
+		ASSERT(WaitChild(pid, NULL)==pid);
+	}
+	return time_since(&t0);
+}
+
+
+BOOT_TEST(bench_term_input_isolation,
+	"Benchmark terminal input on terminal 0, while many readers are\n"
+	"blocked on terminals 1 to 3. The interrupts of terminal 0 must\n"
+	"not wake up the readers of other terminals.",
+	.minimum_terminals = 4, .timeout = 100
+	)
+{
+	const uint nchars = 200;
+	const uint nidle = 100;
+
+	double T0 = term_run_input(nchars);
+
+	/* Block readers on the other terminals */
+	for(uint term=1; term<4; term++)
+		for(uint i=0; i<nidle; i++)
+			ASSERT(Exec(read_char_from_terminal, term, NULL)!=NOPROC);
+
+	/* Let them block */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+
+	serial_stats before[4], after[4];
+	for(uint term=0; term<4; term++) serial_get_stats(term, &before[term]);
+	double Tidle = term_run_input(nchars);
+	for(uint term=0; term<4; term++) serial_get_stats(term, &after[term]);
+
+	/* The readers of the idle terminals are woken up only by the (timeout)
+	   interrupts of their own terminal, not by the input on terminal 0 */
+	ASSERT(after[0].rx_signals > before[0].rx_signals);
+	for(uint term=1; term<4; term++) {
+		unsigned long signals = after[term].rx_signals - before[term].rx_signals;
+		unsigned long wakeups = after[term].rx_wakeups - before[term].rx_wakeups;
+		MSG("terminal %u: %lu rx signals, %lu reader wakeups\n", term, signals, wakeups);
+		/* The serial timeouts come every 300 msec or so */
+		ASSERT(signals <= 2 + (unsigned long)(10*Tidle));
+		/* A signal before the first snapshot may wake the readers after it */
+		ASSERT(wakeups <= (signals+1)*nidle);
+	}
+
+	/* Release the blocked readers */
+	char* dummy_input = malloc(nidle+1);
+	memset(dummy_input, 'A', nidle);
+	dummy_input[nidle] = '\0';
+	for(uint term=1; term<4; term++)
+		sendme(term, dummy_input);
+	for(uint i=0; i<3*nidle; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	free(dummy_input);
+
+	MSG("%u chars: T(0 idle)= %f   T(%u idle)= %f\n", nchars, T0, 3*nidle, Tidle);
+	ASSERT_MSG( (Tidle-T0)/T0 < 0.5, "Failed: T(0 idle)= %f   T(%u idle)= %f\n", 
+		T0, 3*nidle, Tidle );
+	return 0;
+}
+
+
+/* Read 32 random sectors of block device 0, using argl as the seed */
+static int block_random_reader(int argl, void* args)
+{
+	char sector[BLOCK_SECTOR_SIZE];
+	unsigned int seed = argl;
+	uint64_t sectors = bios_block_sectors(0);
+	for(int i=0; i<32; i++)
+		block_device_io(0, BLOCK_READ, rand_r(&seed) % sectors, 1, sector);
+	return 0;
+}
+
+
+BOOT_TEST(bench_block_elevators,
+	"Benchmark concurrent random reads from a block device, with each\n"
+	"elevator of the block request queue.",
+	.disk_sectors = 65536, .disk_latency = 4000, .timeout = 100
+	)
+{
+	const char* elevators[] = { "noop", "deadline", "clook" };
+	const int nreaders = 16;
+	double T[3];
+
+	for(int e=0; e<3; e++) {
+		ASSERT(block_set_elevator(0, elevators[e])==0);
+		struct timeval t0;
+		mark_time(&t0);
+		for(int i=0; i<nreaders; i++)
+			ASSERT(Exec(block_random_reader, i, NULL)!=NOPROC);
+		for(int i=0; i<nreaders; i++)
+			ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+		T[e] = time_since(&t0);
+	}
+
+	MSG("%d readers x 32 random sectors: T(noop)= %f  T(deadline)= %f  T(clook)= %f\n",
+		nreaders, T[0], T[1], T[2]);
+	return 0;
+}
+
+
+/* Send NET_FLOOD_PACKETS 64-byte packets to network device argl */
+#define NET_FLOOD_PACKETS 20000
+static int net_flood(int argl, void* args)
+{
+	Fid_t nic = argl;
+	char pkt[64];
+	memset(pkt, 0, sizeof(pkt));
+	for(int i=0; i<NET_FLOOD_PACKETS; i++) {
+		pkt[0] = i % 8;		/* spread the packets over the queues */
+		ASSERT(Write(nic, pkt, sizeof(pkt))==sizeof(pkt));
+	}
+	return 0;
+}
+
+/* The number of receive interrupts delivered so far, on all cores */
+static unsigned long net_rx_interrupts()
+{
+	bios_stats st;
+	bios_get_stats(&st);
+	unsigned long n = 0;
+	for(uint c=0; c<st.ncores; c++)
+		n += st.core[c].irq_delivered[NET_RX_READY];
+	return n;
+}
+
+/* Flood network device nic with the given coalescing, and return the packet rate */
+static double net_run_flood(Fid_t nic, uint frames, TimerDuration usec, unsigned long* irqs)
+{
+	net_set_coalesce(0, frames, usec);
+	unsigned long irq0 = net_rx_interrupts();
+	struct timeval t0;
+	mark_time(&t0);
+	ASSERT(Exec(net_flood, nic, NULL)!=NOPROC);
+	char buf[NET_MTU];
+	for(int i=0; i<NET_FLOOD_PACKETS; i++)
+		ASSERT(Read(nic, buf, sizeof(buf))==64);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	double T = time_since(&t0);
+	*irqs = net_rx_interrupts() - irq0;
+	return NET_FLOOD_PACKETS / T;
+}
+
+
+BOOT_TEST(bench_net_loopback_pps,
+	"Benchmark the packet rate of a loopback network device, with and\n"
+	"without receive interrupt coalescing.",
+	.nic_queues = 2, .timeout = 100
+	)
+{
+	Fid_t nic = OpenNetworkDevice(0);
+	ASSERT(nic!=NOFILE);
+
+	unsigned long irq1, irq32;
+	double pps1 = net_run_flood(nic, 1, 0, &irq1);
+	double pps32 = net_run_flood(nic, 32, 100, &irq32);
+
+	MSG("%d packets: no coalescing %.0f pps (%lu rx interrupts), "
+		"32 frames/100us %.0f pps (%lu rx interrupts)\n",
+		NET_FLOOD_PACKETS, pps1, irq1, pps32, irq32);
+
+	ASSERT(Close(nic)==0);
+	return 0;
+}
+
+
+TEST_SUITE(kernel_benchmarks,
+	"Benchmarks of the kernel internals."
+	)
+{
+	&bench_term_input_isolation,
+	&bench_block_elevators,
+	&bench_net_loopback_pps,
+	NULL
+};
+
+
+
+int main(int argc, char** argv)
+{
+	register_test(&kernel_tests);
+	register_test(&kernel_benchmarks);
+	return run_program(argc, argv, &kernel_tests);
+}
+